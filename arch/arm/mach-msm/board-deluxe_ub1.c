@@ -163,6 +163,8 @@
 #define MSM_PMEM_KERNEL_EBI1_SIZE  0x110C000
 #define MSM_ION_HEAP_NUM	1
 #endif
+/* system heap buffers freed in the background, drained on alloc failure */
+#define MSM_ION_SYSTEM_DEFERRED_FREE	SZ_64M
 
 #define APQ8064_FIXED_AREA_START (0xa0000000 - (MSM_ION_MM_FW_SIZE + HOLE_SIZE))
 #define MAX_FIXED_AREA_SIZE	0x10000000
@@ -500,6 +502,7 @@ static struct ion_platform_data ion_pdata = {
 			.id	= ION_SYSTEM_HEAP_ID,
 			.type	= ION_HEAP_TYPE_SYSTEM,
 			.name	= ION_VMALLOC_HEAP_NAME,
+			.deferred_free_max = MSM_ION_SYSTEM_DEFERRED_FREE,
 		},
 #ifdef CONFIG_MSM_MULTIMEDIA_USE_ION
 		{
@@ -12,6 +12,12 @@
  * Asynchronous and synchronous requests are not treated separately, but
  * we relay on deadlines to ensure fairness.
  *
+ * With the "sorted" tunable set, requests are also kept in a sector
+ * sorted tree: batches continue with the next request in sector order,
+ * front merges are looked up in the tree, sync reads are picked fairly
+ * between processes and the batch size shrinks whenever sync reads
+ * complete slower than read_latency_target.
+ *
  */
 #include <linux/blkdev.h>
 #include <linux/elevator.h>
@@ -20,6 +26,9 @@
 #include <linux/init.h>
 #include <linux/version.h>
 #include <linux/slab.h>
+#include <linux/rbtree.h>
+#include <linux/iocontext.h>
+#include <linux/hrtimer.h>
 
 enum { ASYNC, SYNC };
 
@@ -33,22 +42,99 @@ static const int async_write_expire = 16 * HZ;	/* ditto for async, these limits
 static const int writes_starved = 2;		/* max times reads can starve a write */
 static const int fifo_batch     = 8;		/* # of sequential requests treated as one
 						   by the above parameters. For throughput. */
+static const int read_latency_target = 20;	/* ms a sync read may take before batches shrink */
+static const int fair_scan = 8;			/* sync reads looked at when picking fairly */
 
 /* Elevator data */
 struct sio_data {
 	/* Request queues */
 	struct list_head fifo_list[2][2];
+	struct rb_root sort_list[2];
 
 	/* Attributes */
 	unsigned int batched;
 	unsigned int starved;
+	struct request *next_rq[2];
+	int last_dir;
+	int batch_limit;
+	u64 min_vios;
+	unsigned long avg_read_lat;
 
 	/* Settings */
 	int fifo_expire[2][2];
 	int fifo_batch;
 	int writes_starved;
+	int sorted;
+	int read_latency_target;
+};
+
+/* Per process data, used to pick sync reads fairly */
+struct sio_ioc {
+	struct io_cq icq;
+	u64 vios;
 };
 
+#define RQ_SIO_IOC(rq) \
+	((rq)->elv.icq ? container_of((rq)->elv.icq, struct sio_ioc, icq) : NULL)
+#define RQ_DISPATCH_US(rq)	((unsigned long)(rq)->elv.priv[0])
+
+static inline unsigned long
+sio_now_us(void)
+{
+	return (unsigned long)ktime_to_us(ktime_get());
+}
+
+static inline struct request *
+sio_latter_sorted(struct request *rq)
+{
+	struct rb_node *node = rb_next(&rq->rb_node);
+
+	return node ? rb_entry_rq(node) : NULL;
+}
+
+static void
+sio_del_rq_rb(struct sio_data *sd, struct request *rq)
+{
+	const int data_dir = rq_data_dir(rq);
+
+	if (sd->next_rq[data_dir] == rq)
+		sd->next_rq[data_dir] = sio_latter_sorted(rq);
+
+	elv_rb_del(&sd->sort_list[data_dir], rq);
+}
+
+static int
+sio_merge(struct request_queue *q, struct request **req, struct bio *bio)
+{
+	struct sio_data *sd = q->elevator->elevator_data;
+	sector_t sector = bio->bi_sector + bio_sectors(bio);
+	struct request *__rq;
+
+	if (!sd->sorted)
+		return ELEVATOR_NO_MERGE;
+
+	/* Look for a request that starts where the bio ends */
+	__rq = elv_rb_find(&sd->sort_list[bio_data_dir(bio)], sector);
+	if (__rq && elv_rq_merge_ok(__rq, bio)) {
+		*req = __rq;
+		return ELEVATOR_FRONT_MERGE;
+	}
+
+	return ELEVATOR_NO_MERGE;
+}
+
+static void
+sio_merged_request(struct request_queue *q, struct request *req, int type)
+{
+	struct sio_data *sd = q->elevator->elevator_data;
+
+	/* A front merge changes the start sector, so re-sort the request */
+	if (type == ELEVATOR_FRONT_MERGE) {
+		elv_rb_del(&sd->sort_list[rq_data_dir(req)], req);
+		elv_rb_add(&sd->sort_list[rq_data_dir(req)], req);
+	}
+}
+
 static void
 sio_merged_requests(struct request_queue *q, struct request *rq,
 		    struct request *next)
@@ -66,6 +152,7 @@ sio_merged_requests(struct request_queue *q, struct request *rq,
 
 	/* Delete next request */
 	rq_fifo_clear(next);
+	sio_del_rq_rb(q->elevator->elevator_data, next);
 }
 
 static void
@@ -81,6 +168,7 @@ sio_add_request(struct request_queue *q, struct request *rq)
 	 */
 	rq_set_fifo_time(rq, jiffies + sd->fifo_expire[sync][data_dir]);
 	list_add_tail(&rq->queuelist, &sd->fifo_list[sync][data_dir]);
+	elv_rb_add(&sd->sort_list[data_dir], rq);
 }
 
 #if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,38)
@@ -165,14 +253,72 @@ sio_choose_request(struct sio_data *sd, int data_dir)
 	return NULL;
 }
 
+static inline u64
+sio_ioc_vios(struct sio_data *sd, struct sio_ioc *sic)
+{
+	/* a process that was idle does not get to catch up */
+	if (!sic || (s64)(sic->vios - sd->min_vios) < 0)
+		return sd->min_vios;
+	return sic->vios;
+}
+
+/*
+ * Picks the sync read, among the oldest few, of the process that has had
+ * the fewest sync reads dispatched, so that one process streaming reads
+ * cannot monopolize the device.
+ */
+static struct request *
+sio_choose_fair_read(struct sio_data *sd)
+{
+	struct request *rq, *best = NULL;
+	u64 vios, best_vios = 0;
+	int n = 0;
+
+	list_for_each_entry(rq, &sd->fifo_list[SYNC][READ], queuelist) {
+		vios = sio_ioc_vios(sd, RQ_SIO_IOC(rq));
+		if (!best || (s64)(vios - best_vios) < 0) {
+			best = rq;
+			best_vios = vios;
+		}
+		if (++n >= fair_scan)
+			break;
+	}
+
+	return best;
+}
+
+static void
+sio_charge_ioc(struct sio_data *sd, struct request *rq)
+{
+	struct sio_ioc *sic = RQ_SIO_IOC(rq);
+	u64 start;
+
+	if (!sic || !rq_is_sync(rq) || rq_data_dir(rq) != READ)
+		return;
+
+	start = sio_ioc_vios(sd, sic);
+	sic->vios = start + 1;
+	sd->min_vios = start;
+}
+
 static inline void
 sio_dispatch_request(struct sio_data *sd, struct request *rq)
 {
+	const int data_dir = rq_data_dir(rq);
+
 	/*
-	 * Remove the request from the fifo list
-	 * and dispatch it.
+	 * Remember where the batch would continue in sector order,
+	 * remove the request from the fifo list and dispatch it.
 	 */
+	sd->next_rq[READ] = NULL;
+	sd->next_rq[WRITE] = NULL;
+	sd->next_rq[data_dir] = sio_latter_sorted(rq);
+	sd->last_dir = data_dir;
+
 	rq_fifo_clear(rq);
+	elv_rb_del(&sd->sort_list[data_dir], rq);
+	sio_charge_ioc(sd, rq);
+	rq->elv.priv[0] = (void *)sio_now_us();
 	elv_dispatch_add_tail(rq->q, rq);
 
 	sd->batched++;
@@ -183,6 +329,63 @@ sio_dispatch_request(struct sio_data *sd, struct request *rq)
 		sd->starved++;
 }
 
+static int
+sio_dispatch_sorted(struct sio_data *sd)
+{
+	struct request *rq = NULL;
+	int data_dir = READ;
+
+	/* Continue the batch with the next request in sector order */
+	if (sd->batched < sd->batch_limit)
+		rq = sd->next_rq[sd->last_dir];
+
+	if (!rq) {
+		sd->batched = 0;
+		rq = sio_choose_expired_request(sd);
+	}
+
+	if (!rq) {
+		if (sd->starved > sd->writes_starved)
+			data_dir = WRITE;
+
+		if (data_dir == READ && !list_empty(&sd->fifo_list[SYNC][READ]))
+			rq = sio_choose_fair_read(sd);
+		else
+			rq = sio_choose_request(sd, data_dir);
+		if (!rq)
+			return 0;
+	}
+
+	sio_dispatch_request(sd, rq);
+
+	return 1;
+}
+
+/*
+ * Shrinks the batch size while sync reads complete slower than the
+ * target and lets it grow back towards fifo_batch once they are fast.
+ */
+static void
+sio_completed_request(struct request_queue *q, struct request *rq)
+{
+	struct sio_data *sd = q->elevator->elevator_data;
+	unsigned long lat, target;
+
+	if (!sd->sorted || !rq_is_sync(rq) || rq_data_dir(rq) != READ ||
+	    !RQ_DISPATCH_US(rq))
+		return;
+
+	lat = sio_now_us() - RQ_DISPATCH_US(rq);
+	sd->avg_read_lat = (7 * sd->avg_read_lat + lat) / 8;
+
+	target = sd->read_latency_target * USEC_PER_MSEC;
+	if (sd->avg_read_lat > target && sd->batch_limit > 1)
+		sd->batch_limit /= 2;
+	else if (sd->avg_read_lat < target / 2 &&
+		 sd->batch_limit < sd->fifo_batch)
+		sd->batch_limit++;
+}
+
 static int
 sio_dispatch_requests(struct request_queue *q, int force)
 {
@@ -190,6 +393,9 @@ sio_dispatch_requests(struct request_queue *q, int force)
 	struct request *rq = NULL;
 	int data_dir = READ;
 
+	if (sd->sorted)
+		return sio_dispatch_sorted(sd);
+
 	/*
 	 * Retrieve any expired request after a batch of
 	 * sequential requests.
@@ -222,6 +428,9 @@ sio_former_request(struct request_queue *q, struct request *rq)
 	const int sync = rq_is_sync(rq);
 	const int data_dir = rq_data_dir(rq);
 
+	if (sd->sorted)
+		return elv_rb_former_request(q, rq);
+
 	if (rq->queuelist.prev == &sd->fifo_list[sync][data_dir])
 		return NULL;
 
@@ -236,6 +445,9 @@ sio_latter_request(struct request_queue *q, struct request *rq)
 	const int sync = rq_is_sync(rq);
 	const int data_dir = rq_data_dir(rq);
 
+	if (sd->sorted)
+		return elv_rb_latter_request(q, rq);
+
 	if (rq->queuelist.next == &sd->fifo_list[sync][data_dir])
 		return NULL;
 
@@ -258,14 +470,26 @@ sio_init_queue(struct request_queue *q)
 	INIT_LIST_HEAD(&sd->fifo_list[SYNC][WRITE]);
 	INIT_LIST_HEAD(&sd->fifo_list[ASYNC][READ]);
 	INIT_LIST_HEAD(&sd->fifo_list[ASYNC][WRITE]);
+	sd->sort_list[READ] = RB_ROOT;
+	sd->sort_list[WRITE] = RB_ROOT;
 
 	/* Initialize data */
 	sd->batched = 0;
+	sd->starved = 0;
+	sd->next_rq[READ] = NULL;
+	sd->next_rq[WRITE] = NULL;
+	sd->last_dir = READ;
+	sd->batch_limit = fifo_batch;
+	sd->min_vios = 0;
+	sd->avg_read_lat = 0;
 	sd->fifo_expire[SYNC][READ] = sync_read_expire;
 	sd->fifo_expire[SYNC][WRITE] = sync_write_expire;
 	sd->fifo_expire[ASYNC][READ] = async_read_expire;
 	sd->fifo_expire[ASYNC][WRITE] = async_write_expire;
 	sd->fifo_batch = fifo_batch;
+	sd->writes_starved = writes_starved;
+	sd->sorted = 0;
+	sd->read_latency_target = read_latency_target;
 
 	return sd;
 }
@@ -318,6 +542,10 @@ SHOW_FUNCTION(sio_async_read_expire_show, sd->fifo_expire[ASYNC][READ], 1);
 SHOW_FUNCTION(sio_async_write_expire_show, sd->fifo_expire[ASYNC][WRITE], 1);
 SHOW_FUNCTION(sio_fifo_batch_show, sd->fifo_batch, 0);
 SHOW_FUNCTION(sio_writes_starved_show, sd->writes_starved, 0);
+SHOW_FUNCTION(sio_sorted_show, sd->sorted, 0);
+SHOW_FUNCTION(sio_read_latency_target_show, sd->read_latency_target, 0);
+SHOW_FUNCTION(sio_batch_limit_show, sd->batch_limit, 0);
+SHOW_FUNCTION(sio_avg_read_latency_show, sd->avg_read_lat, 0);
 #undef SHOW_FUNCTION
 
 #define STORE_FUNCTION(__FUNC, __PTR, MIN, MAX, __CONV)			\
@@ -342,6 +570,8 @@ STORE_FUNCTION(sio_async_read_expire_store, &sd->fifo_expire[ASYNC][READ], 0, IN
 STORE_FUNCTION(sio_async_write_expire_store, &sd->fifo_expire[ASYNC][WRITE], 0, INT_MAX, 1);
 STORE_FUNCTION(sio_fifo_batch_store, &sd->fifo_batch, 0, INT_MAX, 0);
 STORE_FUNCTION(sio_writes_starved_store, &sd->writes_starved, 0, INT_MAX, 0);
+STORE_FUNCTION(sio_sorted_store, &sd->sorted, 0, 1, 0);
+STORE_FUNCTION(sio_read_latency_target_store, &sd->read_latency_target, 1, INT_MAX, 0);
 #undef STORE_FUNCTION
 
 #define DD_ATTR(name) \
@@ -355,14 +585,21 @@ static struct elv_fs_entry sio_attrs[] = {
 	DD_ATTR(async_write_expire),
 	DD_ATTR(fifo_batch),
 	DD_ATTR(writes_starved),
+	DD_ATTR(sorted),
+	DD_ATTR(read_latency_target),
+	__ATTR(batch_limit, S_IRUGO, sio_batch_limit_show, NULL),
+	__ATTR(avg_read_latency, S_IRUGO, sio_avg_read_latency_show, NULL),
 	__ATTR_NULL
 };
 
 static struct elevator_type iosched_sio = {
 	.ops = {
+		.elevator_merge_fn		= sio_merge,
+		.elevator_merged_fn		= sio_merged_request,
 		.elevator_merge_req_fn		= sio_merged_requests,
 		.elevator_dispatch_fn		= sio_dispatch_requests,
 		.elevator_add_req_fn		= sio_add_request,
+		.elevator_completed_req_fn	= sio_completed_request,
 #if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,38)
 		.elevator_queue_empty_fn	= sio_queue_empty,
 #endif
@@ -372,6 +609,8 @@ static struct elevator_type iosched_sio = {
 		.elevator_exit_fn		= sio_exit_queue,
 	},
 
+	.icq_size = sizeof(struct sio_ioc),
+	.icq_align = __alignof__(struct sio_ioc),
 	.elevator_attrs = sio_attrs,
 	.elevator_name = "sio",
 	.elevator_owner = THIS_MODULE,
@@ -14,6 +14,8 @@
  * according to the requests completion error code.
  * Each test is exposed via debugfs and can be triggered by writing to
  * the debugfs file.
+ * The module also carries a benchmark harness that replays request
+ * traces through any elevator, see "Benchmark harness" below.
  *
  */
 
@@ -26,6 +28,11 @@
 #include <linux/debugfs.h>
 #include <linux/test-iosched.h>
 #include <linux/delay.h>
+#include <linux/hrtimer.h>
+#include <linux/seq_file.h>
+#include <linux/sort.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
 #include "blk.h"
 
 #define MODULE_NAME "test-iosched"
@@ -861,8 +868,496 @@ static struct elevator_type elevator_test_iosched = {
 	.elevator_owner = THIS_MODULE,
 };
 
+/*
+ * Benchmark harness
+ *
+ * Replays a request trace against a block device through whatever
+ * elevator the device currently uses, so that cfq, deadline, sio, fiops
+ * and friends can be compared with traces captured on real hardware.
+ * The device has to be request based: brd and loop queue bios straight
+ * to the driver and have no elevator, so use scsi_debug or the eMMC
+ * itself. Lives in debugfs under iosched_bench/:
+ *
+ *   device	write the path of the block device to replay against
+ *   trace	append entries, one per line:
+ *		  <sector> <bytes> <R|W> <sync 0|1> <delay us>
+ *		where bytes is a multiple of 512 and the delay is counted
+ *		from the previous entry. Writing "clear" drops the loaded
+ *		trace. tools/testing/selftests/iosched/blk_replay -t
+ *		converts blkparse dumps into this format.
+ *   start	write 1 to replay the trace; returns once every request
+ *		has completed, or fails with ENODEV if the device has no
+ *		elevator
+ *   results	throughput, per class latency percentiles and the merge
+ *		counts of the device during the last replay
+ *
+ * The replay is open loop: requests are submitted at their recorded
+ * times whether or not earlier ones have completed, like the
+ * applications that generated them would have.
+ */
+
+#define BENCH_MIN_IOS		4096
+#define BENCH_MAX_IOS		(1 << 20)
+#define BENCH_MAX_PAGES		128
+#define BENCH_NR_CLASSES	4
+
+static const char * const bench_class_name[BENCH_NR_CLASSES] = {
+	"async read", "sync read", "async write", "sync write",
+};
+
+struct bench_io {
+	sector_t sector;
+	unsigned int bytes;
+	unsigned int delay_us;
+	u8 class;			/* 2 * direction + sync */
+	int error;
+	ktime_t submit;
+	ktime_t complete;
+};
+
+struct bench_result {
+	char elevator[ELV_NAME_MAX];
+	unsigned int nr_ios;
+	unsigned int errors;
+	u64 bytes;
+	s64 elapsed_us;
+	unsigned long merges[2];
+	unsigned int count[BENCH_NR_CLASSES];
+	s64 lat_us[BENCH_NR_CLASSES][5];	/* p50 p90 p99 p99.9 max */
+};
+
+static struct {
+	struct mutex lock;
+	char path[64];
+	struct bench_io *ios;
+	unsigned int nr_ios;
+	unsigned int max_ios;
+	struct page *pages[BENCH_MAX_PAGES];
+	atomic_t inflight;
+	wait_queue_head_t wait;
+	struct bench_result result;
+	struct dentry *root;
+} bench;
+
+static void bench_end_io(struct bio *bio, int err)
+{
+	struct bench_io *io = bio->bi_private;
+
+	io->complete = ktime_get();
+	io->error = err;
+	bio_put(bio);
+
+	if (atomic_dec_and_test(&bench.inflight))
+		wake_up(&bench.wait);
+}
+
+static void bench_submit(struct block_device *bdev, struct bench_io *io)
+{
+	static const int rw_flags[BENCH_NR_CLASSES] = {
+		READ, READ_SYNC, WRITE, WRITE_SYNC,
+	};
+	unsigned int nr_pages = DIV_ROUND_UP(io->bytes, PAGE_SIZE);
+	unsigned int len, done = 0;
+	struct bio *bio;
+	int i;
+
+	bio = bio_alloc(GFP_NOIO, nr_pages);
+	bio->bi_bdev = bdev;
+	bio->bi_sector = io->sector;
+	bio->bi_end_io = bench_end_io;
+	bio->bi_private = io;
+
+	for (i = 0; i < nr_pages; i++) {
+		len = min_t(unsigned int, io->bytes - done, PAGE_SIZE);
+		if (bio_add_page(bio, bench.pages[i], len, 0) < len)
+			break;
+		done += len;
+	}
+	/* the queue limits may be smaller than the traced request */
+	io->bytes = done;
+
+	atomic_inc(&bench.inflight);
+	io->submit = ktime_get();
+	submit_bio(rw_flags[io->class], bio);
+}
+
+static int bench_cmp_s64(const void *a, const void *b)
+{
+	s64 x = *(const s64 *)a, y = *(const s64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void bench_collect(struct bench_result *res, ktime_t start)
+{
+	static const unsigned int permille[4] = { 500, 900, 990, 999 };
+	struct bench_io *io;
+	s64 *lat;
+	unsigned int i, c, n;
+	ktime_t end = start;
+
+	lat = vmalloc(bench.nr_ios * sizeof(*lat));
+
+	for (c = 0; c < BENCH_NR_CLASSES; c++) {
+		for (i = 0, n = 0; i < bench.nr_ios; i++) {
+			io = &bench.ios[i];
+			if (c == 0) {
+				res->bytes += io->bytes;
+				res->errors += !!io->error;
+				if (ktime_to_ns(io->complete) > ktime_to_ns(end))
+					end = io->complete;
+			}
+			if (io->class != c)
+				continue;
+			if (lat)
+				lat[n] = ktime_us_delta(io->complete,
+							io->submit);
+			n++;
+		}
+		res->count[c] = n;
+		if (!n || !lat)
+			continue;
+		sort(lat, n, sizeof(*lat), bench_cmp_s64, NULL);
+		for (i = 0; i < ARRAY_SIZE(permille); i++)
+			res->lat_us[c][i] = lat[(u64)n * permille[i] / 1000];
+		res->lat_us[c][4] = lat[n - 1];
+	}
+
+	res->nr_ios = bench.nr_ios;
+	res->elapsed_us = ktime_us_delta(end, start);
+	vfree(lat);
+}
+
+static int bench_run(void)
+{
+	struct bench_result *res = &bench.result;
+	struct block_device *bdev;
+	struct request_queue *q;
+	struct hd_struct *part;
+	ktime_t start, next;
+	s64 ahead_us;
+	unsigned int i, mask;
+
+	if (!bench.nr_ios)
+		return -EINVAL;
+
+	bdev = blkdev_get_by_path(bench.path,
+				  FMODE_READ | FMODE_WRITE | FMODE_EXCL, &bench);
+	if (IS_ERR(bdev))
+		return PTR_ERR(bdev);
+
+	memset(res, 0, sizeof(*res));
+	q = bdev_get_queue(bdev);
+	spin_lock_irq(q->queue_lock);
+	if (q->elevator)
+		strlcpy(res->elevator, q->elevator->type->elevator_name,
+			sizeof(res->elevator));
+	spin_unlock_irq(q->queue_lock);
+	if (!res->elevator[0]) {
+		blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+		return -ENODEV;
+	}
+
+	/* the trace is in 512 byte units, the device may want more */
+	mask = (bdev_logical_block_size(bdev) >> 9) - 1;
+	for (i = 0; i < bench.nr_ios; i++) {
+		if ((bench.ios[i].sector | bench.ios[i].bytes >> 9) & mask) {
+			blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+			return -EINVAL;
+		}
+		if (bench.ios[i].sector + (bench.ios[i].bytes >> 9) >
+		    i_size_read(bdev->bd_inode) >> 9) {
+			blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+			return -ENOSPC;
+		}
+	}
+
+	part = bdev->bd_part;
+	res->merges[READ] = part_stat_read(part, merges[READ]);
+	res->merges[WRITE] = part_stat_read(part, merges[WRITE]);
+
+	atomic_set(&bench.inflight, 1);
+	start = next = ktime_get();
+	for (i = 0; i < bench.nr_ios; i++) {
+		next = ktime_add_us(next, bench.ios[i].delay_us);
+		ahead_us = ktime_us_delta(next, ktime_get());
+		if (ahead_us > 20)
+			usleep_range(ahead_us, ahead_us + 10);
+		bench_submit(bdev, &bench.ios[i]);
+		if (!(i % 64))
+			cond_resched();
+	}
+	if (!atomic_dec_and_test(&bench.inflight))
+		wait_event(bench.wait, !atomic_read(&bench.inflight));
+
+	res->merges[READ] = part_stat_read(part, merges[READ]) -
+			    res->merges[READ];
+	res->merges[WRITE] = part_stat_read(part, merges[WRITE]) -
+			     res->merges[WRITE];
+	bench_collect(res, start);
+
+	blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	return 0;
+}
+
+/* grow the trace by doubling, most traces are far below the limit */
+static int bench_grow(void)
+{
+	struct bench_io *ios;
+	unsigned int max_ios;
+
+	if (bench.max_ios == BENCH_MAX_IOS)
+		return -ENOSPC;
+	max_ios = bench.max_ios ? 2 * bench.max_ios : BENCH_MIN_IOS;
+	ios = vmalloc(max_ios * sizeof(*ios));
+	if (!ios)
+		return -ENOMEM;
+	if (bench.ios)
+		memcpy(ios, bench.ios, bench.nr_ios * sizeof(*ios));
+	vfree(bench.ios);
+	bench.ios = ios;
+	bench.max_ios = max_ios;
+	return 0;
+}
+
+static int bench_add_line(char *line)
+{
+	unsigned long long sector;
+	unsigned int bytes, sync, delay_us;
+	struct bench_io *io;
+	char dir;
+	int ret;
+
+	line = strim(line);
+	if (!*line)
+		return 0;
+	if (!strcmp(line, "clear")) {
+		vfree(bench.ios);
+		bench.ios = NULL;
+		bench.nr_ios = bench.max_ios = 0;
+		return 0;
+	}
+	if (sscanf(line, "%llu %u %c %u %u", &sector, &bytes, &dir, &sync,
+		   &delay_us) != 5 || (dir != 'R' && dir != 'W') || !bytes ||
+	    bytes & 511)
+		return -EINVAL;
+	if (bench.nr_ios == bench.max_ios) {
+		ret = bench_grow();
+		if (ret)
+			return ret;
+	}
+
+	io = &bench.ios[bench.nr_ios++];
+	memset(io, 0, sizeof(*io));
+	io->sector = sector;
+	io->bytes = min_t(unsigned int, bytes, BENCH_MAX_PAGES * PAGE_SIZE);
+	io->delay_us = delay_us;
+	io->class = 2 * (dir == 'W') + !!sync;
+	return 0;
+}
+
+static ssize_t bench_trace_write(struct file *file, const char __user *ubuf,
+				 size_t count, loff_t *ppos)
+{
+	char *buf, *line, *end;
+	size_t len = min_t(size_t, count, PAGE_SIZE - 1);
+	ssize_t ret;
+	int err;
+
+	buf = (char *)__get_free_page(GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+	if (copy_from_user(buf, ubuf, len)) {
+		ret = -EFAULT;
+		goto out;
+	}
+	buf[len] = '\0';
+
+	/* only consume whole lines, the caller writes the rest again */
+	end = strrchr(buf, '\n');
+	if (end && len < count)
+		len = end - buf + 1;
+	buf[len] = '\0';
+
+	mutex_lock(&bench.lock);
+	ret = len;
+	line = buf;
+	while (line) {
+		end = strchr(line, '\n');
+		if (end)
+			*end++ = '\0';
+		err = bench_add_line(line);
+		if (err) {
+			ret = err;
+			break;
+		}
+		line = end;
+	}
+	mutex_unlock(&bench.lock);
+out:
+	free_page((unsigned long)buf);
+	return ret;
+}
+
+static const struct file_operations bench_trace_fops = {
+	.open		= simple_open,
+	.write		= bench_trace_write,
+	.llseek		= noop_llseek,
+};
+
+static ssize_t bench_device_write(struct file *file, const char __user *ubuf,
+				  size_t count, loff_t *ppos)
+{
+	char path[sizeof(bench.path)];
+
+	if (count >= sizeof(path))
+		return -EINVAL;
+	if (copy_from_user(path, ubuf, count))
+		return -EFAULT;
+	path[count] = '\0';
+
+	mutex_lock(&bench.lock);
+	strlcpy(bench.path, strim(path), sizeof(bench.path));
+	mutex_unlock(&bench.lock);
+	return count;
+}
+
+static ssize_t bench_device_read(struct file *file, char __user *ubuf,
+				 size_t count, loff_t *ppos)
+{
+	char path[sizeof(bench.path) + 1];
+	int len;
+
+	mutex_lock(&bench.lock);
+	len = scnprintf(path, sizeof(path), "%s\n", bench.path);
+	mutex_unlock(&bench.lock);
+	return simple_read_from_buffer(ubuf, count, ppos, path, len);
+}
+
+static const struct file_operations bench_device_fops = {
+	.open		= simple_open,
+	.read		= bench_device_read,
+	.write		= bench_device_write,
+	.llseek		= default_llseek,
+};
+
+static ssize_t bench_start_write(struct file *file, const char __user *ubuf,
+				 size_t count, loff_t *ppos)
+{
+	int ret;
+
+	mutex_lock(&bench.lock);
+	ret = bench_run();
+	mutex_unlock(&bench.lock);
+
+	return ret ? ret : count;
+}
+
+static const struct file_operations bench_start_fops = {
+	.open		= simple_open,
+	.write		= bench_start_write,
+	.llseek		= noop_llseek,
+};
+
+static int bench_results_show(struct seq_file *s, void *unused)
+{
+	struct bench_result *res = &bench.result;
+	int c;
+
+	mutex_lock(&bench.lock);
+	if (!res->nr_ios)
+		goto out;
+
+	seq_printf(s, "elevator: %s\n", res->elevator);
+	seq_printf(s, "requests: %u (%u failed)\n", res->nr_ios, res->errors);
+	seq_printf(s, "bytes: %llu in %lld us, %llu KB/s\n", res->bytes,
+		   res->elapsed_us, res->elapsed_us ?
+		   div64_u64(res->bytes * USEC_PER_SEC, res->elapsed_us) >> 10 :
+		   0);
+	seq_printf(s, "merges: read %lu write %lu\n", res->merges[READ],
+		   res->merges[WRITE]);
+	seq_printf(s, "%-12s %8s %8s %8s %8s %8s %8s\n", "latency us",
+		   "count", "p50", "p90", "p99", "p99.9", "max");
+	for (c = 0; c < BENCH_NR_CLASSES; c++) {
+		if (!res->count[c])
+			continue;
+		seq_printf(s, "%-12s %8u %8lld %8lld %8lld %8lld %8lld\n",
+			   bench_class_name[c], res->count[c],
+			   res->lat_us[c][0], res->lat_us[c][1],
+			   res->lat_us[c][2], res->lat_us[c][3],
+			   res->lat_us[c][4]);
+	}
+out:
+	mutex_unlock(&bench.lock);
+	return 0;
+}
+
+static int bench_results_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, bench_results_show, inode->i_private);
+}
+
+static const struct file_operations bench_results_fops = {
+	.open		= bench_results_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int bench_init(void)
+{
+	int i;
+
+	mutex_init(&bench.lock);
+	init_waitqueue_head(&bench.wait);
+
+	for (i = 0; i < BENCH_MAX_PAGES; i++) {
+		bench.pages[i] = alloc_page(GFP_KERNEL | __GFP_ZERO);
+		if (!bench.pages[i])
+			goto err;
+	}
+
+	bench.root = debugfs_create_dir("iosched_bench", NULL);
+	if (IS_ERR_OR_NULL(bench.root))
+		goto err;
+	if (!debugfs_create_file("device", S_IRUSR | S_IWUSR, bench.root,
+				 NULL, &bench_device_fops) ||
+	    !debugfs_create_file("trace", S_IWUSR, bench.root, NULL,
+				 &bench_trace_fops) ||
+	    !debugfs_create_file("start", S_IWUSR, bench.root, NULL,
+				 &bench_start_fops) ||
+	    !debugfs_create_file("results", S_IRUSR, bench.root, NULL,
+				 &bench_results_fops)) {
+		debugfs_remove_recursive(bench.root);
+		goto err;
+	}
+
+	return 0;
+err:
+	/* test_exit() only calls bench_exit() if bench.root is set */
+	bench.root = NULL;
+	while (--i >= 0) {
+		__free_page(bench.pages[i]);
+		bench.pages[i] = NULL;
+	}
+	return -ENOMEM;
+}
+
+static void bench_exit(void)
+{
+	int i;
+
+	debugfs_remove_recursive(bench.root);
+	for (i = 0; i < BENCH_MAX_PAGES; i++)
+		__free_page(bench.pages[i]);
+	vfree(bench.ios);
+}
+
 static int __init test_init(void)
 {
+	if (bench_init())
+		test_pr_err("%s: benchmark harness not available", __func__);
+
 	elv_register(&elevator_test_iosched);
 
 	return 0;
@@ -871,6 +1366,9 @@ static int __init test_init(void)
 static void __exit test_exit(void)
 {
 	elv_unregister(&elevator_test_iosched);
+
+	if (bench.root)
+		bench_exit();
 }
 
 module_init(test_init);
@@ -32,6 +32,18 @@
 
 #include <trace/events/power.h>
 
+/* shared by the governors, which may be built as modules */
+#define CREATE_TRACE_POINTS
+#include <trace/events/cpufreq_interactive.h>
+
+EXPORT_TRACEPOINT_SYMBOL_GPL(cpufreq_interactive_up);
+EXPORT_TRACEPOINT_SYMBOL_GPL(cpufreq_interactive_down);
+EXPORT_TRACEPOINT_SYMBOL_GPL(cpufreq_interactive_target);
+EXPORT_TRACEPOINT_SYMBOL_GPL(cpufreq_interactive_already);
+EXPORT_TRACEPOINT_SYMBOL_GPL(cpufreq_interactive_notyet);
+EXPORT_TRACEPOINT_SYMBOL_GPL(cpufreq_interactive_boost);
+EXPORT_TRACEPOINT_SYMBOL_GPL(cpufreq_interactive_unboost);
+
 static struct cpufreq_driver *cpufreq_driver;
 static DEFINE_PER_CPU(struct cpufreq_policy *, cpufreq_cpu_data);
 #ifdef CONFIG_HOTPLUG_CPU
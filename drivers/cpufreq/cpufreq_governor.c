@@ -0,0 +1,654 @@
+/*
+ * drivers/cpufreq/cpufreq_governor.c
+ *
+ * Sampling core shared by the ondemand family of governors: idle time
+ * accounting, one timer per group of cpus sharing a clock, and a replay
+ * mode that runs a governor's decisions over a recorded load trace.
+ *
+ * Based on the sampling code of the ondemand governor,
+ *  Copyright (C)  2001 Russell King
+ *            (C)  2003 Venkatesh Pallipadi <venkatesh.pallipadi@intel.com>.
+ *                      Jun Nakajima <jun.nakajima@intel.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <linux/cpu.h>
+#include <linux/cpufreq.h>
+#include <linux/debugfs.h>
+#include <linux/init.h>
+#include <linux/jiffies.h>
+#include <linux/kernel.h>
+#include <linux/kernel_stat.h>
+#include <linux/module.h>
+#include <linux/rcupdate.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/tick.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <asm/cputime.h>
+
+#include "cpufreq_governor.h"
+
+#define REPLAY_MAX_SAMPLES	20000
+#define REPLAY_MAX_IDLE_CHECKS	1000
+
+struct dbs_cpu_prev {
+	u64 idle;
+	u64 iowait;
+	u64 wall;
+	u64 nice;
+};
+
+struct dbs_replay {
+	unsigned int *loads;		/* rows of nr_cpu_ids percentages */
+	unsigned int nr_cols;
+	unsigned int nr_rows;
+	unsigned int row;
+	unsigned int wall;		/* usecs covered by the next row */
+};
+
+static DEFINE_PER_CPU(struct dbs_cpu_prev, dbs_prev);
+static DEFINE_PER_CPU(struct dbs_group *, dbs_groups);
+
+/* protects the governor list and the replay state */
+static DEFINE_MUTEX(dbs_lock);
+static LIST_HEAD(dbs_governors);
+
+static char replay_gov_name[CPUFREQ_NAME_LEN];
+static struct dbs_replay replay_trace;
+
+static inline u64 get_cpu_idle_time_jiffy(unsigned int cpu, u64 *wall)
+{
+	u64 idle_time;
+	u64 cur_wall_time;
+	u64 busy_time;
+
+	cur_wall_time = jiffies64_to_cputime64(get_jiffies_64());
+
+	busy_time  = kcpustat_cpu(cpu).cpustat[CPUTIME_USER];
+	busy_time += kcpustat_cpu(cpu).cpustat[CPUTIME_SYSTEM];
+	busy_time += kcpustat_cpu(cpu).cpustat[CPUTIME_IRQ];
+	busy_time += kcpustat_cpu(cpu).cpustat[CPUTIME_SOFTIRQ];
+	busy_time += kcpustat_cpu(cpu).cpustat[CPUTIME_STEAL];
+	busy_time += kcpustat_cpu(cpu).cpustat[CPUTIME_NICE];
+
+	idle_time = cur_wall_time - busy_time;
+	if (wall)
+		*wall = jiffies_to_usecs(cur_wall_time);
+
+	return jiffies_to_usecs(idle_time);
+}
+
+/* Idle time including iowait, which the governors may count as busy */
+static inline u64 get_cpu_idle_time(unsigned int cpu, u64 *wall)
+{
+	u64 idle_time = get_cpu_idle_time_us(cpu, NULL);
+
+	if (idle_time == -1ULL)
+		return get_cpu_idle_time_jiffy(cpu, wall);
+	else
+		idle_time += get_cpu_iowait_time_us(cpu, wall);
+
+	return idle_time;
+}
+
+static inline u64 get_cpu_iowait_time(unsigned int cpu)
+{
+	u64 iowait_time = get_cpu_iowait_time_us(cpu, NULL);
+
+	if (iowait_time == -1ULL)
+		return 0;
+
+	return iowait_time;
+}
+
+static void dbs_sample_cpu(unsigned int cpu, struct dbs_cpu_load *l)
+{
+	struct dbs_cpu_prev *prev = &per_cpu(dbs_prev, cpu);
+	u64 wall, idle, iowait, nice;
+
+	idle = get_cpu_idle_time(cpu, &wall);
+	iowait = get_cpu_iowait_time(cpu);
+	nice = kcpustat_cpu(cpu).cpustat[CPUTIME_NICE];
+
+	l->cpu = cpu;
+	l->wall = (unsigned int)(wall - prev->wall);
+	l->idle = (unsigned int)(idle - prev->idle);
+	l->iowait = (unsigned int)(iowait - prev->iowait);
+	/*
+	 * Assumption: nice time between sampling periods will be less
+	 * than 2^32 jiffies for 32 bit sys
+	 */
+	l->nice = jiffies_to_usecs((unsigned long)
+				   cputime64_to_jiffies64(nice - prev->nice));
+
+	prev->wall = wall;
+	prev->idle = idle;
+	prev->iowait = iowait;
+	prev->nice = nice;
+}
+
+static void dbs_replay_sample(struct dbs_group *grp)
+{
+	struct dbs_replay *r = grp->replay;
+	unsigned int *row;
+	int i;
+
+	grp->nr_loads = 0;
+	if (r->row == r->nr_rows)
+		return;
+
+	row = r->loads + r->row++ * nr_cpu_ids;
+	for (i = 0; i < r->nr_cols; i++) {
+		struct dbs_cpu_load *l = &grp->loads[i];
+
+		memset(l, 0, sizeof(*l));
+		l->cpu = i;
+		l->wall = r->wall;
+		l->idle = r->wall / 100 * (100 - row[i]);
+		l->freq_avg = grp->cur;
+	}
+	grp->nr_loads = r->nr_cols;
+}
+
+/**
+ * dbs_group_sample - sample the load of every cpu in a group
+ * @grp: the group
+ *
+ * Fills grp->loads with what each cpu did since the previous sample.
+ */
+void dbs_group_sample(struct dbs_group *grp)
+{
+	unsigned int j, n = 0;
+	int freq_avg;
+
+	if (grp->replay) {
+		dbs_replay_sample(grp);
+		return;
+	}
+
+	for_each_cpu(j, grp->policy->cpus) {
+		dbs_sample_cpu(j, &grp->loads[n]);
+
+		freq_avg = __cpufreq_driver_getavg(grp->policy, j);
+		grp->loads[n].freq_avg = freq_avg > 0 ? freq_avg : grp->cur;
+		n++;
+	}
+	grp->nr_loads = n;
+}
+EXPORT_SYMBOL_GPL(dbs_group_sample);
+
+/**
+ * dbs_group_reset_sample - restart the sampling period of a group
+ * @grp: the group
+ */
+void dbs_group_reset_sample(struct dbs_group *grp)
+{
+	struct dbs_cpu_load l;
+	unsigned int j;
+
+	if (grp->replay)
+		return;
+
+	for_each_cpu(j, grp->policy->cpus)
+		dbs_sample_cpu(j, &l);
+}
+EXPORT_SYMBOL_GPL(dbs_group_reset_sample);
+
+/**
+ * dbs_target - apply a governor decision
+ * @grp: the group
+ * @freq: target frequency
+ * @relation: CPUFREQ_RELATION_L or CPUFREQ_RELATION_H
+ */
+void dbs_target(struct dbs_group *grp, unsigned int freq,
+		unsigned int relation)
+{
+	struct cpufreq_frequency_table *table;
+	struct cpufreq_policy *policy = grp->policy;
+	unsigned int index;
+
+	if (!grp->replay) {
+		__cpufreq_driver_target(policy, freq, relation);
+		grp->cur = policy->cur;
+		return;
+	}
+
+	/* what the driver would have picked */
+	table = cpufreq_frequency_get_table(policy->cpu);
+	if (table && !cpufreq_frequency_table_target(policy, table, freq,
+						     relation, &index))
+		grp->cur = table[index].frequency;
+	else
+		grp->cur = clamp(freq, policy->min, policy->max);
+}
+EXPORT_SYMBOL_GPL(dbs_target);
+
+/**
+ * dbs_align_delay - align a sampling delay on a multiple of itself
+ * @delay: delay in jiffies
+ *
+ * Groups sampled with aligned delays fire in the same jiffy, so the
+ * cpus wake up once for all of them.
+ */
+unsigned long dbs_align_delay(unsigned long delay)
+{
+	if (num_online_cpus() > 1 && delay > 1)
+		delay -= jiffies % delay;
+
+	return delay ? delay : 1;
+}
+EXPORT_SYMBOL_GPL(dbs_align_delay);
+
+static void dbs_group_work(struct work_struct *work)
+{
+	struct dbs_group *grp = container_of(work, struct dbs_group, work.work);
+	unsigned long delay;
+
+	mutex_lock(&grp->timer_mutex);
+	grp->cur = grp->policy->cur;
+	delay = grp->gov->check(grp);
+	schedule_delayed_work_on(grp->cpu, &grp->work, delay);
+	mutex_unlock(&grp->timer_mutex);
+}
+
+static struct dbs_group *dbs_group_alloc(struct dbs_governor *gov,
+					 struct cpufreq_policy *policy)
+{
+	struct dbs_group *grp;
+
+	grp = kzalloc(sizeof(*grp) + gov->data_size, GFP_KERNEL);
+	if (!grp)
+		return NULL;
+
+	grp->loads = kcalloc(nr_cpu_ids, sizeof(*grp->loads), GFP_KERNEL);
+	if (!grp->loads) {
+		kfree(grp);
+		return NULL;
+	}
+
+	grp->policy = policy;
+	grp->gov = gov;
+	grp->cpu = policy->cpu;
+	grp->cur = policy->cur;
+	mutex_init(&grp->timer_mutex);
+	INIT_DELAYED_WORK_DEFERRABLE(&grp->work, dbs_group_work);
+
+	return grp;
+}
+
+static void dbs_group_free(struct dbs_group *grp)
+{
+	mutex_destroy(&grp->timer_mutex);
+	kfree(grp->loads);
+	kfree(grp);
+}
+
+/**
+ * dbs_group_start - start governing a policy
+ * @gov: the governor
+ * @policy: the policy, whose cpus become the group
+ *
+ * The timer is not started, see dbs_group_timer_start().
+ */
+struct dbs_group *dbs_group_start(struct dbs_governor *gov,
+				  struct cpufreq_policy *policy)
+{
+	struct dbs_group *grp;
+	unsigned int j;
+
+	grp = dbs_group_alloc(gov, policy);
+	if (!grp)
+		return NULL;
+
+	dbs_group_reset_sample(grp);
+	if (gov->init)
+		gov->init(grp);
+
+	for_each_cpu(j, policy->cpus)
+		rcu_assign_pointer(per_cpu(dbs_groups, j), grp);
+
+	return grp;
+}
+EXPORT_SYMBOL_GPL(dbs_group_start);
+
+void dbs_group_stop(struct dbs_group *grp)
+{
+	unsigned int j;
+
+	dbs_group_timer_stop(grp);
+
+	for_each_possible_cpu(j)
+		if (per_cpu(dbs_groups, j) == grp)
+			rcu_assign_pointer(per_cpu(dbs_groups, j), NULL);
+
+	/* for dbs_group_get() callers that only hold rcu_read_lock() */
+	synchronize_rcu();
+	dbs_group_free(grp);
+}
+EXPORT_SYMBOL_GPL(dbs_group_stop);
+
+/*
+ * Returns the group @cpu belongs to if @gov governs it, else NULL. The
+ * group stays valid while the caller holds the mutex the governor calls
+ * dbs_group_stop() under, or rcu_read_lock() if it does not sleep.
+ */
+struct dbs_group *dbs_group_get(unsigned int cpu, struct dbs_governor *gov)
+{
+	struct dbs_group *grp = rcu_dereference_raw(per_cpu(dbs_groups, cpu));
+
+	return grp && grp->gov == gov ? grp : NULL;
+}
+EXPORT_SYMBOL_GPL(dbs_group_get);
+
+void dbs_group_timer_start(struct dbs_group *grp, unsigned long delay)
+{
+	schedule_delayed_work_on(grp->cpu, &grp->work, delay);
+}
+EXPORT_SYMBOL_GPL(dbs_group_timer_start);
+
+/* Must not be called with grp->timer_mutex held */
+void dbs_group_timer_stop(struct dbs_group *grp)
+{
+	cancel_delayed_work_sync(&grp->work);
+}
+EXPORT_SYMBOL_GPL(dbs_group_timer_stop);
+
+/* Brings the speed back within new policy limits */
+void dbs_group_limits(struct dbs_group *grp)
+{
+	struct cpufreq_policy *policy = grp->policy;
+
+	mutex_lock(&grp->timer_mutex);
+	if (policy->max < policy->cur)
+		__cpufreq_driver_target(policy, policy->max,
+					CPUFREQ_RELATION_H);
+	else if (policy->min > policy->cur)
+		__cpufreq_driver_target(policy, policy->min,
+					CPUFREQ_RELATION_L);
+	grp->cur = policy->cur;
+	mutex_unlock(&grp->timer_mutex);
+}
+EXPORT_SYMBOL_GPL(dbs_group_limits);
+
+int dbs_register_governor(struct dbs_governor *gov)
+{
+	mutex_lock(&dbs_lock);
+	list_add_tail(&gov->list, &dbs_governors);
+	mutex_unlock(&dbs_lock);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(dbs_register_governor);
+
+void dbs_unregister_governor(struct dbs_governor *gov)
+{
+	mutex_lock(&dbs_lock);
+	list_del(&gov->list);
+	mutex_unlock(&dbs_lock);
+}
+EXPORT_SYMBOL_GPL(dbs_unregister_governor);
+
+/*
+ * Replay
+ *
+ * cpufreq_governor/replay_governor names the governor to test and
+ * cpufreq_governor/replay takes a load trace, one sample per line with
+ * the busy percentage of each cpu of the group:
+ *
+ *	# cpu0 cpu1
+ *	12 3
+ *	97 40
+ *
+ * Reading replay runs the governor's decisions, with its current
+ * tunables and the limits of cpu0's policy, starting at the minimum
+ * speed, and prints the time, the loads and the chosen speed of every
+ * sample. Nothing is changed on the hardware.
+ */
+
+static struct dbs_governor *dbs_find_governor(const char *name)
+{
+	struct dbs_governor *gov;
+
+	list_for_each_entry(gov, &dbs_governors, list)
+		if (!strnicmp(gov->name, name, CPUFREQ_NAME_LEN))
+			return gov;
+	return NULL;
+}
+
+static int dbs_replay_show(struct seq_file *m, void *unused)
+{
+	struct dbs_replay *r = &replay_trace;
+	struct cpufreq_policy *real, *policy;
+	struct dbs_governor *gov;
+	struct dbs_group *grp;
+	unsigned long delay;
+	unsigned int row, idle_checks = 0, i;
+	u64 time_us = 0;
+	int ret = 0;
+
+	mutex_lock(&dbs_lock);
+
+	gov = dbs_find_governor(replay_gov_name);
+	if (!gov || !r->nr_rows) {
+		seq_puts(m, "# set replay_governor and write a trace first\n");
+		goto out;
+	}
+
+	real = cpufreq_cpu_get(0);
+	if (!real) {
+		ret = -ENODEV;
+		goto out;
+	}
+	/* a private copy, only its limits and cpu are used */
+	policy = kmemdup(real, sizeof(*real), GFP_KERNEL);
+	cpufreq_cpu_put(real);
+	if (!policy) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	grp = dbs_group_alloc(gov, policy);
+	if (!grp) {
+		kfree(policy);
+		ret = -ENOMEM;
+		goto out;
+	}
+	grp->replay = r;
+	grp->cur = policy->min;
+	r->row = 0;
+	r->wall = jiffies_to_usecs(1);
+	if (gov->init)
+		gov->init(grp);
+
+	seq_printf(m, "# %s, %u-%u kHz\n# time_ms loads khz\n", gov->name,
+		   policy->min, policy->max);
+
+	while (r->row < r->nr_rows && idle_checks < REPLAY_MAX_IDLE_CHECKS) {
+		row = r->row;
+		delay = max(gov->check(grp), 1UL);
+		r->wall = jiffies_to_usecs(delay);
+
+		if (r->row != row) {
+			seq_printf(m, "%llu", div_u64(time_us, USEC_PER_MSEC));
+			for (i = 0; i < r->nr_cols; i++)
+				seq_printf(m, " %u",
+					   r->loads[row * nr_cpu_ids + i]);
+			seq_printf(m, " %u\n", grp->cur);
+			idle_checks = 0;
+		} else {
+			idle_checks++;
+		}
+		time_us += jiffies_to_usecs(delay);
+	}
+
+	dbs_group_free(grp);
+	kfree(policy);
+out:
+	mutex_unlock(&dbs_lock);
+	return ret;
+}
+
+static int dbs_replay_open(struct inode *inode, struct file *file)
+{
+	struct dbs_replay *r = &replay_trace;
+
+	/* opening for writing starts a new trace */
+	if (file->f_mode & FMODE_WRITE) {
+		mutex_lock(&dbs_lock);
+		r->nr_rows = 0;
+		r->nr_cols = 0;
+		mutex_unlock(&dbs_lock);
+	}
+
+	/* also for writers, an O_RDWR file may be read from as well */
+	return single_open(file, dbs_replay_show, NULL);
+}
+
+static int dbs_replay_add_line(char *line)
+{
+	struct dbs_replay *r = &replay_trace;
+	unsigned int *vals, n = 0;
+	char *tok;
+
+	line = strim(line);
+	if (!*line || *line == '#')
+		return 0;
+
+	if (r->nr_rows == REPLAY_MAX_SAMPLES)
+		return -ENOSPC;
+
+	if (!r->loads) {
+		r->loads = vmalloc(REPLAY_MAX_SAMPLES * nr_cpu_ids *
+				   sizeof(*r->loads));
+		if (!r->loads)
+			return -ENOMEM;
+	}
+
+	vals = r->loads + r->nr_rows * nr_cpu_ids;
+	while ((tok = strsep(&line, " \t")) != NULL) {
+		if (!*tok)
+			continue;
+		if (n == nr_cpu_ids || kstrtouint(tok, 10, &vals[n]) ||
+		    vals[n] > 100)
+			return -EINVAL;
+		n++;
+	}
+
+	if (!r->nr_rows)
+		r->nr_cols = n;
+	if (n != r->nr_cols)
+		return -EINVAL;
+
+	r->nr_rows++;
+	return 0;
+}
+
+static ssize_t dbs_replay_write(struct file *file, const char __user *ubuf,
+				size_t count, loff_t *ppos)
+{
+	char *buf, *line, *end;
+	size_t len = min_t(size_t, count, PAGE_SIZE - 1);
+	ssize_t ret;
+
+	buf = (char *)__get_free_page(GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+	if (copy_from_user(buf, ubuf, len)) {
+		ret = -EFAULT;
+		goto out;
+	}
+	buf[len] = '\0';
+
+	/* only consume whole lines, the caller writes the rest again */
+	end = strrchr(buf, '\n');
+	if (end && len < count)
+		len = end - buf + 1;
+	buf[len] = '\0';
+
+	mutex_lock(&dbs_lock);
+	ret = len;
+	for (line = buf; line; line = end) {
+		end = strchr(line, '\n');
+		if (end)
+			*end++ = '\0';
+		ret = dbs_replay_add_line(line);
+		if (ret)
+			break;
+		ret = len;
+	}
+	mutex_unlock(&dbs_lock);
+out:
+	free_page((unsigned long)buf);
+	return ret;
+}
+
+static const struct file_operations dbs_replay_fops = {
+	.open		= dbs_replay_open,
+	.read		= seq_read,
+	.write		= dbs_replay_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static ssize_t dbs_replay_gov_read(struct file *file, char __user *ubuf,
+				   size_t count, loff_t *ppos)
+{
+	char buf[CPUFREQ_NAME_LEN + 1];
+	int len;
+
+	mutex_lock(&dbs_lock);
+	len = scnprintf(buf, sizeof(buf), "%s\n", replay_gov_name);
+	mutex_unlock(&dbs_lock);
+	return simple_read_from_buffer(ubuf, count, ppos, buf, len);
+}
+
+static ssize_t dbs_replay_gov_write(struct file *file, const char __user *ubuf,
+				    size_t count, loff_t *ppos)
+{
+	char buf[CPUFREQ_NAME_LEN];
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+
+	mutex_lock(&dbs_lock);
+	strlcpy(replay_gov_name, strim(buf), sizeof(replay_gov_name));
+	mutex_unlock(&dbs_lock);
+	return count;
+}
+
+static const struct file_operations dbs_replay_gov_fops = {
+	.open		= simple_open,
+	.read		= dbs_replay_gov_read,
+	.write		= dbs_replay_gov_write,
+	.llseek		= default_llseek,
+};
+
+static int __init dbs_debugfs_init(void)
+{
+	struct dentry *dir;
+
+	dir = debugfs_create_dir("cpufreq_governor", NULL);
+	if (!dir)
+		return -ENOMEM;
+
+	if (!debugfs_create_file("replay_governor", S_IRUSR | S_IWUSR, dir,
+				 NULL, &dbs_replay_gov_fops) ||
+	    !debugfs_create_file("replay", S_IRUSR | S_IWUSR, dir, NULL,
+				 &dbs_replay_fops)) {
+		debugfs_remove_recursive(dir);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+late_initcall(dbs_debugfs_init);
+
+MODULE_DESCRIPTION("Sampling core of the ondemand family of cpufreq governors");
+MODULE_LICENSE("GPL");
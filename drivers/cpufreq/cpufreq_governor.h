@@ -0,0 +1,112 @@
+/*
+ * drivers/cpufreq/cpufreq_governor.h
+ *
+ * Sampling core shared by the ondemand family of governors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef _CPUFREQ_GOVERNOR_H
+#define _CPUFREQ_GOVERNOR_H
+
+#include <linux/cpufreq.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+
+/*
+ * The core owns the idle time accounting of every cpu and one deferrable
+ * timer per policy, i.e. per group of cpus sharing a clock. When the timer
+ * fires, the governor's check() callback asks for a sample of the group
+ * with dbs_group_sample(), decides on a speed, applies it with
+ * dbs_target() and returns how long to wait for the next check.
+ *
+ * The same check() can be fed recorded loads instead of live ones, see
+ * the replay files in debugfs under cpufreq_governor/. check() must
+ * therefore read the current speed from grp->cur and change it only
+ * through dbs_target().
+ */
+
+/* What one cpu did since the previous sample, all times in usecs */
+struct dbs_cpu_load {
+	unsigned int cpu;
+	unsigned int wall;
+	unsigned int idle;		/* iowait included */
+	unsigned int iowait;
+	unsigned int nice;
+	unsigned int freq_avg;		/* average speed, kHz */
+};
+
+struct dbs_replay;
+
+struct dbs_group {
+	struct cpufreq_policy *policy;
+	struct dbs_governor *gov;
+	unsigned int cpu;		/* cpu the timer runs on */
+	unsigned int cur;		/* speed the decisions start from */
+	struct delayed_work work;
+	/* serializes check() with limit and tunable changes */
+	struct mutex timer_mutex;
+	unsigned int nr_loads;
+	struct dbs_cpu_load *loads;
+	struct dbs_replay *replay;
+	unsigned long data[0];		/* gov->data_size bytes for the governor */
+};
+
+struct dbs_governor {
+	struct list_head list;
+	const char *name;
+	size_t data_size;
+	/* sets up the governor data of a new group */
+	void (*init)(struct dbs_group *grp);
+	/* evaluates the group, returns the jiffies until the next check */
+	unsigned long (*check)(struct dbs_group *grp);
+};
+
+static inline void *dbs_group_data(struct dbs_group *grp)
+{
+	return grp->data;
+}
+
+static inline bool dbs_group_replaying(struct dbs_group *grp)
+{
+	return grp->replay != NULL;
+}
+
+/* Busy percentage of @l, or -1 if the sample cannot be used */
+static inline int dbs_cpu_load_pct(const struct dbs_cpu_load *l,
+				   bool ignore_nice, bool io_is_busy)
+{
+	unsigned int idle = l->idle;
+
+	if (ignore_nice)
+		idle += l->nice;
+	if (io_is_busy && idle >= l->iowait)
+		idle -= l->iowait;
+	if (unlikely(!l->wall || l->wall < idle))
+		return -1;
+
+	return 100 * (l->wall - idle) / l->wall;
+}
+
+extern int dbs_register_governor(struct dbs_governor *gov);
+extern void dbs_unregister_governor(struct dbs_governor *gov);
+
+extern struct dbs_group *dbs_group_start(struct dbs_governor *gov,
+					 struct cpufreq_policy *policy);
+extern void dbs_group_stop(struct dbs_group *grp);
+extern struct dbs_group *dbs_group_get(unsigned int cpu,
+				       struct dbs_governor *gov);
+extern void dbs_group_timer_start(struct dbs_group *grp, unsigned long delay);
+extern void dbs_group_timer_stop(struct dbs_group *grp);
+extern void dbs_group_limits(struct dbs_group *grp);
+
+extern void dbs_group_sample(struct dbs_group *grp);
+extern void dbs_group_reset_sample(struct dbs_group *grp);
+extern void dbs_target(struct dbs_group *grp, unsigned int freq,
+		       unsigned int relation);
+extern unsigned long dbs_align_delay(unsigned long delay);
+
+#endif /* _CPUFREQ_GOVERNOR_H */
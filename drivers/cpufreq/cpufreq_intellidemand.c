@@ -27,6 +27,8 @@
 #include <linux/slab.h>
 #include <linux/earlysuspend.h>
 
+#include "cpufreq_governor.h"
+
 #define _LIMIT_LCD_OFF_CPU_MAX_FREQ_
 
 /*
@@ -63,7 +65,6 @@ static unsigned int min_sampling_rate;
 #define MIN_LATENCY_MULTIPLIER			(100)
 #define TRANSITION_LATENCY_LIMIT		(10 * 1000 * 1000)
 
-static void do_dbs_timer(struct work_struct *work);
 static int cpufreq_governor_dbs(struct cpufreq_policy *policy,
 				unsigned int event);
 
@@ -87,28 +88,25 @@ struct cpufreq_governor cpufreq_gov_intellidemand = {
 /* Sampling types */
 enum {DBS_NORMAL_SAMPLE, DBS_SUB_SAMPLE};
 
-struct cpu_dbs_info_s {
-	cputime64_t prev_cpu_idle;
-	cputime64_t prev_cpu_iowait;
-	cputime64_t prev_cpu_wall;
-	cputime64_t prev_cpu_nice;
-	struct cpufreq_policy *cur_policy;
-	struct delayed_work work;
+/* Per policy state, kept in the group data of the governor core */
+struct id_dbs_info {
 	struct cpufreq_frequency_table *freq_table;
 	unsigned int freq_lo;
 	unsigned int freq_lo_jiffies;
 	unsigned int freq_hi_jiffies;
 	unsigned int rate_mult;
-	int cpu;
 	unsigned int sample_type:1;
-	/*
-	 * percpu mutex that serializes governor limit change with
-	 * do_dbs_timer invocation. We do not want do_dbs_timer to run
-	 * when user is changing the governor or limits.
-	 */
-	struct mutex timer_mutex;
 };
-static DEFINE_PER_CPU(struct cpu_dbs_info_s, od_cpu_dbs_info);
+
+static void id_init(struct dbs_group *grp);
+static unsigned long id_check(struct dbs_group *grp);
+
+static struct dbs_governor id_dbs_gov = {
+	.name		= "intellidemand",
+	.data_size	= sizeof(struct id_dbs_info),
+	.init		= id_init,
+	.check		= id_check,
+};
 
 static unsigned int dbs_enable;	/* number of CPUs using this policy */
 
@@ -118,8 +116,6 @@ static unsigned int dbs_enable;	/* number of CPUs using this policy */
  */
 static DEFINE_MUTEX(dbs_mutex);
 
-static struct workqueue_struct	*kintellidemand_wq;
-
 static struct dbs_tuners {
 	unsigned int sampling_rate;
 	unsigned int up_threshold;
@@ -136,55 +132,12 @@ static struct dbs_tuners {
 	.powersave_bias = 0,
 };
 
-static inline cputime64_t get_cpu_idle_time_jiffy(unsigned int cpu,
-							cputime64_t *wall)
-{
-	u64 idle_time;
-	u64 cur_wall_time;
-	u64 busy_time;
-
-	cur_wall_time = jiffies64_to_cputime64(get_jiffies_64());
-
-	busy_time  = kcpustat_cpu(cpu).cpustat[CPUTIME_USER];
-	busy_time += kcpustat_cpu(cpu).cpustat[CPUTIME_SYSTEM];
-	busy_time += kcpustat_cpu(cpu).cpustat[CPUTIME_IRQ];
-	busy_time += kcpustat_cpu(cpu).cpustat[CPUTIME_SOFTIRQ];
-	busy_time += kcpustat_cpu(cpu).cpustat[CPUTIME_STEAL];
-	busy_time += kcpustat_cpu(cpu).cpustat[CPUTIME_NICE];
-
-	idle_time = cur_wall_time - busy_time;
-	if (wall)
-		*wall = jiffies_to_usecs(cur_wall_time);
-
-	return jiffies_to_usecs(idle_time);
-}
-
-static inline cputime64_t get_cpu_idle_time(unsigned int cpu, cputime64_t *wall)
-{
-	u64 idle_time = get_cpu_idle_time_us(cpu, wall);
-
-	if (idle_time == -1ULL)
-		return get_cpu_idle_time_jiffy(cpu, wall);
-
-	return idle_time;
-}
-
-static inline cputime64_t get_cpu_iowait_time(unsigned int cpu, cputime64_t *wall)
-{
-	u64 iowait_time = get_cpu_iowait_time_us(cpu, wall);
-
-	if (iowait_time == -1ULL)
-		return 0;
-
-	return iowait_time;
-}
-
 /*
  * Find right freq to be set now with powersave_bias on.
  * Returns the freq_hi to be used right now and will set freq_hi_jiffies,
  * freq_lo, and freq_lo_jiffies in percpu area for averaging freqs.
  */
-static unsigned int powersave_bias_target(struct cpufreq_policy *policy,
+static unsigned int powersave_bias_target(struct dbs_group *grp,
 					  unsigned int freq_next,
 					  unsigned int relation)
 {
@@ -192,8 +145,8 @@ static unsigned int powersave_bias_target(struct cpufreq_policy *policy,
 	unsigned int freq_hi, freq_lo;
 	unsigned int index = 0;
 	unsigned int jiffies_total, jiffies_hi, jiffies_lo;
-	struct cpu_dbs_info_s *dbs_info = &per_cpu(od_cpu_dbs_info,
-						   policy->cpu);
+	struct cpufreq_policy *policy = grp->policy;
+	struct id_dbs_info *dbs_info = dbs_group_data(grp);
 
 	if (!dbs_info->freq_table) {
 		dbs_info->freq_lo = 0;
@@ -234,19 +187,20 @@ static unsigned int powersave_bias_target(struct cpufreq_policy *policy,
 	return freq_hi;
 }
 
-static void intellidemand_powersave_bias_init_cpu(int cpu)
+static void intellidemand_powersave_bias_init(struct dbs_group *grp)
 {
-	struct cpu_dbs_info_s *dbs_info = &per_cpu(od_cpu_dbs_info, cpu);
-	dbs_info->freq_table = cpufreq_frequency_get_table(cpu);
+	struct id_dbs_info *dbs_info = dbs_group_data(grp);
+	dbs_info->freq_table = cpufreq_frequency_get_table(grp->policy->cpu);
 	dbs_info->freq_lo = 0;
 }
 
-static void intellidemand_powersave_bias_init(void)
+static void id_init(struct dbs_group *grp)
 {
-	int i;
-	for_each_online_cpu(i) {
-		intellidemand_powersave_bias_init_cpu(i);
-	}
+	struct id_dbs_info *dbs_info = dbs_group_data(grp);
+
+	dbs_info->rate_mult = 1;
+	dbs_info->sample_type = DBS_NORMAL_SAMPLE;
+	intellidemand_powersave_bias_init(grp);
 }
 
 /************************** sysfs interface ************************/
@@ -348,8 +302,12 @@ static ssize_t store_sampling_down_factor(struct kobject *a,
 
 	/* Reset down sampling multiplier in case it was active */
 	for_each_online_cpu(j) {
-		struct cpu_dbs_info_s *dbs_info;
-		dbs_info = &per_cpu(od_cpu_dbs_info, j);
+		struct dbs_group *grp = dbs_group_get(j, &id_dbs_gov);
+		struct id_dbs_info *dbs_info;
+
+		if (!grp)
+			continue;
+		dbs_info = dbs_group_data(grp);
 		dbs_info->rate_mult = 1;
 	}
 	mutex_unlock(&dbs_mutex);
@@ -363,8 +321,6 @@ static ssize_t store_ignore_nice_load(struct kobject *a, struct attribute *b,
 	unsigned int input;
 	int ret;
 
-	unsigned int j;
-
 	ret = sscanf(buf, "%u", &input);
 	if (ret != 1)
 		return -EINVAL;
@@ -372,28 +328,15 @@ static ssize_t store_ignore_nice_load(struct kobject *a, struct attribute *b,
 	if (input > 1)
 		input = 1;
 
-	if (input == dbs_tuners_ins.ignore_nice) { /* nothing to do */
-		return count;
-	}
+	/* nice time is always sampled, the next check simply uses it */
 	dbs_tuners_ins.ignore_nice = input;
-
-	/* we need to re-evaluate prev_cpu_idle */
-	for_each_online_cpu(j) {
-		struct cpu_dbs_info_s *dbs_info;
-		dbs_info = &per_cpu(od_cpu_dbs_info, j);
-		dbs_info->prev_cpu_idle = get_cpu_idle_time(j,
-						&dbs_info->prev_cpu_wall);
-		if (dbs_tuners_ins.ignore_nice)
-			dbs_info->prev_cpu_nice = kcpustat_cpu(j).cpustat[CPUTIME_NICE];
-
-	}
 	return count;
 }
 
 static ssize_t store_powersave_bias(struct kobject *a, struct attribute *b,
 				    const char *buf, size_t count)
 {
-	unsigned int input;
+	unsigned int input, j;
 	int ret;
 	ret = sscanf(buf, "%u", &input);
 
@@ -405,7 +348,15 @@ static ssize_t store_powersave_bias(struct kobject *a, struct attribute *b,
 
 	mutex_lock(&dbs_mutex);
 	dbs_tuners_ins.powersave_bias = input;
-	intellidemand_powersave_bias_init();
+	for_each_online_cpu(j) {
+		struct dbs_group *grp = dbs_group_get(j, &id_dbs_gov);
+
+		if (!grp || grp->cpu != j)
+			continue;
+		mutex_lock(&grp->timer_mutex);
+		intellidemand_powersave_bias_init(grp);
+		mutex_unlock(&grp->timer_mutex);
+	}
 	mutex_unlock(&dbs_mutex);
 
 	return count;
@@ -469,26 +420,27 @@ static struct attribute_group dbs_attr_group = {
 
 /************************** sysfs end ************************/
 
-static void dbs_freq_increase(struct cpufreq_policy *p, unsigned int freq)
+static void dbs_freq_increase(struct dbs_group *grp, unsigned int freq)
 {
 	if (dbs_tuners_ins.powersave_bias)
-		freq = powersave_bias_target(p, freq, CPUFREQ_RELATION_H);
-	else if (p->cur == p->max)
+		freq = powersave_bias_target(grp, freq, CPUFREQ_RELATION_H);
+	else if (grp->cur == grp->policy->max)
 		return;
 
-	__cpufreq_driver_target(p, freq, dbs_tuners_ins.powersave_bias ?
+	dbs_target(grp, freq, dbs_tuners_ins.powersave_bias ?
 			CPUFREQ_RELATION_L : CPUFREQ_RELATION_H);
 }
 
-static void dbs_check_cpu(struct cpu_dbs_info_s *this_dbs_info)
+static void dbs_check_cpu(struct dbs_group *grp)
 {
+	struct id_dbs_info *this_dbs_info = dbs_group_data(grp);
 	unsigned int max_load_freq;
 
 	struct cpufreq_policy *policy;
 	unsigned int j;
 
 	this_dbs_info->freq_lo = 0;
-	policy = this_dbs_info->cur_policy;
+	policy = grp->policy;
 
 	/*
 	 * Every sampling_rate, we check, if current idle time is less
@@ -505,98 +457,56 @@ static void dbs_check_cpu(struct cpu_dbs_info_s *this_dbs_info)
 	/* Get Absolute Load - in terms of freq */
 	max_load_freq = 0;
 
-	for_each_cpu(j, policy->cpus) {
-		struct cpu_dbs_info_s *j_dbs_info;
-		cputime64_t cur_wall_time, cur_idle_time, cur_iowait_time;
-		unsigned int idle_time, wall_time, iowait_time;
-		unsigned int load, load_freq;
-		int freq_avg;
-
-		j_dbs_info = &per_cpu(od_cpu_dbs_info, j);
-
-		cur_idle_time = get_cpu_idle_time(j, &cur_wall_time);
-		cur_iowait_time = get_cpu_iowait_time(j, &cur_wall_time);
-
-		wall_time = (unsigned int)
-			(cur_wall_time - j_dbs_info->prev_cpu_wall);
-		j_dbs_info->prev_cpu_wall = cur_wall_time;
-
-		idle_time = (unsigned int)
-			(cur_idle_time - j_dbs_info->prev_cpu_idle);
-		j_dbs_info->prev_cpu_idle = cur_idle_time;
-
-		iowait_time = (unsigned int)
-			(cur_iowait_time - j_dbs_info->prev_cpu_iowait);
-		j_dbs_info->prev_cpu_iowait = cur_iowait_time;
-
-		if (dbs_tuners_ins.ignore_nice) {
-			u64 cur_nice;
-			unsigned long cur_nice_jiffies;
-
-			cur_nice = kcpustat_cpu(j).cpustat[CPUTIME_NICE] -
-					 j_dbs_info->prev_cpu_nice;
-			/*
-			 * Assumption: nice time between sampling periods will
-			 * be less than 2^32 jiffies for 32 bit sys
-			 */
-			cur_nice_jiffies = (unsigned long)
-					cputime64_to_jiffies64(cur_nice);
-
-			j_dbs_info->prev_cpu_nice = kcpustat_cpu(j).cpustat[CPUTIME_NICE];
-			idle_time += jiffies_to_usecs(cur_nice_jiffies);
-		}
+	dbs_group_sample(grp);
+	for (j = 0; j < grp->nr_loads; j++) {
+		struct dbs_cpu_load *l = &grp->loads[j];
+		unsigned int load_freq;
+		int load;
+
 		/*
 		 * For the purpose of ondemand, waiting for disk IO is an
 		 * indication that you're performance critical, and not that
-		 * the system is actually idle. So subtract the iowait time
-		 * from the cpu idle time.
+		 * the system is actually idle. So io_is_busy subtracts the
+		 * iowait time from the cpu idle time.
 		 */
-
-		if (dbs_tuners_ins.io_is_busy && idle_time >= iowait_time)
-			idle_time -= iowait_time;
-
-		if (unlikely(!wall_time || wall_time < idle_time))
+		load = dbs_cpu_load_pct(l, dbs_tuners_ins.ignore_nice,
+					dbs_tuners_ins.io_is_busy);
+		if (load < 0)
 			continue;
 
-		load = 100 * (wall_time - idle_time) / wall_time;
-
-		freq_avg = __cpufreq_driver_getavg(policy, j);
-		if (freq_avg <= 0)
-			freq_avg = policy->cur;
-
-		load_freq = load * freq_avg;
+		load_freq = load * l->freq_avg;
 		if (load_freq > max_load_freq)
 			max_load_freq = load_freq;
 	}
 
 	/* Check for frequency increase */
-	if (max_load_freq > dbs_tuners_ins.up_threshold * policy->cur) {
+	if (max_load_freq > dbs_tuners_ins.up_threshold * grp->cur) {
 
 /* In case of increase to max freq., freq. scales by 2 step for reducing the current consumption*/
 #ifdef _LIMIT_LCD_OFF_CPU_MAX_FREQ_
 		if(!cpufreq_gov_lcd_status) {
-			if (policy->cur < policy->max) {
-				if (policy->cur < 400000) dbs_freq_increase(policy, 800000);
-				else if (policy->cur < 800000) dbs_freq_increase(policy, 1000000);
+			if (grp->cur < policy->max) {
+				if (grp->cur < 400000) dbs_freq_increase(grp, 800000);
+				else if (grp->cur < 800000) dbs_freq_increase(grp, 1000000);
 				else {
 					this_dbs_info->rate_mult = dbs_tuners_ins.sampling_down_factor;
-					dbs_freq_increase(policy, policy->max);
+					dbs_freq_increase(grp, policy->max);
 				}
 			}
 			return;
 		} else
 #endif
 		/* If switching to max speed, apply sampling_down_factor */
-		if (policy->cur < policy->max)
+		if (grp->cur < policy->max)
 			this_dbs_info->rate_mult =
 				dbs_tuners_ins.sampling_down_factor;
-		dbs_freq_increase(policy, policy->max);
+		dbs_freq_increase(grp, policy->max);
 		return;
 	}
 
 	/* Check for frequency decrease */
 	/* if we cannot reduce the frequency anymore, break out early */
-	if (policy->cur == policy->min)
+	if (grp->cur == policy->min)
 		return;
 
 	/*
@@ -606,7 +516,7 @@ static void dbs_check_cpu(struct cpu_dbs_info_s *this_dbs_info)
 	 */
 	if (max_load_freq <
 	    (dbs_tuners_ins.up_threshold - dbs_tuners_ins.down_differential) *
-	     policy->cur) {
+	     grp->cur) {
 		unsigned int freq_next;
 		freq_next = max_load_freq /
 				(dbs_tuners_ins.up_threshold -
@@ -619,67 +529,38 @@ static void dbs_check_cpu(struct cpu_dbs_info_s *this_dbs_info)
 			freq_next = policy->min;
 
 		if (!dbs_tuners_ins.powersave_bias) {
-			__cpufreq_driver_target(policy, freq_next,
-					CPUFREQ_RELATION_L);
+			dbs_target(grp, freq_next, CPUFREQ_RELATION_L);
 		} else {
-			int freq = powersave_bias_target(policy, freq_next,
+			int freq = powersave_bias_target(grp, freq_next,
 					CPUFREQ_RELATION_L);
-			__cpufreq_driver_target(policy, freq,
-				CPUFREQ_RELATION_L);
+			dbs_target(grp, freq, CPUFREQ_RELATION_L);
 		}
 	}
 }
 
-static void do_dbs_timer(struct work_struct *work)
+static unsigned long id_check(struct dbs_group *grp)
 {
-	struct cpu_dbs_info_s *dbs_info =
-		container_of(work, struct cpu_dbs_info_s, work.work);
-	unsigned int cpu = dbs_info->cpu;
+	struct id_dbs_info *dbs_info = dbs_group_data(grp);
 	int sample_type = dbs_info->sample_type;
 
-	/* We want all CPUs to do sampling nearly on same jiffy */
-	int delay = usecs_to_jiffies(dbs_tuners_ins.sampling_rate
+	/* Don't care too much about synchronizing the checks of groups */
+	unsigned long delay = usecs_to_jiffies(dbs_tuners_ins.sampling_rate
 		* dbs_info->rate_mult);
 
-#if 0
-	/* Don't care too much about synchronizing the workqueue in both cpus */
-	if (num_online_cpus() > 1)
-		delay -= jiffies % delay;
-#endif
-
-	mutex_lock(&dbs_info->timer_mutex);
-
 	/* Common NORMAL_SAMPLE setup */
 	dbs_info->sample_type = DBS_NORMAL_SAMPLE;
 	if (!dbs_tuners_ins.powersave_bias ||
 	    sample_type == DBS_NORMAL_SAMPLE) {
-		dbs_check_cpu(dbs_info);
+		dbs_check_cpu(grp);
 		if (dbs_info->freq_lo) {
 			/* Setup timer for SUB_SAMPLE */
 			dbs_info->sample_type = DBS_SUB_SAMPLE;
 			delay = dbs_info->freq_hi_jiffies;
 		}
 	} else {
-		__cpufreq_driver_target(dbs_info->cur_policy,
-			dbs_info->freq_lo, CPUFREQ_RELATION_H);
+		dbs_target(grp, dbs_info->freq_lo, CPUFREQ_RELATION_H);
 	}
-	queue_delayed_work_on(cpu, kintellidemand_wq, &dbs_info->work, delay);
-	mutex_unlock(&dbs_info->timer_mutex);
-}
-
-static inline void dbs_timer_init(struct cpu_dbs_info_s *dbs_info)
-{
-	int delay = usecs_to_jiffies(dbs_tuners_ins.sampling_rate);
-
-	dbs_info->sample_type = DBS_NORMAL_SAMPLE;
-	INIT_DELAYED_WORK_DEFERRABLE(&dbs_info->work, do_dbs_timer);
-	queue_delayed_work_on(dbs_info->cpu, kintellidemand_wq, &dbs_info->work,
-		delay);
-}
-
-static inline void dbs_timer_exit(struct cpu_dbs_info_s *dbs_info)
-{
-	cancel_delayed_work_sync(&dbs_info->work);
+	return delay;
 }
 
 /*
@@ -712,12 +593,9 @@ static int cpufreq_governor_dbs(struct cpufreq_policy *policy,
 				   unsigned int event)
 {
 	unsigned int cpu = policy->cpu;
-	struct cpu_dbs_info_s *this_dbs_info;
-	unsigned int j;
+	struct dbs_group *grp;
 	int rc;
 
-	this_dbs_info = &per_cpu(od_cpu_dbs_info, cpu);
-
 	switch (event) {
 	case CPUFREQ_GOV_START:
 		if ((!cpu_online(cpu)) || (!policy->cur))
@@ -725,26 +603,11 @@ static int cpufreq_governor_dbs(struct cpufreq_policy *policy,
 		//per_cpu(cpu_load, cpu) = 0;
 		mutex_lock(&dbs_mutex);
 
-		dbs_enable++;
-		for_each_cpu(j, policy->cpus) {
-			struct cpu_dbs_info_s *j_dbs_info;
-			j_dbs_info = &per_cpu(od_cpu_dbs_info, j);
-			j_dbs_info->cur_policy = policy;
-
-			j_dbs_info->prev_cpu_idle = get_cpu_idle_time(j,
-						&j_dbs_info->prev_cpu_wall);
-			if (dbs_tuners_ins.ignore_nice)
-				j_dbs_info->prev_cpu_nice =
-						kcpustat_cpu(j).cpustat[CPUTIME_NICE];
-		}
-		this_dbs_info->cpu = cpu;
-		this_dbs_info->rate_mult = 1;
-		intellidemand_powersave_bias_init_cpu(cpu);
 		/*
 		 * Start the timerschedule work, when this governor
 		 * is used for first time
 		 */
-		if (dbs_enable == 1) {
+		if (dbs_enable == 0) {
 			unsigned int latency;
 
 			rc = sysfs_create_group(cpufreq_global_kobject,
@@ -766,17 +629,29 @@ static int cpufreq_governor_dbs(struct cpufreq_policy *policy,
 				    latency * LATENCY_MULTIPLIER);
 			dbs_tuners_ins.io_is_busy = should_io_be_busy();
 		}
+
+		grp = dbs_group_start(&id_dbs_gov, policy);
+		if (!grp) {
+			if (dbs_enable == 0)
+				sysfs_remove_group(cpufreq_global_kobject,
+						   &dbs_attr_group);
+			mutex_unlock(&dbs_mutex);
+			return -ENOMEM;
+		}
+		dbs_enable++;
 		mutex_unlock(&dbs_mutex);
 
-		mutex_init(&this_dbs_info->timer_mutex);
-		dbs_timer_init(this_dbs_info);
+		dbs_group_timer_start(grp,
+			usecs_to_jiffies(dbs_tuners_ins.sampling_rate));
 		break;
 
 	case CPUFREQ_GOV_STOP:
-		dbs_timer_exit(this_dbs_info);
+		grp = dbs_group_get(cpu, &id_dbs_gov);
+		if (!grp)
+			break;
 
 		mutex_lock(&dbs_mutex);
-		mutex_destroy(&this_dbs_info->timer_mutex);
+		dbs_group_stop(grp);
 		dbs_enable--;
 		mutex_unlock(&dbs_mutex);
 		if (!dbs_enable)
@@ -786,14 +661,9 @@ static int cpufreq_governor_dbs(struct cpufreq_policy *policy,
 		break;
 
 	case CPUFREQ_GOV_LIMITS:
-		mutex_lock(&this_dbs_info->timer_mutex);
-		if (policy->max < this_dbs_info->cur_policy->cur)
-			__cpufreq_driver_target(this_dbs_info->cur_policy,
-				policy->max, CPUFREQ_RELATION_H);
-		else if (policy->min > this_dbs_info->cur_policy->cur)
-			__cpufreq_driver_target(this_dbs_info->cur_policy,
-				policy->min, CPUFREQ_RELATION_L);
-		mutex_unlock(&this_dbs_info->timer_mutex);
+		grp = dbs_group_get(cpu, &id_dbs_gov);
+		if (grp)
+			dbs_group_limits(grp);
 		break;
 	}
 	return 0;
@@ -843,14 +713,12 @@ static int __init cpufreq_gov_dbs_init(void)
 			MIN_SAMPLING_RATE_RATIO * jiffies_to_usecs(1);
 	}
 
-	kintellidemand_wq = create_workqueue("kintellidemand");
-	if (!kintellidemand_wq) {
-		printk(KERN_ERR "Creation of kintellidemand failed\n");
-		return -EFAULT;
-	}
+	dbs_register_governor(&id_dbs_gov);
 	err = cpufreq_register_governor(&cpufreq_gov_intellidemand);
-	if (err)
-		destroy_workqueue(kintellidemand_wq);
+	if (err) {
+		dbs_unregister_governor(&id_dbs_gov);
+		return err;
+	}
 
 #ifdef _LIMIT_LCD_OFF_CPU_MAX_FREQ_
 #ifdef CONFIG_HAS_EARLYSUSPEND
@@ -870,7 +738,7 @@ static int __init cpufreq_gov_dbs_init(void)
 static void __exit cpufreq_gov_dbs_exit(void)
 {
 	cpufreq_unregister_governor(&cpufreq_gov_intellidemand);
-	destroy_workqueue(kintellidemand_wq);
+	dbs_unregister_governor(&id_dbs_gov);
 }
 
 
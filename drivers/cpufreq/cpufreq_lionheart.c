@@ -43,6 +43,8 @@
 #include <linux/slab.h>
 #include <linux/earlysuspend.h>
 
+#include "cpufreq_governor.h"
+
 #define DEF_FREQUENCY_UP_THRESHOLD		(65)
 #define DEF_FREQUENCY_DOWN_THRESHOLD		(30)
 #define MIN_SAMPLING_RATE_RATIO			(2)
@@ -55,22 +57,21 @@ static unsigned int min_sampling_rate;
 #define MAX_SAMPLING_DOWN_FACTOR		(10)
 #define TRANSITION_LATENCY_LIMIT		(10 * 1000 * 1000)
 
-static void do_dbs_timer(struct work_struct *work);
-
-struct cpu_dbs_info_s {
-	cputime64_t prev_cpu_idle;
-	cputime64_t prev_cpu_wall;
-	cputime64_t prev_cpu_nice;
-	struct cpufreq_policy *cur_policy;
-	struct delayed_work work;
+/* Per policy state, kept in the group data of the governor core */
+struct lh_dbs_info {
 	unsigned int down_skip;
 	unsigned int requested_freq;
-	int cpu;
-	unsigned int enable:1;
+};
 
-	struct mutex timer_mutex;
+static void lh_init(struct dbs_group *grp);
+static unsigned long lh_check(struct dbs_group *grp);
+
+static struct dbs_governor lh_dbs_gov = {
+	.name		= "Lionheart",
+	.data_size	= sizeof(struct lh_dbs_info),
+	.init		= lh_init,
+	.check		= lh_check,
 };
-static DEFINE_PER_CPU(struct cpu_dbs_info_s, cs_cpu_dbs_info);
 
 static unsigned int dbs_enable;	
 
@@ -91,57 +92,34 @@ static struct dbs_tuners {
 	.freq_step = 5,
 };
 
-static inline cputime64_t get_cpu_idle_time_jiffy(unsigned int cpu,
-							cputime64_t *wall)
-{
-	cputime64_t idle_time;
-	cputime64_t cur_wall_time;
-	cputime64_t busy_time;
-
-	cur_wall_time = jiffies64_to_cputime64(get_jiffies_64());
-
-	busy_time  = kcpustat_cpu(cpu).cpustat[CPUTIME_USER];
-	busy_time += kcpustat_cpu(cpu).cpustat[CPUTIME_SYSTEM];
-	busy_time += kcpustat_cpu(cpu).cpustat[CPUTIME_IRQ];
-	busy_time += kcpustat_cpu(cpu).cpustat[CPUTIME_SOFTIRQ];
-	busy_time += kcpustat_cpu(cpu).cpustat[CPUTIME_STEAL];
-	busy_time += kcpustat_cpu(cpu).cpustat[CPUTIME_NICE];
-
-	idle_time = (cur_wall_time - busy_time);
-	if (wall)
-		*wall = (cputime64_t)jiffies_to_usecs(cur_wall_time);
-
-	return (cputime64_t)jiffies_to_usecs(idle_time);
-}
-
-static inline cputime64_t get_cpu_idle_time(unsigned int cpu, cputime64_t *wall)
-{
-	u64 idle_time = get_cpu_idle_time_us(cpu, wall);
-
-	if (idle_time == -1ULL)
-		return get_cpu_idle_time_jiffy(cpu, wall);
-
-	return idle_time;
-}
-
 static int
 dbs_cpufreq_notifier(struct notifier_block *nb, unsigned long val,
 		     void *data)
 {
 	struct cpufreq_freqs *freq = data;
-	struct cpu_dbs_info_s *this_dbs_info = &per_cpu(cs_cpu_dbs_info,
-							freq->cpu);
+	struct dbs_group *grp;
+	struct lh_dbs_info *this_dbs_info;
 
 	struct cpufreq_policy *policy;
 
-	if (!this_dbs_info->enable)
+	/*
+	 * Our own timer work ends up here, and GOV_STOP waits for it with
+	 * dbs_mutex held, so RCU has to keep the group alive instead.
+	 */
+	rcu_read_lock();
+	grp = dbs_group_get(freq->cpu, &lh_dbs_gov);
+	if (!grp) {
+		rcu_read_unlock();
 		return 0;
+	}
 
-	policy = this_dbs_info->cur_policy;
+	this_dbs_info = dbs_group_data(grp);
+	policy = grp->policy;
 
 	if (this_dbs_info->requested_freq > policy->max
 			|| this_dbs_info->requested_freq < policy->min)
 		this_dbs_info->requested_freq = freq->new;
+	rcu_read_unlock();
 
 	return 0;
 }
@@ -237,8 +215,6 @@ static ssize_t store_ignore_nice_load(struct kobject *a, struct attribute *b,
 	unsigned int input;
 	int ret;
 
-	unsigned int j;
-
 	ret = sscanf(buf, "%u", &input);
 	if (ret != 1)
 		return -EINVAL;
@@ -246,19 +222,8 @@ static ssize_t store_ignore_nice_load(struct kobject *a, struct attribute *b,
 	if (input > 1)
 		input = 1;
 
-	if (input == dbs_tuners_ins.ignore_nice)
-		return count;
-
+	/* nice time is always sampled, the next check simply uses it */
 	dbs_tuners_ins.ignore_nice = input;
-
-	for_each_online_cpu(j) {
-		struct cpu_dbs_info_s *dbs_info;
-		dbs_info = &per_cpu(cs_cpu_dbs_info, j);
-		dbs_info->prev_cpu_idle = get_cpu_idle_time(j,
-						&dbs_info->prev_cpu_wall);
-		if (dbs_tuners_ins.ignore_nice)
-			dbs_info->prev_cpu_nice = kcpustat_cpu(j).cpustat[CPUTIME_NICE];
-	}
 	return count;
 }
 
@@ -302,51 +267,37 @@ static struct attribute_group dbs_attr_group = {
 	.name = "Lionheart",
 };
 
-static void dbs_check_cpu(struct cpu_dbs_info_s *this_dbs_info)
+static void lh_init(struct dbs_group *grp)
+{
+	struct lh_dbs_info *this_dbs_info = dbs_group_data(grp);
+
+	this_dbs_info->down_skip = 0;
+	this_dbs_info->requested_freq = grp->cur;
+}
+
+static void dbs_check_cpu(struct dbs_group *grp)
 {
-	unsigned int load = 0;
+	struct lh_dbs_info *this_dbs_info = dbs_group_data(grp);
 	unsigned int max_load = 0;
 	unsigned int freq_target;
 
 	struct cpufreq_policy *policy;
 	unsigned int j;
 
-	policy = this_dbs_info->cur_policy;
-
-	for_each_cpu(j, policy->cpus) {
-		struct cpu_dbs_info_s *j_dbs_info;
-		cputime64_t cur_wall_time, cur_idle_time;
-		unsigned int idle_time, wall_time;
-
-		j_dbs_info = &per_cpu(cs_cpu_dbs_info, j);
-
-		cur_idle_time = get_cpu_idle_time(j, &cur_wall_time);
-
-		wall_time = (unsigned int) (cur_wall_time - j_dbs_info->prev_cpu_wall);
-		j_dbs_info->prev_cpu_wall = cur_wall_time;
-
-		idle_time = (unsigned int) (cur_idle_time - j_dbs_info->prev_cpu_idle);
-		j_dbs_info->prev_cpu_idle = cur_idle_time;
-
-		if (dbs_tuners_ins.ignore_nice) {
-			cputime64_t cur_nice;
-			unsigned long cur_nice_jiffies;
-
-			cur_nice = (kcpustat_cpu(j).cpustat[CPUTIME_NICE] - j_dbs_info->prev_cpu_nice);
+	policy = grp->policy;
 
-			cur_nice_jiffies = (unsigned long)
-					cputime64_to_jiffies64(cur_nice);
-
-			j_dbs_info->prev_cpu_nice = kcpustat_cpu(j).cpustat[CPUTIME_NICE];
-			idle_time += jiffies_to_usecs(cur_nice_jiffies);
-		}
-
-		if (unlikely(!wall_time || wall_time < idle_time))
-			continue;
+	/* the transition notifier does not see replayed decisions */
+	if (this_dbs_info->requested_freq > policy->max
+			|| this_dbs_info->requested_freq < policy->min)
+		this_dbs_info->requested_freq = grp->cur;
 
-		load = 100 * (wall_time - idle_time) / wall_time;
+	dbs_group_sample(grp);
+	for (j = 0; j < grp->nr_loads; j++) {
+		/* iowait has always counted as busy here */
+		int load = dbs_cpu_load_pct(&grp->loads[j],
+					    dbs_tuners_ins.ignore_nice, true);
 
-		if (load > max_load)
+		if (load > (int)max_load)
 			max_load = load;
 	}
 
@@ -368,7 +319,7 @@ static void dbs_check_cpu(struct cpu_dbs_info_s *this_dbs_info)
 		if (this_dbs_info->requested_freq > policy->max)
 			this_dbs_info->requested_freq = policy->max;
 
-		__cpufreq_driver_target(policy, this_dbs_info->requested_freq,
+		dbs_target(grp, this_dbs_info->requested_freq,
 			CPUFREQ_RELATION_H);
 		return;
 	}
@@ -380,60 +331,29 @@ static void dbs_check_cpu(struct cpu_dbs_info_s *this_dbs_info)
 		if (this_dbs_info->requested_freq < policy->min)
 			this_dbs_info->requested_freq = policy->min;
 
-		if (policy->cur == policy->min)
+		if (grp->cur == policy->min)
 			return;
 
-		__cpufreq_driver_target(policy, this_dbs_info->requested_freq,
+		dbs_target(grp, this_dbs_info->requested_freq,
 				CPUFREQ_RELATION_H);
 		return;
 	}
 }
 
-static void do_dbs_timer(struct work_struct *work)
+static unsigned long lh_check(struct dbs_group *grp)
 {
-	struct cpu_dbs_info_s *dbs_info =
-		container_of(work, struct cpu_dbs_info_s, work.work);
-	unsigned int cpu = dbs_info->cpu;
-
-	int delay = usecs_to_jiffies(dbs_tuners_ins.sampling_rate);
-
-	// delay -= jiffies % delay;
-
-	mutex_lock(&dbs_info->timer_mutex);
-
-	dbs_check_cpu(dbs_info);
+	dbs_check_cpu(grp);
 
-	schedule_delayed_work_on(cpu, &dbs_info->work, delay);
-	mutex_unlock(&dbs_info->timer_mutex);
-}
-
-static inline void dbs_timer_init(struct cpu_dbs_info_s *dbs_info)
-{
-	int delay = usecs_to_jiffies(dbs_tuners_ins.sampling_rate);
-
-	// delay -= jiffies % delay;
-
-	dbs_info->enable = 1;
-	INIT_DELAYED_WORK_DEFERRABLE(&dbs_info->work, do_dbs_timer);
-	schedule_delayed_work_on(dbs_info->cpu, &dbs_info->work, delay);
-}
-
-static inline void dbs_timer_exit(struct cpu_dbs_info_s *dbs_info)
-{
-	dbs_info->enable = 0;
-	cancel_delayed_work_sync(&dbs_info->work);
+	return usecs_to_jiffies(dbs_tuners_ins.sampling_rate);
 }
 
 static int cpufreq_governor_dbs(struct cpufreq_policy *policy,
 				   unsigned int event)
 {
 	unsigned int cpu = policy->cpu;
-	struct cpu_dbs_info_s *this_dbs_info;
-	unsigned int j;
+	struct dbs_group *grp;
 	int rc;
 
-	this_dbs_info = &per_cpu(cs_cpu_dbs_info, cpu);
-
 	switch (event) {
 	case CPUFREQ_GOV_START:
 		if ((!cpu_online(cpu)) || (!policy->cur))
@@ -441,31 +361,7 @@ static int cpufreq_governor_dbs(struct cpufreq_policy *policy,
 
 		mutex_lock(&dbs_mutex);
 
-		for_each_cpu(j, policy->cpus) {
-			struct cpu_dbs_info_s *j_dbs_info;
-			j_dbs_info = &per_cpu(cs_cpu_dbs_info, j);
-			j_dbs_info->cur_policy = policy;
-
-			j_dbs_info->prev_cpu_idle = get_cpu_idle_time(j,
-						&j_dbs_info->prev_cpu_wall);
-			if (dbs_tuners_ins.ignore_nice) {
-				j_dbs_info->prev_cpu_nice =
-						kcpustat_cpu(j).cpustat[CPUTIME_NICE];
-			}
-		}
-		this_dbs_info->down_skip = 0;
-		this_dbs_info->requested_freq = policy->cur;
-
-		mutex_init(&this_dbs_info->timer_mutex);
-		dbs_enable++;
-
-		if (dbs_enable == 1) {
-			unsigned int latency;
-
-			latency = policy->cpuinfo.transition_latency / 1000;
-			if (latency == 0)
-				latency = 1;
-
+		if (dbs_enable == 0) {
 			rc = sysfs_create_group(cpufreq_global_kobject,
 						&dbs_attr_group);
 			if (rc) {
@@ -475,23 +371,36 @@ static int cpufreq_governor_dbs(struct cpufreq_policy *policy,
 
 			min_sampling_rate = 10000;
 			dbs_tuners_ins.sampling_rate = 10000;
+		}
+
+		grp = dbs_group_start(&lh_dbs_gov, policy);
+		if (!grp) {
+			if (dbs_enable == 0)
+				sysfs_remove_group(cpufreq_global_kobject,
+						   &dbs_attr_group);
+			mutex_unlock(&dbs_mutex);
+			return -ENOMEM;
+		}
 
+		if (++dbs_enable == 1)
 			cpufreq_register_notifier(
 					&dbs_cpufreq_notifier_block,
 					CPUFREQ_TRANSITION_NOTIFIER);
-		}
 		mutex_unlock(&dbs_mutex);
 
-		dbs_timer_init(this_dbs_info);
+		dbs_group_timer_start(grp,
+			usecs_to_jiffies(dbs_tuners_ins.sampling_rate));
 
 		break;
 
 	case CPUFREQ_GOV_STOP:
-		dbs_timer_exit(this_dbs_info);
+		grp = dbs_group_get(cpu, &lh_dbs_gov);
+		if (!grp)
+			break;
 
 		mutex_lock(&dbs_mutex);
+		dbs_group_stop(grp);
 		dbs_enable--;
-		mutex_destroy(&this_dbs_info->timer_mutex);
 
 		if (dbs_enable == 0)
 			cpufreq_unregister_notifier(
@@ -506,16 +415,9 @@ static int cpufreq_governor_dbs(struct cpufreq_policy *policy,
 		break;
 
 	case CPUFREQ_GOV_LIMITS:
-		mutex_lock(&this_dbs_info->timer_mutex);
-		if (policy->max < this_dbs_info->cur_policy->cur)
-			__cpufreq_driver_target(
-					this_dbs_info->cur_policy,
-					policy->max, CPUFREQ_RELATION_H);
-		else if (policy->min > this_dbs_info->cur_policy->cur)
-			__cpufreq_driver_target(
-					this_dbs_info->cur_policy,
-					policy->min, CPUFREQ_RELATION_L);
-		mutex_unlock(&this_dbs_info->timer_mutex);
+		grp = dbs_group_get(cpu, &lh_dbs_gov);
+		if (grp)
+			dbs_group_limits(grp);
 
 		break;
 	}
@@ -534,12 +436,19 @@ struct cpufreq_governor cpufreq_gov_lionheart = {
 
 static int __init cpufreq_gov_dbs_init(void)
 {
-	return cpufreq_register_governor(&cpufreq_gov_lionheart);
+	int rc;
+
+	dbs_register_governor(&lh_dbs_gov);
+	rc = cpufreq_register_governor(&cpufreq_gov_lionheart);
+	if (rc)
+		dbs_unregister_governor(&lh_dbs_gov);
+	return rc;
 }
 
 static void __exit cpufreq_gov_dbs_exit(void)
 {
 	cpufreq_unregister_governor(&cpufreq_gov_lionheart);
+	dbs_unregister_governor(&lh_dbs_gov);
 }
 
 MODULE_AUTHOR("knzo");
@@ -26,9 +26,10 @@
 #include <linux/workqueue.h>
 #include <linux/slab.h>
 
-#define CREATE_TRACE_POINTS
 #include <trace/events/cpufreq_interactive.h>
 
+#include "cpufreq_governor.h"
+
 
 #define DEF_FREQUENCY_DOWN_DIFFERENTIAL		(10)
 #define DEF_FREQUENCY_UP_THRESHOLD		(80)
@@ -57,7 +58,6 @@ static unsigned int skip_ondemand = 0;
 #define POWERSAVE_BIAS_MAXLEVEL			(1000)
 #define POWERSAVE_BIAS_MINLEVEL			(-1000)
 
-static void do_dbs_timer(struct work_struct *work);
 static int cpufreq_governor_dbs(struct cpufreq_policy *policy,
 				unsigned int event);
 
@@ -73,28 +73,32 @@ struct cpufreq_governor cpufreq_gov_ondemand = {
 
 enum {DBS_NORMAL_SAMPLE, DBS_SUB_SAMPLE};
 
-struct cpu_dbs_info_s {
-	cputime64_t prev_cpu_idle;
-	cputime64_t prev_cpu_iowait;
-	cputime64_t prev_cpu_wall;
-	cputime64_t prev_cpu_nice;
-	struct cpufreq_policy *cur_policy;
-	struct delayed_work work;
+/* Per policy state, kept in the group data of the governor core */
+struct od_dbs_info {
 	struct cpufreq_frequency_table *freq_table;
 	unsigned int freq_lo;
 	unsigned int freq_lo_jiffies;
 	unsigned int freq_hi_jiffies;
 	unsigned int rate_mult;
-	int cpu;
 	unsigned int sample_type:1;
-	struct mutex timer_mutex;
+#ifdef CONFIG_CPU_FREQ_GOV_ONDEMAND_2_PHASE
+	unsigned int phase;
+	unsigned int counter;
+#endif
 };
-static DEFINE_PER_CPU(struct cpu_dbs_info_s, od_cpu_dbs_info);
 static DEFINE_PER_CPU(unsigned int, cpu_load);
 
+static void od_init(struct dbs_group *grp);
+static unsigned long od_check(struct dbs_group *grp);
 
-static inline void dbs_timer_init(struct cpu_dbs_info_s *dbs_info);
-static inline void dbs_timer_exit(struct cpu_dbs_info_s *dbs_info);
+static struct dbs_governor od_dbs_gov = {
+	.name		= "ondemand",
+	.data_size	= sizeof(struct od_dbs_info),
+	.init		= od_init,
+	.check		= od_check,
+};
+
+static inline void dbs_timer_init(struct dbs_group *grp);
 
 static unsigned int dbs_enable;	
 static unsigned int g_ui_counter = 0;
@@ -142,51 +146,7 @@ bool is_ondemand_locked(void)
 }
 EXPORT_SYMBOL(is_ondemand_locked);
 
-static inline u64 get_cpu_idle_time_jiffy(unsigned int cpu, u64 *wall)
-{
-	u64 idle_time;
-	u64 cur_wall_time;
-	u64 busy_time;
-
-	cur_wall_time = jiffies64_to_cputime64(get_jiffies_64());
-
-	busy_time  = kcpustat_cpu(cpu).cpustat[CPUTIME_USER];
-	busy_time += kcpustat_cpu(cpu).cpustat[CPUTIME_SYSTEM];
-	busy_time += kcpustat_cpu(cpu).cpustat[CPUTIME_IRQ];
-	busy_time += kcpustat_cpu(cpu).cpustat[CPUTIME_SOFTIRQ];
-	busy_time += kcpustat_cpu(cpu).cpustat[CPUTIME_STEAL];
-	busy_time += kcpustat_cpu(cpu).cpustat[CPUTIME_NICE];
-
-	idle_time = cur_wall_time - busy_time;
-	if (wall)
-		*wall = jiffies_to_usecs(cur_wall_time);
-
-	return jiffies_to_usecs(idle_time);
-}
-
-static inline cputime64_t get_cpu_idle_time(unsigned int cpu, cputime64_t *wall)
-{
-	u64 idle_time = get_cpu_idle_time_us(cpu, NULL);
-
-	if (idle_time == -1ULL)
-		return get_cpu_idle_time_jiffy(cpu, wall);
-	else
-		idle_time += get_cpu_iowait_time_us(cpu, wall);
-
-	return idle_time;
-}
-
-static inline cputime64_t get_cpu_iowait_time(unsigned int cpu, cputime64_t *wall)
-{
-	u64 iowait_time = get_cpu_iowait_time_us(cpu, wall);
-
-	if (iowait_time == -1ULL)
-		return 0;
-
-	return iowait_time;
-}
-
-static unsigned int powersave_bias_target(struct cpufreq_policy *policy,
+static unsigned int powersave_bias_target(struct dbs_group *grp,
 					  unsigned int freq_next,
 					  unsigned int relation)
 {
@@ -195,8 +155,8 @@ static unsigned int powersave_bias_target(struct cpufreq_policy *policy,
 	unsigned int index = 0;
 	unsigned int jiffies_total, jiffies_hi, jiffies_lo;
 	int freq_reduc;
-	struct cpu_dbs_info_s *dbs_info = &per_cpu(od_cpu_dbs_info,
-						   policy->cpu);
+	struct cpufreq_policy *policy = grp->policy;
+	struct od_dbs_info *dbs_info = dbs_group_data(grp);
 
 	if (!dbs_info->freq_table) {
 		dbs_info->freq_lo = 0;
@@ -257,44 +217,45 @@ static int ondemand_powersave_bias_setspeed(struct cpufreq_policy *policy,
 	return 0;
 }
 
-static void ondemand_powersave_bias_init_cpu(int cpu)
+static void ondemand_powersave_bias_init(struct dbs_group *grp)
 {
-	struct cpu_dbs_info_s *dbs_info = &per_cpu(od_cpu_dbs_info, cpu);
-	dbs_info->freq_table = cpufreq_frequency_get_table(cpu);
+	struct od_dbs_info *dbs_info = dbs_group_data(grp);
+	dbs_info->freq_table = cpufreq_frequency_get_table(grp->policy->cpu);
 	dbs_info->freq_lo = 0;
 }
 
-static void ondemand_powersave_bias_init(void)
+static void od_init(struct dbs_group *grp)
 {
-	int i;
-	for_each_online_cpu(i) {
-		ondemand_powersave_bias_init_cpu(i);
-	}
+	struct od_dbs_info *dbs_info = dbs_group_data(grp);
+
+	dbs_info->rate_mult = 1;
+	dbs_info->sample_type = DBS_NORMAL_SAMPLE;
+	ondemand_powersave_bias_init(grp);
 }
 
 void ondemand_boost_cpu(int boost)
 {
 	int cpu;
 
+	/* GOV_STOP frees the group under dbs_mutex */
+	mutex_lock(&dbs_mutex);
 	for_each_online_cpu(cpu) {
-		struct cpufreq_policy *policy;
-		struct cpu_dbs_info_s *dbs_info;
+		struct dbs_group *grp = dbs_group_get(cpu, &od_dbs_gov);
 
-		policy = cpufreq_cpu_get(cpu);
-		if (!policy)
+		if (!grp)
 			continue;
-		dbs_info = &per_cpu(od_cpu_dbs_info, policy->cpu);
-		cpufreq_cpu_put(policy);
 
-		mutex_lock(&dbs_info->timer_mutex);
+		mutex_lock(&grp->timer_mutex);
 		if (boost) {
 			skip_ondemand = 1;
-			__cpufreq_driver_target(policy, policy->max, CPUFREQ_RELATION_H);
+			__cpufreq_driver_target(grp->policy, grp->policy->max,
+						CPUFREQ_RELATION_H);
 		} else {
 			skip_ondemand = 0;
 		}
-		mutex_unlock(&dbs_info->timer_mutex);
+		mutex_unlock(&grp->timer_mutex);
 	}
+	mutex_unlock(&dbs_mutex);
 }
 EXPORT_SYMBOL(ondemand_boost_cpu);
 
@@ -333,40 +294,38 @@ static void update_sampling_rate(unsigned int new_rate)
 	dbs_tuners_ins.sampling_rate = new_rate
 				     = max(new_rate, min_sampling_rate);
 
+	mutex_lock(&dbs_mutex);
 	for_each_online_cpu(cpu) {
-		struct cpufreq_policy *policy;
-		struct cpu_dbs_info_s *dbs_info;
+		struct dbs_group *grp = dbs_group_get(cpu, &od_dbs_gov);
 		unsigned long next_sampling, appointed_at;
 
-		policy = cpufreq_cpu_get(cpu);
-		if (!policy)
+		/* the group timer runs on the policy cpu, visit it once */
+		if (!grp || grp->cpu != cpu)
 			continue;
-		dbs_info = &per_cpu(od_cpu_dbs_info, policy->cpu);
-		cpufreq_cpu_put(policy);
 
-		mutex_lock(&dbs_info->timer_mutex);
+		mutex_lock(&grp->timer_mutex);
 
-		if (!delayed_work_pending(&dbs_info->work)) {
-			mutex_unlock(&dbs_info->timer_mutex);
+		if (!delayed_work_pending(&grp->work)) {
+			mutex_unlock(&grp->timer_mutex);
 			continue;
 		}
 
 		next_sampling  = jiffies + usecs_to_jiffies(new_rate);
-		appointed_at = dbs_info->work.timer.expires;
+		appointed_at = grp->work.timer.expires;
 
 
 		if (time_before(next_sampling, appointed_at)) {
 
-			mutex_unlock(&dbs_info->timer_mutex);
-			cancel_delayed_work_sync(&dbs_info->work);
-			mutex_lock(&dbs_info->timer_mutex);
+			mutex_unlock(&grp->timer_mutex);
+			dbs_group_timer_stop(grp);
+			mutex_lock(&grp->timer_mutex);
 
-			schedule_delayed_work_on(dbs_info->cpu, &dbs_info->work,
-						 usecs_to_jiffies(new_rate));
+			dbs_group_timer_start(grp, usecs_to_jiffies(new_rate));
 
 		}
-		mutex_unlock(&dbs_info->timer_mutex);
+		mutex_unlock(&grp->timer_mutex);
 	}
+	mutex_unlock(&dbs_mutex);
 }
 
 #ifdef CONFIG_CPU_FREQ_GOV_ONDEMAND_2_PHASE
@@ -477,11 +436,17 @@ static ssize_t store_sampling_down_factor(struct kobject *a,
 	dbs_tuners_ins.sampling_down_factor = input;
 
 	
+	mutex_lock(&dbs_mutex);
 	for_each_online_cpu(j) {
-		struct cpu_dbs_info_s *dbs_info;
-		dbs_info = &per_cpu(od_cpu_dbs_info, j);
+		struct dbs_group *grp = dbs_group_get(j, &od_dbs_gov);
+		struct od_dbs_info *dbs_info;
+
+		if (!grp)
+			continue;
+		dbs_info = dbs_group_data(grp);
 		dbs_info->rate_mult = 1;
 	}
+	mutex_unlock(&dbs_mutex);
 	return count;
 }
 
@@ -491,8 +456,6 @@ static ssize_t store_ignore_nice_load(struct kobject *a, struct attribute *b,
 	unsigned int input;
 	int ret;
 
-	unsigned int j;
-
 	ret = sscanf(buf, "%u", &input);
 	if (ret != 1)
 		return -EINVAL;
@@ -500,21 +463,8 @@ static ssize_t store_ignore_nice_load(struct kobject *a, struct attribute *b,
 	if (input > 1)
 		input = 1;
 
-	if (input == dbs_tuners_ins.ignore_nice) { 
-		return count;
-	}
+	/* nice time is always sampled, the next check simply uses it */
 	dbs_tuners_ins.ignore_nice = input;
-
-	
-	for_each_online_cpu(j) {
-		struct cpu_dbs_info_s *dbs_info;
-		dbs_info = &per_cpu(od_cpu_dbs_info, j);
-		dbs_info->prev_cpu_idle = get_cpu_idle_time(j,
-						&dbs_info->prev_cpu_wall);
-		if (dbs_tuners_ins.ignore_nice)
-			dbs_info->prev_cpu_nice = kcpustat_cpu(j).cpustat[CPUTIME_NICE];
-
-	}
 	return count;
 }
 
@@ -523,11 +473,8 @@ static ssize_t store_powersave_bias(struct kobject *a, struct attribute *b,
 {
 	int input  = 0;
 	int bypass = 0;
-	int ret, cpu, reenable_timer, j;
-	struct cpu_dbs_info_s *dbs_info;
-
-	struct cpumask cpus_timer_done;
-	cpumask_clear(&cpus_timer_done);
+	int ret, cpu, reenable_timer;
+	struct dbs_group *grp;
 
 	ret = sscanf(buf, "%d", &input);
 
@@ -553,69 +500,32 @@ static ssize_t store_powersave_bias(struct kobject *a, struct attribute *b,
 				POWERSAVE_BIAS_MINLEVEL));
 
 	dbs_tuners_ins.powersave_bias = input;
-	if (!bypass) {
-		if (reenable_timer) {
-			
-			for_each_online_cpu(cpu) {
-				if (lock_policy_rwsem_write(cpu) < 0)
-					continue;
-
-				dbs_info = &per_cpu(od_cpu_dbs_info, cpu);
-
-				for_each_cpu(j, &cpus_timer_done) {
-					if (!dbs_info->cur_policy) {
-						pr_err("Dbs policy is NULL\n");
-						goto skip_this_cpu;
-					}
-					if (cpumask_test_cpu(j, dbs_info->
-							cur_policy->cpus))
-						goto skip_this_cpu;
-				}
-
-				cpumask_set_cpu(cpu, &cpus_timer_done);
-				if (dbs_info->cur_policy) {
-					
-					dbs_timer_init(dbs_info);
-				}
-skip_this_cpu:
-				unlock_policy_rwsem_write(cpu);
-			}
-		}
-		ondemand_powersave_bias_init();
-	} else {
-		for_each_online_cpu(cpu) {
-			if (lock_policy_rwsem_write(cpu) < 0)
-				continue;
-
-			dbs_info = &per_cpu(od_cpu_dbs_info, cpu);
-
-			for_each_cpu(j, &cpus_timer_done) {
-				if (!dbs_info->cur_policy) {
-					pr_err("Dbs policy is NULL\n");
-					goto skip_this_cpu_bypass;
-				}
-				if (cpumask_test_cpu(j, dbs_info->
-							cur_policy->cpus))
-					goto skip_this_cpu_bypass;
-			}
 
-			cpumask_set_cpu(cpu, &cpus_timer_done);
-
-			if (dbs_info->cur_policy) {
-				
-				mutex_lock(&dbs_info->timer_mutex);
-				dbs_timer_exit(dbs_info);
-
-				ondemand_powersave_bias_setspeed(
-					dbs_info->cur_policy,
-					NULL,
-					input);
+	for_each_online_cpu(cpu) {
+		if (lock_policy_rwsem_write(cpu) < 0)
+			continue;
 
-				mutex_unlock(&dbs_info->timer_mutex);
-			}
-skip_this_cpu_bypass:
-			unlock_policy_rwsem_write(cpu);
+		/* one visit per group, on the cpu its timer runs on */
+		grp = dbs_group_get(cpu, &od_dbs_gov);
+		if (!grp || grp->cpu != cpu)
+			goto skip_this_cpu;
+
+		if (!bypass) {
+			if (reenable_timer)
+				dbs_timer_init(grp);
+			mutex_lock(&grp->timer_mutex);
+			ondemand_powersave_bias_init(grp);
+			mutex_unlock(&grp->timer_mutex);
+		} else {
+			/* the timer takes timer_mutex, stop it first */
+			dbs_group_timer_stop(grp);
+			mutex_lock(&grp->timer_mutex);
+			ondemand_powersave_bias_setspeed(grp->policy, NULL,
+							 input);
+			mutex_unlock(&grp->timer_mutex);
 		}
+skip_this_cpu:
+		unlock_policy_rwsem_write(cpu);
 	}
 
 	return count;
@@ -671,21 +581,23 @@ static struct attribute_group dbs_attr_group = {
 };
 
 
-static void dbs_freq_increase(struct cpufreq_policy *p, unsigned load, unsigned int freq)
+static void dbs_freq_increase(struct dbs_group *grp, unsigned load, unsigned int freq)
 {
+	struct cpufreq_policy *p = grp->policy;
+
 	if (dbs_tuners_ins.powersave_bias && g_ui_counter == 0)
-		freq = powersave_bias_target(p, freq, CPUFREQ_RELATION_H);
-	else if (p->cur == p->max) {
-		trace_cpufreq_interactive_already (p->cpu, load, p->cur, p->cur);
+		freq = powersave_bias_target(grp, freq, CPUFREQ_RELATION_H);
+	else if (grp->cur == p->max) {
+		trace_cpufreq_interactive_already (p->cpu, load, grp->cur, grp->cur);
 		return;
 	}
 
-	trace_cpufreq_interactive_target (p->cpu, load, p->cur, freq);
+	trace_cpufreq_interactive_target (p->cpu, load, grp->cur, freq);
 
-	__cpufreq_driver_target(p, freq, dbs_tuners_ins.powersave_bias ?
+	dbs_target(grp, freq, dbs_tuners_ins.powersave_bias ?
 			CPUFREQ_RELATION_L : CPUFREQ_RELATION_H);
 
-	trace_cpufreq_interactive_up (p->cpu, freq, p->cur);
+	trace_cpufreq_interactive_up (p->cpu, freq, grp->cur);
 }
 
 #ifdef CONFIG_CPU_FREQ_GOV_ONDEMAND_2_PHASE
@@ -696,8 +608,9 @@ int set_two_phase_freq(int cpufreq)
 }
 #endif
 
-static void dbs_check_cpu(struct cpu_dbs_info_s *this_dbs_info)
+static void dbs_check_cpu(struct dbs_group *grp)
 {
+	struct od_dbs_info *this_dbs_info = dbs_group_data(grp);
 	
 	unsigned int load_at_max_freq = 0;
 	unsigned int max_load_freq;
@@ -706,135 +619,98 @@ static void dbs_check_cpu(struct cpu_dbs_info_s *this_dbs_info)
 
 	struct cpufreq_policy *policy;
 	unsigned int j;
-#ifdef CONFIG_CPU_FREQ_GOV_ONDEMAND_2_PHASE
-	static unsigned int phase = 0;
-	static unsigned int counter = 0;
-#endif
 
 	this_dbs_info->freq_lo = 0;
-	policy = this_dbs_info->cur_policy;
+	policy = grp->policy;
 
 
 	
 	max_load_freq = 0;
 
-	for_each_cpu(j, policy->cpus) {
-		struct cpu_dbs_info_s *j_dbs_info;
-		cputime64_t cur_wall_time, cur_idle_time, cur_iowait_time;
-		unsigned int idle_time, wall_time, iowait_time;
+	dbs_group_sample(grp);
+	for (j = 0; j < grp->nr_loads; j++) {
+		struct dbs_cpu_load *l = &grp->loads[j];
 		unsigned int load_freq;
-		int freq_avg;
-
-		j_dbs_info = &per_cpu(od_cpu_dbs_info, j);
-
-		cur_idle_time = get_cpu_idle_time(j, &cur_wall_time);
-		cur_iowait_time = get_cpu_iowait_time(j, &cur_wall_time);
-
-		wall_time = (unsigned int)
-			(cur_wall_time - j_dbs_info->prev_cpu_wall);
-		j_dbs_info->prev_cpu_wall = cur_wall_time;
-
-		idle_time = (unsigned int)
-			(cur_idle_time - j_dbs_info->prev_cpu_idle);
-		j_dbs_info->prev_cpu_idle = cur_idle_time;
-
-		iowait_time = (unsigned int)
-			(cur_iowait_time - j_dbs_info->prev_cpu_iowait);
-		j_dbs_info->prev_cpu_iowait = cur_iowait_time;
-
-		if (dbs_tuners_ins.ignore_nice) {
-			u64 cur_nice;
-			unsigned long cur_nice_jiffies;
+		int load;
 
-			cur_nice = kcpustat_cpu(j).cpustat[CPUTIME_NICE] -
-					 j_dbs_info->prev_cpu_nice;
-			cur_nice_jiffies = (unsigned long)
-					cputime64_to_jiffies64(cur_nice);
-
-			j_dbs_info->prev_cpu_nice = kcpustat_cpu(j).cpustat[CPUTIME_NICE];
-			idle_time += jiffies_to_usecs(cur_nice_jiffies);
-		}
-
-
-		if (dbs_tuners_ins.io_is_busy && idle_time >= iowait_time)
-			idle_time -= iowait_time;
-
-		if (unlikely(!wall_time || wall_time < idle_time))
+		load = dbs_cpu_load_pct(l, dbs_tuners_ins.ignore_nice,
+					dbs_tuners_ins.io_is_busy);
+		if (load < 0)
 			continue;
 
-		cur_load = 100 * (wall_time - idle_time) / wall_time;
-		per_cpu(cpu_load, j) = cur_load;
-
-		freq_avg = __cpufreq_driver_getavg(policy, j);
-		if (freq_avg <= 0)
-			freq_avg = policy->cur;
+		cur_load = load;
+		if (!dbs_group_replaying(grp))
+			per_cpu(cpu_load, l->cpu) = cur_load;
 
-		load_freq = cur_load * freq_avg;
+		load_freq = cur_load * l->freq_avg;
 		if (load_freq > max_load_freq)
 			max_load_freq = load_freq;
 
 		
-		load_at_max_freq += (cur_load * policy->cur) /
+		load_at_max_freq += (cur_load * grp->cur) /
 					policy->cpuinfo.max_freq;
 	}
 
-	cpufreq_notify_utilization(policy, load_at_max_freq);
+	if (!dbs_group_replaying(grp)) {
+		cpufreq_notify_utilization(policy, load_at_max_freq);
 
-	
-	if (g_ui_counter > 0){
-		g_ui_counter--;
-		if(g_ui_counter == 0)
-			dbs_tuners_ins.sampling_rate = dbs_tuners_ins.origin_sampling_rate;
+		
+		if (g_ui_counter > 0){
+			g_ui_counter--;
+			if(g_ui_counter == 0)
+				dbs_tuners_ins.sampling_rate = dbs_tuners_ins.origin_sampling_rate;
+		}
 	}
 
 	
-	if (max_load_freq > dbs_tuners_ins.up_threshold * policy->cur) {
+	if (max_load_freq > dbs_tuners_ins.up_threshold * grp->cur) {
 		
 #ifndef CONFIG_CPU_FREQ_GOV_ONDEMAND_2_PHASE
-		if (policy->cur < policy->max)
+		if (grp->cur < policy->max)
 			this_dbs_info->rate_mult =
 				dbs_tuners_ins.sampling_down_factor;
-		dbs_freq_increase(policy, cur_load, policy->max);
+		dbs_freq_increase(grp, cur_load, policy->max);
 #else
-		if (counter < 5) {
-			counter++;
-			if (counter > 2) {
+		if (this_dbs_info->counter < 5) {
+			this_dbs_info->counter++;
+			if (this_dbs_info->counter > 2) {
 				
-				phase = 1;
+				this_dbs_info->phase = 1;
 			}
 		}
-		if (dbs_tuners_ins.two_phase_freq != 0 && phase == 0) {
+		if (dbs_tuners_ins.two_phase_freq != 0 &&
+		    this_dbs_info->phase == 0) {
 			
-			dbs_freq_increase(policy, cur_load, dbs_tuners_ins.two_phase_freq);
+			dbs_freq_increase(grp, cur_load, dbs_tuners_ins.two_phase_freq);
 		} else {
 			
-		if (policy->cur < policy->max)
+		if (grp->cur < policy->max)
 			this_dbs_info->rate_mult =
 				dbs_tuners_ins.sampling_down_factor;
-		dbs_freq_increase(policy, cur_load, policy->max);
+		dbs_freq_increase(grp, cur_load, policy->max);
 		}
 #endif
 		return;
 	}
 #ifdef CONFIG_CPU_FREQ_GOV_ONDEMAND_2_PHASE
-	if (counter > 0) {
-		counter--;
-		if (counter == 0) {
+	if (this_dbs_info->counter > 0) {
+		this_dbs_info->counter--;
+		if (this_dbs_info->counter == 0) {
 			
-			phase = 0;
+			this_dbs_info->phase = 0;
 		}
 	}
 #endif
 
 	
 	
-	if (policy->cur == policy->min){
-		trace_cpufreq_interactive_already (policy->cpu, cur_load, policy->cur,policy->cur);
+	if (grp->cur == policy->min){
+		trace_cpufreq_interactive_already (policy->cpu, cur_load, grp->cur, grp->cur);
 		return;
 	}
 	if (max_load_freq <
 	    (dbs_tuners_ins.up_threshold - dbs_tuners_ins.down_differential) *
-	     policy->cur) {
+	     grp->cur) {
 		unsigned int freq_next;
 		freq_next = max_load_freq /
 				(dbs_tuners_ins.up_threshold -
@@ -847,77 +723,56 @@ static void dbs_check_cpu(struct cpu_dbs_info_s *this_dbs_info)
 			freq_next = policy->min;
 
 		if (!dbs_tuners_ins.powersave_bias) {
-			trace_cpufreq_interactive_target (policy->cpu, cur_load, policy->cur, freq_next);
-			__cpufreq_driver_target(policy, freq_next,
-					CPUFREQ_RELATION_L);
+			trace_cpufreq_interactive_target (policy->cpu, cur_load, grp->cur, freq_next);
+			dbs_target(grp, freq_next, CPUFREQ_RELATION_L);
 		} else {
-			freq_next = powersave_bias_target(policy, freq_next,
+			freq_next = powersave_bias_target(grp, freq_next,
 					CPUFREQ_RELATION_L);
-			trace_cpufreq_interactive_target (policy->cpu, cur_load, policy->cur, freq_next);
-			__cpufreq_driver_target(policy, freq_next,
-				CPUFREQ_RELATION_L);
+			trace_cpufreq_interactive_target (policy->cpu, cur_load, grp->cur, freq_next);
+			dbs_target(grp, freq_next, CPUFREQ_RELATION_L);
 		}
-		trace_cpufreq_interactive_down (policy->cpu, freq_next, policy->cur);
+		trace_cpufreq_interactive_down (policy->cpu, freq_next, grp->cur);
 	}
 }
 
-static void do_dbs_timer(struct work_struct *work)
+static unsigned long od_check(struct dbs_group *grp)
 {
-	struct cpu_dbs_info_s *dbs_info =
-		container_of(work, struct cpu_dbs_info_s, work.work);
-	unsigned int cpu = dbs_info->cpu;
+	struct od_dbs_info *dbs_info = dbs_group_data(grp);
 	int sample_type = dbs_info->sample_type;
+	unsigned long delay;
 
-	int delay = msecs_to_jiffies(50);
-
-	mutex_lock(&dbs_info->timer_mutex);
-
-	if (skip_ondemand)
-		goto sched_wait;
+	if (skip_ondemand && !dbs_group_replaying(grp))
+		return msecs_to_jiffies(50);
 
 	
 	dbs_info->sample_type = DBS_NORMAL_SAMPLE;
 	if (!dbs_tuners_ins.powersave_bias ||
 	    sample_type == DBS_NORMAL_SAMPLE) {
-		dbs_check_cpu(dbs_info);
+		dbs_check_cpu(grp);
 		if (dbs_info->freq_lo) {
 			
 			dbs_info->sample_type = DBS_SUB_SAMPLE;
 			delay = dbs_info->freq_hi_jiffies;
 		} else {
-			delay = usecs_to_jiffies(dbs_tuners_ins.sampling_rate
-				* dbs_info->rate_mult);
-
-			if (num_online_cpus() > 1)
-				delay -= jiffies % delay;
+			delay = dbs_align_delay(usecs_to_jiffies(
+				dbs_tuners_ins.sampling_rate *
+				dbs_info->rate_mult));
 		}
 	} else {
-		__cpufreq_driver_target(dbs_info->cur_policy,
-			dbs_info->freq_lo, CPUFREQ_RELATION_H);
+		dbs_target(grp, dbs_info->freq_lo, CPUFREQ_RELATION_H);
 		delay = dbs_info->freq_lo_jiffies;
 	}
 
-sched_wait:
-	schedule_delayed_work_on(cpu, &dbs_info->work, delay);
-	mutex_unlock(&dbs_info->timer_mutex);
+	return delay;
 }
 
-static inline void dbs_timer_init(struct cpu_dbs_info_s *dbs_info)
+static inline void dbs_timer_init(struct dbs_group *grp)
 {
-	
-	int delay = usecs_to_jiffies(dbs_tuners_ins.sampling_rate);
-
-	if (num_online_cpus() > 1)
-		delay -= jiffies % delay;
+	struct od_dbs_info *dbs_info = dbs_group_data(grp);
 
 	dbs_info->sample_type = DBS_NORMAL_SAMPLE;
-	INIT_DELAYED_WORK_DEFERRABLE(&dbs_info->work, do_dbs_timer);
-	schedule_delayed_work_on(dbs_info->cpu, &dbs_info->work, delay);
-}
-
-static inline void dbs_timer_exit(struct cpu_dbs_info_s *dbs_info)
-{
-	cancel_delayed_work_sync(&dbs_info->work);
+	dbs_group_timer_start(grp, dbs_align_delay(
+		usecs_to_jiffies(dbs_tuners_ins.sampling_rate)));
 }
 
 static int should_io_be_busy(void)
@@ -933,8 +788,7 @@ static int should_io_be_busy(void)
 
 static void dbs_refresh_callback(struct work_struct *unused)
 {
-	struct cpufreq_policy *policy;
-	struct cpu_dbs_info_s *this_dbs_info;
+	struct dbs_group *grp;
 	unsigned int cpu = smp_processor_id();
 
 	get_online_cpus();
@@ -942,9 +796,8 @@ static void dbs_refresh_callback(struct work_struct *unused)
 	if (lock_policy_rwsem_write(cpu) < 0)
 		goto bail_acq_sema_failed;
 
-	this_dbs_info = &per_cpu(od_cpu_dbs_info, cpu);
-	policy = this_dbs_info->cur_policy;
-	if (!policy) {
+	grp = dbs_group_get(cpu, &od_dbs_gov);
+	if (!grp) {
 		
 		goto bail_incorrect_governor;
 	}
@@ -954,12 +807,14 @@ static void dbs_refresh_callback(struct work_struct *unused)
 	if(g_ui_counter > 0)
 		dbs_tuners_ins.sampling_rate = dbs_tuners_ins.ui_sampling_rate;
 #if DBS_INPUT_EVENT_FREQ_INCREASE
-	if (policy->cur < DBS_INPUT_EVENT_MIN_FREQ) {
-		dbs_freq_increase(policy, per_cpu(cpu_load, cpu),DBS_INPUT_EVENT_MIN_FREQ);
+	mutex_lock(&grp->timer_mutex);
+	grp->cur = grp->policy->cur;
+	if (grp->cur < DBS_INPUT_EVENT_MIN_FREQ) {
+		dbs_freq_increase(grp, per_cpu(cpu_load, cpu),DBS_INPUT_EVENT_MIN_FREQ);
 
-		this_dbs_info->prev_cpu_idle = get_cpu_idle_time(cpu,
-				&this_dbs_info->prev_cpu_wall);
+		dbs_group_reset_sample(grp);
 	}
+	mutex_unlock(&grp->timer_mutex);
 #endif
 
 bail_incorrect_governor:
@@ -1059,12 +914,9 @@ static int cpufreq_governor_dbs(struct cpufreq_policy *policy,
 				   unsigned int event)
 {
 	unsigned int cpu = policy->cpu;
-	struct cpu_dbs_info_s *this_dbs_info;
-	unsigned int j;
+	struct dbs_group *grp;
 	int rc;
 
-	this_dbs_info = &per_cpu(od_cpu_dbs_info, cpu);
-
 	switch (event) {
 	case CPUFREQ_GOV_START:
 		if ((!cpu_online(cpu)) || (!policy->cur))
@@ -1072,22 +924,7 @@ static int cpufreq_governor_dbs(struct cpufreq_policy *policy,
 		
 		mutex_lock(&dbs_mutex);
 
-		dbs_enable++;
-		for_each_cpu(j, policy->cpus) {
-			struct cpu_dbs_info_s *j_dbs_info;
-			j_dbs_info = &per_cpu(od_cpu_dbs_info, j);
-			j_dbs_info->cur_policy = policy;
-
-			j_dbs_info->prev_cpu_idle = get_cpu_idle_time(j,
-						&j_dbs_info->prev_cpu_wall);
-			if (dbs_tuners_ins.ignore_nice)
-				j_dbs_info->prev_cpu_nice =
-						kcpustat_cpu(j).cpustat[CPUTIME_NICE];
-		}
-		this_dbs_info->cpu = cpu;
-		this_dbs_info->rate_mult = 1;
-		ondemand_powersave_bias_init_cpu(cpu);
-		if (dbs_enable == 1) {
+		if (dbs_enable == 0) {
 			unsigned int latency;
 
 			rc = sysfs_create_group(cpufreq_global_kobject,
@@ -1110,26 +947,36 @@ static int cpufreq_governor_dbs(struct cpufreq_policy *policy,
 			dbs_tuners_ins.origin_sampling_rate = dbs_tuners_ins.sampling_rate;
 			dbs_tuners_ins.io_is_busy = should_io_be_busy();
 		}
+
+		grp = dbs_group_start(&od_dbs_gov, policy);
+		if (!grp) {
+			if (dbs_enable == 0)
+				sysfs_remove_group(cpufreq_global_kobject,
+						   &dbs_attr_group);
+			mutex_unlock(&dbs_mutex);
+			return -ENOMEM;
+		}
+		dbs_enable++;
+
 		if (!cpu)
 			rc = input_register_handler(&dbs_input_handler);
 		mutex_unlock(&dbs_mutex);
 
-		mutex_init(&this_dbs_info->timer_mutex);
-
 		if (!ondemand_powersave_bias_setspeed(
-					this_dbs_info->cur_policy,
+					policy,
 					NULL,
 					dbs_tuners_ins.powersave_bias))
-			dbs_timer_init(this_dbs_info);
+			dbs_timer_init(grp);
 		break;
 
 	case CPUFREQ_GOV_STOP:
-		dbs_timer_exit(this_dbs_info);
+		grp = dbs_group_get(cpu, &od_dbs_gov);
+		if (!grp)
+			break;
 
 		mutex_lock(&dbs_mutex);
-		mutex_destroy(&this_dbs_info->timer_mutex);
+		dbs_group_stop(grp);
 		dbs_enable--;
-		this_dbs_info->cur_policy = NULL;
 		if (!cpu)
 			input_unregister_handler(&dbs_input_handler);
 		mutex_unlock(&dbs_mutex);
@@ -1140,21 +987,17 @@ static int cpufreq_governor_dbs(struct cpufreq_policy *policy,
 		break;
 
 	case CPUFREQ_GOV_LIMITS:
-		mutex_lock(&this_dbs_info->timer_mutex);
-		if(this_dbs_info->cur_policy){
-			if (policy->max < this_dbs_info->cur_policy->cur)
-				__cpufreq_driver_target(this_dbs_info->cur_policy,
-					policy->max, CPUFREQ_RELATION_H);
-			else if (policy->min > this_dbs_info->cur_policy->cur)
-				__cpufreq_driver_target(this_dbs_info->cur_policy,
-					policy->min, CPUFREQ_RELATION_L);
-			else if (dbs_tuners_ins.powersave_bias != 0)
-				ondemand_powersave_bias_setspeed(
-					this_dbs_info->cur_policy,
-					policy,
+		grp = dbs_group_get(cpu, &od_dbs_gov);
+		if (!grp)
+			break;
+
+		dbs_group_limits(grp);
+		if (dbs_tuners_ins.powersave_bias != 0) {
+			mutex_lock(&grp->timer_mutex);
+			ondemand_powersave_bias_setspeed(grp->policy, policy,
 					dbs_tuners_ins.powersave_bias);
+			mutex_unlock(&grp->timer_mutex);
 		}
-		mutex_unlock(&this_dbs_info->timer_mutex);
 		break;
 	}
 	return 0;
@@ -1164,6 +1007,7 @@ static int __init cpufreq_gov_dbs_init(void)
 {
 	u64 idle_time;
 	unsigned int i;
+	int rc;
 	int cpu = get_cpu();
 
 	idle_time = get_cpu_idle_time_us(cpu, NULL);
@@ -1189,12 +1033,17 @@ static int __init cpufreq_gov_dbs_init(void)
 		INIT_WORK(&per_cpu(dbs_refresh_work, i), dbs_refresh_callback);
 	}
 
-	return cpufreq_register_governor(&cpufreq_gov_ondemand);
+	dbs_register_governor(&od_dbs_gov);
+	rc = cpufreq_register_governor(&cpufreq_gov_ondemand);
+	if (rc)
+		dbs_unregister_governor(&od_dbs_gov);
+	return rc;
 }
 
 static void __exit cpufreq_gov_dbs_exit(void)
 {
 	cpufreq_unregister_governor(&cpufreq_gov_ondemand);
+	dbs_unregister_governor(&od_dbs_gov);
 	destroy_workqueue(input_wq);
 }
 
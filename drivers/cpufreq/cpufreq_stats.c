@@ -18,30 +18,70 @@
 #include <linux/jiffies.h>
 #include <linux/percpu.h>
 #include <linux/kobject.h>
-#include <linux/spinlock.h>
 #include <linux/notifier.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
 #include <asm/cputime.h>
 
-static spinlock_t cpufreq_stats_lock;
-
 #define CPUFREQ_STATDEVICE_ATTR(_name, _mode, _show) \
 static struct freq_attr _attr_##_name = {\
 	.attr = {.name = __stringify(_name), .mode = _mode, }, \
 	.show = _show,\
 };
 
+/*
+ * The counters of a cpu live in one vmalloc_user() buffer laid out as
+ * below, which stats_matrix exports as is, for reading and for mmap():
+ *
+ *	struct cpufreq_stats_hdr
+ *	u32 freq[state_num]			at hdr.freq_offset, in kHz
+ *	u64 time_in_state[state_num]		at hdr.time_offset, in 1/hz s
+ *	u32 trans[state_num][state_num]		at hdr.trans_offset, from/to
+ *
+ * Only the transition notifier of the cpu writes to it, under the
+ * lock of the stats: transitions are not always serialized by the
+ * driver, perflock and cpufreq_out_of_sync() send their own. Readers,
+ * in the kernel or through a mapping, take no lock and retry while
+ * hdr.seq is odd or changed under them. time_in_state[last_index] does not include the
+ * time since last_time, which is in jiffies.
+ */
+#define CPUFREQ_STATS_MAGIC	0x63667374	/* "cfst" */
+#define CPUFREQ_STATS_VERSION	1
+
+struct cpufreq_stats_hdr {
+	u32 magic;
+	u32 version;
+	u32 seq;
+	u32 state_num;
+	u32 hz;
+	u32 total_trans;
+	s32 last_index;
+	u32 freq_offset;
+	u32 time_offset;
+	u32 trans_offset;
+	u64 last_time;
+};
+
+/* freq to index hash, open addressing, 0 marks a free slot */
+struct cpufreq_stats_slot {
+	unsigned int freq;
+	int index;
+};
+
 struct cpufreq_stats {
 	unsigned int cpu;
-	unsigned int total_trans;
-	unsigned long long  last_time;
+	spinlock_t lock;		/* serializes writers of hdr */
 	unsigned int max_state;
 	unsigned int state_num;
-	unsigned int last_index;
-	cputime64_t *time_in_state;
+	struct cpufreq_stats_hdr *hdr;
+	size_t size;
+	u64 *time_in_state;
 	unsigned int *freq_table;
-#ifdef CONFIG_CPU_FREQ_STAT_DETAILS
 	unsigned int *trans_table;
-#endif
+	unsigned int hash_bits;
+	struct cpufreq_stats_slot *hash;
 };
 
 static DEFINE_PER_CPU(struct cpufreq_stats *, cpufreq_stats_table);
@@ -51,20 +91,44 @@ struct cpufreq_stats_attribute {
 	ssize_t(*show) (struct cpufreq_stats *, char *);
 };
 
-static int cpufreq_stats_update(unsigned int cpu)
+static inline void cpufreq_stats_write_begin(struct cpufreq_stats_hdr *hdr)
 {
-	struct cpufreq_stats *stat;
-	unsigned long long cur_time;
+	hdr->seq++;
+	smp_wmb();
+}
 
-	cur_time = get_jiffies_64();
-	spin_lock(&cpufreq_stats_lock);
-	stat = per_cpu(cpufreq_stats_table, cpu);
-	if (stat->time_in_state)
-		stat->time_in_state[stat->last_index] +=
-			cur_time - stat->last_time;
-	stat->last_time = cur_time;
-	spin_unlock(&cpufreq_stats_lock);
-	return 0;
+static inline void cpufreq_stats_write_end(struct cpufreq_stats_hdr *hdr)
+{
+	smp_wmb();
+	hdr->seq++;
+}
+
+static inline u32 cpufreq_stats_read_begin(struct cpufreq_stats_hdr *hdr)
+{
+	u32 seq;
+
+	while ((seq = ACCESS_ONCE(hdr->seq)) & 1)
+		cpu_relax();
+	smp_rmb();
+	return seq;
+}
+
+static inline bool cpufreq_stats_read_retry(struct cpufreq_stats_hdr *hdr,
+					    u32 seq)
+{
+	smp_rmb();
+	return ACCESS_ONCE(hdr->seq) != seq;
+}
+
+/* Time spent at @index so far, including the current stay */
+static u64 cpufreq_stats_time(struct cpufreq_stats *stat, int index,
+			      u64 now)
+{
+	u64 time = stat->time_in_state[index];
+
+	if (index == stat->hdr->last_index)
+		time += now - stat->hdr->last_time;
+	return time;
 }
 
 static ssize_t show_total_trans(struct cpufreq_policy *policy, char *buf)
@@ -72,23 +136,29 @@ static ssize_t show_total_trans(struct cpufreq_policy *policy, char *buf)
 	struct cpufreq_stats *stat = per_cpu(cpufreq_stats_table, policy->cpu);
 	if (!stat)
 		return 0;
-	return sprintf(buf, "%d\n",
-			per_cpu(cpufreq_stats_table, stat->cpu)->total_trans);
+	return sprintf(buf, "%d\n", ACCESS_ONCE(stat->hdr->total_trans));
 }
 
 static ssize_t show_time_in_state(struct cpufreq_policy *policy, char *buf)
 {
-	ssize_t len = 0;
+	ssize_t len;
+	u64 now;
+	u32 seq;
 	int i;
 	struct cpufreq_stats *stat = per_cpu(cpufreq_stats_table, policy->cpu);
 	if (!stat)
 		return 0;
-	cpufreq_stats_update(stat->cpu);
-	for (i = 0; i < stat->state_num; i++) {
-		len += sprintf(buf + len, "%u %llu\n", stat->freq_table[i],
-			(unsigned long long)
-			cputime64_to_clock_t(stat->time_in_state[i]));
-	}
+	do {
+		seq = cpufreq_stats_read_begin(stat->hdr);
+		now = get_jiffies_64();
+		len = 0;
+		for (i = 0; i < stat->state_num; i++) {
+			len += sprintf(buf + len, "%u %llu\n",
+				stat->freq_table[i], (unsigned long long)
+				cputime64_to_clock_t(
+					cpufreq_stats_time(stat, i, now)));
+		}
+	} while (cpufreq_stats_read_retry(stat->hdr, seq));
 	return len;
 }
 
@@ -101,7 +171,6 @@ static ssize_t show_trans_table(struct cpufreq_policy *policy, char *buf)
 	struct cpufreq_stats *stat = per_cpu(cpufreq_stats_table, policy->cpu);
 	if (!stat)
 		return 0;
-	cpufreq_stats_update(stat->cpu);
 	len += snprintf(buf + len, PAGE_SIZE - len, "   From  :    To\n");
 	len += snprintf(buf + len, PAGE_SIZE - len, "         : ");
 	for (i = 0; i < stat->state_num; i++) {
@@ -126,7 +195,7 @@ static ssize_t show_trans_table(struct cpufreq_policy *policy, char *buf)
 			if (len >= PAGE_SIZE)
 				break;
 			len += snprintf(buf + len, PAGE_SIZE - len, "%9u ",
-					stat->trans_table[i*stat->max_state+j]);
+				ACCESS_ONCE(stat->trans_table[i*stat->max_state+j]));
 		}
 		if (len >= PAGE_SIZE)
 			break;
@@ -139,6 +208,54 @@ static ssize_t show_trans_table(struct cpufreq_policy *policy, char *buf)
 CPUFREQ_STATDEVICE_ATTR(trans_table, 0444, show_trans_table);
 #endif
 
+static struct cpufreq_stats *kobj_to_stats(struct kobject *kobj)
+{
+	struct cpufreq_policy *policy =
+		container_of(kobj, struct cpufreq_policy, kobj);
+
+	return per_cpu(cpufreq_stats_table, policy->cpu);
+}
+
+/* A snapshot of the raw counters, see the layout above */
+static ssize_t read_stats_matrix(struct file *filp, struct kobject *kobj,
+				 struct bin_attribute *attr, char *buf,
+				 loff_t off, size_t count)
+{
+	struct cpufreq_stats *stat = kobj_to_stats(kobj);
+	u32 seq;
+
+	if (!stat || off >= stat->size)
+		return 0;
+	count = min_t(size_t, count, stat->size - off);
+	do {
+		seq = cpufreq_stats_read_begin(stat->hdr);
+		memcpy(buf, (char *)stat->hdr + off, count);
+	} while (cpufreq_stats_read_retry(stat->hdr, seq));
+	return count;
+}
+
+static int mmap_stats_matrix(struct file *filp, struct kobject *kobj,
+			     struct bin_attribute *attr,
+			     struct vm_area_struct *vma)
+{
+	struct cpufreq_stats *stat = kobj_to_stats(kobj);
+
+	if (!stat)
+		return -ENODEV;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	/* the mapping holds references on the pages, they outlive stat */
+	return remap_vmalloc_range(vma, stat->hdr, vma->vm_pgoff);
+}
+
+static struct bin_attribute stats_matrix_attr = {
+	.attr = { .name = "stats_matrix", .mode = 0444 },
+	.read = read_stats_matrix,
+	.mmap = mmap_stats_matrix,
+};
+
 CPUFREQ_STATDEVICE_ATTR(total_trans, 0444, show_total_trans);
 CPUFREQ_STATDEVICE_ATTR(time_in_state, 0444, show_time_in_state);
 
@@ -157,24 +274,39 @@ static struct attribute_group stats_attr_group = {
 
 static int freq_table_get_index(struct cpufreq_stats *stat, unsigned int freq)
 {
-	int index;
-	for (index = 0; index < stat->max_state; index++)
-		if (stat->freq_table[index] == freq)
-			return index;
+	unsigned int mask = (1U << stat->hash_bits) - 1;
+	unsigned int i = hash_32(freq, stat->hash_bits);
+
+	for (; stat->hash[i].freq; i = (i + 1) & mask)
+		if (stat->hash[i].freq == freq)
+			return stat->hash[i].index;
 	return -1;
 }
 
+static void freq_table_add_index(struct cpufreq_stats *stat,
+				 unsigned int freq, int index)
+{
+	unsigned int mask = (1U << stat->hash_bits) - 1;
+	unsigned int i = hash_32(freq, stat->hash_bits);
+
+	while (stat->hash[i].freq)
+		i = (i + 1) & mask;
+	stat->hash[i].freq = freq;
+	stat->hash[i].index = index;
+}
+
 /* should be called late in the CPU removal sequence so that the stats
  * memory is still available in case someone tries to use it.
  */
 static void cpufreq_stats_free_table(unsigned int cpu)
 {
 	struct cpufreq_stats *stat = per_cpu(cpufreq_stats_table, cpu);
+	per_cpu(cpufreq_stats_table, cpu) = NULL;
 	if (stat) {
-		kfree(stat->time_in_state);
+		vfree(stat->hdr);
+		kfree(stat->hash);
 		kfree(stat);
 	}
-	per_cpu(cpufreq_stats_table, cpu) = NULL;
 }
 
 /* must be called early in the CPU removal sequence (before
@@ -183,8 +315,10 @@ static void cpufreq_stats_free_table(unsigned int cpu)
 static void cpufreq_stats_free_sysfs(unsigned int cpu)
 {
 	struct cpufreq_policy *policy = cpufreq_cpu_get(cpu);
-	if (policy && policy->cpu == cpu)
+	if (policy && policy->cpu == cpu) {
+		sysfs_remove_bin_file(&policy->kobj, &stats_matrix_attr);
 		sysfs_remove_group(&policy->kobj, &stats_attr_group);
+	}
 	if (policy)
 		cpufreq_cpu_put(policy);
 }
@@ -194,6 +328,7 @@ static int cpufreq_stats_create_table(struct cpufreq_policy *policy,
 {
 	unsigned int i, j, count = 0, ret = 0;
 	struct cpufreq_stats *stat;
+	struct cpufreq_stats_hdr *hdr;
 	struct cpufreq_policy *data;
 	unsigned int alloc_size;
 	unsigned int cpu = policy->cpu;
@@ -209,12 +344,8 @@ static int cpufreq_stats_create_table(struct cpufreq_policy *policy,
 		goto error_get_fail;
 	}
 
-	ret = sysfs_create_group(&data->kobj, &stats_attr_group);
-	if (ret)
-		goto error_out;
-
 	stat->cpu = cpu;
-	per_cpu(cpufreq_stats_table, cpu) = stat;
+	spin_lock_init(&stat->lock);
 
 	for (i = 0; table[i].frequency != CPUFREQ_TABLE_END; i++) {
 		unsigned int freq = table[i].frequency;
@@ -223,42 +354,71 @@ static int cpufreq_stats_create_table(struct cpufreq_policy *policy,
 		count++;
 	}
 
-	alloc_size = count * sizeof(int) + count * sizeof(cputime64_t);
+	/* at most half full, so probes stay short */
+	stat->hash_bits = ilog2(roundup_pow_of_two(2 * count + 1));
+	stat->hash = kcalloc(1 << stat->hash_bits, sizeof(*stat->hash),
+			     GFP_KERNEL);
+	if (!stat->hash) {
+		ret = -ENOMEM;
+		goto error_out;
+	}
 
-#ifdef CONFIG_CPU_FREQ_STAT_DETAILS
-	alloc_size += count * count * sizeof(int);
-#endif
+	alloc_size = ALIGN(sizeof(*hdr) + count * sizeof(int), sizeof(u64)) +
+		count * sizeof(u64) + count * count * sizeof(int);
 	stat->max_state = count;
-	stat->time_in_state = kzalloc(alloc_size, GFP_KERNEL);
-	if (!stat->time_in_state) {
+	stat->size = alloc_size;
+	/* zeroed, and page backed so that it can be mapped */
+	hdr = vmalloc_user(alloc_size);
+	if (!hdr) {
 		ret = -ENOMEM;
 		goto error_out;
 	}
-	stat->freq_table = (unsigned int *)(stat->time_in_state + count);
-
-#ifdef CONFIG_CPU_FREQ_STAT_DETAILS
-	stat->trans_table = stat->freq_table + count;
-#endif
+	stat->hdr = hdr;
+	hdr->magic = CPUFREQ_STATS_MAGIC;
+	hdr->version = CPUFREQ_STATS_VERSION;
+	hdr->hz = HZ;
+	hdr->freq_offset = sizeof(*hdr);
+	hdr->time_offset = ALIGN(hdr->freq_offset + count * sizeof(int),
+				 sizeof(u64));
+	stat->freq_table = (void *)hdr + hdr->freq_offset;
+	stat->time_in_state = (void *)hdr + hdr->time_offset;
+	hdr->trans_offset = hdr->time_offset + count * sizeof(u64);
+	stat->trans_table = (void *)hdr + hdr->trans_offset;
 	j = 0;
 	for (i = 0; table[i].frequency != CPUFREQ_TABLE_END; i++) {
 		unsigned int freq = table[i].frequency;
 		if (freq == CPUFREQ_ENTRY_INVALID)
 			continue;
-		if (freq_table_get_index(stat, freq) == -1)
+		if (freq_table_get_index(stat, freq) == -1) {
+			freq_table_add_index(stat, freq, j);
 			stat->freq_table[j++] = freq;
+		}
 	}
 	stat->state_num = j;
-	spin_lock(&cpufreq_stats_lock);
-	stat->last_time = get_jiffies_64();
-	stat->last_index = freq_table_get_index(stat, policy->cur);
-	spin_unlock(&cpufreq_stats_lock);
+	hdr->state_num = j;
+	hdr->last_time = get_jiffies_64();
+	hdr->last_index = freq_table_get_index(stat, policy->cur);
+
+	ret = sysfs_create_group(&data->kobj, &stats_attr_group);
+	if (ret)
+		goto error_out;
+	ret = sysfs_create_bin_file(&data->kobj, &stats_matrix_attr);
+	if (ret) {
+		sysfs_remove_group(&data->kobj, &stats_attr_group);
+		goto error_out;
+	}
+
+	/* fully set up before the notifiers and sysfs can see it */
+	smp_wmb();
+	per_cpu(cpufreq_stats_table, cpu) = stat;
 	cpufreq_cpu_put(data);
 	return 0;
 error_out:
 	cpufreq_cpu_put(data);
+	vfree(stat->hdr);
+	kfree(stat->hash);
 error_get_fail:
 	kfree(stat);
-	per_cpu(cpufreq_stats_table, cpu) = NULL;
 	return ret;
 }
 
@@ -285,7 +445,10 @@ static int cpufreq_stat_notifier_trans(struct notifier_block *nb,
 {
 	struct cpufreq_freqs *freq = data;
 	struct cpufreq_stats *stat;
+	struct cpufreq_stats_hdr *hdr;
 	int old_index, new_index;
+	unsigned long flags;
+	u64 cur_time;
 
 	if (val != CPUFREQ_POSTCHANGE)
 		return 0;
@@ -293,26 +456,32 @@ static int cpufreq_stat_notifier_trans(struct notifier_block *nb,
 	stat = per_cpu(cpufreq_stats_table, freq->cpu);
 	if (!stat)
 		return 0;
+	hdr = stat->hdr;
 
-	old_index = stat->last_index;
-	new_index = freq_table_get_index(stat, freq->new);
+	spin_lock_irqsave(&stat->lock, flags);
+	old_index = hdr->last_index;
+	if (old_index != -1 && stat->freq_table[old_index] == freq->new)
+		new_index = old_index;
+	else
+		new_index = freq_table_get_index(stat, freq->new);
 
 	/* We can't do stat->time_in_state[-1]= .. */
-	if (old_index == -1 || new_index == -1)
-		return 0;
-
-	cpufreq_stats_update(freq->cpu);
-
-	if (old_index == new_index)
+	if (old_index == -1 || new_index == -1) {
+		spin_unlock_irqrestore(&stat->lock, flags);
 		return 0;
+	}
 
-	spin_lock(&cpufreq_stats_lock);
-	stat->last_index = new_index;
-#ifdef CONFIG_CPU_FREQ_STAT_DETAILS
-	stat->trans_table[old_index * stat->max_state + new_index]++;
-#endif
-	stat->total_trans++;
-	spin_unlock(&cpufreq_stats_lock);
+	cur_time = get_jiffies_64();
+	cpufreq_stats_write_begin(hdr);
+	stat->time_in_state[old_index] += cur_time - hdr->last_time;
+	hdr->last_time = cur_time;
+	if (old_index != new_index) {
+		hdr->last_index = new_index;
+		stat->trans_table[old_index * stat->max_state + new_index]++;
+		hdr->total_trans++;
+	}
+	cpufreq_stats_write_end(hdr);
+	spin_unlock_irqrestore(&stat->lock, flags);
 	return 0;
 }
 
@@ -357,7 +526,6 @@ static int __init cpufreq_stats_init(void)
 	int ret;
 	unsigned int cpu;
 
-	spin_lock_init(&cpufreq_stats_lock);
 	ret = cpufreq_register_notifier(&notifier_policy_block,
 				CPUFREQ_POLICY_NOTIFIER);
 	if (ret)
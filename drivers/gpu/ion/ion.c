@@ -33,6 +33,9 @@
 #include <linux/uaccess.h>
 #include <linux/debugfs.h>
 #include <linux/dma-buf.h>
+#include <linux/freezer.h>
+#include <linux/hrtimer.h>
+#include <linux/kthread.h>
 
 #include <mach/iommu_domains.h>
 #include "ion_priv.h"
@@ -237,11 +240,8 @@ static void ion_iommu_delayed_unmap(struct ion_buffer *buffer)
 	mutex_unlock(&buffer->lock);
 }
 
-static void ion_buffer_destroy(struct kref *kref)
+static void _ion_buffer_destroy(struct ion_buffer *buffer)
 {
-	struct ion_buffer *buffer = container_of(kref, struct ion_buffer, ref);
-	struct ion_device *dev = buffer->dev;
-
 	if (WARN_ON(buffer->kmap_cnt > 0))
 		buffer->heap->ops->unmap_kernel(buffer->heap, buffer);
 
@@ -249,10 +249,128 @@ static void ion_buffer_destroy(struct kref *kref)
 
 	ion_iommu_delayed_unmap(buffer);
 	buffer->heap->ops->free(buffer);
+	kfree(buffer);
+}
+
+/* Queues @buffer for the heap's free thread; false if the list is full */
+static bool ion_heap_freelist_add(struct ion_heap *heap,
+				  struct ion_buffer *buffer)
+{
+	spin_lock(&heap->free_lock);
+	if (heap->free_list_size + buffer->size > heap->deferred_free_max) {
+		heap->deferred_overflows++;
+		spin_unlock(&heap->free_lock);
+		return false;
+	}
+	buffer->free_time = ktime_get();
+	list_add_tail(&buffer->free_list, &heap->free_list);
+	heap->free_list_size += buffer->size;
+	heap->deferred_bytes += buffer->size;
+	spin_unlock(&heap->free_lock);
+
+	wake_up(&heap->waitqueue);
+	return true;
+}
+
+static struct ion_buffer *ion_heap_freelist_get(struct ion_heap *heap)
+{
+	struct ion_buffer *buffer = NULL;
+
+	spin_lock(&heap->free_lock);
+	if (!list_empty(&heap->free_list)) {
+		buffer = list_first_entry(&heap->free_list, struct ion_buffer,
+					  free_list);
+		list_del(&buffer->free_list);
+		heap->free_list_size -= buffer->size;
+	}
+	spin_unlock(&heap->free_lock);
+
+	return buffer;
+}
+
+static void ion_heap_freelist_destroy(struct ion_heap *heap,
+				      struct ion_buffer *buffer)
+{
+	ktime_t queued = buffer->free_time;
+	s64 us;
+
+	_ion_buffer_destroy(buffer);
+
+	us = ktime_us_delta(ktime_get(), queued);
+	spin_lock(&heap->free_lock);
+	heap->drained++;
+	heap->drain_us_total += us;
+	heap->drain_us_max = max(heap->drain_us_max, us);
+	spin_unlock(&heap->free_lock);
+}
+
+/* Frees everything on the heap's list in the caller; returns bytes freed */
+static size_t ion_heap_freelist_drain(struct ion_heap *heap)
+{
+	struct ion_buffer *buffer;
+	size_t size = 0;
+
+	while ((buffer = ion_heap_freelist_get(heap))) {
+		size += buffer->size;
+		ion_heap_freelist_destroy(heap, buffer);
+	}
+
+	return size;
+}
+
+static int ion_heap_deferred_free(void *data)
+{
+	struct ion_heap *heap = data;
+	struct ion_buffer *buffer;
+
+	set_freezable();
+	while (!kthread_should_stop()) {
+		wait_event_freezable(heap->waitqueue,
+				     heap->free_list_size ||
+				     kthread_should_stop());
+
+		while ((buffer = ion_heap_freelist_get(heap)))
+			ion_heap_freelist_destroy(heap, buffer);
+	}
+
+	return 0;
+}
+
+static int ion_heap_init_deferred_free(struct ion_heap *heap)
+{
+	struct sched_param param = { .sched_priority = 0 };
+
+	INIT_LIST_HEAD(&heap->free_list);
+	heap->free_list_size = 0;
+	spin_lock_init(&heap->free_lock);
+	init_waitqueue_head(&heap->waitqueue);
+
+	heap->task = kthread_run(ion_heap_deferred_free, heap,
+				 "ion_free_%s", heap->name);
+	if (IS_ERR(heap->task)) {
+		pr_err("%s: creating thread for deferred free failed\n",
+		       __func__);
+		heap->task = NULL;
+		return -ENOMEM;
+	}
+	/* tearing down buffers should never compete with the UI */
+	sched_setscheduler(heap->task, SCHED_IDLE, &param);
+	return 0;
+}
+
+static void ion_buffer_destroy(struct kref *kref)
+{
+	struct ion_buffer *buffer = container_of(kref, struct ion_buffer, ref);
+	struct ion_device *dev = buffer->dev;
+	struct ion_heap *heap = buffer->heap;
+
 	mutex_lock(&dev->lock);
 	rb_erase(&buffer->node, &dev->buffers);
 	mutex_unlock(&dev->lock);
-	kfree(buffer);
+
+	if (heap->task && ion_heap_freelist_add(heap, buffer))
+		return;
+	_ion_buffer_destroy(buffer);
 }
 
 static void ion_buffer_get(struct ion_buffer *buffer)
@@ -402,6 +520,10 @@ struct ion_handle *ion_alloc(struct ion_client *client, size_t len,
 		if (secure_allocation && (heap->type != ION_HEAP_TYPE_CP))
 			continue;
 		buffer = ion_buffer_create(heap, dev, len, align, flags);
+		/* memory may be sitting on the deferred free list */
+		if (IS_ERR(buffer) && heap->task &&
+		    ion_heap_freelist_drain(heap))
+			buffer = ion_buffer_create(heap, dev, len, align, flags);
 		if (!IS_ERR_OR_NULL(buffer))
 			break;
 		if (dbg_str_idx < MAX_DBG_STR_LEN) {
@@ -1589,6 +1711,17 @@ static void ion_debug_mem_map_destroy(struct rb_root *mem_map)
 
 static void ion_heap_print_debug(struct seq_file *s, struct ion_heap *heap)
 {
+	if (heap->task) {
+		spin_lock(&heap->free_lock);
+		seq_printf(s, "deferred free: %zu bytes pending, %llu bytes "
+			   "total, %lu overflows\n", heap->free_list_size,
+			   heap->deferred_bytes, heap->deferred_overflows);
+		seq_printf(s, "deferred free latency: %lld us avg, %lld us "
+			   "max\n", heap->drained ?
+			   div_s64(heap->drain_us_total, heap->drained) : 0,
+			   heap->drain_us_max);
+		spin_unlock(&heap->free_lock);
+	}
 	if (heap->ops->print_debug) {
 		struct rb_root mem_map = RB_ROOT;
 		ion_debug_mem_map_create(s, heap, &mem_map);
@@ -1668,6 +1801,9 @@ void ion_device_add_heap(struct ion_device *dev, struct ion_heap *heap)
 		}
 	}
 
+	if (heap->deferred_free_max)
+		ion_heap_init_deferred_free(heap);
+
 	rb_link_node(&heap->node, parent, p);
 	rb_insert_color(&heap->node, &dev->heaps);
 	debugfs_create_file(heap->name, 0664, dev->debug_root, heap,
@@ -16,6 +16,7 @@
  */
 
 #include <linux/err.h>
+#include <linux/kthread.h>
 #include <linux/ion.h>
 #include "ion_priv.h"
 
@@ -54,6 +55,7 @@ struct ion_heap *ion_heap_create(struct ion_platform_heap *heap_data)
 
 	heap->name = heap_data->name;
 	heap->id = heap_data->id;
+	heap->deferred_free_max = heap_data->deferred_free_max;
 	return heap;
 }
 
@@ -62,6 +64,10 @@ void ion_heap_destroy(struct ion_heap *heap)
 	if (!heap)
 		return;
 
+	/* the free thread empties the deferred free list before exiting */
+	if (heap->task)
+		kthread_stop(heap->task);
+
 	switch (heap->type) {
 	case ION_HEAP_TYPE_SYSTEM_CONTIG:
 		ion_system_contig_heap_destroy(heap);
@@ -0,0 +1,159 @@
+/*
+ * drivers/gpu/ion/ion_page_pool.c
+ *
+ * Copyright (C) 2011 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <linux/highmem.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include "ion_priv.h"
+
+/*
+ * Pages handed back to a pool go on the dirty list and are zeroed by a
+ * worker before they move to the clean list, so allocations never pay
+ * for clearing recycled memory. Only freshly allocated pages are zeroed
+ * inline, by the page allocator.
+ */
+
+static void ion_page_pool_zero(struct ion_page_pool *pool, struct page *page)
+{
+	int i;
+
+	for (i = 0; i < (1 << pool->order); i++)
+		clear_highpage(page + i);
+}
+
+static void ion_page_pool_zero_work(struct work_struct *work)
+{
+	struct ion_page_pool *pool = container_of(work, struct ion_page_pool,
+						  zero_work);
+	struct page *page;
+
+	for (;;) {
+		spin_lock(&pool->lock);
+		if (list_empty(&pool->dirty)) {
+			spin_unlock(&pool->lock);
+			break;
+		}
+		page = list_first_entry(&pool->dirty, struct page, lru);
+		list_del(&page->lru);
+		pool->dirty_count--;
+		spin_unlock(&pool->lock);
+
+		ion_page_pool_zero(pool, page);
+
+		spin_lock(&pool->lock);
+		list_add_tail(&page->lru, &pool->clean);
+		pool->clean_count++;
+		spin_unlock(&pool->lock);
+
+		cond_resched();
+	}
+}
+
+struct page *ion_page_pool_alloc(struct ion_page_pool *pool)
+{
+	struct page *page = NULL;
+
+	spin_lock(&pool->lock);
+	if (pool->clean_count) {
+		page = list_first_entry(&pool->clean, struct page, lru);
+		list_del(&page->lru);
+		pool->clean_count--;
+	}
+	spin_unlock(&pool->lock);
+
+	if (!page)
+		page = alloc_pages(pool->gfp_mask | __GFP_ZERO, pool->order);
+
+	return page;
+}
+
+void ion_page_pool_free(struct ion_page_pool *pool, struct page *page)
+{
+	spin_lock(&pool->lock);
+	list_add_tail(&page->lru, &pool->dirty);
+	pool->dirty_count++;
+	spin_unlock(&pool->lock);
+
+	queue_work(system_unbound_wq, &pool->zero_work);
+}
+
+/* Returns the number of base pages held by @pool */
+int ion_page_pool_total(struct ion_page_pool *pool)
+{
+	return (pool->clean_count + pool->dirty_count) << pool->order;
+}
+
+/*
+ * Gives up to @nr_to_scan base pages back to the page allocator, dirty
+ * ones first since they are not ready for reuse anyway. Returns the
+ * number of base pages left in the pool.
+ */
+int ion_page_pool_shrink(struct ion_page_pool *pool, int nr_to_scan)
+{
+	struct page *page;
+	int freed = 0;
+
+	while (freed < nr_to_scan) {
+		spin_lock(&pool->lock);
+		if (pool->dirty_count) {
+			page = list_first_entry(&pool->dirty, struct page, lru);
+			pool->dirty_count--;
+		} else if (pool->clean_count) {
+			page = list_first_entry(&pool->clean, struct page, lru);
+			pool->clean_count--;
+		} else {
+			spin_unlock(&pool->lock);
+			break;
+		}
+		list_del(&page->lru);
+		spin_unlock(&pool->lock);
+
+		__free_pages(page, pool->order);
+		freed += 1 << pool->order;
+	}
+
+	return ion_page_pool_total(pool);
+}
+
+struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order)
+{
+	struct ion_page_pool *pool = kmalloc(sizeof(struct ion_page_pool),
+					     GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	spin_lock_init(&pool->lock);
+	INIT_LIST_HEAD(&pool->clean);
+	INIT_LIST_HEAD(&pool->dirty);
+	pool->clean_count = 0;
+	pool->dirty_count = 0;
+	pool->gfp_mask = gfp_mask;
+	pool->order = order;
+	INIT_WORK(&pool->zero_work, ion_page_pool_zero_work);
+
+	return pool;
+}
+
+void ion_page_pool_destroy(struct ion_page_pool *pool)
+{
+	cancel_work_sync(&pool->zero_work);
+	ion_page_pool_shrink(pool, INT_MAX);
+	kfree(pool);
+}
@@ -25,6 +25,10 @@
 #include <linux/ion.h>
 #include <linux/iommu.h>
 #include <linux/seq_file.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
+#include <linux/ktime.h>
 
 enum {
 	DI_PARTITION_NUM = 0,
@@ -61,6 +65,8 @@ struct ion_buffer {
 	struct mutex lock;
 	int kmap_cnt;
 	void *vaddr;
+	struct list_head free_list;
+	ktime_t free_time;
 	int dmap_cnt;
 	struct sg_table *sg_table;
 	int umap_cnt;
@@ -101,6 +107,13 @@ struct ion_heap_ops {
 	int (*unsecure_heap)(struct ion_heap *heap, int version, void *data);
 };
 
+/*
+ * Heaps with a non-zero deferred_free_max hand buffers released by their
+ * last user to a per-heap thread instead of tearing them down in the
+ * caller, as long as no more than deferred_free_max bytes are waiting.
+ * The list is drained synchronously when an allocation from the heap
+ * fails.
+ */
 struct ion_heap {
 	struct rb_node node;
 	struct ion_device *dev;
@@ -108,6 +121,17 @@ struct ion_heap {
 	struct ion_heap_ops *ops;
 	int id;
 	const char *name;
+	size_t deferred_free_max;
+	struct list_head free_list;
+	size_t free_list_size;
+	spinlock_t free_lock;
+	wait_queue_head_t waitqueue;
+	struct task_struct *task;
+	u64 deferred_bytes;
+	unsigned long deferred_overflows;
+	unsigned long drained;
+	s64 drain_us_total;
+	s64 drain_us_max;
 };
 
 struct mem_map_data {
@@ -158,6 +182,24 @@ void ion_carveout_free(struct ion_heap *heap, ion_phys_addr_t addr,
 		       unsigned long size);
 
 
+struct ion_page_pool {
+	spinlock_t lock;
+	struct list_head clean;
+	struct list_head dirty;
+	int clean_count;
+	int dirty_count;
+	gfp_t gfp_mask;
+	unsigned int order;
+	struct work_struct zero_work;
+};
+
+struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order);
+void ion_page_pool_destroy(struct ion_page_pool *);
+struct page *ion_page_pool_alloc(struct ion_page_pool *);
+void ion_page_pool_free(struct ion_page_pool *, struct page *);
+int ion_page_pool_total(struct ion_page_pool *);
+int ion_page_pool_shrink(struct ion_page_pool *, int nr_to_scan);
+
 struct ion_heap *msm_get_contiguous_heap(void);
 #define ION_CARVEOUT_ALLOCATE_FAIL -1
 #define ION_CP_ALLOCATE_FAIL -1
@@ -23,6 +23,9 @@
 #include <linux/vmalloc.h>
 #include <linux/iommu.h>
 #include <linux/seq_file.h>
+#include <linux/shrinker.h>
+#include <linux/hrtimer.h>
+#include <linux/log2.h>
 #include <mach/iommu_domains.h>
 #include "ion_priv.h"
 #include <mach/memory.h>
@@ -33,49 +36,153 @@ static atomic_t system_contig_heap_allocated;
 static unsigned int system_heap_has_outer_cache;
 static unsigned int system_heap_contig_has_outer_cache;
 
+/*
+ * Buffers are built from the largest chunks the page allocator can hand
+ * out quickly, taken from a pool per order. High orders never enter
+ * direct reclaim or wake kswapd; on a fragmented system the allocation
+ * simply falls back to the next smaller order.
+ */
+static const unsigned int orders[] = {8, 4, 0};
+#define NUM_ORDERS ARRAY_SIZE(orders)
+
+/* allocation latency histogram buckets: <1us, <2us, ... , >=16ms */
+#define ION_SYSTEM_LAT_BUCKETS	16
+
+struct ion_system_heap {
+	struct ion_heap heap;
+	struct ion_page_pool *pools[NUM_ORDERS];
+	struct shrinker shrinker;
+	atomic_t alloc_lat[ION_SYSTEM_LAT_BUCKETS];
+	atomic_t alloc_fallbacks;
+};
+
+static int order_to_index(unsigned int order)
+{
+	int i;
+
+	for (i = 0; i < NUM_ORDERS; i++)
+		if (order == orders[i])
+			return i;
+	BUG();
+	return -1;
+}
+
+static struct page *alloc_largest_available(struct ion_system_heap *sheap,
+					    unsigned long size,
+					    unsigned int max_order,
+					    unsigned int *order)
+{
+	struct page *page;
+	int i;
+
+	for (i = 0; i < NUM_ORDERS; i++) {
+		if (size < (PAGE_SIZE << orders[i]))
+			continue;
+		if (max_order < orders[i])
+			continue;
+
+		page = ion_page_pool_alloc(sheap->pools[i]);
+		if (!page) {
+			atomic_inc(&sheap->alloc_fallbacks);
+			continue;
+		}
+		*order = orders[i];
+		return page;
+	}
+
+	return NULL;
+}
+
+static void free_buffer_page(struct ion_system_heap *sheap, struct page *page,
+			     unsigned int order)
+{
+	ion_page_pool_free(sheap->pools[order_to_index(order)], page);
+}
+
+static void ion_system_heap_account(struct ion_system_heap *sheap,
+				    ktime_t start)
+{
+	s64 us = ktime_us_delta(ktime_get(), start);
+	int bucket = 0;
+
+	if (us > 0)
+		bucket = min(ilog2(us) + 1, ION_SYSTEM_LAT_BUCKETS - 1);
+	atomic_inc(&sheap->alloc_lat[bucket]);
+}
+
 static int ion_system_heap_allocate(struct ion_heap *heap,
 				     struct ion_buffer *buffer,
 				     unsigned long size, unsigned long align,
 				     unsigned long flags)
 {
+	struct ion_system_heap *sheap = container_of(heap,
+						     struct ion_system_heap,
+						     heap);
 	struct sg_table *table;
 	struct scatterlist *sg;
-	int i, j;
-	int npages = PAGE_ALIGN(size) / PAGE_SIZE;
+	struct list_head pages;
+	struct page *page, *tmp;
+	unsigned long size_remaining = PAGE_ALIGN(size);
+	unsigned int max_order = orders[0];
+	unsigned int order;
+	ktime_t start = ktime_get();
+	int i = 0;
+
+	INIT_LIST_HEAD(&pages);
+	while (size_remaining > 0) {
+		page = alloc_largest_available(sheap, size_remaining,
+					       max_order, &order);
+		if (!page)
+			goto err;
+		set_page_private(page, order);
+		list_add_tail(&page->lru, &pages);
+		size_remaining -= PAGE_SIZE << order;
+		max_order = order;
+		i++;
+	}
 
 	table = kmalloc(sizeof(struct sg_table), GFP_KERNEL);
 	if (!table)
-		return -ENOMEM;
-	i = sg_alloc_table(table, npages, GFP_KERNEL);
-	if (i)
-		goto err0;
-	for_each_sg(table->sgl, sg, table->nents, i) {
-		struct page *page;
-		page = alloc_page(GFP_KERNEL|__GFP_ZERO);
-		if (!page)
-			goto err1;
-		sg_set_page(sg, page, PAGE_SIZE, 0);
+		goto err;
+	if (sg_alloc_table(table, i, GFP_KERNEL))
+		goto err1;
+
+	sg = table->sgl;
+	list_for_each_entry_safe(page, tmp, &pages, lru) {
+		order = page_private(page);
+		set_page_private(page, 0);
+		list_del(&page->lru);
+		sg_set_page(sg, page, PAGE_SIZE << order, 0);
+		sg = sg_next(sg);
 	}
+
 	buffer->priv_virt = table;
 	atomic_add(size, &system_heap_allocated);
+	ion_system_heap_account(sheap, start);
 	return 0;
 err1:
-	for_each_sg(table->sgl, sg, i, j)
-		__free_page(sg_page(sg));
-	sg_free_table(table);
-err0:
 	kfree(table);
+err:
+	list_for_each_entry_safe(page, tmp, &pages, lru) {
+		order = page_private(page);
+		set_page_private(page, 0);
+		list_del(&page->lru);
+		free_buffer_page(sheap, page, order);
+	}
 	return -ENOMEM;
 }
 
 void ion_system_heap_free(struct ion_buffer *buffer)
 {
+	struct ion_system_heap *sheap = container_of(buffer->heap,
+						     struct ion_system_heap,
+						     heap);
 	int i;
 	struct scatterlist *sg;
 	struct sg_table *table = buffer->priv_virt;
 
 	for_each_sg(table->sgl, sg, table->nents, i)
-		__free_page(sg_page(sg));
+		free_buffer_page(sheap, sg_page(sg), get_order(sg->length));
 	if (buffer->sg_table)
 		sg_free_table(buffer->sg_table);
 	kfree(buffer->sg_table);
@@ -102,16 +209,20 @@ void *ion_system_heap_map_kernel(struct ion_heap *heap,
 		return ERR_PTR(-EINVAL);
 	} else {
 		struct scatterlist *sg;
-		int i;
+		int i, j, npages = PAGE_ALIGN(buffer->size) / PAGE_SIZE;
 		void *vaddr;
 		struct sg_table *table = buffer->priv_virt;
 		struct page **pages = kmalloc(
-					sizeof(struct page *) * table->nents,
+					sizeof(struct page *) * npages,
 					GFP_KERNEL);
+		struct page **tmp = pages;
 
+		if (!pages)
+			return ERR_PTR(-ENOMEM);
 		for_each_sg(table->sgl, sg, table->nents, i)
-			pages[i] = sg_page(sg);
-		vaddr = vmap(pages, table->nents, VM_MAP, PAGE_KERNEL);
+			for (j = 0; j < sg->length / PAGE_SIZE; j++)
+				*(tmp++) = nth_page(sg_page(sg), j);
+		vaddr = vmap(pages, npages, VM_MAP, PAGE_KERNEL);
 		kfree(pages);
 
 		return vaddr;
@@ -159,17 +270,30 @@ int ion_system_heap_map_user(struct ion_heap *heap, struct ion_buffer *buffer,
 	} else {
 		struct sg_table *table = buffer->priv_virt;
 		unsigned long addr = vma->vm_start;
-		unsigned long offset = vma->vm_pgoff;
+		unsigned long offset = vma->vm_pgoff * PAGE_SIZE;
 		struct scatterlist *sg;
-		int i;
+		int i, ret;
 
+		/* high order chunks are not compound, so map them by pfn */
 		for_each_sg(table->sgl, sg, table->nents, i) {
-			if (offset) {
-				offset--;
+			unsigned long len = sg->length;
+			unsigned long pfn = page_to_pfn(sg_page(sg));
+
+			if (offset >= len) {
+				offset -= len;
 				continue;
 			}
-			vm_insert_page(vma, addr, sg_page(sg));
-			addr += PAGE_SIZE;
+			pfn += offset >> PAGE_SHIFT;
+			len -= offset;
+			offset = 0;
+			len = min(len, vma->vm_end - addr);
+			ret = remap_pfn_range(vma, addr, pfn, len,
+					      vma->vm_page_prot);
+			if (ret)
+				return ret;
+			addr += len;
+			if (addr >= vma->vm_end)
+				break;
 		}
 		return 0;
 	}
@@ -210,7 +334,7 @@ int ion_system_heap_cache_ops(struct ion_heap *heap, struct ion_buffer *buffer,
 				WARN(1, "Could not translate virtual address to physical address\n");
 				return -EINVAL;
 			}
-			outer_cache_op(pstart, pstart + PAGE_SIZE);
+			outer_cache_op(pstart, pstart + sg->length);
 		}
 	}
 	return 0;
@@ -219,9 +343,36 @@ int ion_system_heap_cache_ops(struct ion_heap *heap, struct ion_buffer *buffer,
 static int ion_system_print_debug(struct ion_heap *heap, struct seq_file *s,
 				  const struct rb_root *unused)
 {
+	struct ion_system_heap *sheap = container_of(heap,
+						     struct ion_system_heap,
+						     heap);
+	int i;
+
 	seq_printf(s, "total bytes currently allocated: %lx\n",
 			(unsigned long) atomic_read(&system_heap_allocated));
 
+	for (i = 0; i < NUM_ORDERS; i++) {
+		struct ion_page_pool *pool = sheap->pools[i];
+
+		seq_printf(s, "order %u pool: %d zeroed, %d to zero (%lu kB)\n",
+			   pool->order, pool->clean_count, pool->dirty_count,
+			   (unsigned long)ion_page_pool_total(pool) *
+			   (PAGE_SIZE / 1024));
+	}
+	seq_printf(s, "high order fallbacks: %d\n",
+		   atomic_read(&sheap->alloc_fallbacks));
+
+	seq_printf(s, "allocation latency:\n");
+	for (i = 0; i < ION_SYSTEM_LAT_BUCKETS; i++) {
+		if (i == 0)
+			seq_printf(s, "  %8s", "<1us");
+		else if (i == ION_SYSTEM_LAT_BUCKETS - 1)
+			seq_printf(s, "  >=%6luus", 1UL << (i - 1));
+		else
+			seq_printf(s, "  <%7luus", 1UL << i);
+		seq_printf(s, " %d\n", atomic_read(&sheap->alloc_lat[i]));
+	}
+
 	return 0;
 }
 
@@ -305,22 +456,82 @@ static struct ion_heap_ops vmalloc_ops = {
 	.unmap_iommu = ion_system_heap_unmap_iommu,
 };
 
+static int ion_system_heap_shrink(struct shrinker *shrinker,
+				  struct shrink_control *sc)
+{
+	struct ion_system_heap *sheap = container_of(shrinker,
+						     struct ion_system_heap,
+						     shrinker);
+	int nr_total = 0;
+	int nr_freed = 0;
+	int i;
+
+	if (sc->nr_to_scan == 0)
+		goto end;
+
+	/* give back the largest chunks first, they are the hardest to get */
+	for (i = 0; i < NUM_ORDERS; i++) {
+		struct ion_page_pool *pool = sheap->pools[i];
+		int before = ion_page_pool_total(pool);
+
+		nr_freed += before - ion_page_pool_shrink(pool,
+						sc->nr_to_scan - nr_freed);
+		if (nr_freed >= sc->nr_to_scan)
+			break;
+	}
+
+end:
+	for (i = 0; i < NUM_ORDERS; i++)
+		nr_total += ion_page_pool_total(sheap->pools[i]);
+	return nr_total;
+}
+
 struct ion_heap *ion_system_heap_create(struct ion_platform_heap *pheap)
 {
-	struct ion_heap *heap;
+	struct ion_system_heap *sheap;
+	int i;
 
-	heap = kzalloc(sizeof(struct ion_heap), GFP_KERNEL);
-	if (!heap)
+	sheap = kzalloc(sizeof(struct ion_system_heap), GFP_KERNEL);
+	if (!sheap)
 		return ERR_PTR(-ENOMEM);
-	heap->ops = &vmalloc_ops;
-	heap->type = ION_HEAP_TYPE_SYSTEM;
+	sheap->heap.ops = &vmalloc_ops;
+	sheap->heap.type = ION_HEAP_TYPE_SYSTEM;
 	system_heap_has_outer_cache = pheap->has_outer_cache;
-	return heap;
+
+	for (i = 0; i < NUM_ORDERS; i++) {
+		gfp_t gfp_flags = GFP_KERNEL;
+
+		if (orders[i])
+			gfp_flags = (GFP_KERNEL | __GFP_NOWARN |
+				     __GFP_NORETRY | __GFP_NO_KSWAPD) &
+				    ~__GFP_WAIT;
+		sheap->pools[i] = ion_page_pool_create(gfp_flags, orders[i]);
+		if (!sheap->pools[i])
+			goto err;
+	}
+
+	sheap->shrinker.shrink = ion_system_heap_shrink;
+	sheap->shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&sheap->shrinker);
+	return &sheap->heap;
+err:
+	while (--i >= 0)
+		ion_page_pool_destroy(sheap->pools[i]);
+	kfree(sheap);
+	return ERR_PTR(-ENOMEM);
 }
 
 void ion_system_heap_destroy(struct ion_heap *heap)
 {
-	kfree(heap);
+	struct ion_system_heap *sheap = container_of(heap,
+						     struct ion_system_heap,
+						     heap);
+	int i;
+
+	unregister_shrinker(&sheap->shrinker);
+	for (i = 0; i < NUM_ORDERS; i++)
+		ion_page_pool_destroy(sheap->pools[i]);
+	kfree(sheap);
 }
 
 static int ion_system_contig_heap_allocate(struct ion_heap *heap,
@@ -0,0 +1,125 @@
+/*
+ * drivers/gpu/ion/ion_system_heap_test.c
+ *
+ * Allocation loop for the ion system heap. On load, allocates and frees
+ * buffer queues of the sizes graphics, video and camera use, and logs
+ * the average and worst allocation and free times for each size. Run it
+ * twice in a row to see the effect of warm page pools.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <linux/err.h>
+#include <linux/hrtimer.h>
+#include <linux/ion.h>
+#include <linux/kernel.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <asm/sizes.h>
+
+#define MODULE_NAME "ion_system_heap_test"
+
+static int iterations = 50;
+module_param(iterations, int, S_IRUGO);
+MODULE_PARM_DESC(iterations, "number of allocate/free rounds per size");
+
+static int queue_depth = 4;
+module_param(queue_depth, int, S_IRUGO);
+MODULE_PARM_DESC(queue_depth, "buffers held at once, like a buffer queue");
+
+static const struct {
+	const char *name;
+	size_t size;
+} test_sizes[] = {
+	{ "4k", SZ_4K },
+	{ "64k", SZ_64K },
+	{ "720p rgba", 1280 * 720 * 4 },
+	{ "1080p nv12", 1920 * 1088 * 3 / 2 },
+	{ "1080p rgba", 1920 * 1080 * 4 },
+	{ "12mp nv12", 4096 * 3072 * 3 / 2 },
+};
+
+static int run_size(struct ion_client *client, const char *name, size_t size)
+{
+	struct ion_handle **handles;
+	s64 alloc_us = 0, free_us = 0, max_alloc_us = 0, us;
+	ktime_t start;
+	int i, j, ret = 0;
+
+	handles = kcalloc(queue_depth, sizeof(*handles), GFP_KERNEL);
+	if (!handles)
+		return -ENOMEM;
+
+	for (i = 0; i < iterations && !ret; i++) {
+		for (j = 0; j < queue_depth; j++) {
+			start = ktime_get();
+			handles[j] = ion_alloc(client, size, SZ_4K,
+					       ION_HEAP(ION_SYSTEM_HEAP_ID) |
+					       ION_SET_CACHE(CACHED));
+			us = ktime_us_delta(ktime_get(), start);
+			if (IS_ERR_OR_NULL(handles[j])) {
+				pr_err("%s: %s: allocation failed\n",
+				       MODULE_NAME, name);
+				ret = -ENOMEM;
+				break;
+			}
+			alloc_us += us;
+			max_alloc_us = max(max_alloc_us, us);
+		}
+
+		start = ktime_get();
+		while (--j >= 0)
+			ion_free(client, handles[j]);
+		free_us += ktime_us_delta(ktime_get(), start);
+	}
+
+	if (!ret)
+		pr_info("%s: %-12s %9zu bytes: alloc avg %lld us max %lld us, "
+			"free avg %lld us\n", MODULE_NAME, name, size,
+			div_s64(alloc_us, iterations * queue_depth),
+			max_alloc_us,
+			div_s64(free_us, iterations * queue_depth));
+
+	kfree(handles);
+	return ret;
+}
+
+static int __init ion_system_heap_test_init(void)
+{
+	struct ion_client *client;
+	int i, ret = 0;
+
+	if (iterations < 1 || queue_depth < 1)
+		return -EINVAL;
+
+	client = msm_ion_client_create(ION_HEAP_SYSTEM_MASK, MODULE_NAME);
+	if (IS_ERR_OR_NULL(client)) {
+		pr_err("%s: cannot create ion client\n", MODULE_NAME);
+		return -ENODEV;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(test_sizes) && !ret; i++)
+		ret = run_size(client, test_sizes[i].name, test_sizes[i].size);
+
+	ion_client_destroy(client);
+	return ret;
+}
+
+static void __exit ion_system_heap_test_exit(void)
+{
+}
+
+module_init(ion_system_heap_test_init);
+module_exit(ion_system_heap_test_exit);
+
+MODULE_LICENSE("GPL v2");
+MODULE_DESCRIPTION("ion system heap allocation test");
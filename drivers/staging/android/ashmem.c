@@ -27,6 +27,9 @@
 #include <linux/personality.h>
 #include <linux/bitops.h>
 #include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include <linux/shmem_fs.h>
 #include <linux/ashmem.h>
 #include <asm/cacheflush.h>
@@ -37,6 +40,7 @@
 
 struct ashmem_area {
 	char name[ASHMEM_FULL_NAME_LEN]; 
+	struct mutex mutex;		 /* protects everything below */
 	struct list_head unpinned_list;	 
 	struct file *file;		 
 	size_t size;			 
@@ -53,11 +57,24 @@ struct ashmem_range {
 	unsigned int purged;		
 };
 
+/*
+ * The LRU of unpinned ranges has a lock of its own so that the shrinker
+ * does not serialize against every ashmem operation. Lock order is
+ * asma->mutex -> ashmem_lru_lock; the shrinker, which walks the LRU
+ * first, only ever trylocks an area.
+ */
 static LIST_HEAD(ashmem_lru_list);
 
 static unsigned long lru_count;
 
-static DEFINE_MUTEX(ashmem_mutex);
+static DEFINE_SPINLOCK(ashmem_lru_lock);
+
+/* give up a shrink pass after this many busy areas in a row */
+#define ASHMEM_SHRINK_MAX_BUSY	16
+
+static unsigned long ashmem_purged_pages;
+static unsigned long ashmem_shrink_nofs_skips;
+static unsigned long ashmem_shrink_busy_skips;
 
 static struct kmem_cache *ashmem_area_cachep __read_mostly;
 static struct kmem_cache *ashmem_range_cachep __read_mostly;
@@ -88,14 +105,18 @@ static struct kmem_cache *ashmem_range_cachep __read_mostly;
 
 static inline void lru_add(struct ashmem_range *range)
 {
+	spin_lock(&ashmem_lru_lock);
 	list_add_tail(&range->lru, &ashmem_lru_list);
 	lru_count += range_size(range);
+	spin_unlock(&ashmem_lru_lock);
 }
 
 static inline void lru_del(struct ashmem_range *range)
 {
+	spin_lock(&ashmem_lru_lock);
 	list_del(&range->lru);
 	lru_count -= range_size(range);
+	spin_unlock(&ashmem_lru_lock);
 }
 
 static int range_alloc(struct ashmem_area *asma,
@@ -138,11 +159,16 @@ static inline void range_shrink(struct ashmem_range *range,
 {
 	size_t pre = range_size(range);
 
-	range->pgstart = start;
-	range->pgend = end;
-
-	if (range_on_lru(range))
+	if (range_on_lru(range)) {
+		spin_lock(&ashmem_lru_lock);
+		range->pgstart = start;
+		range->pgend = end;
 		lru_count -= pre - range_size(range);
+		spin_unlock(&ashmem_lru_lock);
+	} else {
+		range->pgstart = start;
+		range->pgend = end;
+	}
 }
 
 static int ashmem_open(struct inode *inode, struct file *file)
@@ -162,6 +188,7 @@ static int ashmem_open(struct inode *inode, struct file *file)
 		return -ENOMEM;
 	}
 
+	mutex_init(&asma->mutex);
 	INIT_LIST_HEAD(&asma->unpinned_list);
 	memcpy(asma->name, ASHMEM_NAME_PREFIX, ASHMEM_NAME_PREFIX_LEN);
 	asma->prot_mask = PROT_MASK;
@@ -175,10 +202,10 @@ static int ashmem_release(struct inode *ignored, struct file *file)
 	struct ashmem_area *asma = file->private_data;
 	struct ashmem_range *range, *next;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned)
 		range_del(range);
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	if (asma->file)
 		fput(asma->file);
@@ -193,7 +220,7 @@ static ssize_t ashmem_read(struct file *file, char __user *buf,
 	struct ashmem_area *asma = file->private_data;
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	
 	if (asma->size == 0)
@@ -212,7 +239,7 @@ static ssize_t ashmem_read(struct file *file, char __user *buf,
 	asma->file->f_pos = *pos;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -221,7 +248,7 @@ static loff_t ashmem_llseek(struct file *file, loff_t offset, int origin)
 	struct ashmem_area *asma = file->private_data;
 	int ret;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	if (asma->size == 0) {
 		ret = -EINVAL;
@@ -241,7 +268,7 @@ static loff_t ashmem_llseek(struct file *file, loff_t offset, int origin)
 	file->f_pos = asma->file->f_pos;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -257,7 +284,7 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	struct ashmem_area *asma = file->private_data;
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	
 	if (unlikely(!asma->size)) {
@@ -301,38 +328,99 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	asma->vm_start = vma->vm_start;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
+/*
+ * Purges unpinned ranges of @asma until at least @nr_pages are gone.
+ * Ranges that are adjacent in the area are truncated with one call.
+ * Called with asma->mutex held; returns the number of pages purged.
+ */
+static unsigned long ashmem_purge_area(struct ashmem_area *asma,
+				       unsigned long nr_pages)
+{
+	struct inode *inode = asma->file->f_dentry->d_inode;
+	struct ashmem_range *range;
+	unsigned long purged = 0;
+	size_t start = 0, end = 0;
+	bool pending = false;
+
+	/* the unpinned list is sorted by descending page offset */
+	list_for_each_entry(range, &asma->unpinned_list, unpinned) {
+		if (!range_on_lru(range))
+			continue;
+
+		if (pending && range->pgend + 1 != start) {
+			vmtruncate_range(inode, start * PAGE_SIZE,
+					 (end + 1) * PAGE_SIZE - 1);
+			pending = false;
+			if (purged >= nr_pages)
+				break;
+		}
+		if (!pending)
+			end = range->pgend;
+		start = range->pgstart;
+		pending = true;
+
+		range->purged = ASHMEM_WAS_PURGED;
+		lru_del(range);
+		purged += range_size(range);
+	}
+	if (pending)
+		vmtruncate_range(inode, start * PAGE_SIZE,
+				 (end + 1) * PAGE_SIZE - 1);
+
+	spin_lock(&ashmem_lru_lock);
+	ashmem_purged_pages += purged;
+	spin_unlock(&ashmem_lru_lock);
+
+	return purged;
+}
+
 static int ashmem_shrink(struct shrinker *s, struct shrink_control *sc)
 {
-	struct ashmem_range *range, *next;
+	struct ashmem_range *range;
+	struct ashmem_area *asma;
+	unsigned long purged;
+	int busy = 0;
 
 	
-	if (sc->nr_to_scan && !(sc->gfp_mask & __GFP_FS))
+	if (sc->nr_to_scan && !(sc->gfp_mask & __GFP_FS)) {
+		ashmem_shrink_nofs_skips++;
 		return -1;
+	}
 	if (!sc->nr_to_scan)
 		return lru_count;
 
-	
-	if (!mutex_trylock(&ashmem_mutex)) {
-                return -1;
-	}
-	list_for_each_entry_safe(range, next, &ashmem_lru_list, lru) {
-		struct inode *inode = range->asma->file->f_dentry->d_inode;
-		loff_t start = range->pgstart * PAGE_SIZE;
-		loff_t end = (range->pgend + 1) * PAGE_SIZE - 1;
+	spin_lock(&ashmem_lru_lock);
+	while (sc->nr_to_scan > 0 && !list_empty(&ashmem_lru_list)) {
+		range = list_first_entry(&ashmem_lru_list,
+					 struct ashmem_range, lru);
+		asma = range->asma;
+
+		/*
+		 * Pinning may allocate with the area locked and end up here,
+		 * so never wait for an area; move on to the next one.
+		 */
+		if (!mutex_trylock(&asma->mutex)) {
+			list_move_tail(&range->lru, &ashmem_lru_list);
+			ashmem_shrink_busy_skips++;
+			if (++busy >= ASHMEM_SHRINK_MAX_BUSY)
+				break;
+			continue;
+		}
+		busy = 0;
+		spin_unlock(&ashmem_lru_lock);
 
-		vmtruncate_range(inode, start, end);
-		range->purged = ASHMEM_WAS_PURGED;
-		lru_del(range);
+		purged = ashmem_purge_area(asma, sc->nr_to_scan);
+		mutex_unlock(&asma->mutex);
 
-		sc->nr_to_scan -= range_size(range);
-		if (sc->nr_to_scan <= 0)
-			break;
+		sc->nr_to_scan -= min_t(unsigned long, purged,
+					sc->nr_to_scan);
+		spin_lock(&ashmem_lru_lock);
 	}
-	mutex_unlock(&ashmem_mutex);
+	spin_unlock(&ashmem_lru_lock);
 
 	return lru_count;
 }
@@ -346,7 +434,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	
 	if (unlikely((asma->prot_mask & prot) != prot)) {
@@ -361,7 +449,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 	asma->prot_mask = prot;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -369,7 +457,7 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	
 	if (unlikely(asma->file)) {
@@ -383,7 +471,7 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 	asma->name[ASHMEM_FULL_NAME_LEN-1] = '\0';
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
@@ -392,7 +480,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 	if (asma->name[ASHMEM_NAME_PREFIX_LEN] != '\0') {
 		size_t len;
 
@@ -405,7 +493,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 					  sizeof(ASHMEM_NAME_DEF))))
 			ret = -EFAULT;
 	}
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
@@ -523,7 +611,7 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 	pgstart = pin.offset / PAGE_SIZE;
 	pgend = pgstart + (pin.len / PAGE_SIZE) - 1;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	switch (cmd) {
 	case ASHMEM_PIN:
@@ -537,7 +625,7 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 		break;
 	}
 
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
@@ -648,10 +736,12 @@ static long ashmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		break;
 	case ASHMEM_SET_SIZE:
 		ret = -EINVAL;
+		mutex_lock(&asma->mutex);
 		if (!asma->file) {
 			ret = 0;
 			asma->size = (size_t) arg;
 		}
+		mutex_unlock(&asma->mutex);
 		break;
 	case ASHMEM_GET_SIZE:
 		ret = asma->size;
@@ -746,6 +836,30 @@ void put_ashmem_file(struct file *file)
 }
 EXPORT_SYMBOL(put_ashmem_file);
 
+static int ashmem_stats_show(struct seq_file *m, void *unused)
+{
+	seq_printf(m, "lru_pages: %lu\n", lru_count);
+	seq_printf(m, "purged_pages: %lu\n", ashmem_purged_pages);
+	seq_printf(m, "shrink_nofs_skips: %lu\n", ashmem_shrink_nofs_skips);
+	seq_printf(m, "shrink_busy_skips: %lu\n", ashmem_shrink_busy_skips);
+	return 0;
+}
+
+static int ashmem_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ashmem_stats_show, inode->i_private);
+}
+
+static const struct file_operations ashmem_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = ashmem_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static struct dentry *ashmem_debugfs_stats;
+
 static const struct file_operations ashmem_fops = {
 	.owner = THIS_MODULE,
 	.open = ashmem_open,
@@ -791,6 +905,10 @@ static int __init ashmem_init(void)
 
 	register_shrinker(&ashmem_shrinker);
 
+	ashmem_debugfs_stats = debugfs_create_file("ashmem_stats", S_IRUGO,
+						   NULL, NULL,
+						   &ashmem_stats_fops);
+
 	printk(KERN_INFO "ashmem: initialized\n");
 
 	return 0;
@@ -800,6 +918,7 @@ static void __exit ashmem_exit(void)
 {
 	int ret;
 
+	debugfs_remove(ashmem_debugfs_stats);
 	unregister_shrinker(&ashmem_shrinker);
 
 	ret = misc_deregister(&ashmem_misc);
@@ -37,6 +37,14 @@ enum {
 enum {
 	FLAT_BINDER_FLAG_PRIORITY_MASK = 0xff,
 	FLAT_BINDER_FLAG_ACCEPTS_FDS = 0x100,
+	/*
+	 * Scheduling policy that FLAT_BINDER_FLAG_PRIORITY_MASK applies to:
+	 * SCHED_NORMAL (0), SCHED_FIFO (1), SCHED_RR (2) or SCHED_BATCH (3).
+	 * For SCHED_FIFO and SCHED_RR the priority is an rt_priority,
+	 * otherwise a nice value.
+	 */
+	FLAT_BINDER_FLAG_SCHED_POLICY_MASK = 3U << 9,
+	FLAT_BINDER_FLAG_SCHED_POLICY_SHIFT = 9,
 };
 
 struct flat_binder_object {
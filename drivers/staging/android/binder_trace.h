@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2012 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM binder
+
+#if !defined(_BINDER_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _BINDER_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * A binder thread changed its own scheduling policy and priority. prio
+ * is a nice value for normal policies and an rt_priority for
+ * SCHED_FIFO and SCHED_RR.
+ */
+TRACE_EVENT(binder_set_priority,
+	TP_PROTO(int proc, int thread, unsigned int old_policy, int old_prio,
+		 unsigned int new_policy, int new_prio),
+	TP_ARGS(proc, thread, old_policy, old_prio, new_policy, new_prio),
+
+	TP_STRUCT__entry(
+		__field(int, proc)
+		__field(int, thread)
+		__field(unsigned int, old_policy)
+		__field(int, old_prio)
+		__field(unsigned int, new_policy)
+		__field(int, new_prio)
+	),
+	TP_fast_assign(
+		__entry->proc = proc;
+		__entry->thread = thread;
+		__entry->old_policy = old_policy;
+		__entry->old_prio = old_prio;
+		__entry->new_policy = new_policy;
+		__entry->new_prio = new_prio;
+	),
+	TP_printk("proc=%d thread=%d old=%u:%d => new=%u:%d",
+		  __entry->proc, __entry->thread,
+		  __entry->old_policy, __entry->old_prio,
+		  __entry->new_policy, __entry->new_prio)
+);
+
+#endif /* _BINDER_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE binder_trace
+#include <trace/define_trace.h>
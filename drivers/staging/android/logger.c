@@ -25,29 +25,74 @@
 #include <linux/poll.h>
 #include <linux/slab.h>
 #include <linux/time.h>
+#include <linux/percpu.h>
+#include <linux/mm.h>
+#include <linux/compat.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
 
+/*
+ * Records are laid out back to back in the ring at monotonically
+ * increasing positions; a position is only turned into a buffer offset
+ * when the ring is accessed, so readers can tell how far behind the
+ * writers they are by plain subtraction.
+ *
+ * Writers reserve space with a cmpxchg on w_reserve, copy their record
+ * in and then add its length to a per-chunk counter of written bytes.
+ * The counters live outside of the ring, so a torn or stale record can
+ * never be mistaken for a committed one. The completely written prefix
+ * of the ring, w_written, is advanced by whichever writer finds every
+ * byte reserved in the current chunk written, so no writer ever waits
+ * for another one to finish copying. w_written may stop in the middle
+ * of a record at a chunk boundary; what readers see is w_commit, the
+ * last record boundary at or below it. Readers only look at records
+ * below w_commit and notice that a record was overwritten under them
+ * from the position stored in its header, instead of being fixed up by
+ * every writer.
+ */
+#define LOGGER_CHUNKS	LOGGER_MMAP_CHUNKS
+
+/*
+ * Lives in a page of its own that readers may map in front of the ring,
+ * so its layout has to match struct logger_mmap_header.
+ */
+struct logger_shared {
+	__u32			version;
+	__u32			hdr_size;
+	__u32			size;
+	__u32			rec_hdr_size;
+	atomic_long_t		w_reserve;
+	atomic_long_t		w_commit;
+	unsigned long		flush_pos;
+	atomic_long_t		chunk_first[LOGGER_CHUNKS];
+};
+
 struct logger_log {
 	unsigned char		*buffer;
-	struct miscdevice	misc;	
-	wait_queue_head_t	wq;	
-	struct list_head	readers; 
-	struct mutex		mutex;	
-	size_t			w_off;	
-	size_t			head;	
-	size_t			size;	
+	struct miscdevice	misc;
+	wait_queue_head_t	wq;
+	struct logger_shared	*shared;
+	size_t			size;
+	atomic_long_t		w_written;
+	/* start of the chunk in the current lap plus bytes written to it */
+	atomic_long_t		chunk_done[LOGGER_CHUNKS];
+	/* last record boundary at or below the end of each chunk */
+	atomic_long_t		chunk_last[LOGGER_CHUNKS];
 };
 
 struct logger_reader {
-	struct logger_log	*log;	
-	struct list_head	list;	
-	size_t			r_off;	
-	bool			r_all;	
-	int			r_ver;	
+	struct logger_log	*log;
+	struct mutex		mutex;
+	unsigned long		r_pos;
+	bool			r_all;
+	bool			r_batch;
+	int			r_ver;
+	struct logger_rec	*rec;
 };
 
+static DEFINE_PER_CPU(char [LOGGER_ENTRY_MAX_PAYLOAD], logger_bounce);
+
 size_t logger_offset(struct logger_log *log, size_t n)
 {
 	return n & (log->size-1);
@@ -63,27 +108,141 @@ static inline struct logger_log *file_get_log(struct file *file)
 		return file->private_data;
 }
 
-static struct logger_entry *get_entry_header(struct logger_log *log,
-		size_t off, struct logger_entry *scratch)
+static void copy_from_log(struct logger_log *log, unsigned long pos,
+			  void *dst, size_t count)
+{
+	size_t off = logger_offset(log, pos);
+	size_t len = min(count, log->size - off);
+
+	memcpy(dst, log->buffer + off, len);
+	if (count != len)
+		memcpy(dst + len, log->buffer, count - len);
+}
+
+static void copy_to_log(struct logger_log *log, unsigned long pos,
+			const void *src, size_t count)
+{
+	size_t off = logger_offset(log, pos);
+	size_t len = min(count, log->size - off);
+
+	memcpy(log->buffer + off, src, len);
+	if (count != len)
+		memcpy(log->buffer, src + len, count - len);
+}
+
+static inline size_t rec_len(struct logger_entry *entry)
+{
+	return sizeof(struct logger_rec) + entry->len;
+}
+
+static inline atomic_long_t *chunk_done(struct logger_log *log,
+					unsigned long pos)
+{
+	return &log->chunk_done[(pos / (log->size / LOGGER_CHUNKS)) %
+				LOGGER_CHUNKS];
+}
+
+static inline atomic_long_t *chunk_last(struct logger_log *log,
+					unsigned long pos)
+{
+	return &log->chunk_last[(pos / (log->size / LOGGER_CHUNKS)) %
+				LOGGER_CHUNKS];
+}
+
+/* true if no committed record starts at or after @pos */
+static inline bool is_drained(struct logger_log *log, unsigned long pos)
+{
+	return (long)(atomic_long_read(&log->shared->w_commit) - pos) <= 0;
+}
+
+/* true if the record at @pos may have been overwritten by a writer */
+static inline bool is_overrun(struct logger_log *log, unsigned long pos)
 {
-	size_t len = min(sizeof(struct logger_entry), log->size - off);
-	if (len != sizeof(struct logger_entry)) {
-		memcpy(((void *) scratch), log->buffer + off, len);
-		memcpy(((void *) scratch) + len, log->buffer,
-			sizeof(struct logger_entry) - len);
-		return scratch;
+	return atomic_long_read(&log->shared->w_reserve) - pos > log->size;
+}
+
+/*
+ * Returns the position of the oldest record that is not about to be
+ * overwritten. Writers remember where the first record of every chunk
+ * of the ring starts, so this never has to walk the records themselves.
+ */
+static unsigned long get_oldest(struct logger_log *log)
+{
+	unsigned long res = atomic_long_read(&log->shared->w_reserve);
+	unsigned long commit = atomic_long_read(&log->shared->w_commit);
+	unsigned long chunk = log->size / LOGGER_CHUNKS;
+	unsigned long b, first;
+	int i;
+
+	if (res <= log->size)
+		return 0;
+
+	/* skip the chunk that writers are overwriting right now */
+	b = ((res - log->size) / chunk + 1) * chunk;
+	for (i = 1; i < LOGGER_CHUNKS; i++, b += chunk) {
+		first = atomic_long_read(&log->shared->chunk_first[(b / chunk) %
+							   LOGGER_CHUNKS]);
+		if (first - b >= chunk)
+			continue;
+		if ((long)(first - commit) > 0)
+			break;
+		return first;
 	}
 
-	return (struct logger_entry *) (log->buffer + off);
+	return commit;
 }
 
-static __u32 get_entry_msg_len(struct logger_log *log, size_t off)
+static void reader_resync(struct logger_reader *reader)
 {
-	struct logger_entry scratch;
-	struct logger_entry *entry;
+	struct logger_log *log = reader->log;
+	unsigned long flush_pos = ACCESS_ONCE(log->shared->flush_pos);
 
-	entry = get_entry_header(log, off, &scratch);
-	return entry->len;
+	if (is_overrun(log, reader->r_pos))
+		reader->r_pos = get_oldest(log);
+	if ((long)(flush_pos - reader->r_pos) > 0)
+		reader->r_pos = flush_pos;
+}
+
+/*
+ * Copies the record at the reader's position into its bounce buffer,
+ * skipping records that are not meant for it. Returns false if there is
+ * nothing left to read.
+ */
+static bool fetch_entry(struct logger_reader *reader)
+{
+	struct logger_log *log = reader->log;
+	struct logger_rec *rec = reader->rec;
+
+	for (;;) {
+		reader_resync(reader);
+		if (is_drained(log, reader->r_pos))
+			return false;
+		smp_rmb();
+
+		copy_from_log(log, reader->r_pos, rec, sizeof(*rec));
+		if (rec->pos != reader->r_pos ||
+		    rec->entry.len > LOGGER_ENTRY_MAX_PAYLOAD) {
+			/* w_commit is always a record boundary */
+			if (!is_overrun(log, reader->r_pos))
+				reader->r_pos = atomic_long_read(&log->shared->w_commit);
+			continue;
+		}
+		/* only a record being overwritten can look like this */
+		if (is_drained(log, reader->r_pos + rec_len(&rec->entry) - 1)) {
+			if (is_overrun(log, reader->r_pos))
+				continue;
+			return false;
+		}
+		copy_from_log(log, reader->r_pos + sizeof(*rec),
+			      rec->entry.msg, rec->entry.len);
+		smp_rmb();
+		if (is_overrun(log, reader->r_pos))
+			continue;
+
+		if (reader->r_all || rec->entry.euid == current_euid())
+			return true;
+		reader->r_pos += rec_len(&rec->entry);
+	}
 }
 
 static size_t get_user_hdr_len(int ver)
@@ -118,57 +277,20 @@ static ssize_t copy_header_to_user(int ver, struct logger_entry *entry,
 	return copy_to_user(buf, hdr, hdr_len);
 }
 
-static ssize_t do_read_log_to_user(struct logger_log *log,
-				   struct logger_reader *reader,
-				   char __user *buf,
-				   size_t count)
+static ssize_t do_read_log_to_user(struct logger_reader *reader,
+				   char __user *buf)
 {
-	struct logger_entry scratch;
-	struct logger_entry *entry;
-	size_t len;
-	size_t msg_start;
+	struct logger_entry *entry = &reader->rec->entry;
+	size_t hdr_len = get_user_hdr_len(reader->r_ver);
 
-	entry = get_entry_header(log, reader->r_off, &scratch);
 	if (copy_header_to_user(reader->r_ver, entry, buf))
 		return -EFAULT;
-
-	count -= get_user_hdr_len(reader->r_ver);
-	buf += get_user_hdr_len(reader->r_ver);
-	msg_start = logger_offset(log,
-		reader->r_off + sizeof(struct logger_entry));
-
-	len = min(count, log->size - msg_start);
-	if (copy_to_user(buf, log->buffer + msg_start, len))
+	if (copy_to_user(buf + hdr_len, entry->msg, entry->len))
 		return -EFAULT;
 
-	if (count != len)
-		if (copy_to_user(buf + len, log->buffer, count - len))
-			return -EFAULT;
-
-	reader->r_off = logger_offset(log, reader->r_off +
-		sizeof(struct logger_entry) + count);
+	reader->r_pos += rec_len(entry);
 
-	return count + get_user_hdr_len(reader->r_ver);
-}
-
-static size_t get_next_entry_by_uid(struct logger_log *log,
-		size_t off, uid_t euid)
-{
-	while (off != log->w_off) {
-		struct logger_entry *entry;
-		struct logger_entry scratch;
-		size_t next_len;
-
-		entry = get_entry_header(log, off, &scratch);
-
-		if (entry->euid == euid)
-			return off;
-
-		next_len = sizeof(struct logger_entry) + entry->len;
-		off = logger_offset(log, off + next_len);
-	}
-
-	return off;
+	return hdr_len + entry->len;
 }
 
 static ssize_t logger_read(struct file *file, char __user *buf,
@@ -179,146 +301,187 @@ static ssize_t logger_read(struct file *file, char __user *buf,
 	ssize_t ret;
 	DEFINE_WAIT(wait);
 
-start:
 	while (1) {
-		mutex_lock(&log->mutex);
+		mutex_lock(&reader->mutex);
 
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
-		if (!ret)
+		if (fetch_entry(reader))
 			break;
+		mutex_unlock(&reader->mutex);
 
 		if (file->f_flags & O_NONBLOCK) {
-			ret = -EAGAIN;
-			break;
+			finish_wait(&log->wq, &wait);
+			return -EAGAIN;
 		}
 
 		if (signal_pending(current)) {
-			ret = -EINTR;
-			break;
+			finish_wait(&log->wq, &wait);
+			return -EINTR;
 		}
 
 		schedule();
 	}
 
 	finish_wait(&log->wq, &wait);
-	if (ret)
-		return ret;
-
-	mutex_lock(&log->mutex);
 
-	if (!reader->r_all)
-		reader->r_off = get_next_entry_by_uid(log,
-			reader->r_off, current_euid());
-
-	
-	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
-		goto start;
-	}
-
-	
-	ret = get_user_hdr_len(reader->r_ver) +
-		get_entry_msg_len(log, reader->r_off);
+	ret = get_user_hdr_len(reader->r_ver) + reader->rec->entry.len;
 	if (count < ret) {
 		ret = -EINVAL;
 		goto out;
 	}
 
-	
-	ret = do_read_log_to_user(log, reader, buf, ret);
+	ret = do_read_log_to_user(reader, buf);
+	if (!reader->r_batch || ret < 0)
+		goto out;
+
+	/* batched readers get as many whole entries as fit */
+	while (fetch_entry(reader)) {
+		ssize_t nr = get_user_hdr_len(reader->r_ver) +
+			reader->rec->entry.len;
+
+		if (count - ret < nr)
+			break;
+		nr = do_read_log_to_user(reader, buf + ret);
+		if (nr < 0)
+			break;
+		ret += nr;
+	}
 
 out:
-	mutex_unlock(&log->mutex);
+	mutex_unlock(&reader->mutex);
 
 	return ret;
 }
 
-static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
+/* Copies @count bytes of the write payload; may not fault if @atomic */
+static int copy_payload(char *dst, const struct iovec *iov,
+			unsigned long nr_segs, size_t count, bool atomic)
 {
-	size_t count = 0;
-
-	do {
-		size_t nr = sizeof(struct logger_entry) +
-			get_entry_msg_len(log, off);
-		off = logger_offset(log, off + nr);
-		count += nr;
-	} while (count < len);
+	while (nr_segs-- > 0 && count) {
+		size_t len = min_t(size_t, iov->iov_len, count);
+		unsigned long left;
 
-	return off;
-}
+		if (atomic)
+			left = __copy_from_user_inatomic(dst, iov->iov_base,
+							 len);
+		else
+			left = copy_from_user(dst, iov->iov_base, len);
+		if (left)
+			return -EFAULT;
 
-static inline int is_between(size_t a, size_t b, size_t c)
-{
-	if (a < b) {
-		
-		if (a < c && c <= b)
-			return 1;
-	} else {
-		
-		if (c <= b || a < c)
-			return 1;
+		dst += len;
+		count -= len;
+		iov++;
 	}
 
 	return 0;
 }
 
-static void fix_up_readers(struct logger_log *log, size_t len)
+static int reserve_rec(struct logger_log *log, size_t len,
+		       unsigned long *pos)
 {
-	size_t old = log->w_off;
-	size_t new = logger_offset(log, old + len);
-	struct logger_reader *reader;
+	unsigned long chunk = log->size / LOGGER_CHUNKS;
+	unsigned long res, written;
 
-	if (is_between(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
-
-	list_for_each_entry(reader, &log->readers, list)
-		if (is_between(old, new, reader->r_off))
-			reader->r_off = get_next_entry(log, reader->r_off, len);
+	do {
+		res = atomic_long_read(&log->shared->w_reserve);
+		written = atomic_long_read(&log->w_written);
+
+		/*
+		 * Never write into a chunk whose counter still accounts for
+		 * the previous lap. That only happens if writers holding a
+		 * whole ring worth of space stalled, so drop the record
+		 * instead of waiting for them.
+		 */
+		if (res + len - (written - written % chunk) > log->size)
+			return -EAGAIN;
+	} while (atomic_long_cmpxchg(&log->shared->w_reserve, res,
+				     res + len) != res);
+
+	*pos = res;
+	return 0;
 }
 
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+/* Accounts a completely written record to the chunks it covers */
+static void finish_rec(struct logger_log *log, unsigned long pos, size_t len)
 {
-	size_t len;
-
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
-
-	if (count != len)
-		memcpy(log->buffer, buf + len, count - len);
-
-	log->w_off = logger_offset(log, log->w_off + count);
-
+	unsigned long chunk = log->size / LOGGER_CHUNKS;
+	unsigned long end = pos + len;
+	unsigned long n;
+
+	smp_wmb();
+	while (pos != end) {
+		n = min(end - pos, chunk - pos % chunk);
+		atomic_long_add(n, chunk_done(log, pos));
+		pos += n;
+	}
 }
 
-static ssize_t do_write_log_from_user(struct logger_log *log,
-				      const void __user *buf, size_t count)
+/* Lets readers see every record ending at or before @pos */
+static void publish_commit(struct logger_log *log, unsigned long pos)
 {
-	size_t len;
+	unsigned long commit;
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
-		return -EFAULT;
-
-	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
-			return -EFAULT;
+	do {
+		commit = atomic_long_read(&log->shared->w_commit);
+		if ((long)(pos - commit) <= 0)
+			return;
+	} while (atomic_long_cmpxchg(&log->shared->w_commit, commit,
+				     pos) != commit);
+}
 
-	log->w_off = logger_offset(log, log->w_off + count);
+/*
+ * Moves w_written forward while every byte reserved in its chunk has
+ * been written. Only bytes reserved before w_reserve was sampled can have
+ * been counted, so the count matching the reserved length means none of
+ * those records is still being copied. w_reserve is always a record
+ * boundary; at a chunk end the boundary is the one remembered by the
+ * writer whose record crossed it.
+ */
+static void commit_recs(struct logger_log *log)
+{
+	unsigned long chunk = log->size / LOGGER_CHUNKS;
+	unsigned long written, res, start, end, done, last;
+
+	for (;;) {
+		written = atomic_long_read(&log->w_written);
+		start = written - written % chunk;
+		done = atomic_long_read(chunk_done(log, start));
+		smp_rmb();
+		res = atomic_long_read(&log->shared->w_reserve);
+
+		end = res - start < chunk ? res : start + chunk;
+		if (done != end || end == written)
+			return;
+		if (atomic_long_cmpxchg(&log->w_written, written,
+					end) != written)
+			continue;
+
+		if (end != start + chunk) {
+			publish_commit(log, end);
+			continue;
+		}
 
-	return count;
+		/* only the writer that completed the chunk gets here */
+		last = atomic_long_read(chunk_last(log, start));
+		if (last - start <= chunk)
+			publish_commit(log, last);
+		atomic_long_add(log->size - chunk, chunk_done(log, start));
+	}
 }
 
 ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
+	unsigned long chunk = log->size / LOGGER_CHUNKS;
 	struct logger_entry header;
 	struct timespec now;
-	ssize_t ret = 0;
+	unsigned long pos;
+	char *payload, *kbuf = NULL;
+	size_t len;
+	int ret;
 
 	now = current_kernel_time();
 
@@ -334,37 +497,60 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
-
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
-
-	do_write_log(log, &header, sizeof(struct logger_entry));
-
-	while (nr_segs-- > 0) {
-		size_t len;
-		ssize_t nr;
-
-		
-		len = min_t(size_t, iov->iov_len, header.len - ret);
-
-		
-		nr = do_write_log_from_user(log, iov->iov_base, len);
-		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
+	/*
+	 * The payload is copied in before space is reserved so that nothing
+	 * between reservation and commit can fault or sleep; a writer that
+	 * stalled there would hold back every record behind its own.
+	 */
+	preempt_disable();
+	payload = __get_cpu_var(logger_bounce);
+	pagefault_disable();
+	ret = copy_payload(payload, iov, nr_segs, header.len, true);
+	pagefault_enable();
+	if (unlikely(ret)) {
+		preempt_enable();
+		kbuf = kmalloc(header.len, GFP_KERNEL);
+		if (!kbuf)
+			return -ENOMEM;
+		if (copy_payload(kbuf, iov, nr_segs, header.len, false)) {
+			kfree(kbuf);
+			return -EFAULT;
 		}
+		payload = kbuf;
+		preempt_disable();
+	}
 
-		iov++;
-		ret += nr;
+	len = sizeof(struct logger_rec) + header.len;
+	ret = reserve_rec(log, len, &pos);
+	if (unlikely(ret)) {
+		preempt_enable();
+		kfree(kbuf);
+		return ret;
+	}
+
+	copy_to_log(log, pos + offsetof(struct logger_rec, entry),
+		    &header, sizeof(header));
+	copy_to_log(log, pos + sizeof(struct logger_rec), payload, header.len);
+	if (pos / chunk != (pos + len) / chunk) {
+		atomic_long_set(&log->shared->chunk_first[((pos + len) / chunk) %
+						  LOGGER_CHUNKS], pos + len);
+		atomic_long_set(chunk_last(log, pos),
+				(pos + len) % chunk ? pos : pos + len);
 	}
 
-	mutex_unlock(&log->mutex);
+	copy_to_log(log, pos, &pos, sizeof(pos));
+	finish_rec(log, pos, len);
+	commit_recs(log);
 
-	
-	wake_up_interruptible(&log->wq);
+	preempt_enable();
+	kfree(kbuf);
 
-	return ret;
+	/* pairs with prepare_to_wait() in logger_read() */
+	smp_mb();
+	if (waitqueue_active(&log->wq))
+		wake_up_interruptible(&log->wq);
+
+	return header.len;
 }
 
 static struct logger_log *get_log_from_minor(int);
@@ -389,17 +575,22 @@ static int logger_open(struct inode *inode, struct file *file)
 		if (!reader)
 			return -ENOMEM;
 
+		reader->rec = kmalloc(sizeof(struct logger_rec) +
+				      LOGGER_ENTRY_MAX_PAYLOAD, GFP_KERNEL);
+		if (!reader->rec) {
+			kfree(reader);
+			return -ENOMEM;
+		}
+
 		reader->log = log;
 		reader->r_ver = 1;
+		reader->r_batch = false;
 		reader->r_all = in_egroup_p(inode->i_gid) ||
 			capable(CAP_SYSLOG);
 
-		INIT_LIST_HEAD(&reader->list);
-
-		mutex_lock(&log->mutex);
-		reader->r_off = log->head;
-		list_add_tail(&reader->list, &log->readers);
-		mutex_unlock(&log->mutex);
+		mutex_init(&reader->mutex);
+		reader->r_pos = get_oldest(log);
+		reader_resync(reader);
 
 		file->private_data = reader;
 	} else
@@ -412,18 +603,48 @@ static int logger_release(struct inode *ignored, struct file *file)
 {
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
-		struct logger_log *log = reader->log;
-
-		mutex_lock(&log->mutex);
-		list_del(&reader->list);
-		mutex_unlock(&log->mutex);
 
+		kfree(reader->rec);
 		kfree(reader);
 	}
 
 	return 0;
 }
 
+/*
+ * Maps the shared header page followed by the ring, read-only. Readers
+ * that are only allowed to see their own entries cannot use this.
+ */
+static int logger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct logger_reader *reader = file->private_data;
+	struct logger_log *log;
+	int ret;
+
+	if (!(file->f_mode & FMODE_READ))
+		return -EBADF;
+	log = reader->log;
+	if (!reader->r_all)
+		return -EPERM;
+	/* struct logger_rec is laid out for native readers only */
+	if (is_compat_task())
+		return -EINVAL;
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start != PAGE_SIZE + log->size)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	ret = remap_pfn_range(vma, vma->vm_start,
+			      virt_to_phys(log->shared) >> PAGE_SHIFT,
+			      PAGE_SIZE, vma->vm_page_prot);
+	if (ret)
+		return ret;
+	return remap_pfn_range(vma, vma->vm_start + PAGE_SIZE,
+			       virt_to_phys(log->buffer) >> PAGE_SHIFT,
+			       log->size, vma->vm_page_prot);
+}
+
 static unsigned int logger_poll(struct file *file, poll_table *wait)
 {
 	struct logger_reader *reader;
@@ -438,14 +659,10 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &log->wq, wait);
 
-	mutex_lock(&log->mutex);
-	if (!reader->r_all)
-		reader->r_off = get_next_entry_by_uid(log,
-			reader->r_off, current_euid());
-
-	if (log->w_off != reader->r_off)
+	mutex_lock(&reader->mutex);
+	if (fetch_entry(reader))
 		ret |= POLLIN | POLLRDNORM;
-	mutex_unlock(&log->mutex);
+	mutex_unlock(&reader->mutex);
 
 	return ret;
 }
@@ -463,44 +680,51 @@ static long logger_set_version(struct logger_reader *reader, void __user *arg)
 	return 0;
 }
 
+static long logger_set_batch(struct logger_reader *reader, void __user *arg)
+{
+	int batch;
+	if (copy_from_user(&batch, arg, sizeof(int)))
+		return -EFAULT;
+
+	reader->r_batch = batch != 0;
+	return 0;
+}
+
 static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
-	struct logger_reader *reader;
+	struct logger_reader *reader = NULL;
 	long ret = -EINVAL;
 	void __user *argp = (void __user *) arg;
 
-	mutex_lock(&log->mutex);
+	if (file->f_mode & FMODE_READ) {
+		reader = file->private_data;
+		mutex_lock(&reader->mutex);
+	}
 
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
 		ret = log->size;
 		break;
 	case LOGGER_GET_LOG_LEN:
-		if (!(file->f_mode & FMODE_READ)) {
+		if (!reader) {
 			ret = -EBADF;
 			break;
 		}
-		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
-		else
-			ret = (log->size - reader->r_off) + log->w_off;
+		reader_resync(reader);
+		ret = atomic_long_read(&log->shared->w_commit) - reader->r_pos;
+		if (ret < 0)
+			ret = 0;
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
-		if (!(file->f_mode & FMODE_READ)) {
+		if (!reader) {
 			ret = -EBADF;
 			break;
 		}
-		reader = file->private_data;
 
-		if (!reader->r_all)
-			reader->r_off = get_next_entry_by_uid(log,
-				reader->r_off, current_euid());
-
-		if (log->w_off != reader->r_off)
+		if (fetch_entry(reader))
 			ret = get_user_hdr_len(reader->r_ver) +
-				get_entry_msg_len(log, reader->r_off);
+				reader->rec->entry.len;
 		else
 			ret = 0;
 		break;
@@ -509,30 +733,35 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			ret = -EBADF;
 			break;
 		}
-		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
-		log->head = log->w_off;
+		/* readers catch up with this the next time they look */
+		ACCESS_ONCE(log->shared->flush_pos) = atomic_long_read(&log->shared->w_commit);
 		ret = 0;
 		break;
 	case LOGGER_GET_VERSION:
-		if (!(file->f_mode & FMODE_READ)) {
+		if (!reader) {
 			ret = -EBADF;
 			break;
 		}
-		reader = file->private_data;
 		ret = reader->r_ver;
 		break;
 	case LOGGER_SET_VERSION:
-		if (!(file->f_mode & FMODE_READ)) {
+		if (!reader) {
 			ret = -EBADF;
 			break;
 		}
-		reader = file->private_data;
 		ret = logger_set_version(reader, argp);
 		break;
+	case LOGGER_SET_BATCH_READ:
+		if (!reader) {
+			ret = -EBADF;
+			break;
+		}
+		ret = logger_set_batch(reader, argp);
+		break;
 	}
 
-	mutex_unlock(&log->mutex);
+	if (reader)
+		mutex_unlock(&reader->mutex);
 
 	return ret;
 }
@@ -542,6 +771,7 @@ static const struct file_operations logger_fops = {
 	.read = logger_read,
 	.aio_write = logger_aio_write,
 	.poll = logger_poll,
+	.mmap = logger_mmap,
 	.unlocked_ioctl = logger_ioctl,
 	.compat_ioctl = logger_ioctl,
 	.open = logger_open,
@@ -549,7 +779,7 @@ static const struct file_operations logger_fops = {
 };
 
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
+static unsigned char _buf_ ## VAR[SIZE] __aligned(PAGE_SIZE); \
 static struct logger_log VAR = { \
 	.buffer = _buf_ ## VAR, \
 	.misc = { \
@@ -559,10 +789,6 @@ static struct logger_log VAR = { \
 		.parent = NULL, \
 	}, \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
-	.readers = LIST_HEAD_INIT(VAR .readers), \
-	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
-	.w_off = 0, \
-	.head = 0, \
 	.size = SIZE, \
 };
 
@@ -586,12 +812,25 @@ static struct logger_log *get_log_from_minor(int minor)
 
 static int __init init_log(struct logger_log *log)
 {
-	int ret;
+	int ret, i;
+
+	for (i = 0; i < LOGGER_CHUNKS; i++)
+		atomic_long_set(&log->chunk_done[i],
+				i * (log->size / LOGGER_CHUNKS));
+
+	log->shared = (struct logger_shared *)get_zeroed_page(GFP_KERNEL);
+	if (!log->shared)
+		return -ENOMEM;
+	log->shared->version = LOGGER_MMAP_VERSION;
+	log->shared->hdr_size = PAGE_SIZE;
+	log->shared->size = log->size;
+	log->shared->rec_hdr_size = sizeof(struct logger_rec);
 
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "logger: failed to register misc "
 		       "device for log '%s'!\n", log->misc.name);
+		free_page((unsigned long)log->shared);
 		return ret;
 	}
 
@@ -605,6 +844,13 @@ static int __init logger_init(void)
 {
 	int ret;
 
+	BUILD_BUG_ON(sizeof(struct logger_shared) !=
+		     sizeof(struct logger_mmap_header));
+	BUILD_BUG_ON(offsetof(struct logger_shared, w_reserve) !=
+		     offsetof(struct logger_mmap_header, w_reserve));
+	BUILD_BUG_ON(offsetof(struct logger_shared, chunk_first) !=
+		     offsetof(struct logger_mmap_header, chunk_first));
+
 	ret = init_log(&log_main);
 	if (unlikely(ret))
 		goto out;
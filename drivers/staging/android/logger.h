@@ -41,6 +41,31 @@ struct logger_entry {
 	char		msg[0];		
 };
 
+/*
+ * Layout of the ring as seen through mmap(): a header page followed by
+ * the records, each a logger_rec at a monotonically increasing position
+ * taken modulo the ring size. A record is valid once its pos matches
+ * and while w_reserve - pos does not exceed the ring size.
+ */
+#define LOGGER_MMAP_VERSION	1
+#define LOGGER_MMAP_CHUNKS	16
+
+struct logger_rec {
+	unsigned long		pos;
+	struct logger_entry	entry;
+};
+
+struct logger_mmap_header {
+	__u32		version;
+	__u32		hdr_size;
+	__u32		size;
+	__u32		rec_hdr_size;
+	unsigned long	w_reserve;
+	unsigned long	w_commit;
+	unsigned long	flush_pos;
+	unsigned long	chunk_first[LOGGER_MMAP_CHUNKS];
+};
+
 #define LOGGER_LOG_RADIO	"log_radio"	
 #define LOGGER_LOG_EVENTS	"log_events"	
 #define LOGGER_LOG_SYSTEM	"log_system"	
@@ -56,5 +81,6 @@ struct logger_entry {
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) 
 #define LOGGER_GET_VERSION		_IO(__LOGGERIO, 5) 
 #define LOGGER_SET_VERSION		_IO(__LOGGERIO, 6) 
+#define LOGGER_SET_BATCH_READ		_IO(__LOGGERIO, 7) 
 
 #endif 
@@ -37,6 +37,9 @@
 #include <linux/sched.h>
 #include <linux/rcupdate.h>
 #include <linux/notifier.h>
+#include <linux/rculist.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
 
 extern void show_meminfo(void);
 static uint32_t lowmem_debug_level = 2;
@@ -56,6 +59,28 @@ static int lowmem_minfree[6] = {
 static int lowmem_minfree_size = 4;
 
 static unsigned long lowmem_deathpending_timeout;
+static struct task_struct *lowmem_deathpending;
+static DEFINE_MUTEX(lowmem_shrink_lock);
+
+/*
+ * Processes indexed by oom_score_adj, so that the shrinker only looks
+ * at the processes it may actually kill instead of walking the whole
+ * task list. Bucket i holds the thread group leaders with
+ * oom_score_adj == OOM_SCORE_ADJ_MAX - i, so the highest scores come
+ * first in lowmem_adj_used. Writers hold lowmem_adj_lock, the shrinker
+ * walks the buckets under RCU like for_each_process does. A process
+ * whose score changed is out of the index for one grace period.
+ */
+#define LOWMEM_ADJ_BUCKETS	(OOM_SCORE_ADJ_MAX - OOM_SCORE_ADJ_MIN + 1)
+
+static struct hlist_head lowmem_adj_index[LOWMEM_ADJ_BUCKETS];
+static DECLARE_BITMAP(lowmem_adj_used, LOWMEM_ADJ_BUCKETS);
+static DEFINE_SPINLOCK(lowmem_adj_lock);
+
+static inline int lowmem_adj_bucket(int oom_score_adj)
+{
+	return OOM_SCORE_ADJ_MAX - oom_score_adj;
+}
 
 #define lowmem_print(level, x...)			\
 	do {						\
@@ -83,10 +108,162 @@ static void dump_tasks(void)
        }
 }
 
+static void lowmem_dump_func(struct work_struct *work)
+{
+	show_meminfo();
+	rcu_read_lock();
+	dump_tasks();
+	rcu_read_unlock();
+}
+static DECLARE_WORK(lowmem_dump_work, lowmem_dump_func);
+
+/* Must be called with lowmem_adj_lock held */
+static void __lowmem_adj_index_del(struct task_struct *p)
+{
+	int bucket = lowmem_adj_bucket(p->lowmem_adj);
+
+	if (hlist_unhashed(&p->lowmem_adj_node))
+		return;
+	hlist_del_init_rcu(&p->lowmem_adj_node);
+	if (hlist_empty(&lowmem_adj_index[bucket]))
+		__clear_bit(bucket, lowmem_adj_used);
+}
+
+/* Must be called with lowmem_adj_lock held */
+static void __lowmem_adj_index_add(struct task_struct *p)
+{
+	int bucket;
+
+	p->lowmem_adj = p->signal->oom_score_adj;
+	bucket = lowmem_adj_bucket(p->lowmem_adj);
+	hlist_add_head_rcu(&p->lowmem_adj_node, &lowmem_adj_index[bucket]);
+	__set_bit(bucket, lowmem_adj_used);
+}
+
+/* Called from copy_process() for a new thread group leader */
+void lowmem_adj_index_add(struct task_struct *p)
+{
+	unsigned long flags;
+
+	INIT_HLIST_NODE(&p->lowmem_adj_node);
+	p->lowmem_adj_moving = false;
+	spin_lock_irqsave(&lowmem_adj_lock, flags);
+	__lowmem_adj_index_add(p);
+	spin_unlock_irqrestore(&lowmem_adj_lock, flags);
+}
+
+static void lowmem_adj_index_readd(struct rcu_head *head)
+{
+	struct task_struct *p = container_of(head, struct task_struct,
+					     lowmem_adj_rcu);
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_adj_lock, flags);
+	/* cleared if the process died or exec'd meanwhile */
+	if (p->lowmem_adj_moving) {
+		p->lowmem_adj_moving = false;
+		__lowmem_adj_index_add(p);
+	}
+	spin_unlock_irqrestore(&lowmem_adj_lock, flags);
+	put_task_struct(p);
+}
+
+/*
+ * Called after oom_score_adj of the process of @p changed. The process
+ * is unlinked right away but only added to its new bucket after a grace
+ * period: a shrinker standing on it in the old bucket would otherwise
+ * follow it into the new one and miss the rest of the old bucket. Must
+ * not be called with task_lock held, as the shrinker nests it inside
+ * RCU only.
+ */
+void lowmem_adj_index_update(struct task_struct *p)
+{
+	unsigned long flags;
+
+	rcu_read_lock();
+	p = p->group_leader;
+	spin_lock_irqsave(&lowmem_adj_lock, flags);
+	if (!hlist_unhashed(&p->lowmem_adj_node) &&
+	    p->lowmem_adj != p->signal->oom_score_adj) {
+		__lowmem_adj_index_del(p);
+		p->lowmem_adj_moving = true;
+		get_task_struct(p);
+		call_rcu(&p->lowmem_adj_rcu, lowmem_adj_index_readd);
+	}
+	spin_unlock_irqrestore(&lowmem_adj_lock, flags);
+	rcu_read_unlock();
+}
+
+/* Called from __unhash_process() when a thread group dies */
+void lowmem_adj_index_del(struct task_struct *p)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_adj_lock, flags);
+	p->lowmem_adj_moving = false;
+	__lowmem_adj_index_del(p);
+	spin_unlock_irqrestore(&lowmem_adj_lock, flags);
+}
+
+/* Called from de_thread() when @new takes over as group leader */
+void lowmem_adj_index_replace(struct task_struct *old, struct task_struct *new)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_adj_lock, flags);
+	new->lowmem_adj_moving = false;
+	if (hlist_unhashed(&old->lowmem_adj_node)) {
+		INIT_HLIST_NODE(&new->lowmem_adj_node);
+		/* @new is not linked anywhere, it can go in right away */
+		if (old->lowmem_adj_moving) {
+			old->lowmem_adj_moving = false;
+			__lowmem_adj_index_add(new);
+		}
+	} else {
+		new->lowmem_adj = old->lowmem_adj;
+		hlist_replace_rcu(&old->lowmem_adj_node,
+				  &new->lowmem_adj_node);
+		INIT_HLIST_NODE(&old->lowmem_adj_node);
+	}
+	spin_unlock_irqrestore(&lowmem_adj_lock, flags);
+}
+
+/*
+ * Returns true while the last victim is still releasing its memory,
+ * so that a single low memory condition does not kill several tasks.
+ */
+static bool lowmem_death_pending(void)
+{
+	struct task_struct *p;
+
+	if (!lowmem_deathpending)
+		return false;
+	if (time_before_eq(jiffies, lowmem_deathpending_timeout)) {
+		/* find_lock_task_mm() walks the victim's threads */
+		rcu_read_lock();
+		p = find_lock_task_mm(lowmem_deathpending);
+		if (p) {
+			lowmem_print(2, "%d (%s), oom_adj %d score_adj %d, "
+				     "is exiting, return\n", p->pid, p->comm,
+				     p->signal->oom_adj,
+				     p->signal->oom_score_adj);
+			task_unlock(p);
+			rcu_read_unlock();
+			return true;
+		}
+		rcu_read_unlock();
+	}
+	put_task_struct(lowmem_deathpending);
+	lowmem_deathpending = NULL;
+	return false;
+}
+
 static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 {
 	struct task_struct *tsk;
 	struct task_struct *selected = NULL;
+	struct hlist_node *pos;
+	int bucket;
 	int rem = 0;
 	int tasksize;
 	int i;
@@ -125,66 +302,85 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 	}
 	selected_oom_score_adj = min_score_adj;
 
+	/* also serializes kills, the shrinker runs on many CPUs at once */
+	if (!mutex_trylock(&lowmem_shrink_lock))
+		return 0;
+	if (lowmem_death_pending()) {
+		mutex_unlock(&lowmem_shrink_lock);
+		return 0;
+	}
+
 	rcu_read_lock();
-	for_each_process(tsk) {
-		struct task_struct *p;
-		int oom_score_adj;
+	for_each_set_bit(bucket, lowmem_adj_used,
+			 lowmem_adj_bucket(min_score_adj) + 1) {
+		hlist_for_each_entry_rcu(tsk, pos, &lowmem_adj_index[bucket],
+					 lowmem_adj_node) {
+			struct task_struct *p;
+			int oom_score_adj;
 
-		if (tsk->flags & PF_KTHREAD)
-			continue;
+			if (tsk->flags & PF_KTHREAD)
+				continue;
 
-		p = find_lock_task_mm(tsk);
-		if (!p)
-			continue;
+			p = find_lock_task_mm(tsk);
+			if (!p)
+				continue;
 
-		if (test_tsk_thread_flag(p, TIF_MEMDIE) &&
-		    time_before_eq(jiffies, lowmem_deathpending_timeout)) {
-			lowmem_print(2, "%d (%s), oom_adj %d score_adj %d, is exiting, return\n"
-					, p->pid, p->comm, p->signal->oom_adj, p->signal->oom_score_adj);
-			task_unlock(p);
-			rcu_read_unlock();
-			return 0;
-		}
-		oom_score_adj = p->signal->oom_score_adj;
-		if (oom_score_adj < min_score_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(p->mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_score_adj < selected_oom_score_adj)
+			/* also covers victims of the OOM killer */
+			if (test_tsk_thread_flag(p, TIF_MEMDIE) &&
+			    time_before_eq(jiffies, lowmem_deathpending_timeout)) {
+				lowmem_print(2, "%d (%s), oom_adj %d score_adj %d, is exiting, return\n",
+					     p->pid, p->comm, p->signal->oom_adj,
+					     p->signal->oom_score_adj);
+				task_unlock(p);
+				rcu_read_unlock();
+				mutex_unlock(&lowmem_shrink_lock);
+				return 0;
+			}
+
+			oom_score_adj = p->signal->oom_score_adj;
+			if (oom_score_adj < min_score_adj) {
+				task_unlock(p);
 				continue;
-			if (oom_score_adj == selected_oom_score_adj &&
-			    tasksize <= selected_tasksize)
+			}
+			tasksize = get_mm_rss(p->mm);
+			task_unlock(p);
+			if (tasksize <= 0)
 				continue;
+			if (selected) {
+				if (oom_score_adj < selected_oom_score_adj)
+					continue;
+				if (oom_score_adj == selected_oom_score_adj &&
+				    tasksize <= selected_tasksize)
+					continue;
+			}
+			selected = p;
+			selected_tasksize = tasksize;
+			selected_oom_score_adj = oom_score_adj;
+			selected_oom_adj = p->signal->oom_adj;
+			lowmem_print(2, "select %d (%s), oom_adj %d score_adj %d, size %d, to kill\n",
+				     p->pid, p->comm, selected_oom_adj, oom_score_adj, tasksize);
 		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_score_adj = oom_score_adj;
-		selected_oom_adj = p->signal->oom_adj;
-		lowmem_print(2, "select %d (%s), oom_adj %d score_adj %d, size %d, to kill\n",
-			     p->pid, p->comm, selected_oom_adj, oom_score_adj, tasksize);
+		/* lower buckets only hold lower scores */
+		if (selected)
+			break;
 	}
 	if (selected) {
 		lowmem_print(1, "send sigkill to %d (%s), oom_adj %d, score_adj %d, size %d\n",
 			     selected->pid, selected->comm, selected_oom_adj,
 			     selected_oom_score_adj, selected_tasksize);
 		lowmem_deathpending_timeout = jiffies + HZ;
+		get_task_struct(selected);
+		lowmem_deathpending = selected;
 		if (selected_oom_adj < 7)
-		{
-			show_meminfo();
-			dump_tasks();
-		}
+			schedule_work(&lowmem_dump_work);
 		send_sig(SIGKILL, selected, 0);
 		set_tsk_thread_flag(selected, TIF_MEMDIE);
 		rem -= selected_tasksize;
 	}
+	rcu_read_unlock();
+	mutex_unlock(&lowmem_shrink_lock);
 	lowmem_print(4, "lowmem_shrink %lu, %x, return %d\n",
 		     sc->nr_to_scan, sc->gfp_mask, rem);
-	rcu_read_unlock();
 	return rem;
 }
 
@@ -0,0 +1,331 @@
+/* drivers/staging/android/mem_pressure.c
+ *
+ * Reports memory pressure levels to userspace before the lowmemorykiller
+ * has to kill anything. Pressure is taken from page reclaim itself: for
+ * every window of scanned pages, the share of pages that could not be
+ * reclaimed (0-100) is mapped to a level:
+ *
+ *   low       reclaim is keeping up
+ *   medium    reclaim is struggling, caches should be trimmed
+ *   critical  reclaim is failing, kills are imminent
+ *
+ * Userspace opens /dev/mem_pressure and polls it. A read returns the
+ * name of the level the listener moved to, e.g. "medium\n". Writing a
+ * level name makes the listener ignore changes that stay below that
+ * level. Every listener tracks its own level. A level is entered at
+ * its threshold but only left once pressure drops below the threshold
+ * minus that level's hysteresis, so pressure that hovers around a
+ * threshold does not flood listeners with events.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <linux/fs.h>
+#include <linux/gfp.h>
+#include <linux/list.h>
+#include <linux/miscdevice.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/swap.h>
+#include <linux/uaccess.h>
+#include <linux/vmpressure.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+
+enum {
+	MEM_PRESSURE_LOW,
+	MEM_PRESSURE_MEDIUM,
+	MEM_PRESSURE_CRITICAL,
+	MEM_PRESSURE_NR_LEVELS,
+};
+
+static const char * const mem_pressure_names[MEM_PRESSURE_NR_LEVELS] = {
+	"low",
+	"medium",
+	"critical",
+};
+
+/* pressure (percent of scanned pages not reclaimed) to enter a level */
+static int mem_pressure_threshold[MEM_PRESSURE_NR_LEVELS] = {
+	0,
+	60,
+	95,
+};
+static int mem_pressure_threshold_size = MEM_PRESSURE_NR_LEVELS;
+
+/* how far below its threshold pressure has to fall to leave a level */
+static int mem_pressure_hysteresis[MEM_PRESSURE_NR_LEVELS] = {
+	0,
+	10,
+	5,
+};
+static int mem_pressure_hysteresis_size = MEM_PRESSURE_NR_LEVELS;
+
+/* scanned pages per sample; small windows make the level jumpy */
+static unsigned long mem_pressure_window = SWAP_CLUSTER_MAX * 16;
+
+/* reclaim priority at or below which pressure is critical right away */
+static int mem_pressure_critical_prio = 3;
+
+struct mem_pressure_listener {
+	struct list_head entry;
+	int min_level;
+	int level;
+	int pending;
+};
+
+static DEFINE_SPINLOCK(mem_pressure_lock);
+static unsigned long mem_pressure_scanned;
+static unsigned long mem_pressure_reclaimed;
+static unsigned long mem_pressure_work_scanned;
+static unsigned long mem_pressure_work_reclaimed;
+
+static DEFINE_MUTEX(mem_pressure_listeners_lock);
+static LIST_HEAD(mem_pressure_listeners);
+static DECLARE_WAIT_QUEUE_HEAD(mem_pressure_wait);
+
+static int mem_pressure_level(int cur, unsigned int pressure)
+{
+	int level;
+
+	for (level = MEM_PRESSURE_NR_LEVELS - 1; level > 0; level--) {
+		int threshold = mem_pressure_threshold[level];
+
+		if (level <= cur)
+			threshold -= mem_pressure_hysteresis[level];
+		if (pressure >= threshold)
+			break;
+	}
+	return level;
+}
+
+/* Must be called with mem_pressure_listeners_lock held */
+static void mem_pressure_update(struct mem_pressure_listener *l,
+				unsigned int pressure)
+{
+	int level = mem_pressure_level(l->level, pressure);
+
+	if (level == l->level)
+		return;
+	/* changes below the filter are tracked but not reported */
+	if (level >= l->min_level || l->level >= l->min_level)
+		l->pending = level;
+	l->level = level;
+}
+
+static void mem_pressure_work_func(struct work_struct *work)
+{
+	struct mem_pressure_listener *l;
+	unsigned long scanned, reclaimed;
+	unsigned int pressure;
+
+	spin_lock(&mem_pressure_lock);
+	scanned = mem_pressure_work_scanned;
+	reclaimed = mem_pressure_work_reclaimed;
+	mem_pressure_work_scanned = 0;
+	mem_pressure_work_reclaimed = 0;
+	spin_unlock(&mem_pressure_lock);
+
+	if (!scanned)
+		return;
+	/* slab pages count as reclaimed but not as scanned */
+	reclaimed = min(reclaimed, scanned);
+	pressure = 100 - reclaimed * 100 / scanned;
+
+	mutex_lock(&mem_pressure_listeners_lock);
+	list_for_each_entry(l, &mem_pressure_listeners, entry)
+		mem_pressure_update(l, pressure);
+	mutex_unlock(&mem_pressure_listeners_lock);
+	wake_up_interruptible(&mem_pressure_wait);
+}
+static DECLARE_WORK(mem_pressure_work, mem_pressure_work_func);
+
+/*
+ * Called from reclaim after a zone was shrunk. Only allocations that
+ * could have used any memory count, so that pressure in a single
+ * constrained zone, e.g. for GFP_DMA, does not show up as global.
+ */
+void vmpressure(gfp_t gfp, unsigned long scanned, unsigned long reclaimed)
+{
+	if (!(gfp & (__GFP_HIGHMEM | __GFP_MOVABLE | __GFP_IO | __GFP_FS)))
+		return;
+	if (!scanned)
+		return;
+
+	spin_lock(&mem_pressure_lock);
+	mem_pressure_scanned += scanned;
+	mem_pressure_reclaimed += reclaimed;
+	if (mem_pressure_scanned < mem_pressure_window) {
+		spin_unlock(&mem_pressure_lock);
+		return;
+	}
+	mem_pressure_work_scanned += mem_pressure_scanned;
+	mem_pressure_work_reclaimed += mem_pressure_reclaimed;
+	mem_pressure_scanned = 0;
+	mem_pressure_reclaimed = 0;
+	spin_unlock(&mem_pressure_lock);
+
+	schedule_work(&mem_pressure_work);
+}
+
+/*
+ * Called from direct reclaim for every priority it goes through. Once
+ * reclaim has to scan a large part of the LRUs, report a full window
+ * without progress, as the allocation is about to fail.
+ */
+void vmpressure_prio(gfp_t gfp, int prio)
+{
+	if (prio > mem_pressure_critical_prio)
+		return;
+	vmpressure(gfp, mem_pressure_window, 0);
+}
+
+static int mem_pressure_open(struct inode *inode, struct file *file)
+{
+	struct mem_pressure_listener *l;
+	int ret;
+
+	ret = nonseekable_open(inode, file);
+	if (ret)
+		return ret;
+
+	l = kzalloc(sizeof(*l), GFP_KERNEL);
+	if (!l)
+		return -ENOMEM;
+	l->min_level = MEM_PRESSURE_LOW;
+	l->level = MEM_PRESSURE_LOW;
+	l->pending = -1;
+	file->private_data = l;
+
+	mutex_lock(&mem_pressure_listeners_lock);
+	list_add_tail(&l->entry, &mem_pressure_listeners);
+	mutex_unlock(&mem_pressure_listeners_lock);
+	return 0;
+}
+
+static int mem_pressure_release(struct inode *inode, struct file *file)
+{
+	struct mem_pressure_listener *l = file->private_data;
+
+	mutex_lock(&mem_pressure_listeners_lock);
+	list_del(&l->entry);
+	mutex_unlock(&mem_pressure_listeners_lock);
+	kfree(l);
+	return 0;
+}
+
+/* Returns the pending level and clears it, or -1 if there is none */
+static int mem_pressure_take(struct mem_pressure_listener *l)
+{
+	int level;
+
+	mutex_lock(&mem_pressure_listeners_lock);
+	level = l->pending;
+	l->pending = -1;
+	mutex_unlock(&mem_pressure_listeners_lock);
+	return level;
+}
+
+static ssize_t mem_pressure_read(struct file *file, char __user *buf,
+				 size_t count, loff_t *pos)
+{
+	struct mem_pressure_listener *l = file->private_data;
+	char kbuf[16];
+	int level, len, ret;
+
+	while ((level = mem_pressure_take(l)) < 0) {
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		ret = wait_event_interruptible(mem_pressure_wait,
+					       ACCESS_ONCE(l->pending) >= 0);
+		if (ret)
+			return ret;
+	}
+
+	len = snprintf(kbuf, sizeof(kbuf), "%s\n", mem_pressure_names[level]);
+	if (count < len)
+		len = count;
+	if (copy_to_user(buf, kbuf, len))
+		return -EFAULT;
+	return len;
+}
+
+static ssize_t mem_pressure_write(struct file *file, const char __user *buf,
+				  size_t count, loff_t *pos)
+{
+	struct mem_pressure_listener *l = file->private_data;
+	char kbuf[16];
+	int level;
+
+	if (count >= sizeof(kbuf))
+		return -EINVAL;
+	if (copy_from_user(kbuf, buf, count))
+		return -EFAULT;
+	kbuf[count] = '\0';
+
+	for (level = 0; level < MEM_PRESSURE_NR_LEVELS; level++)
+		if (!strcmp(strim(kbuf), mem_pressure_names[level]))
+			break;
+	if (level == MEM_PRESSURE_NR_LEVELS)
+		return -EINVAL;
+
+	mutex_lock(&mem_pressure_listeners_lock);
+	l->min_level = level;
+	mutex_unlock(&mem_pressure_listeners_lock);
+	return count;
+}
+
+static unsigned int mem_pressure_poll(struct file *file, poll_table *wait)
+{
+	struct mem_pressure_listener *l = file->private_data;
+
+	poll_wait(file, &mem_pressure_wait, wait);
+	if (ACCESS_ONCE(l->pending) >= 0)
+		return POLLIN | POLLRDNORM;
+	return 0;
+}
+
+static const struct file_operations mem_pressure_fops = {
+	.owner = THIS_MODULE,
+	.open = mem_pressure_open,
+	.release = mem_pressure_release,
+	.read = mem_pressure_read,
+	.write = mem_pressure_write,
+	.poll = mem_pressure_poll,
+	.llseek = no_llseek,
+};
+
+static struct miscdevice mem_pressure_miscdev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "mem_pressure",
+	.fops = &mem_pressure_fops,
+};
+
+static int __init mem_pressure_init(void)
+{
+	return misc_register(&mem_pressure_miscdev);
+}
+
+module_param_array_named(threshold, mem_pressure_threshold, int,
+			 &mem_pressure_threshold_size, S_IRUGO | S_IWUSR);
+module_param_array_named(hysteresis, mem_pressure_hysteresis, int,
+			 &mem_pressure_hysteresis_size, S_IRUGO | S_IWUSR);
+module_param_named(window, mem_pressure_window, ulong, S_IRUGO | S_IWUSR);
+module_param_named(critical_prio, mem_pressure_critical_prio, int,
+		   S_IRUGO | S_IWUSR);
+
+device_initcall(mem_pressure_init);
+
+MODULE_LICENSE("GPL");
@@ -0,0 +1,337 @@
+/*
+ * zram compression backends and stream management
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#define KMSG_COMPONENT "zram"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/sched.h>
+#include <linux/crypto.h>
+
+#include "zcomp.h"
+#include "zcomp_lzo.h"
+#ifdef CONFIG_ZRAM_LZ4_COMPRESS
+#include "zcomp_lz4.h"
+#endif
+#ifdef CONFIG_ZRAM_CRYPTO_COMPRESS
+#include "zcomp_crypto.h"
+#endif
+
+/* Backends implemented natively, in order of preference */
+static struct zcomp_backend *backends[] = {
+	&zcomp_lzo,
+#ifdef CONFIG_ZRAM_LZ4_COMPRESS
+	&zcomp_lz4,
+#endif
+	NULL
+};
+
+static struct zcomp_backend *find_backend(const char *comp)
+{
+	int i = 0;
+
+	while (backends[i]) {
+		if (sysfs_streq(comp, backends[i]->name))
+			return backends[i];
+		i++;
+	}
+
+#ifdef CONFIG_ZRAM_CRYPTO_COMPRESS
+	/* fall back to the crypto API for anything else, e.g. deflate */
+	if (crypto_has_comp(comp, 0, 0))
+		return &zcomp_crypto;
+#endif
+	return NULL;
+}
+
+/* show available compressors, the selected one enclosed in [] */
+ssize_t zcomp_available_show(const char *comp, char *buf)
+{
+	int found = 0;
+	ssize_t sz = 0;
+	int i = 0;
+
+	while (backends[i]) {
+		if (sysfs_streq(comp, backends[i]->name)) {
+			sz += sprintf(buf + sz, "[%s] ", backends[i]->name);
+			found = 1;
+		} else {
+			sz += sprintf(buf + sz, "%s ", backends[i]->name);
+		}
+		i++;
+	}
+
+	/* algorithms from the crypto API are listed only when selected */
+	if (!found)
+		sz += sprintf(buf + sz, "[%s] ", comp);
+
+	sz += sprintf(buf + sz, "\n");
+	return sz;
+}
+
+int zcomp_available_algorithm(const char *comp)
+{
+	return find_backend(comp) != NULL;
+}
+
+static void zcomp_strm_free(struct zcomp_backend *backend,
+			    struct zcomp_strm *zstrm)
+{
+	if (zstrm->private)
+		backend->destroy(zstrm->private);
+	free_pages((unsigned long)zstrm->buffer, 1);
+	kfree(zstrm);
+}
+
+/*
+ * Allocate a new compression stream. The stream buffer is two pages
+ * long because compressed data may exceed PAGE_SIZE for incompressible
+ * input.
+ */
+static struct zcomp_strm *zcomp_strm_alloc(struct zcomp_backend *backend,
+					   const char *name)
+{
+	struct zcomp_strm *zstrm;
+
+	zstrm = kmalloc(sizeof(*zstrm), GFP_KERNEL);
+	if (!zstrm)
+		return NULL;
+
+	zstrm->private = backend->create(name);
+	zstrm->buffer = (void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, 1);
+	if (!zstrm->private || !zstrm->buffer) {
+		zcomp_strm_free(backend, zstrm);
+		return NULL;
+	}
+
+	INIT_LIST_HEAD(&zstrm->list);
+	return zstrm;
+}
+
+/*
+ * Allocate up to @nr streams for algorithm @compress onto @list and
+ * return how many were allocated. This may enter reclaim and swap to a
+ * zram device, so the caller must not hold any zram lock.
+ */
+int zcomp_strm_prealloc(const char *compress, int nr, struct list_head *list)
+{
+	struct zcomp_backend *backend = find_backend(compress);
+	struct zcomp_strm *zstrm;
+	int i;
+
+	if (!backend)
+		return 0;
+
+	for (i = 0; i < nr; i++) {
+		zstrm = zcomp_strm_alloc(backend, compress);
+		if (!zstrm)
+			break;
+		list_add(&zstrm->list, list);
+	}
+	return i;
+}
+
+/* Free streams that zcomp_strm_prealloc() allocated but nobody took */
+void zcomp_strm_free_list(const char *compress, struct list_head *list)
+{
+	struct zcomp_backend *backend = find_backend(compress);
+	struct zcomp_strm *zstrm, *tmp;
+
+	list_for_each_entry_safe(zstrm, tmp, list, list) {
+		list_del(&zstrm->list);
+		zcomp_strm_free(backend, zstrm);
+	}
+}
+
+/* Get an idle stream, sleeping until one is released if all are busy */
+struct zcomp_strm *zcomp_strm_find(struct zcomp *comp)
+{
+	struct zcomp_strm *zstrm;
+
+	while (1) {
+		spin_lock(&comp->strm_lock);
+		if (!list_empty(&comp->idle_strm)) {
+			zstrm = list_entry(comp->idle_strm.next,
+					struct zcomp_strm, list);
+			list_del(&zstrm->list);
+			spin_unlock(&comp->strm_lock);
+			return zstrm;
+		}
+		spin_unlock(&comp->strm_lock);
+
+		wait_event(comp->strm_wait, !list_empty(&comp->idle_strm));
+	}
+}
+
+/* Return a stream to the idle list, or free it if we are over limit */
+void zcomp_strm_release(struct zcomp *comp, struct zcomp_strm *zstrm)
+{
+	spin_lock(&comp->strm_lock);
+	if (comp->avail_strm <= comp->max_strm) {
+		list_add(&zstrm->list, &comp->idle_strm);
+		spin_unlock(&comp->strm_lock);
+		wake_up(&comp->strm_wait);
+		return;
+	}
+
+	comp->avail_strm--;
+	spin_unlock(&comp->strm_lock);
+	zcomp_strm_free(comp->backend, zstrm);
+}
+
+/*
+ * Change the number of streams. New streams are taken from @spare, which
+ * the caller filled with zcomp_strm_prealloc() and has to free whatever
+ * is left on it; idle streams over the new limit are freed here, busy
+ * ones when they are released. Never allocates memory, so it is safe to
+ * call with init_lock held.
+ */
+int zcomp_set_max_streams(struct zcomp *comp, int num_strm,
+			  struct list_head *spare)
+{
+	struct zcomp_strm *zstrm;
+	int ret = 0;
+
+	if (num_strm < 1)
+		return -EINVAL;
+
+	spin_lock(&comp->strm_lock);
+	comp->max_strm = num_strm;
+
+	while (comp->avail_strm < num_strm) {
+		if (list_empty(spare)) {
+			ret = -ENOMEM;
+			break;
+		}
+		list_move(spare->next, &comp->idle_strm);
+		comp->avail_strm++;
+		wake_up(&comp->strm_wait);
+	}
+
+	while (comp->avail_strm > num_strm && !list_empty(&comp->idle_strm)) {
+		zstrm = list_entry(comp->idle_strm.next,
+				struct zcomp_strm, list);
+		list_del(&zstrm->list);
+		comp->avail_strm--;
+		spin_unlock(&comp->strm_lock);
+		zcomp_strm_free(comp->backend, zstrm);
+		spin_lock(&comp->strm_lock);
+	}
+	spin_unlock(&comp->strm_lock);
+
+	return ret;
+}
+
+int zcomp_max_streams(struct zcomp *comp)
+{
+	return comp->max_strm;
+}
+
+/* Streams that exist, which trails max_strm until busy ones are freed */
+int zcomp_avail_streams(struct zcomp *comp)
+{
+	int avail;
+
+	spin_lock(&comp->strm_lock);
+	avail = comp->avail_strm;
+	spin_unlock(&comp->strm_lock);
+	return avail;
+}
+
+int zcomp_compress(struct zcomp *comp, struct zcomp_strm *zstrm,
+		const unsigned char *src, size_t *dst_len)
+{
+	return comp->backend->compress(src, zstrm->buffer, dst_len,
+					zstrm->private);
+}
+
+/*
+ * Stateless backends decompress without a stream, so readers never
+ * wait for writers. Stateful ones (crypto API transforms) need one.
+ * Must be called before entering atomic context.
+ */
+struct zcomp_strm *zcomp_decompress_begin(struct zcomp *comp)
+{
+	if (comp->backend->stateful_decompress)
+		return zcomp_strm_find(comp);
+	return NULL;
+}
+
+int zcomp_decompress(struct zcomp *comp, struct zcomp_strm *zstrm,
+		const unsigned char *src, size_t src_len, unsigned char *dst)
+{
+	return comp->backend->decompress(src, src_len, dst,
+					zstrm ? zstrm->private : NULL);
+}
+
+void zcomp_decompress_end(struct zcomp *comp, struct zcomp_strm *zstrm)
+{
+	if (zstrm)
+		zcomp_strm_release(comp, zstrm);
+}
+
+void zcomp_destroy(struct zcomp *comp)
+{
+	struct zcomp_strm *zstrm;
+
+	while (!list_empty(&comp->idle_strm)) {
+		zstrm = list_entry(comp->idle_strm.next,
+				struct zcomp_strm, list);
+		list_del(&zstrm->list);
+		zcomp_strm_free(comp->backend, zstrm);
+	}
+	kfree(comp);
+}
+
+/*
+ * Create a compression backend for algorithm @compress with @max_strm
+ * preallocated streams. At least one stream must be allocated for the
+ * device to be usable; the rest are best effort.
+ */
+struct zcomp *zcomp_create(const char *compress, int max_strm)
+{
+	struct zcomp *comp;
+	struct zcomp_backend *backend;
+	LIST_HEAD(spare);
+
+	backend = find_backend(compress);
+	if (!backend)
+		return NULL;
+
+	comp = kzalloc(sizeof(*comp), GFP_KERNEL);
+	if (!comp)
+		return NULL;
+
+	spin_lock_init(&comp->strm_lock);
+	INIT_LIST_HEAD(&comp->idle_strm);
+	init_waitqueue_head(&comp->strm_wait);
+	comp->backend = backend;
+	strlcpy(comp->name, compress, sizeof(comp->name));
+	strim(comp->name);
+
+	if (max_strm < 1)
+		max_strm = 1;
+	zcomp_strm_prealloc(comp->name, max_strm, &spare);
+	if (zcomp_set_max_streams(comp, max_strm, &spare)) {
+		if (!comp->avail_strm) {
+			zcomp_destroy(comp);
+			return NULL;
+		}
+		pr_warn("Only %d of %d compression streams allocated\n",
+			comp->avail_strm, max_strm);
+		comp->max_strm = comp->avail_strm;
+	}
+
+	return comp;
+}
@@ -0,0 +1,94 @@
+/*
+ * zram compression backends and stream management
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZCOMP_H_
+#define _ZCOMP_H_
+
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+
+#define ZCOMP_NAME_LEN	64
+
+struct zcomp_strm {
+	/* compression/decompression buffer */
+	void *buffer;
+	/* backend private data, e.g. compressor working memory */
+	void *private;
+	/* used in the idle stream list */
+	struct list_head list;
+};
+
+/*
+ * Compression backend. All callbacks return 0 on success. Decompression
+ * is expected to produce exactly PAGE_SIZE bytes.
+ */
+struct zcomp_backend {
+	int (*compress)(const unsigned char *src, unsigned char *dst,
+			size_t *dst_len, void *private);
+
+	int (*decompress)(const unsigned char *src, size_t src_len,
+			unsigned char *dst, void *private);
+
+	void *(*create)(const char *name);
+	void (*destroy)(void *private);
+
+	const char *name;
+	/*
+	 * Set if decompression uses state in the stream private data,
+	 * so that readers have to own a stream while decompressing.
+	 */
+	int stateful_decompress;
+};
+
+/*
+ * A bounded pool of compression streams. Writers grab an idle stream
+ * and sleep on strm_wait when all of them are busy. Streams are only
+ * allocated and freed from process context (device init and sysfs), so
+ * the I/O path never allocates memory for them.
+ */
+struct zcomp {
+	spinlock_t strm_lock;		/* protects the fields below */
+	struct list_head idle_strm;
+	wait_queue_head_t strm_wait;
+	int max_strm;
+	int avail_strm;
+
+	struct zcomp_backend *backend;
+	char name[ZCOMP_NAME_LEN];
+};
+
+ssize_t zcomp_available_show(const char *comp, char *buf);
+int zcomp_available_algorithm(const char *comp);
+
+struct zcomp *zcomp_create(const char *comp, int max_strm);
+void zcomp_destroy(struct zcomp *comp);
+
+struct zcomp_strm *zcomp_strm_find(struct zcomp *comp);
+void zcomp_strm_release(struct zcomp *comp, struct zcomp_strm *zstrm);
+
+int zcomp_compress(struct zcomp *comp, struct zcomp_strm *zstrm,
+		const unsigned char *src, size_t *dst_len);
+
+struct zcomp_strm *zcomp_decompress_begin(struct zcomp *comp);
+int zcomp_decompress(struct zcomp *comp, struct zcomp_strm *zstrm,
+		const unsigned char *src, size_t src_len, unsigned char *dst);
+void zcomp_decompress_end(struct zcomp *comp, struct zcomp_strm *zstrm);
+
+int zcomp_strm_prealloc(const char *compress, int nr, struct list_head *list);
+void zcomp_strm_free_list(const char *compress, struct list_head *list);
+int zcomp_set_max_streams(struct zcomp *comp, int num_strm,
+			  struct list_head *spare);
+int zcomp_max_streams(struct zcomp *comp);
+int zcomp_avail_streams(struct zcomp *comp);
+
+#endif /* _ZCOMP_H_ */
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+/*
+ * Backend for any compression algorithm registered with the crypto
+ * API, e.g. "deflate". Every stream owns its own transform, as
+ * transforms keep per-call state (the zlib streams for deflate).
+ */
+
+#include <linux/kernel.h>
+#include <linux/err.h>
+#include <linux/crypto.h>
+
+#include "zcomp_crypto.h"
+
+static void *zcomp_crypto_create(const char *name)
+{
+	struct crypto_comp *tfm;
+
+	tfm = crypto_alloc_comp(name, 0, 0);
+	if (IS_ERR(tfm))
+		return NULL;
+	return tfm;
+}
+
+static void zcomp_crypto_destroy(void *private)
+{
+	crypto_free_comp(private);
+}
+
+static int zcomp_crypto_compress(const unsigned char *src, unsigned char *dst,
+		size_t *dst_len, void *private)
+{
+	/* the destination is a 2 page stream buffer */
+	unsigned int dlen = PAGE_SIZE * 2;
+	int ret;
+
+	ret = crypto_comp_compress(private, src, PAGE_SIZE, dst, &dlen);
+	if (!ret)
+		*dst_len = dlen;
+	return ret;
+}
+
+static int zcomp_crypto_decompress(const unsigned char *src, size_t src_len,
+		unsigned char *dst, void *private)
+{
+	unsigned int dlen = PAGE_SIZE;
+	int ret;
+
+	ret = crypto_comp_decompress(private, src, src_len, dst, &dlen);
+	if (!ret && dlen != PAGE_SIZE)
+		ret = -EINVAL;
+	return ret;
+}
+
+struct zcomp_backend zcomp_crypto = {
+	.compress = zcomp_crypto_compress,
+	.decompress = zcomp_crypto_decompress,
+	.create = zcomp_crypto_create,
+	.destroy = zcomp_crypto_destroy,
+	.name = "crypto",
+	.stateful_decompress = 1,
+};
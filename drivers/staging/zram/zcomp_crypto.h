@@ -0,0 +1,18 @@
+/*
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZCOMP_CRYPTO_H_
+#define _ZCOMP_CRYPTO_H_
+
+#include "zcomp.h"
+
+extern struct zcomp_backend zcomp_crypto;
+
+#endif /* _ZCOMP_CRYPTO_H_ */
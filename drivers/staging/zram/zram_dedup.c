@@ -0,0 +1,209 @@
+/*
+ * Compressed RAM block device - same page deduplication
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#include <linux/kernel.h>
+#include <linux/jhash.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+
+#include "zram_drv.h"
+
+/* One hash bucket per 64 pages of disk */
+#define ZRAM_HASH_SHIFT		6
+
+static struct kmem_cache *zram_entry_cache;
+
+u32 zram_dedup_checksum(unsigned char *mem)
+{
+	return jhash2((u32 *)mem, PAGE_SIZE / sizeof(u32), 0);
+}
+
+static struct zram_hash *zram_dedup_bucket(struct zram *zram, u32 checksum)
+{
+	return &zram->hash[checksum % zram->hash_size];
+}
+
+/* Compare the object of @entry against the uncompressed page @mem */
+static int zram_dedup_match(struct zram *zram, struct zcomp_strm *zstrm,
+			struct zram_entry *entry, unsigned char *mem)
+{
+	int match = 0;
+	unsigned char *cmem;
+
+	cmem = zs_map_object(zram->mem_pool, entry->handle);
+	if (!zcomp_decompress(zram->comp, zstrm,
+			cmem + sizeof(struct zobj_header), entry->len,
+			zstrm->buffer))
+		match = !memcmp(mem, zstrm->buffer, PAGE_SIZE);
+	zs_unmap_object(zram->mem_pool, entry->handle);
+
+	return match;
+}
+
+/*
+ * Look up an object with the same content as @mem and take a reference
+ * to it. Candidates are decompressed into the stream buffer of @zstrm
+ * to rule out checksum collisions. Entries with equal checksums are
+ * adjacent in the tree, and each of them is tried in turn; the one
+ * being compared is pinned by a reference, so that the walk can go on
+ * from it after dropping the lock.
+ */
+struct zram_entry *zram_dedup_find(struct zram *zram, struct zcomp_strm *zstrm,
+				unsigned char *mem, u32 checksum)
+{
+	struct zram_hash *hash = zram_dedup_bucket(zram, checksum);
+	struct zram_entry *entry = NULL, *next;
+	struct rb_node *rb_node, *prev;
+
+	spin_lock(&hash->lock);
+	rb_node = hash->rb_root.rb_node;
+	while (rb_node) {
+		entry = rb_entry(rb_node, struct zram_entry, rb_node);
+		if (checksum == entry->checksum)
+			break;
+		if (checksum < entry->checksum)
+			rb_node = rb_node->rb_left;
+		else
+			rb_node = rb_node->rb_right;
+	}
+	if (!rb_node) {
+		spin_unlock(&hash->lock);
+		return NULL;
+	}
+
+	while ((prev = rb_prev(rb_node)) &&
+	       rb_entry(prev, struct zram_entry, rb_node)->checksum == checksum)
+		rb_node = prev;
+	entry = rb_entry(rb_node, struct zram_entry, rb_node);
+	entry->refcount++;
+	spin_unlock(&hash->lock);
+
+	for (;;) {
+		if (zram_dedup_match(zram, zstrm, entry, mem))
+			return entry;
+
+		spin_lock(&hash->lock);
+		rb_node = rb_next(&entry->rb_node);
+		next = rb_node ? rb_entry(rb_node, struct zram_entry, rb_node) :
+			NULL;
+		if (next && next->checksum == checksum)
+			next->refcount++;
+		else
+			next = NULL;
+		spin_unlock(&hash->lock);
+
+		zram_dedup_put(zram, entry);
+		if (!next)
+			return NULL;
+		entry = next;
+	}
+}
+
+/*
+ * Make the freshly stored object @handle available for deduplication.
+ * Returns NULL if no memory is available for tracking it, in which case
+ * the caller keeps owning the object.
+ */
+struct zram_entry *zram_dedup_insert(struct zram *zram, void *handle,
+				u16 len, u32 checksum)
+{
+	struct zram_hash *hash = zram_dedup_bucket(zram, checksum);
+	struct rb_node **rb_node, *parent = NULL;
+	struct zram_entry *entry, *e;
+
+	entry = kmem_cache_alloc(zram_entry_cache, GFP_NOIO | __GFP_NOWARN);
+	if (!entry)
+		return NULL;
+
+	entry->handle = handle;
+	entry->checksum = checksum;
+	entry->len = len;
+	entry->refcount = 1;
+
+	spin_lock(&hash->lock);
+	rb_node = &hash->rb_root.rb_node;
+	while (*rb_node) {
+		parent = *rb_node;
+		e = rb_entry(parent, struct zram_entry, rb_node);
+		if (checksum < e->checksum)
+			rb_node = &parent->rb_left;
+		else
+			rb_node = &parent->rb_right;
+	}
+	rb_link_node(&entry->rb_node, parent, rb_node);
+	rb_insert_color(&entry->rb_node, &hash->rb_root);
+	spin_unlock(&hash->lock);
+
+	return entry;
+}
+
+/*
+ * Drop a reference to @entry, freeing the object with the last one.
+ * Returns 1 if the object was freed.
+ */
+int zram_dedup_put(struct zram *zram, struct zram_entry *entry)
+{
+	struct zram_hash *hash = zram_dedup_bucket(zram, entry->checksum);
+	unsigned long refcount;
+
+	spin_lock(&hash->lock);
+	refcount = --entry->refcount;
+	if (!refcount)
+		rb_erase(&entry->rb_node, &hash->rb_root);
+	spin_unlock(&hash->lock);
+
+	if (refcount)
+		return 0;
+
+	zs_free(zram->mem_pool, entry->handle);
+	kmem_cache_free(zram_entry_cache, entry);
+	return 1;
+}
+
+int zram_dedup_init(struct zram *zram, size_t num_pages)
+{
+	size_t i;
+
+	if (!zram->use_dedup)
+		return 0;
+
+	zram->hash_size = max_t(size_t, num_pages >> ZRAM_HASH_SHIFT, 1);
+	zram->hash = vzalloc(zram->hash_size * sizeof(struct zram_hash));
+	if (!zram->hash)
+		return -ENOMEM;
+
+	for (i = 0; i < zram->hash_size; i++) {
+		spin_lock_init(&zram->hash[i].lock);
+		zram->hash[i].rb_root = RB_ROOT;
+	}
+
+	return 0;
+}
+
+void zram_dedup_fini(struct zram *zram)
+{
+	vfree(zram->hash);
+	zram->hash = NULL;
+	zram->hash_size = 0;
+}
+
+int zram_dedup_cache_create(void)
+{
+	zram_entry_cache = KMEM_CACHE(zram_entry, 0);
+	if (!zram_entry_cache)
+		return -ENOMEM;
+	return 0;
+}
+
+void zram_dedup_cache_destroy(void)
+{
+	kmem_cache_destroy(zram_entry_cache);
+}
@@ -0,0 +1,51 @@
+/*
+ * Compressed RAM block device - same page deduplication
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZRAM_DEDUP_H_
+#define _ZRAM_DEDUP_H_
+
+#include <linux/rbtree.h>
+#include <linux/spinlock.h>
+
+struct zram;
+struct zcomp_strm;
+
+/*
+ * A compressed object shared by all table entries with identical
+ * content. Table entries flagged ZRAM_DEDUP point to one of these
+ * instead of to the zsmalloc object itself.
+ */
+struct zram_entry {
+	struct rb_node rb_node;
+	void *handle;		/* zsmalloc handle */
+	u32 checksum;		/* of the uncompressed page */
+	u16 len;		/* compressed length */
+	unsigned long refcount;	/* protected by the bucket lock */
+};
+
+struct zram_hash {
+	spinlock_t lock;
+	struct rb_root rb_root;
+};
+
+u32 zram_dedup_checksum(unsigned char *mem);
+struct zram_entry *zram_dedup_find(struct zram *zram, struct zcomp_strm *zstrm,
+				unsigned char *mem, u32 checksum);
+struct zram_entry *zram_dedup_insert(struct zram *zram, void *handle,
+				u16 len, u32 checksum);
+int zram_dedup_put(struct zram *zram, struct zram_entry *entry);
+
+int zram_dedup_init(struct zram *zram, size_t num_pages);
+void zram_dedup_fini(struct zram *zram);
+
+int zram_dedup_cache_create(void);
+void zram_dedup_cache_destroy(void);
+
+#endif
@@ -29,9 +29,12 @@
 #include <linux/genhd.h>
 #include <linux/highmem.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
+#include <linux/cpumask.h>
+#include <linux/fs.h>
+#include <linux/sched.h>
+#include <linux/workqueue.h>
 
 #include "zram_drv.h"
 
@@ -89,21 +92,37 @@ static void zram_clear_flag(struct zram *zram, u32 index,
 	zram->table[index].flags &= ~BIT(flag);
 }
 
-static int page_zero_filled(void *ptr)
+static int page_same_filled(void *ptr, unsigned long *element)
 {
 	unsigned int pos;
 	unsigned long *page;
 
 	page = (unsigned long *)ptr;
 
-	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++) {
-		if (page[pos])
+	for (pos = 1; pos != PAGE_SIZE / sizeof(*page); pos++) {
+		if (page[pos] != page[0])
 			return 0;
 	}
 
+	*element = page[0];
 	return 1;
 }
 
+static void zram_fill_page(void *ptr, unsigned int len, unsigned long element)
+{
+	unsigned int pos;
+	unsigned long *page;
+
+	if (!element) {
+		memset(ptr, 0, len);
+		return;
+	}
+
+	page = (unsigned long *)ptr;
+	for (pos = 0; pos != len / sizeof(*page); pos++)
+		page[pos] = element;
+}
+
 static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 {
 	if (!zram->disksize) {
@@ -133,22 +152,326 @@ static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 	zram->disksize &= PAGE_MASK;
 }
 
+static inline int is_partial_io(struct bio_vec *bvec)
+{
+	return bvec->bv_len != PAGE_SIZE;
+}
+
+/*
+ * Completion state for a bio that has reads outstanding against the
+ * backing device. The bio is completed when the last one finishes.
+ */
+struct zram_bio_ctx {
+	struct zram *zram;
+	struct bio *parent;
+	atomic_t pending;
+	int error;
+};
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+static u32 zram_now(void)
+{
+	struct timespec ts;
+
+	get_monotonic_boottime(&ts);
+	return ts.tv_sec;
+}
+
+/*
+ * Called with tb_lock held for reading, so readers of the same page may
+ * race here. ac_time is a naturally aligned u32 and cannot be torn; the
+ * racing stores only differ in which of them wins.
+ */
+static void zram_accessed(struct zram *zram, u32 index)
+{
+	ACCESS_ONCE(zram->table[index].ac_time) = zram_now();
+}
+
+/*
+ * Block 0 is never handed out: a written back page with blk_idx 0 would
+ * look like an empty slot to the !handle checks on the read path.
+ */
+static int zram_alloc_bdev_block(struct zram *zram, unsigned long *blk_idx)
+{
+	unsigned long idx = 1;
+
+	do {
+		idx = find_next_zero_bit(zram->bitmap, zram->nr_pages, idx);
+		if (idx >= zram->nr_pages)
+			return -ENOSPC;
+	} while (test_and_set_bit(idx, zram->bitmap));
+
+	*blk_idx = idx;
+	return 0;
+}
+
+static void zram_free_bdev_block(struct zram *zram, unsigned long blk_idx)
+{
+	clear_bit(blk_idx, zram->bitmap);
+}
+
+static void zram_bio_ctx_put(struct zram_bio_ctx *ctx)
+{
+	struct bio *parent = ctx->parent;
+	int error;
+
+	if (!atomic_dec_and_test(&ctx->pending))
+		return;
+
+	error = ctx->error;
+	kfree(ctx);
+	if (!error)
+		set_bit(BIO_UPTODATE, &parent->bi_flags);
+	bio_endio(parent, error);
+}
+
+static void zram_bdev_end_io(struct bio *bio, int err)
+{
+	struct zram_bio_ctx *ctx = bio->bi_private;
+	struct zram *zram = ctx->zram;
+
+	if (err || !test_bit(BIO_UPTODATE, &bio->bi_flags))
+		ctx->error = -EIO;
+	else
+		flush_dcache_page(bio->bi_io_vec[0].bv_page);
+
+	bio_put(bio);
+	zram_bio_ctx_put(ctx);
+
+	if (atomic_dec_and_test(&zram->bd_reads_pending))
+		wake_up(&zram->bd_wait);
+}
+
+/* Wait for reads that zram_bdev_read() did not wait for itself */
+static void zram_bdev_wait_reads(struct zram *zram)
+{
+	wait_event(zram->bd_wait, !atomic_read(&zram->bd_reads_pending));
+}
+
+static void zram_bdev_sync_end_io(struct bio *bio, int err)
+{
+	complete(bio->bi_private);
+}
+
+static struct bio *zram_bdev_bio(struct zram *zram, struct page *page,
+				 unsigned int offset, unsigned long blk_idx)
+{
+	struct bio *bio;
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		return NULL;
+
+	bio->bi_bdev = zram->bdev;
+	bio->bi_sector = blk_idx << SECTORS_PER_PAGE_SHIFT;
+	if (!bio_add_page(bio, page, PAGE_SIZE, offset)) {
+		bio_put(bio);
+		return NULL;
+	}
+
+	return bio;
+}
+
+static int zram_bdev_rw_sync(struct zram *zram, struct page *page,
+			     unsigned long blk_idx, int rw)
+{
+	DECLARE_COMPLETION_ONSTACK(done);
+	struct bio *bio;
+	int ret;
+
+	bio = zram_bdev_bio(zram, page, 0, blk_idx);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_private = &done;
+	bio->bi_end_io = zram_bdev_sync_end_io;
+	submit_bio(rw | REQ_SYNC, bio);
+	wait_for_completion(&done);
+
+	ret = test_bit(BIO_UPTODATE, &bio->bi_flags) ? 0 : -EIO;
+	bio_put(bio);
+
+	if (!ret)
+		zram_stat64_inc(zram, rw == READ ? &zram->stats.bd_reads :
+						   &zram->stats.bd_writes);
+	return ret;
+}
+
+struct zram_work {
+	struct work_struct work;
+	struct zram *zram;
+	struct page *page;
+	unsigned long blk_idx;
+	int ret;
+};
+
+static void zram_bdev_read_work(struct work_struct *work)
+{
+	struct zram_work *zw = container_of(work, struct zram_work, work);
+
+	zw->ret = zram_bdev_rw_sync(zw->zram, zw->page, zw->blk_idx, READ);
+}
+
+/*
+ * Read a backing device block into @page and wait for it. Within
+ * zram_make_request() submit_bio() only queues the bio on
+ * current->bio_list until we return, so the read is submitted and
+ * waited for by a worker instead.
+ */
+static int zram_bdev_read_sync(struct zram *zram, struct page *page,
+			       unsigned long blk_idx)
+{
+	struct zram_work zw;
+
+	zw.zram = zram;
+	zw.page = page;
+	zw.blk_idx = blk_idx;
+	INIT_WORK_ONSTACK(&zw.work, zram_bdev_read_work);
+	queue_work(system_unbound_wq, &zw.work);
+	flush_work(&zw.work);
+	destroy_work_on_stack(&zw.work);
+
+	return zw.ret;
+}
+
+/* Read a written back page into @mem, waiting for the I/O */
+static int zram_bdev_read_mem(struct zram *zram, unsigned long blk_idx,
+			      void *mem)
+{
+	struct page *page;
+	void *src;
+	int ret;
+
+	page = alloc_page(GFP_NOIO);
+	if (!page)
+		return -ENOMEM;
+
+	ret = zram_bdev_read_sync(zram, page, blk_idx);
+	if (!ret) {
+		src = kmap_atomic(page);
+		memcpy(mem, src, PAGE_SIZE);
+		kunmap_atomic(src);
+	}
+
+	__free_page(page);
+	return ret;
+}
+
+/*
+ * Read a written back page for @bvec. Whole pages are read straight
+ * into the bio page without waiting; @parent then completes when the
+ * last such read does. Partial I/O goes through a bounce page.
+ */
+static int zram_bdev_read(struct zram *zram, struct bio_vec *bvec,
+			  unsigned long blk_idx, int offset,
+			  struct bio *parent, struct zram_bio_ctx **ctxp)
+{
+	struct zram_bio_ctx *ctx = *ctxp;
+	struct page *page;
+	struct bio *bio;
+	void *src, *dst;
+	int ret;
+
+	if (!is_partial_io(bvec)) {
+		if (!ctx) {
+			ctx = kmalloc(sizeof(*ctx), GFP_NOIO);
+			if (ctx) {
+				ctx->zram = zram;
+				ctx->parent = parent;
+				atomic_set(&ctx->pending, 1);
+				ctx->error = 0;
+				*ctxp = ctx;
+			}
+		}
+
+		bio = ctx ? zram_bdev_bio(zram, bvec->bv_page,
+					  bvec->bv_offset, blk_idx) : NULL;
+		if (bio) {
+			bio->bi_private = ctx;
+			bio->bi_end_io = zram_bdev_end_io;
+			atomic_inc(&ctx->pending);
+			atomic_inc(&zram->bd_reads_pending);
+			zram_stat64_inc(zram, &zram->stats.bd_reads);
+			submit_bio(READ, bio);
+			return 0;
+		}
+	}
+
+	page = alloc_page(GFP_NOIO);
+	if (!page)
+		return -ENOMEM;
+
+	ret = zram_bdev_read_sync(zram, page, blk_idx);
+	if (!ret) {
+		dst = kmap_atomic(bvec->bv_page);
+		src = kmap_atomic(page);
+		memcpy(dst + bvec->bv_offset, src + offset, bvec->bv_len);
+		kunmap_atomic(src);
+		kunmap_atomic(dst);
+		flush_dcache_page(bvec->bv_page);
+	}
+
+	__free_page(page);
+	return ret;
+}
+#else
+static inline void zram_accessed(struct zram *zram, u32 index) {}
+static inline void zram_free_bdev_block(struct zram *zram,
+					unsigned long blk_idx) {}
+static inline void zram_bio_ctx_put(struct zram_bio_ctx *ctx) {}
+static inline void zram_bdev_wait_reads(struct zram *zram) {}
+
+static inline int zram_bdev_read_mem(struct zram *zram,
+				     unsigned long blk_idx, void *mem)
+{
+	return -EIO;
+}
+
+static inline int zram_bdev_read(struct zram *zram, struct bio_vec *bvec,
+				 unsigned long blk_idx, int offset,
+				 struct bio *parent, struct zram_bio_ctx **ctxp)
+{
+	return -EIO;
+}
+#endif
+
+/*
+ * Release memory backing the given table entry.
+ * Caller must hold zram->tb_lock for writing.
+ */
 static void zram_free_page(struct zram *zram, size_t index)
 {
 	void *handle = zram->table[index].handle;
+	int shared = 0;
+
+	/* tell a pending writeback that the slot changed under it */
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
 
-	if (unlikely(!handle)) {
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		zram_clear_flag(zram, index, ZRAM_WB);
+		zram_free_bdev_block(zram, zram->table[index].blk_idx);
+		zram_stat_dec(&zram->stats.bd_count);
+		zram_stat_dec(&zram->stats.pages_stored);
+		zram->table[index].blk_idx = 0;
+		return;
+	}
+
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
 		/*
-		 * No memory is allocated for zero filled pages.
-		 * Simply clear zero page flag.
+		 * No memory is allocated for same element filled pages.
+		 * Simply clear same page flag.
 		 */
-		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-			zram_clear_flag(zram, index, ZRAM_ZERO);
+		zram_clear_flag(zram, index, ZRAM_SAME);
+		if (!zram->table[index].element)
 			zram_stat_dec(&zram->stats.pages_zero);
-		}
+		zram_stat_dec(&zram->stats.pages_same);
+		zram->table[index].element = 0;
 		return;
 	}
 
+	if (unlikely(!handle))
+		return;
+
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
 		__free_page(handle);
 		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
@@ -156,201 +479,231 @@ static void zram_free_page(struct zram *zram, size_t index)
 		goto out;
 	}
 
-	zs_free(zram->mem_pool, handle);
+	if (zram_test_flag(zram, index, ZRAM_DEDUP)) {
+		zram_clear_flag(zram, index, ZRAM_DEDUP);
+		/* the object may still be used by other table entries */
+		if (!zram_dedup_put(zram, handle)) {
+			zram_stat64_sub(zram, &zram->stats.dedup_saved,
+					zram->table[index].size);
+			shared = 1;
+		}
+	} else {
+		zs_free(zram->mem_pool, handle);
+	}
 
 	if (zram->table[index].size <= PAGE_SIZE / 2)
 		zram_stat_dec(&zram->stats.good_compress);
 
 out:
-	zram_stat64_sub(zram, &zram->stats.compr_size,
-			zram->table[index].size);
+	if (!shared)
+		zram_stat64_sub(zram, &zram->stats.compr_size,
+				zram->table[index].size);
 	zram_stat_dec(&zram->stats.pages_stored);
 
 	zram->table[index].handle = NULL;
 	zram->table[index].size = 0;
 }
 
-static void handle_zero_page(struct bio_vec *bvec)
+static void handle_same_page(struct bio_vec *bvec, unsigned long element)
 {
 	struct page *page = bvec->bv_page;
 	void *user_mem;
 
 	user_mem = kmap_atomic(page);
-	memset(user_mem + bvec->bv_offset, 0, bvec->bv_len);
+	zram_fill_page(user_mem + bvec->bv_offset, bvec->bv_len, element);
 	kunmap_atomic(user_mem);
 
 	flush_dcache_page(page);
 }
 
-static void handle_uncompressed_page(struct zram *zram, struct bio_vec *bvec,
-				     u32 index, int offset)
+/*
+ * Decompress the page stored at @index into @mem (PAGE_SIZE bytes).
+ * Only the read side of tb_lock is taken, so any number of readers
+ * can decompress concurrently with each other and with writers that
+ * are still compressing. @zstrm comes from zcomp_decompress_begin().
+ */
+static int __zram_decompress_page(struct zram *zram, struct zcomp_strm *zstrm,
+				  char *mem, u32 index)
 {
-	struct page *page = bvec->bv_page;
-	unsigned char *user_mem, *cmem;
+	int ret = 0;
+	void *handle;
+	struct zobj_header *zheader;
+	unsigned char *cmem;
 
-	user_mem = kmap_atomic(page);
-	cmem = kmap_atomic(zram->table[index].handle);
+	read_lock(&zram->tb_lock);
+	handle = zram->table[index].handle;
 
-	memcpy(user_mem + bvec->bv_offset, cmem + offset, bvec->bv_len);
-	kunmap_atomic(cmem);
-	kunmap_atomic(user_mem);
+	/* element is 0 for never written pages */
+	if (!handle || zram_test_flag(zram, index, ZRAM_SAME)) {
+		unsigned long element = zram->table[index].element;
 
-	flush_dcache_page(page);
+		read_unlock(&zram->tb_lock);
+		zram_fill_page(mem, PAGE_SIZE, element);
+		return 0;
+	}
+
+	/* Page was written back meanwhile, caller has to read it */
+	if (unlikely(zram_test_flag(zram, index, ZRAM_WB))) {
+		read_unlock(&zram->tb_lock);
+		return -EAGAIN;
+	}
+
+	/* Page is stored uncompressed since it's incompressible */
+	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
+		cmem = kmap_atomic(handle);
+		memcpy(mem, cmem, PAGE_SIZE);
+		kunmap_atomic(cmem);
+		read_unlock(&zram->tb_lock);
+		return 0;
+	}
+
+	if (zram_test_flag(zram, index, ZRAM_DEDUP))
+		handle = ((struct zram_entry *)handle)->handle;
+
+	cmem = zs_map_object(zram->mem_pool, handle);
+	ret = zcomp_decompress(zram->comp, zstrm, cmem + sizeof(*zheader),
+				zram->table[index].size, mem);
+	zs_unmap_object(zram->mem_pool, handle);
+	read_unlock(&zram->tb_lock);
+
+	/* Should NEVER happen. Return bio error if it does. */
+	if (unlikely(ret)) {
+		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
+		zram_stat64_inc(zram, &zram->stats.failed_reads);
+		return ret;
+	}
+
+	return 0;
 }
 
-static inline int is_partial_io(struct bio_vec *bvec)
+/* Like __zram_decompress_page(), but may sleep to read written back pages */
+static int zram_decompress_page(struct zram *zram, char *mem, u32 index)
 {
-	return bvec->bv_len != PAGE_SIZE;
+	int ret;
+	unsigned long blk_idx;
+	struct zcomp_strm *zstrm;
+
+	do {
+		read_lock(&zram->tb_lock);
+		if (zram_test_flag(zram, index, ZRAM_WB)) {
+			blk_idx = zram->table[index].blk_idx;
+			read_unlock(&zram->tb_lock);
+			return zram_bdev_read_mem(zram, blk_idx, mem);
+		}
+		read_unlock(&zram->tb_lock);
+
+		zstrm = zcomp_decompress_begin(zram->comp);
+		ret = __zram_decompress_page(zram, zstrm, mem, index);
+		zcomp_decompress_end(zram->comp, zstrm);
+	} while (ret == -EAGAIN);
+
+	return ret;
 }
 
 static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
-			  u32 index, int offset, struct bio *bio)
+			  u32 index, int offset, struct bio *bio,
+			  struct zram_bio_ctx **ctxp)
 {
 	int ret;
-	size_t clen;
 	struct page *page;
-	struct zobj_header *zheader;
-	unsigned char *user_mem, *cmem, *uncmem = NULL;
+	struct zcomp_strm *zstrm;
+	unsigned char *user_mem, *uncmem = NULL;
 
 	page = bvec->bv_page;
 
-	if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-		handle_zero_page(bvec);
-		return 0;
-	}
+retry:
+	read_lock(&zram->tb_lock);
+	if (unlikely(!zram->table[index].handle) ||
+	    zram_test_flag(zram, index, ZRAM_SAME)) {
+		unsigned long element = zram->table[index].element;
 
-	/* Requested page is not present in compressed area */
-	if (unlikely(!zram->table[index].handle)) {
-		pr_debug("Read before write: sector=%lu, size=%u",
-			 (ulong)(bio->bi_sector), bio->bi_size);
-		handle_zero_page(bvec);
+		read_unlock(&zram->tb_lock);
+		handle_same_page(bvec, element);
 		return 0;
 	}
 
-	/* Page is stored uncompressed since it's incompressible */
-	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-		handle_uncompressed_page(zram, bvec, index, offset);
-		return 0;
+	zram_accessed(zram, index);
+
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		unsigned long blk_idx = zram->table[index].blk_idx;
+
+		read_unlock(&zram->tb_lock);
+		return zram_bdev_read(zram, bvec, blk_idx, offset, bio, ctxp);
 	}
+	read_unlock(&zram->tb_lock);
 
 	if (is_partial_io(bvec)) {
 		/* Use  a temporary buffer to decompress the page */
-		uncmem = kmalloc(PAGE_SIZE, GFP_KERNEL);
+		uncmem = kmalloc(PAGE_SIZE, GFP_NOIO);
 		if (!uncmem) {
 			pr_info("Error allocating temp memory!\n");
 			return -ENOMEM;
 		}
 	}
 
+	zstrm = zcomp_decompress_begin(zram->comp);
 	user_mem = kmap_atomic(page);
 	if (!is_partial_io(bvec))
 		uncmem = user_mem;
-	clen = PAGE_SIZE;
 
-	cmem = zs_map_object(zram->mem_pool, zram->table[index].handle);
-
-	ret = lzo1x_decompress_safe(cmem + sizeof(*zheader),
-				    zram->table[index].size,
-				    uncmem, &clen);
+	ret = __zram_decompress_page(zram, zstrm, uncmem, index);
 
 	if (is_partial_io(bvec)) {
-		memcpy(user_mem + bvec->bv_offset, uncmem + offset,
-		       bvec->bv_len);
+		if (!ret)
+			memcpy(user_mem + bvec->bv_offset, uncmem + offset,
+			       bvec->bv_len);
 		kfree(uncmem);
 	}
 
-	zs_unmap_object(zram->mem_pool, zram->table[index].handle);
 	kunmap_atomic(user_mem);
+	zcomp_decompress_end(zram->comp, zstrm);
 
-	/* Should NEVER happen. Return bio error if it does. */
-	if (unlikely(ret != LZO_E_OK)) {
-		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
-		zram_stat64_inc(zram, &zram->stats.failed_reads);
-		return ret;
+	if (unlikely(ret == -EAGAIN)) {
+		uncmem = NULL;
+		goto retry;
 	}
+	if (unlikely(ret))
+		return ret;
 
 	flush_dcache_page(page);
 
 	return 0;
 }
 
-static int zram_read_before_write(struct zram *zram, char *mem, u32 index)
-{
-	int ret;
-	size_t clen = PAGE_SIZE;
-	struct zobj_header *zheader;
-	unsigned char *cmem;
-
-	if (zram_test_flag(zram, index, ZRAM_ZERO) ||
-	    !zram->table[index].handle) {
-		memset(mem, 0, PAGE_SIZE);
-		return 0;
-	}
-
-	cmem = zs_map_object(zram->mem_pool, zram->table[index].handle);
-
-	/* Page is stored uncompressed since it's incompressible */
-	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-		memcpy(mem, cmem, PAGE_SIZE);
-		kunmap_atomic(cmem);
-		return 0;
-	}
-
-	ret = lzo1x_decompress_safe(cmem + sizeof(*zheader),
-				    zram->table[index].size,
-				    mem, &clen);
-	zs_unmap_object(zram->mem_pool, zram->table[index].handle);
-
-	/* Should NEVER happen. Return bio error if it does. */
-	if (unlikely(ret != LZO_E_OK)) {
-		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
-		zram_stat64_inc(zram, &zram->stats.failed_reads);
-		return ret;
-	}
-
-	return 0;
-}
-
 static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			   int offset)
 {
 	int ret;
-	u32 store_offset;
+	enum zram_pageflags flag = __NR_ZRAM_PAGEFLAGS;
 	size_t clen;
 	void *handle;
+	u32 checksum = 0;
+	unsigned long element;
 	struct zobj_header *zheader;
-	struct page *page, *page_store;
+	struct zram_entry *entry;
+	struct page *page;
+	struct zcomp_strm *zstrm = NULL;
 	unsigned char *user_mem, *cmem, *src, *uncmem = NULL;
 
 	page = bvec->bv_page;
-	src = zram->compress_buffer;
 
 	if (is_partial_io(bvec)) {
 		/*
 		 * This is a partial IO. We need to read the full page
 		 * before to write the changes.
 		 */
-		uncmem = kmalloc(PAGE_SIZE, GFP_KERNEL);
+		uncmem = kmalloc(PAGE_SIZE, GFP_NOIO);
 		if (!uncmem) {
 			pr_info("Error allocating temp memory!\n");
 			ret = -ENOMEM;
 			goto out;
 		}
-		ret = zram_read_before_write(zram, uncmem, index);
-		if (ret) {
-			kfree(uncmem);
+		ret = zram_decompress_page(zram, uncmem, index);
+		if (ret)
 			goto out;
-		}
 	}
 
-	/*
-	 * System overwrites unused sectors. Free memory associated
-	 * with this sector now.
-	 */
-	if (zram->table[index].handle ||
-	    zram_test_flag(zram, index, ZRAM_ZERO))
-		zram_free_page(zram, index);
-
+	zstrm = zcomp_strm_find(zram->comp);
 	user_mem = kmap_atomic(page);
 
 	if (is_partial_io(bvec))
@@ -359,24 +712,45 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 	else
 		uncmem = user_mem;
 
-	if (page_zero_filled(uncmem)) {
+	if (page_same_filled(uncmem, &element)) {
 		kunmap_atomic(user_mem);
-		if (is_partial_io(bvec))
-			kfree(uncmem);
-		zram_stat_inc(&zram->stats.pages_zero);
-		zram_set_flag(zram, index, ZRAM_ZERO);
+		/*
+		 * System overwrites unused sectors. Free memory associated
+		 * with this sector now.
+		 */
+		write_lock(&zram->tb_lock);
+		zram_free_page(zram, index);
+		zram->table[index].element = element;
+		zram_set_flag(zram, index, ZRAM_SAME);
+		zram_stat_inc(&zram->stats.pages_same);
+		if (!element)
+			zram_stat_inc(&zram->stats.pages_zero);
+		write_unlock(&zram->tb_lock);
 		ret = 0;
 		goto out;
 	}
 
-	ret = lzo1x_1_compress(uncmem, PAGE_SIZE, src, &clen,
-			       zram->compress_workmem);
+	if (zram->use_dedup) {
+		checksum = zram_dedup_checksum(uncmem);
+		entry = zram_dedup_find(zram, zstrm, uncmem, checksum);
+		if (entry) {
+			kunmap_atomic(user_mem);
+			handle = entry;
+			clen = entry->len;
+			flag = ZRAM_DEDUP;
+			zram_stat64_inc(zram, &zram->stats.dedup_hits);
+			zram_stat64_add(zram, &zram->stats.dedup_saved, clen);
+			goto memstored;
+		}
+	}
+
+	ret = zcomp_compress(zram->comp, zstrm, uncmem, &clen);
 
 	kunmap_atomic(user_mem);
-	if (is_partial_io(bvec))
-			kfree(uncmem);
+	if (!is_partial_io(bvec))
+		uncmem = NULL;
 
-	if (unlikely(ret != LZO_E_OK)) {
+	if (unlikely(ret)) {
 		pr_err("Compression failed! err=%d\n", ret);
 		goto out;
 	}
@@ -388,21 +762,23 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 	 */
 	if (unlikely(clen > max_zpage_size)) {
 		clen = PAGE_SIZE;
-		page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
-		if (unlikely(!page_store)) {
+		handle = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
+		if (unlikely(!handle)) {
 			pr_info("Error allocating memory for "
 				"incompressible page: %u\n", index);
 			ret = -ENOMEM;
 			goto out;
 		}
 
-		store_offset = 0;
-		zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
-		zram_stat_inc(&zram->stats.pages_expand);
-		handle = page_store;
-		src = kmap_atomic(page);
-		cmem = kmap_atomic(page_store);
-		goto memstore;
+		flag = ZRAM_UNCOMPRESSED;
+		cmem = kmap_atomic(handle);
+		src = uncmem ? uncmem : kmap_atomic(page);
+		memcpy(cmem, src, clen);
+		if (!uncmem)
+			kunmap_atomic(src);
+		kunmap_atomic(cmem);
+		zram_stat64_add(zram, &zram->stats.compr_size, clen);
+		goto memstored;
 	}
 
 	handle = zs_malloc(zram->mem_pool, clen + sizeof(*zheader));
@@ -414,56 +790,72 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 	}
 	cmem = zs_map_object(zram->mem_pool, handle);
 
-memstore:
 #if 0
 	/* Back-reference needed for memory defragmentation */
-	if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
-		zheader = (struct zobj_header *)cmem;
-		zheader->table_idx = index;
-		cmem += sizeof(*zheader);
-	}
+	zheader = (struct zobj_header *)cmem;
+	zheader->table_idx = index;
+	cmem += sizeof(*zheader);
 #endif
 
-	memcpy(cmem, src, clen);
+	memcpy(cmem, zstrm->buffer, clen);
+	zs_unmap_object(zram->mem_pool, handle);
+	zram_stat64_add(zram, &zram->stats.compr_size, clen);
 
-	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-		kunmap_atomic(cmem);
-		kunmap_atomic(src);
-	} else {
-		zs_unmap_object(zram->mem_pool, handle);
+	/* let later writes of the same content share this object */
+	if (zram->use_dedup) {
+		entry = zram_dedup_insert(zram, handle, clen, checksum);
+		if (entry) {
+			handle = entry;
+			flag = ZRAM_DEDUP;
+		}
 	}
 
+memstored:
+	zcomp_strm_release(zram->comp, zstrm);
+	zstrm = NULL;
+
+	/*
+	 * Free memory associated with this sector now and publish the
+	 * new object. Compression ran without the table lock held, so
+	 * this is the only part of a write that excludes readers.
+	 */
+	write_lock(&zram->tb_lock);
+	zram_free_page(zram, index);
+
 	zram->table[index].handle = handle;
 	zram->table[index].size = clen;
+	if (flag != __NR_ZRAM_PAGEFLAGS)
+		zram_set_flag(zram, index, flag);
+	if (flag == ZRAM_UNCOMPRESSED)
+		zram_stat_inc(&zram->stats.pages_expand);
+	zram_accessed(zram, index);
 
 	/* Update stats */
-	zram_stat64_add(zram, &zram->stats.compr_size, clen);
 	zram_stat_inc(&zram->stats.pages_stored);
 	if (clen <= PAGE_SIZE / 2)
 		zram_stat_inc(&zram->stats.good_compress);
-
-	return 0;
+	write_unlock(&zram->tb_lock);
 
 out:
+	if (zstrm)
+		zcomp_strm_release(zram->comp, zstrm);
+	if (is_partial_io(bvec))
+		kfree(uncmem);
 	if (ret)
 		zram_stat64_inc(zram, &zram->stats.failed_writes);
 	return ret;
 }
 
 static int zram_bvec_rw(struct zram *zram, struct bio_vec *bvec, u32 index,
-			int offset, struct bio *bio, int rw)
+			int offset, struct bio *bio, int rw,
+			struct zram_bio_ctx **ctxp)
 {
 	int ret;
 
-	if (rw == READ) {
-		down_read(&zram->lock);
-		ret = zram_bvec_read(zram, bvec, index, offset, bio);
-		up_read(&zram->lock);
-	} else {
-		down_write(&zram->lock);
+	if (rw == READ)
+		ret = zram_bvec_read(zram, bvec, index, offset, bio, ctxp);
+	else
 		ret = zram_bvec_write(zram, bvec, index, offset);
-		up_write(&zram->lock);
-	}
 
 	return ret;
 }
@@ -480,6 +872,7 @@ static void __zram_make_request(struct zram *zram, struct bio *bio, int rw)
 	int i, offset;
 	u32 index;
 	struct bio_vec *bvec;
+	struct zram_bio_ctx *ctx = NULL;
 
 	switch (rw) {
 	case READ:
@@ -507,26 +900,39 @@ static void __zram_make_request(struct zram *zram, struct bio *bio, int rw)
 			bv.bv_len = max_transfer_size;
 			bv.bv_offset = bvec->bv_offset;
 
-			if (zram_bvec_rw(zram, &bv, index, offset, bio, rw) < 0)
+			if (zram_bvec_rw(zram, &bv, index, offset, bio, rw,
+					 &ctx) < 0)
 				goto out;
 
 			bv.bv_len = bvec->bv_len - max_transfer_size;
 			bv.bv_offset += max_transfer_size;
-			if (zram_bvec_rw(zram, &bv, index+1, 0, bio, rw) < 0)
+			if (zram_bvec_rw(zram, &bv, index+1, 0, bio, rw,
+					 &ctx) < 0)
 				goto out;
 		} else
-			if (zram_bvec_rw(zram, bvec, index, offset, bio, rw)
-			    < 0)
+			if (zram_bvec_rw(zram, bvec, index, offset, bio, rw,
+					 &ctx) < 0)
 				goto out;
 
 		update_position(&index, &offset, bvec);
 	}
 
+	/* reads from the backing device in flight complete the bio */
+	if (ctx) {
+		zram_bio_ctx_put(ctx);
+		return;
+	}
+
 	set_bit(BIO_UPTODATE, &bio->bi_flags);
 	bio_endio(bio, 0);
 	return;
 
 out:
+	if (ctx) {
+		ctx->error = -EIO;
+		zram_bio_ctx_put(ctx);
+		return;
+	}
 	bio_io_error(bio);
 }
 
@@ -577,37 +983,208 @@ error:
 	bio_io_error(bio);
 }
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+/* Check whether the page at @index should be written back */
+static int zram_wb_candidate(struct zram *zram, u32 index,
+			     enum zram_wb_mode mode, u32 now, u32 idle_secs)
+{
+	if (!zram->table[index].handle ||
+	    zram_test_flag(zram, index, ZRAM_SAME) ||
+	    zram_test_flag(zram, index, ZRAM_WB) ||
+	    zram_test_flag(zram, index, ZRAM_UNDER_WB))
+		return 0;
+
+	if (mode == ZRAM_WB_HUGE)
+		return zram_test_flag(zram, index, ZRAM_UNCOMPRESSED);
+
+	return now - ACCESS_ONCE(zram->table[index].ac_time) >= idle_secs;
+}
+
+/*
+ * Move pages selected by @mode to the backing device. Each page is
+ * decompressed into a bounce page and written synchronously, and its
+ * memory is released only if the slot was not changed meanwhile.
+ * Caller must hold init_lock for reading on an initialized device.
+ */
+int zram_writeback(struct zram *zram, enum zram_wb_mode mode, u32 idle_secs)
+{
+	size_t index, num_pages = zram->disksize >> PAGE_SHIFT;
+	unsigned long blk_idx;
+	struct page *page;
+	u32 now = zram_now();
+	void *mem;
+	int ret = 0;
+
+	if (!zram->bdev)
+		return -ENODEV;
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page)
+		return -ENOMEM;
+
+	for (index = 0; index < num_pages; index++) {
+		write_lock(&zram->tb_lock);
+		if (!zram_wb_candidate(zram, index, mode, now, idle_secs)) {
+			write_unlock(&zram->tb_lock);
+			continue;
+		}
+		zram_set_flag(zram, index, ZRAM_UNDER_WB);
+		write_unlock(&zram->tb_lock);
+
+		ret = zram_alloc_bdev_block(zram, &blk_idx);
+		if (ret)
+			goto clear;
+
+		mem = kmap(page);
+		ret = zram_decompress_page(zram, mem, index);
+		kunmap(page);
+		if (!ret)
+			ret = zram_bdev_rw_sync(zram, page, blk_idx, WRITE);
+		if (ret) {
+			zram_free_bdev_block(zram, blk_idx);
+			goto clear;
+		}
+
+		write_lock(&zram->tb_lock);
+		if (!zram_test_flag(zram, index, ZRAM_UNDER_WB)) {
+			/* overwritten or discarded while we were writing */
+			write_unlock(&zram->tb_lock);
+			zram_free_bdev_block(zram, blk_idx);
+			continue;
+		}
+		zram_free_page(zram, index);
+		zram->table[index].blk_idx = blk_idx;
+		zram_set_flag(zram, index, ZRAM_WB);
+		zram_stat_inc(&zram->stats.pages_stored);
+		zram_stat_inc(&zram->stats.bd_count);
+		write_unlock(&zram->tb_lock);
+
+		cond_resched();
+	}
+	goto out;
+
+clear:
+	write_lock(&zram->tb_lock);
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+	write_unlock(&zram->tb_lock);
+out:
+	__free_page(page);
+	return ret;
+}
+
+static void zram_reset_bdev(struct zram *zram)
+{
+	if (!zram->bdev)
+		return;
+
+	blkdev_put(zram->bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	filp_close(zram->backing_dev, NULL);
+	vfree(zram->bitmap);
+
+	zram->backing_dev = NULL;
+	zram->bdev = NULL;
+	zram->bitmap = NULL;
+	zram->nr_pages = 0;
+}
+
+/*
+ * Use the block device at @path for writeback, or detach the current
+ * one if @path is empty. Caller must hold init_lock for writing on an
+ * uninitialized device.
+ */
+int zram_set_backing_dev(struct zram *zram, const char *path)
+{
+	struct file *backing_dev;
+	struct block_device *bdev;
+	struct inode *inode;
+	unsigned long *bitmap;
+	unsigned long nr_pages;
+	int ret;
+
+	zram_reset_bdev(zram);
+	if (!*path)
+		return 0;
+
+	backing_dev = filp_open(path, O_RDWR | O_LARGEFILE, 0);
+	if (IS_ERR(backing_dev))
+		return PTR_ERR(backing_dev);
+
+	inode = backing_dev->f_mapping->host;
+	if (!S_ISBLK(inode->i_mode)) {
+		ret = -ENOTBLK;
+		goto out_close;
+	}
+
+	bdev = bdgrab(I_BDEV(inode));
+	ret = blkdev_get(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL, zram);
+	if (ret < 0)
+		goto out_close;
+
+	nr_pages = i_size_read(inode) >> PAGE_SHIFT;
+	bitmap = nr_pages > 1 ?
+		vzalloc(BITS_TO_LONGS(nr_pages) * sizeof(long)) : NULL;
+	if (!bitmap) {
+		ret = nr_pages > 1 ? -ENOMEM : -EINVAL;
+		blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+		goto out_close;
+	}
+	/* see zram_alloc_bdev_block() */
+	set_bit(0, bitmap);
+
+	zram->backing_dev = backing_dev;
+	zram->bdev = bdev;
+	zram->bitmap = bitmap;
+	zram->nr_pages = nr_pages;
+	pr_info("setup backing device %s\n", path);
+	return 0;
+
+out_close:
+	filp_close(backing_dev, NULL);
+	return ret;
+}
+#else
+static inline void zram_reset_bdev(struct zram *zram) {}
+#endif
+
 void __zram_reset_device(struct zram *zram)
 {
 	size_t index;
 
 	zram->init_done = 0;
 
-	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
+	/* Reads from the backing device may still be filling bio pages */
+	zram_bdev_wait_reads(zram);
 
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+	/* Free the compression streams */
+	if (zram->comp)
+		zcomp_destroy(zram->comp);
+	zram->comp = NULL;
 
 	/* Free all pages that are still in this zram device */
 	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
 		void *handle = zram->table[index].handle;
-		if (!handle)
+		if (!handle || zram_test_flag(zram, index, ZRAM_SAME) ||
+		    zram_test_flag(zram, index, ZRAM_WB))
 			continue;
 
 		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
 			__free_page(handle);
+		else if (zram_test_flag(zram, index, ZRAM_DEDUP))
+			zram_dedup_put(zram, handle);
 		else
 			zs_free(zram->mem_pool, handle);
 	}
 
 	vfree(zram->table);
 	zram->table = NULL;
+	zram_dedup_fini(zram);
 
 	zs_destroy_pool(zram->mem_pool);
 	zram->mem_pool = NULL;
 
+	/* Written back pages are gone with the table */
+	zram_reset_bdev(zram);
+
 	/* Reset stats */
 	memset(&zram->stats, 0, sizeof(zram->stats));
 
@@ -635,17 +1212,10 @@ int zram_init_device(struct zram *zram)
 
 	zram_set_disksize(zram, totalram_pages << PAGE_SHIFT);
 
-	zram->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail_no_table;
-	}
-
-	zram->compress_buffer =
-		(void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
+	zram->comp = zcomp_create(zram->compressor, zram->max_comp_streams);
+	if (!zram->comp) {
+		pr_err("Error initializing %s compressor!\n",
+			zram->compressor);
 		ret = -ENOMEM;
 		goto fail_no_table;
 	}
@@ -658,12 +1228,19 @@ int zram_init_device(struct zram *zram)
 		goto fail_no_table;
 	}
 
+	ret = zram_dedup_init(zram, num_pages);
+	if (ret) {
+		pr_err("Error allocating dedup hash table\n");
+		goto fail;
+	}
+
 	set_capacity(zram->disk, zram->disksize >> SECTOR_SHIFT);
 
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
-	zram->mem_pool = zs_create_pool("zram", GFP_NOIO | __GFP_HIGHMEM);
+	zram->mem_pool = zs_create_pool(zram->disk->disk_name,
+					GFP_NOIO | __GFP_HIGHMEM);
 	if (!zram->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
@@ -692,7 +1269,9 @@ static void zram_slot_free_notify(struct block_device *bdev,
 	struct zram *zram;
 
 	zram = bdev->bd_disk->private_data;
+	write_lock(&zram->tb_lock);
 	zram_free_page(zram, index);
+	write_unlock(&zram->tb_lock);
 	zram_stat64_inc(zram, &zram->stats.notify_free);
 }
 
@@ -705,9 +1284,15 @@ static int create_device(struct zram *zram, int device_id)
 {
 	int ret = 0;
 
-	init_rwsem(&zram->lock);
+	rwlock_init(&zram->tb_lock);
 	init_rwsem(&zram->init_lock);
 	spin_lock_init(&zram->stat64_lock);
+#ifdef CONFIG_ZRAM_WRITEBACK
+	init_waitqueue_head(&zram->bd_wait);
+#endif
+	zram->max_comp_streams = num_online_cpus();
+	strlcpy(zram->compressor, default_compressor,
+		sizeof(zram->compressor));
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -777,6 +1362,9 @@ static void destroy_device(struct zram *zram)
 
 	if (zram->queue)
 		blk_cleanup_queue(zram->queue);
+
+	/* a backing device may be set up without initializing the disk */
+	zram_reset_bdev(zram);
 }
 
 unsigned int zram_get_num_devices(void)
@@ -795,11 +1383,17 @@ static int __init zram_init(void)
 		goto out;
 	}
 
+	ret = zram_dedup_cache_create();
+	if (ret) {
+		pr_warning("Unable to create dedup entry cache\n");
+		goto out;
+	}
+
 	zram_major = register_blkdev(0, "zram");
 	if (zram_major <= 0) {
 		pr_warning("Unable to get major number\n");
 		ret = -EBUSY;
-		goto out;
+		goto destroy_cache;
 	}
 
 	if (!num_devices) {
@@ -829,6 +1423,8 @@ free_devices:
 	kfree(zram_devices);
 unregister:
 	unregister_blkdev(zram_major, "zram");
+destroy_cache:
+	zram_dedup_cache_destroy();
 out:
 	return ret;
 }
@@ -849,6 +1445,7 @@ static void __exit zram_exit(void)
 	unregister_blkdev(zram_major, "zram");
 
 	kfree(zram_devices);
+	zram_dedup_cache_destroy();
 	pr_debug("Cleanup done!\n");
 }
 
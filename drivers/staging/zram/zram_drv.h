@@ -19,6 +19,8 @@
 #include <linux/mutex.h>
 
 #include "../zsmalloc/zsmalloc.h"
+#include "zcomp.h"
+#include "zram_dedup.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -40,6 +42,9 @@ struct zobj_header {
 
 /*-- Configurable parameters */
 
+/* Default compression algorithm, see comp_algorithm sysfs node */
+static const char default_compressor[] = "lzo";
+
 /* Default zram disk size: 25% of total RAM */
 static const unsigned default_disksize_perc_ram = 25;
 
@@ -71,8 +76,17 @@ enum zram_pageflags {
 	/* Page is stored uncompressed */
 	ZRAM_UNCOMPRESSED,
 
-	/* Page consists entirely of zeros */
-	ZRAM_ZERO,
+	/* Page is filled with one repeated word, kept in table.element */
+	ZRAM_SAME,
+
+	/* table.handle points to a shared struct zram_entry */
+	ZRAM_DEDUP,
+
+	/* Page was written back to the backing device, see blk_idx */
+	ZRAM_WB,
+
+	/* Page is being written back; cleared when the slot is freed */
+	ZRAM_UNDER_WB,
 
 	__NR_ZRAM_PAGEFLAGS,
 };
@@ -81,10 +95,17 @@ enum zram_pageflags {
 
 /* Allocated for each disk page */
 struct table {
-	void *handle;
+	union {
+		void *handle;
+		unsigned long element;	/* for ZRAM_SAME pages */
+		unsigned long blk_idx;	/* for ZRAM_WB pages */
+	};
 	u16 size;	/* object size (excluding header) */
 	u8 count;	/* object ref count (not yet used) */
 	u8 flags;
+#ifdef CONFIG_ZRAM_WRITEBACK
+	u32 ac_time;	/* last access, in seconds since boot */
+#endif
 } __attribute__((aligned(4)));
 
 struct zram_stats {
@@ -95,20 +116,24 @@ struct zram_stats {
 	u64 failed_writes;	/* can happen when memory is too low */
 	u64 invalid_io;		/* non-page-aligned I/O requests */
 	u64 notify_free;	/* no. of swap slot free notifications */
+	u64 dedup_hits;		/* no. of writes that shared an object */
+	u64 dedup_saved;	/* compressed bytes saved by sharing */
+	u64 bd_reads;		/* no. of pages read from backing device */
+	u64 bd_writes;		/* no. of pages written to backing device */
 	u32 pages_zero;		/* no. of zero filled pages */
+	u32 pages_same;		/* no. of same element filled pages */
 	u32 pages_stored;	/* no. of pages currently stored */
 	u32 good_compress;	/* % of pages with compression ratio<=50% */
 	u32 pages_expand;	/* % of incompressible pages */
+	u32 bd_count;		/* no. of pages on backing device */
 };
 
 struct zram {
 	struct zs_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct zcomp *comp;
 	struct table *table;
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct rw_semaphore lock; /* protect compression buffers and table
-				   * against concurrent read and writes */
+	rwlock_t tb_lock;	/* protect table entries and 32-bit stats */
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -119,6 +144,26 @@ struct zram {
 	 * we can store in a disk.
 	 */
 	u64 disksize;	/* bytes */
+	/* max number of concurrent compression streams */
+	int max_comp_streams;
+	char compressor[ZCOMP_NAME_LEN];
+
+	/* content hash index for deduplication, if use_dedup is set */
+	struct zram_hash *hash;
+	size_t hash_size;
+	int use_dedup;
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+	/* backing device for idle and incompressible pages */
+	struct file *backing_dev;
+	struct block_device *bdev;
+	/* one bit per page of the backing device, set if in use */
+	unsigned long *bitmap;
+	unsigned long nr_pages;
+	/* asynchronous reads from the backing device still in flight */
+	atomic_t bd_reads_pending;
+	wait_queue_head_t bd_wait;
+#endif
 
 	struct zram_stats stats;
 };
@@ -132,4 +177,19 @@ extern struct attribute_group zram_disk_attr_group;
 extern int zram_init_device(struct zram *zram);
 extern void __zram_reset_device(struct zram *zram);
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+/* Default age in seconds for a page to count as idle */
+#define ZRAM_WB_IDLE_SECS	3600
+
+/* writeback modes */
+enum zram_wb_mode {
+	ZRAM_WB_HUGE,	/* pages stored uncompressed */
+	ZRAM_WB_IDLE,	/* pages not accessed for a given time */
+};
+
+extern int zram_set_backing_dev(struct zram *zram, const char *path);
+extern int zram_writeback(struct zram *zram, enum zram_wb_mode mode,
+			  u32 idle_secs);
+#endif
+
 #endif
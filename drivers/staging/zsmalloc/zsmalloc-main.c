@@ -17,9 +17,11 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/bitops.h>
+#include <linux/bit_spinlock.h>
 #include <linux/errno.h>
 #include <linux/highmem.h>
 #include <linux/init.h>
+#include <linux/sched.h>
 #include <linux/string.h>
 #include <linux/slab.h>
 #include <asm/tlbflush.h>
@@ -27,6 +29,8 @@
 #include <linux/cpumask.h>
 #include <linux/cpu.h>
 #include <linux/vmalloc.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #include "zsmalloc.h"
 #include "zsmalloc_int.h"
@@ -43,6 +47,9 @@
 /* per-cpu VM mapping areas for zspage accesses that cross page boundaries */
 static DEFINE_PER_CPU(struct mapping_area, zs_map_area);
 
+/* handles, i.e. the words holding the location of each object */
+static struct kmem_cache *zs_handle_cache;
+
 static int is_first_page(struct page *page)
 {
 	return test_bit(PG_private, &page->flags);
@@ -122,6 +129,7 @@ static void insert_zspage(struct page *page, struct size_class *class,
 		list_add_tail(&page->lru, &(*head)->lru);
 
 	*head = page;
+	class->zspage_count[fullness]++;
 }
 
 static void remove_zspage(struct page *page, struct size_class *class,
@@ -143,6 +151,7 @@ static void remove_zspage(struct page *page, struct size_class *class,
 					struct page, lru);
 
 	list_del_init(&page->lru);
+	class->zspage_count[fullness]--;
 }
 
 static enum fullness_group fix_fullness_group(struct zs_pool *pool,
@@ -230,30 +239,67 @@ static struct page *get_next_page(struct page *page)
 	return next;
 }
 
-/* Encode <page, obj_idx> as a single handle value */
-static void *obj_location_to_handle(struct page *page, unsigned long obj_idx)
+/* Encode <page, obj_idx> as a single obj value */
+static unsigned long location_to_obj(struct page *page, unsigned long obj_idx)
 {
-	unsigned long handle;
+	unsigned long obj;
 
 	if (!page) {
 		BUG_ON(obj_idx);
-		return NULL;
+		return 0;
 	}
 
-	handle = page_to_pfn(page) << OBJ_INDEX_BITS;
-	handle |= (obj_idx & OBJ_INDEX_MASK);
+	obj = page_to_pfn(page) << OBJ_INDEX_BITS;
+	obj |= (obj_idx & OBJ_INDEX_MASK);
 
-	return (void *)handle;
+	return obj << OBJ_TAG_BITS;
 }
 
-/* Decode <page, obj_idx> pair from the given object handle */
-static void obj_handle_to_location(void *handle, struct page **page,
+/* Decode <page, obj_idx> pair from the given obj value */
+static void obj_to_location(unsigned long obj, struct page **page,
 				unsigned long *obj_idx)
 {
-	unsigned long hval = (unsigned long)handle;
+	obj >>= OBJ_TAG_BITS;
+	*page = pfn_to_page(obj >> OBJ_INDEX_BITS);
+	*obj_idx = obj & OBJ_INDEX_MASK;
+}
+
+static unsigned long alloc_handle(struct zs_pool *pool)
+{
+	return (unsigned long)kmem_cache_alloc(zs_handle_cache,
+					pool->flags & ~__GFP_HIGHMEM);
+}
 
-	*page = pfn_to_page(hval >> OBJ_INDEX_BITS);
-	*obj_idx = hval & OBJ_INDEX_MASK;
+static void free_handle(unsigned long handle)
+{
+	kmem_cache_free(zs_handle_cache, (void *)handle);
+}
+
+static unsigned long handle_to_obj(unsigned long handle)
+{
+	return *(unsigned long *)handle & ~(1UL << HANDLE_PIN_BIT);
+}
+
+/* Store @obj as the location of @handle, and the pin bit along with it */
+static void record_obj(unsigned long handle, unsigned long obj)
+{
+	*(unsigned long *)handle = obj;
+}
+
+/* Keep the object of @handle from being moved or freed under us */
+static void pin_tag(unsigned long handle)
+{
+	bit_spin_lock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+static int trypin_tag(unsigned long handle)
+{
+	return bit_spin_trylock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+static void unpin_tag(unsigned long handle)
+{
+	bit_spin_unlock(HANDLE_PIN_BIT, (unsigned long *)handle);
 }
 
 static unsigned long obj_idx_to_offset(struct page *page,
@@ -330,7 +376,7 @@ static void init_zspage(struct page *first_page, struct size_class *class)
 		for (i = 1; i <= objs_on_page; i++) {
 			off += class->size;
 			if (off < PAGE_SIZE) {
-				link->next = obj_location_to_handle(page, i);
+				link->next = location_to_obj(page, i);
 				link += class->size / sizeof(*link);
 			}
 		}
@@ -341,7 +387,7 @@ static void init_zspage(struct page *first_page, struct size_class *class)
 		 * page (if present)
 		 */
 		next_page = get_next_page(page);
-		link->next = obj_location_to_handle(next_page, 0);
+		link->next = location_to_obj(next_page, 0);
 		kunmap_atomic(link);
 		page = next_page;
 		off = (off + class->size) % PAGE_SIZE;
@@ -396,9 +442,9 @@ static struct page *alloc_zspage(struct size_class *class, gfp_t flags)
 
 	init_zspage(first_page, class);
 
-	first_page->freelist = obj_location_to_handle(first_page, 0);
+	first_page->freelist = (void *)location_to_obj(first_page, 0);
 	/* Maximum number of objects we can store in this zspage */
-	first_page->objects = class->zspage_order * PAGE_SIZE / class->size;
+	first_page->objects = class->objs_per_zspage;
 
 	error = 0; /* Success */
 
@@ -425,6 +471,432 @@ static struct page *find_get_zspage(struct size_class *class)
 	return page;
 }
 
+/* Take a free object slot from @first_page for @handle */
+static unsigned long obj_malloc(struct size_class *class,
+				struct page *first_page, unsigned long handle)
+{
+	struct link_free *link;
+	struct page *m_page;
+	unsigned long obj, m_objidx, m_offset;
+
+	obj = (unsigned long)first_page->freelist;
+	obj_to_location(obj, &m_page, &m_objidx);
+	m_offset = obj_idx_to_offset(m_page, m_objidx, class->size);
+
+	link = (struct link_free *)((unsigned char *)kmap_atomic(m_page)
+							+ m_offset);
+	first_page->freelist = (void *)link->next;
+	link->handle = handle | OBJ_ALLOCATED_TAG;
+	kunmap_atomic(link);
+
+	first_page->inuse++;
+	class->obj_used++;
+
+	return obj;
+}
+
+/* Insert object @obj in its containing zspage's freelist */
+static void obj_free(struct size_class *class, unsigned long obj)
+{
+	struct link_free *link;
+	struct page *first_page, *f_page;
+	unsigned long f_objidx, f_offset;
+
+	obj_to_location(obj, &f_page, &f_objidx);
+	first_page = get_first_page(f_page);
+	f_offset = obj_idx_to_offset(f_page, f_objidx, class->size);
+
+	link = (struct link_free *)((unsigned char *)kmap_atomic(f_page)
+							+ f_offset);
+	link->next = (unsigned long)first_page->freelist;
+	kunmap_atomic(link);
+	first_page->freelist = (void *)obj;
+
+	first_page->inuse--;
+	class->obj_used--;
+}
+
+/*
+ * Compaction moves objects out of sparsely used zspages into fuller
+ * ones of the same class, so that the emptied zspages can be freed.
+ * It runs entirely under the class lock and skips objects that are
+ * pinned, i.e. mapped or being freed at the time.
+ */
+struct zs_compact_control {
+	/* source sub-page and index of the next object to look at */
+	struct page *s_page;
+	unsigned long obj_idx;
+};
+
+/* Number of pages compaction could free in @class at best */
+static unsigned long zs_can_compact(struct size_class *class)
+{
+	unsigned long obj_wasted;
+
+	obj_wasted = class->obj_allocated - class->obj_used;
+	return obj_wasted / class->objs_per_zspage * class->zspage_order;
+}
+
+/* Copy an object between two locations, either of which may span pages */
+static void zs_object_copy(struct size_class *class, unsigned long dst,
+				unsigned long src)
+{
+	struct page *s_page, *d_page;
+	unsigned long s_objidx, d_objidx;
+	unsigned long s_off, d_off;
+	void *s_addr, *d_addr;
+	int s_size, d_size, size;
+	int written = 0;
+
+	obj_to_location(src, &s_page, &s_objidx);
+	obj_to_location(dst, &d_page, &d_objidx);
+	s_off = obj_idx_to_offset(s_page, s_objidx, class->size);
+	d_off = obj_idx_to_offset(d_page, d_objidx, class->size);
+
+	s_size = min_t(int, class->size, PAGE_SIZE - s_off);
+	d_size = min_t(int, class->size, PAGE_SIZE - d_off);
+
+	s_addr = kmap_atomic(s_page);
+	d_addr = kmap_atomic(d_page);
+
+	while (1) {
+		size = min(s_size, d_size);
+		memcpy(d_addr + d_off, s_addr + s_off, size);
+		written += size;
+
+		if (written == class->size)
+			break;
+
+		s_off += size;
+		s_size -= size;
+		d_off += size;
+		d_size -= size;
+
+		/* kmap_atomic() mappings have to be released in reverse */
+		if (s_off >= PAGE_SIZE) {
+			kunmap_atomic(d_addr);
+			kunmap_atomic(s_addr);
+			s_page = get_next_page(s_page);
+			s_addr = kmap_atomic(s_page);
+			d_addr = kmap_atomic(d_page);
+			s_size = class->size - written;
+			s_off = 0;
+		}
+
+		if (d_off >= PAGE_SIZE) {
+			kunmap_atomic(d_addr);
+			d_page = get_next_page(d_page);
+			d_addr = kmap_atomic(d_page);
+			d_size = class->size - written;
+			d_off = 0;
+		}
+	}
+
+	kunmap_atomic(d_addr);
+	kunmap_atomic(s_addr);
+}
+
+/*
+ * Find the next allocated object starting on @page, from index
+ * *@obj_idx on, and pin it. Returns its handle, or 0 if none is left.
+ */
+static unsigned long find_alloced_obj(struct size_class *class,
+				struct page *page, unsigned long *obj_idx)
+{
+	unsigned long head, handle = 0;
+	unsigned long offset;
+	void *addr;
+
+	offset = obj_idx_to_offset(page, *obj_idx, class->size);
+	addr = kmap_atomic(page);
+
+	while (offset < PAGE_SIZE) {
+		/* the tail of the last page may not hold a whole object */
+		if (is_last_page(page) && offset + class->size > PAGE_SIZE)
+			break;
+
+		head = *(unsigned long *)(addr + offset);
+		if (head & OBJ_ALLOCATED_TAG) {
+			handle = head & ~OBJ_ALLOCATED_TAG;
+			if (trypin_tag(handle))
+				break;
+			handle = 0;
+		}
+
+		offset += class->size;
+		(*obj_idx)++;
+	}
+
+	kunmap_atomic(addr);
+	return handle;
+}
+
+/*
+ * Move objects from the source zspage into @dst_page until either the
+ * source has no movable object left (returns 0) or @dst_page is full
+ * (returns -ENOSPC).
+ */
+static int migrate_zspage(struct size_class *class,
+			struct zs_compact_control *cc, struct page *dst_page)
+{
+	unsigned long handle, used_obj, free_obj;
+
+	while (cc->s_page) {
+		handle = find_alloced_obj(class, cc->s_page, &cc->obj_idx);
+		if (!handle) {
+			cc->s_page = get_next_page(cc->s_page);
+			cc->obj_idx = 0;
+			continue;
+		}
+
+		if (dst_page->inuse == dst_page->objects) {
+			unpin_tag(handle);
+			return -ENOSPC;
+		}
+
+		used_obj = handle_to_obj(handle);
+		free_obj = obj_malloc(class, dst_page, handle);
+		zs_object_copy(class, free_obj, used_obj);
+		cc->obj_idx++;
+
+		/* the pin bit is dropped by unpin_tag() right after */
+		record_obj(handle, free_obj | (1UL << HANDLE_PIN_BIT));
+		unpin_tag(handle);
+		obj_free(class, used_obj);
+	}
+
+	return 0;
+}
+
+/*
+ * Take the least recently inserted zspage of a fullness group off its
+ * list, so that zspages put back meanwhile are not picked again.
+ */
+static struct page *isolate_zspage(struct size_class *class,
+				enum fullness_group fullness)
+{
+	struct page *page = class->fullness_list[fullness];
+
+	if (!page)
+		return NULL;
+
+	page = list_entry(page->lru.prev, struct page, lru);
+	remove_zspage(page, class, fullness);
+	return page;
+}
+
+static enum fullness_group putback_zspage(struct size_class *class,
+					struct page *first_page)
+{
+	enum fullness_group fullness;
+
+	fullness = get_fullness_group(first_page);
+	insert_zspage(first_page, class, fullness);
+	set_zspage_mapping(first_page, class->index, fullness);
+
+	return fullness;
+}
+
+static unsigned long __zs_compact(struct size_class *class)
+{
+	struct zs_compact_control cc;
+	struct page *src_page, *dst_page = NULL;
+	unsigned long nr_src, freed = 0;
+
+	spin_lock(&class->lock);
+
+	/* every sparse zspage is tried as a source at most once */
+	nr_src = class->zspage_count[ZS_ALMOST_EMPTY];
+	while (nr_src-- && zs_can_compact(class)) {
+		src_page = isolate_zspage(class, ZS_ALMOST_EMPTY);
+		if (!src_page)
+			break;
+
+		cc.s_page = src_page;
+		cc.obj_idx = 0;
+
+		while (1) {
+			dst_page = isolate_zspage(class, ZS_ALMOST_FULL);
+			if (!dst_page)
+				dst_page = isolate_zspage(class,
+							ZS_ALMOST_EMPTY);
+			if (!dst_page)
+				break;
+
+			if (!migrate_zspage(class, &cc, dst_page)) {
+				putback_zspage(class, dst_page);
+				break;
+			}
+			putback_zspage(class, dst_page);
+		}
+
+		if (putback_zspage(class, src_page) == ZS_EMPTY) {
+			class->pages_allocated -= class->zspage_order;
+			class->obj_allocated -= class->objs_per_zspage;
+			freed += class->zspage_order;
+			spin_unlock(&class->lock);
+			free_zspage(src_page);
+			spin_lock(&class->lock);
+		}
+
+		/* nothing left to move objects into */
+		if (!dst_page)
+			break;
+
+		spin_unlock(&class->lock);
+		cond_resched();
+		spin_lock(&class->lock);
+	}
+
+	spin_unlock(&class->lock);
+	return freed;
+}
+
+/**
+ * zs_compact - Move objects to free as many zspages as possible.
+ * @pool: pool to compact
+ *
+ * Returns the number of pages freed. May sleep.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	int i;
+	unsigned long freed = 0;
+
+	for (i = ZS_SIZE_CLASSES - 1; i >= 0; i--) {
+		struct size_class *class = &pool->size_class[i];
+
+		if (!zs_can_compact(class))
+			continue;
+		freed += __zs_compact(class);
+	}
+	atomic_long_add(freed, &pool->pages_compacted);
+
+	return freed;
+}
+EXPORT_SYMBOL_GPL(zs_compact);
+
+static unsigned long zs_freeable_pages(struct zs_pool *pool)
+{
+	int i;
+	unsigned long pages = 0;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++)
+		pages += zs_can_compact(&pool->size_class[i]);
+
+	return pages;
+}
+
+static int zs_shrinker(struct shrinker *shrinker, struct shrink_control *sc)
+{
+	struct zs_pool *pool = container_of(shrinker, struct zs_pool,
+					shrinker);
+
+	if (sc->nr_to_scan)
+		zs_compact(pool);
+
+	return min_t(unsigned long, zs_freeable_pages(pool), INT_MAX);
+}
+
+#ifdef CONFIG_ZSMALLOC_STAT
+static struct dentry *zs_stat_root;
+
+static int zs_stats_size_show(struct seq_file *s, void *v)
+{
+	int i;
+	struct zs_pool *pool = s->private;
+	unsigned long almost_full, almost_empty, obj_allocated, obj_used;
+	unsigned long pages_used, freeable;
+	unsigned long total_objs = 0, total_used_objs = 0;
+	unsigned long total_pages = 0, total_freeable = 0;
+
+	seq_printf(s, " %5s %5s %11s %12s %13s %10s %10s %16s %8s\n",
+			"class", "size", "almost_full", "almost_empty",
+			"obj_allocated", "obj_used", "pages_used",
+			"pages_per_zspage", "freeable");
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		spin_lock(&class->lock);
+		almost_full = class->zspage_count[ZS_ALMOST_FULL];
+		almost_empty = class->zspage_count[ZS_ALMOST_EMPTY];
+		obj_allocated = class->obj_allocated;
+		obj_used = class->obj_used;
+		pages_used = class->pages_allocated;
+		freeable = zs_can_compact(class);
+		spin_unlock(&class->lock);
+
+		if (!pages_used)
+			continue;
+
+		seq_printf(s, " %5u %5d %11lu %12lu %13lu %10lu %10lu %16d %8lu\n",
+			i, class->size, almost_full, almost_empty,
+			obj_allocated, obj_used, pages_used,
+			class->zspage_order, freeable);
+
+		total_objs += obj_allocated;
+		total_used_objs += obj_used;
+		total_pages += pages_used;
+		total_freeable += freeable;
+	}
+
+	seq_puts(s, "\n");
+	seq_printf(s, " %5s %5s %11s %12s %13lu %10lu %10lu %16s %8lu\n",
+			"Total", "", "", "", total_objs, total_used_objs,
+			total_pages, "", total_freeable);
+	seq_printf(s, "\npages_compacted: %ld\n",
+			atomic_long_read(&pool->pages_compacted));
+
+	return 0;
+}
+
+static int zs_stats_size_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, zs_stats_size_show, inode->i_private);
+}
+
+static const struct file_operations zs_stat_size_ops = {
+	.open		= zs_stats_size_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void zs_pool_stat_create(struct zs_pool *pool)
+{
+	if (!zs_stat_root)
+		return;
+
+	pool->stat_dentry = debugfs_create_file(pool->name, S_IRUGO,
+					zs_stat_root, pool, &zs_stat_size_ops);
+	if (!pool->stat_dentry)
+		pr_warn("%s: debugfs file creation failed\n", pool->name);
+}
+
+static void zs_pool_stat_destroy(struct zs_pool *pool)
+{
+	debugfs_remove(pool->stat_dentry);
+}
+
+static void zs_stat_init(void)
+{
+	zs_stat_root = debugfs_create_dir("zsmalloc", NULL);
+	if (!zs_stat_root)
+		pr_warn("debugfs 'zsmalloc' stat dir creation failed\n");
+}
+
+static void zs_stat_exit(void)
+{
+	debugfs_remove_recursive(zs_stat_root);
+	zs_stat_root = NULL;
+}
+#else
+static inline void zs_pool_stat_create(struct zs_pool *pool) {}
+static inline void zs_pool_stat_destroy(struct zs_pool *pool) {}
+static inline void zs_stat_init(void) {}
+static inline void zs_stat_exit(void) {}
+#endif
 
 static int zs_cpu_notifier(struct notifier_block *nb, unsigned long action,
 				void *pcpu)
@@ -464,18 +936,28 @@ static void zs_exit(void)
 	for_each_online_cpu(cpu)
 		zs_cpu_notifier(NULL, CPU_DEAD, (void *)(long)cpu);
 	unregister_cpu_notifier(&zs_cpu_nb);
+
+	zs_stat_exit();
+	kmem_cache_destroy(zs_handle_cache);
 }
 
 static int zs_init(void)
 {
 	int cpu, ret;
 
+	zs_handle_cache = kmem_cache_create("zs_handle", ZS_HANDLE_SIZE,
+					0, 0, NULL);
+	if (!zs_handle_cache)
+		return -ENOMEM;
+
 	register_cpu_notifier(&zs_cpu_nb);
 	for_each_online_cpu(cpu) {
 		ret = zs_cpu_notifier(NULL, CPU_UP_PREPARE, (void *)(long)cpu);
 		if (notifier_to_errno(ret))
 			goto fail;
 	}
+
+	zs_stat_init();
 	return 0;
 fail:
 	zs_exit();
@@ -495,6 +977,12 @@ struct zs_pool *zs_create_pool(const char *name, gfp_t flags)
 	if (!pool)
 		return NULL;
 
+	pool->name = kstrdup(name, GFP_KERNEL);
+	if (!pool->name) {
+		kfree(pool);
+		return NULL;
+	}
+
 	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
 		int size;
 		struct size_class *class;
@@ -508,11 +996,18 @@ struct zs_pool *zs_create_pool(const char *name, gfp_t flags)
 		class->index = i;
 		spin_lock_init(&class->lock);
 		class->zspage_order = get_zspage_order(size);
-
+		class->objs_per_zspage = class->zspage_order * PAGE_SIZE /
+						size;
 	}
 
 	pool->flags = flags;
-	pool->name = name;
+	atomic_long_set(&pool->pages_compacted, 0);
+
+	pool->shrinker.shrink = zs_shrinker;
+	pool->shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&pool->shrinker);
+
+	zs_pool_stat_create(pool);
 
 	return pool;
 }
@@ -522,6 +1017,9 @@ void zs_destroy_pool(struct zs_pool *pool)
 {
 	int i;
 
+	zs_pool_stat_destroy(pool);
+	unregister_shrinker(&pool->shrinker);
+
 	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
 		int fg;
 		struct size_class *class = &pool->size_class[i];
@@ -534,6 +1032,7 @@ void zs_destroy_pool(struct zs_pool *pool)
 			}
 		}
 	}
+	kfree(pool->name);
 	kfree(pool);
 }
 EXPORT_SYMBOL_GPL(zs_destroy_pool);
@@ -542,28 +1041,30 @@ EXPORT_SYMBOL_GPL(zs_destroy_pool);
  * zs_malloc - Allocate block of given size from pool.
  * @pool: pool to allocate from
  * @size: size of block to allocate
- * @page: page no. that holds the object
- * @offset: location of object within page
  *
- * On success, <page, offset> identifies block allocated
- * and 0 is returned. On failure, <page, offset> is set to
- * 0 and -ENOMEM is returned.
+ * On success, a handle to the allocated object is returned. The
+ * object has to be mapped with zs_map_object() to access it. On
+ * failure, NULL is returned.
  *
- * Allocation requests with size > ZS_MAX_ALLOC_SIZE will fail.
+ * Allocation requests with size > ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE
+ * will fail.
  */
 void *zs_malloc(struct zs_pool *pool, size_t size)
 {
-	void *obj;
-	struct link_free *link;
+	unsigned long handle, obj;
 	int class_idx;
 	struct size_class *class;
+	struct page *first_page;
 
-	struct page *first_page, *m_page;
-	unsigned long m_objidx, m_offset;
+	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE))
+		return NULL;
 
-	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE))
+	handle = alloc_handle(pool);
+	if (!handle)
 		return NULL;
 
+	/* extra space in chunk to keep the handle */
+	size += ZS_HANDLE_SIZE;
 	class_idx = get_size_class_index(size);
 	class = &pool->size_class[class_idx];
 	BUG_ON(class_idx != class->index);
@@ -574,79 +1075,74 @@ void *zs_malloc(struct zs_pool *pool, size_t size)
 	if (!first_page) {
 		spin_unlock(&class->lock);
 		first_page = alloc_zspage(class, pool->flags);
-		if (unlikely(!first_page))
+		if (unlikely(!first_page)) {
+			free_handle(handle);
 			return NULL;
+		}
 
 		set_zspage_mapping(first_page, class->index, ZS_EMPTY);
 		spin_lock(&class->lock);
 		class->pages_allocated += class->zspage_order;
+		class->obj_allocated += class->objs_per_zspage;
 	}
 
-	obj = first_page->freelist;
-	obj_handle_to_location(obj, &m_page, &m_objidx);
-	m_offset = obj_idx_to_offset(m_page, m_objidx, class->size);
-
-	link = (struct link_free *)kmap_atomic(m_page) +
-					m_offset / sizeof(*link);
-	first_page->freelist = link->next;
-	memset(link, POISON_INUSE, sizeof(*link));
-	kunmap_atomic(link);
-
-	first_page->inuse++;
+	obj = obj_malloc(class, first_page, handle);
 	/* Now move the zspage to another fullness group, if required */
 	fix_fullness_group(pool, first_page);
+	record_obj(handle, obj);
 	spin_unlock(&class->lock);
 
-	return obj;
+	return (void *)handle;
 }
 EXPORT_SYMBOL_GPL(zs_malloc);
 
-void zs_free(struct zs_pool *pool, void *obj)
+void zs_free(struct zs_pool *pool, void *handle)
 {
-	struct link_free *link;
 	struct page *first_page, *f_page;
-	unsigned long f_objidx, f_offset;
+	unsigned long obj, f_objidx;
 
 	int class_idx;
 	struct size_class *class;
 	enum fullness_group fullness;
 
-	if (unlikely(!obj))
+	if (unlikely(!handle))
 		return;
 
-	obj_handle_to_location(obj, &f_page, &f_objidx);
+	/* compaction must not move the object while we free it */
+	pin_tag((unsigned long)handle);
+	obj = handle_to_obj((unsigned long)handle);
+	obj_to_location(obj, &f_page, &f_objidx);
 	first_page = get_first_page(f_page);
 
 	get_zspage_mapping(first_page, &class_idx, &fullness);
 	class = &pool->size_class[class_idx];
-	f_offset = obj_idx_to_offset(f_page, f_objidx, class->size);
 
 	spin_lock(&class->lock);
-
-	/* Insert this object in containing zspage's freelist */
-	link = (struct link_free *)((unsigned char *)kmap_atomic(f_page)
-							+ f_offset);
-	link->next = first_page->freelist;
-	kunmap_atomic(link);
-	first_page->freelist = obj;
-
-	first_page->inuse--;
+	obj_free(class, obj);
 	fullness = fix_fullness_group(pool, first_page);
 
-	if (fullness == ZS_EMPTY)
+	if (fullness == ZS_EMPTY) {
 		class->pages_allocated -= class->zspage_order;
+		class->obj_allocated -= class->objs_per_zspage;
+	}
 
 	spin_unlock(&class->lock);
+	unpin_tag((unsigned long)handle);
+	free_handle((unsigned long)handle);
 
 	if (fullness == ZS_EMPTY)
 		free_zspage(first_page);
 }
 EXPORT_SYMBOL_GPL(zs_free);
 
+/*
+ * The object stays pinned, and so can not be moved by compaction,
+ * until it is unmapped again.
+ */
 void *zs_map_object(struct zs_pool *pool, void *handle)
 {
 	struct page *page;
-	unsigned long obj_idx, off;
+	unsigned long obj, obj_idx, off;
 
 	unsigned int class_idx;
 	enum fullness_group fg;
@@ -655,7 +1151,9 @@ void *zs_map_object(struct zs_pool *pool, void *handle)
 
 	BUG_ON(!handle);
 
-	obj_handle_to_location(handle, &page, &obj_idx);
+	pin_tag((unsigned long)handle);
+	obj = handle_to_obj((unsigned long)handle);
+	obj_to_location(obj, &page, &obj_idx);
 	get_zspage_mapping(get_first_page(page), &class_idx, &fg);
 	class = &pool->size_class[class_idx];
 	off = obj_idx_to_offset(page, obj_idx, class->size);
@@ -679,14 +1177,14 @@ void *zs_map_object(struct zs_pool *pool, void *handle)
 		area->vm_addr = area->vm->addr;
 	}
 
-	return area->vm_addr + off;
+	return area->vm_addr + off + ZS_HANDLE_SIZE;
 }
 EXPORT_SYMBOL_GPL(zs_map_object);
 
 void zs_unmap_object(struct zs_pool *pool, void *handle)
 {
 	struct page *page;
-	unsigned long obj_idx, off;
+	unsigned long obj, obj_idx, off;
 
 	unsigned int class_idx;
 	enum fullness_group fg;
@@ -695,7 +1193,8 @@ void zs_unmap_object(struct zs_pool *pool, void *handle)
 
 	BUG_ON(!handle);
 
-	obj_handle_to_location(handle, &page, &obj_idx);
+	obj = handle_to_obj((unsigned long)handle);
+	obj_to_location(obj, &page, &obj_idx);
 	get_zspage_mapping(get_first_page(page), &class_idx, &fg);
 	class = &pool->size_class[class_idx];
 	off = obj_idx_to_offset(page, obj_idx, class->size);
@@ -710,6 +1209,7 @@ void zs_unmap_object(struct zs_pool *pool, void *handle)
 		__flush_tlb_one((unsigned long)area->vm_addr + PAGE_SIZE);
 	}
 	put_cpu_var(zs_map_area);
+	unpin_tag((unsigned long)handle);
 }
 EXPORT_SYMBOL_GPL(zs_unmap_object);
 
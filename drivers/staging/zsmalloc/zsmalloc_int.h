@@ -14,6 +14,7 @@
 #define _ZS_MALLOC_INT_H_
 
 #include <linux/kernel.h>
+#include <linux/shrinker.h>
 #include <linux/spinlock.h>
 #include <linux/types.h>
 
@@ -34,13 +35,19 @@
 
 /*
  * Object location (<PFN>, <obj_idx>) is encoded as
- * as single (void *) handle value.
+ * as single unsigned long 'obj' value, shifted left by OBJ_TAG_BITS.
  *
  * Note that object index <obj_idx> is relative to system
  * page <PFN> it is stored in, so for each sub-page belonging
  * to a zspage, obj_idx starts with 0.
  *
  * This is made more complicated by various memory models and PAE.
+ *
+ * Handles given out to users point to a word holding the obj, so
+ * that objects can be moved by compaction. The lowest bit of that
+ * word pins the object in place while it is mapped or being freed.
+ * Every allocated object starts with its handle with the lowest bit
+ * set, which tells it apart from the freelist link of a free object.
  */
 
 #ifndef MAX_PHYSMEM_BITS
@@ -55,9 +62,16 @@
 #endif
 #endif
 #define _PFN_BITS		(MAX_PHYSMEM_BITS - PAGE_SHIFT)
-#define OBJ_INDEX_BITS	(BITS_PER_LONG - _PFN_BITS)
+#define OBJ_TAG_BITS	1
+#define OBJ_INDEX_BITS	(BITS_PER_LONG - _PFN_BITS - OBJ_TAG_BITS)
 #define OBJ_INDEX_MASK	((_AC(1, UL) << OBJ_INDEX_BITS) - 1)
 
+#define OBJ_ALLOCATED_TAG	1
+#define HANDLE_PIN_BIT		0
+
+/* Room taken by the handle back-reference at the start of each object */
+#define ZS_HANDLE_SIZE		(sizeof(unsigned long))
+
 #define MAX(a, b) ((a) >= (b) ? (a) : (b))
 /* ZS_MIN_ALLOC_SIZE must be multiple of ZS_ALIGN */
 #define ZS_MIN_ALLOC_SIZE \
@@ -126,10 +140,16 @@ struct size_class {
 	/* Number of PAGE_SIZE sized pages to combine to form a 'zspage' */
 	int zspage_order;
 
+	/* Number of objects a zspage of this class holds */
+	int objs_per_zspage;
+
 	spinlock_t lock;
 
 	/* stats */
 	u64 pages_allocated;
+	unsigned long obj_allocated;	/* object slots in all zspages */
+	unsigned long obj_used;		/* object slots in use */
+	unsigned long zspage_count[_ZS_NR_FULLNESS_GROUPS];
 
 	struct page *fullness_list[_ZS_NR_FULLNESS_GROUPS];
 };
@@ -141,8 +161,12 @@ struct size_class {
  * This must be power of 2 and less than or equal to ZS_ALIGN
  */
 struct link_free {
-	/* Handle of next free chunk (encodes <PFN, obj_idx>) */
-	void *next;
+	union {
+		/* Location of next free chunk (encodes <PFN, obj_idx>) */
+		unsigned long next;
+		/* Handle of an allocated object, OBJ_ALLOCATED_TAG set */
+		unsigned long handle;
+	};
 };
 
 struct zs_pool {
@@ -150,6 +174,14 @@ struct zs_pool {
 
 	gfp_t flags;	/* allocation flags used when growing pool */
 	const char *name;
+
+	/* compacts the pool under memory pressure */
+	struct shrinker shrinker;
+	atomic_long_t pages_compacted;
+
+#ifdef CONFIG_ZSMALLOC_STAT
+	struct dentry *stat_dentry;
+#endif
 };
 
 #endif
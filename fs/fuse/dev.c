@@ -38,6 +38,8 @@ static void fuse_request_init(struct fuse_req *req)
 	INIT_LIST_HEAD(&req->intr_entry);
 	init_waitqueue_head(&req->waitq);
 	atomic_set(&req->count, 1);
+	req->pages = req->inline_pages;
+	req->max_pages = FUSE_MAX_PAGES_PER_REQ;
 }
 
 struct fuse_req *fuse_request_alloc(void)
@@ -49,6 +51,22 @@ struct fuse_req *fuse_request_alloc(void)
 }
 EXPORT_SYMBOL_GPL(fuse_request_alloc);
 
+struct fuse_req *fuse_request_alloc_pages(unsigned npages)
+{
+	struct fuse_req *req = fuse_request_alloc();
+
+	if (req && npages > FUSE_MAX_PAGES_PER_REQ) {
+		req->pages = kmalloc(npages * sizeof(struct page *),
+				     GFP_KERNEL);
+		if (!req->pages) {
+			kmem_cache_free(fuse_req_cachep, req);
+			return NULL;
+		}
+		req->max_pages = npages;
+	}
+	return req;
+}
+
 struct fuse_req *fuse_request_alloc_nofs(void)
 {
 	struct fuse_req *req = kmem_cache_alloc(fuse_req_cachep, GFP_NOFS);
@@ -59,6 +77,8 @@ struct fuse_req *fuse_request_alloc_nofs(void)
 
 void fuse_request_free(struct fuse_req *req)
 {
+	if (req->pages != req->inline_pages)
+		kfree(req->pages);
 	kmem_cache_free(fuse_req_cachep, req);
 }
 
@@ -93,7 +113,7 @@ static void fuse_req_init_context(struct fuse_req *req)
 	req->in.h.pid = current->pid;
 }
 
-struct fuse_req *fuse_get_req(struct fuse_conn *fc)
+struct fuse_req *fuse_get_req_pages(struct fuse_conn *fc, unsigned npages)
 {
 	struct fuse_req *req;
 	sigset_t oldset;
@@ -112,7 +132,7 @@ struct fuse_req *fuse_get_req(struct fuse_conn *fc)
 	if (!fc->connected)
 		goto out;
 
-	req = fuse_request_alloc();
+	req = fuse_request_alloc_pages(npages);
 	err = -ENOMEM;
 	if (!req)
 		goto out;
@@ -125,6 +145,12 @@ struct fuse_req *fuse_get_req(struct fuse_conn *fc)
 	atomic_dec(&fc->num_waiting);
 	return ERR_PTR(err);
 }
+EXPORT_SYMBOL_GPL(fuse_get_req_pages);
+
+struct fuse_req *fuse_get_req(struct fuse_conn *fc)
+{
+	return fuse_get_req_pages(fc, FUSE_MAX_PAGES_PER_REQ);
+}
 EXPORT_SYMBOL_GPL(fuse_get_req);
 
 static struct fuse_req *get_reserved_req(struct fuse_conn *fc,
@@ -183,6 +209,9 @@ void fuse_put_request(struct fuse_conn *fc, struct fuse_req *req)
 		if (req->waiting)
 			atomic_dec(&fc->num_waiting);
 
+		if (req->passthrough_filp)
+			fput(req->passthrough_filp);
+
 		if (req->stolen_file)
 			put_reserved_req(fc, req);
 		else
@@ -1672,6 +1701,8 @@ static ssize_t fuse_dev_do_write(struct fuse_conn *fc,
 
 	err = copy_out_args(cs, &req->out, nbytes);
 	fuse_copy_finish(cs);
+	if (!err)
+		fuse_passthrough_setup(fc, req);
 
 	spin_lock(&fc->lock);
 	req->locked = 0;
@@ -25,12 +25,16 @@
 
 #define FUSE_MAX_PAGES_PER_REQ 32
 
+#define FUSE_MAX_PAGES_READ 256
+
 #define FUSE_NOWRITE INT_MIN
 
 #define FUSE_NAME_MAX 1024
 
 #define FUSE_CTL_NUM_DENTRIES 5
 
+#define FUSE_SUPER_MAGIC 0x65735546
+
 #define FUSE_DEFAULT_PERMISSIONS (1 << 0)
 
 #define FUSE_ALLOW_OTHER         (1 << 1)
@@ -120,6 +124,9 @@ struct fuse_file {
 
 	
 	bool flock:1;
+
+	
+	struct file *passthrough_filp;
 };
 
 struct fuse_in_arg {
@@ -249,7 +256,13 @@ struct fuse_req {
 	} misc;
 
 	
-	struct page *pages[FUSE_MAX_PAGES_PER_REQ];
+	struct page **pages;
+
+	
+	struct page *inline_pages[FUSE_MAX_PAGES_PER_REQ];
+
+	
+	unsigned max_pages;
 
 	
 	unsigned num_pages;
@@ -271,6 +284,9 @@ struct fuse_req {
 
 	
 	struct file *stolen_file;
+
+	
+	struct file *passthrough_filp;
 };
 
 struct fuse_conn {
@@ -418,6 +434,12 @@ struct fuse_conn {
 	unsigned dont_mask:1;
 
 	
+	unsigned passthrough:1;
+
+	
+	unsigned big_reads:1;
+
+	
 	unsigned no_flock:1;
 
 	
@@ -461,6 +483,9 @@ struct fuse_conn {
 
 	
 	struct rw_semaphore killsb;
+
+	
+	const struct cred *passthrough_creds;
 };
 
 static inline struct fuse_conn *get_fuse_conn_super(struct super_block *sb)
@@ -544,12 +569,16 @@ void fuse_ctl_cleanup(void);
 
 struct fuse_req *fuse_request_alloc(void);
 
+struct fuse_req *fuse_request_alloc_pages(unsigned npages);
+
 struct fuse_req *fuse_request_alloc_nofs(void);
 
 void fuse_request_free(struct fuse_req *req);
 
 struct fuse_req *fuse_get_req(struct fuse_conn *fc);
 
+struct fuse_req *fuse_get_req_pages(struct fuse_conn *fc, unsigned npages);
+
 struct fuse_req *fuse_get_req_nofail(struct fuse_conn *fc, struct file *file);
 
 void fuse_put_request(struct fuse_conn *fc, struct fuse_req *req);
@@ -614,4 +643,11 @@ int fuse_dev_release(struct inode *inode, struct file *file);
 
 void fuse_write_update_size(struct inode *inode, loff_t pos);
 
+void fuse_passthrough_setup(struct fuse_conn *fc, struct fuse_req *req);
+ssize_t fuse_passthrough_aio_read(struct kiocb *iocb, const struct iovec *iov,
+				  unsigned long nr_segs, loff_t pos);
+ssize_t fuse_passthrough_aio_write(struct kiocb *iocb, const struct iovec *iov,
+				   unsigned long nr_segs, loff_t pos);
+void fuse_passthrough_release(struct fuse_file *ff);
+
 #endif 
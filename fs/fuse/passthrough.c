@@ -0,0 +1,143 @@
+/*
+  FUSE: Filesystem in Userspace
+  Copyright (C) 2001-2008  Miklos Szeredi <miklos@szeredi.hu>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include "fuse_i.h"
+
+#include <linux/pagemap.h>
+#include <linux/file.h>
+#include <linux/aio.h>
+#include <linux/uio.h>
+#include <linux/fsnotify.h>
+#include <linux/cred.h>
+
+/*
+ * Called in the context of the daemon writing the reply, so that the file
+ * descriptor it names in the open reply is looked up in its own table.
+ * Reads and writes of that file are later done with the credentials the
+ * daemon had at INIT, so the reply has to come from the same user in
+ * case the device file was passed on after INIT.
+ */
+void fuse_passthrough_setup(struct fuse_conn *fc, struct fuse_req *req)
+{
+	const struct cred *cred = current_cred();
+	struct fuse_open_in *inarg;
+	struct fuse_open_out *outarg;
+	struct file *lower;
+	fmode_t mode;
+
+	if (!fc->passthrough || req->out.h.error)
+		return;
+	if (cred->euid != fc->passthrough_creds->euid ||
+	    cred->egid != fc->passthrough_creds->egid)
+		return;
+	if (req->in.h.opcode != FUSE_OPEN && req->in.h.opcode != FUSE_CREATE)
+		return;
+
+	outarg = req->out.args[req->out.numargs - 1].value;
+	if (!(outarg->open_flags & FOPEN_PASSTHROUGH))
+		return;
+
+	lower = fget(outarg->passthrough_fd);
+	if (!lower)
+		return;
+
+	/* fuse_create_in starts with the same flags as fuse_open_in */
+	inarg = (struct fuse_open_in *)req->in.args[0].value;
+	mode = 0;
+	if ((inarg->flags & O_ACCMODE) != O_WRONLY)
+		mode |= FMODE_READ;
+	if ((inarg->flags & O_ACCMODE) != O_RDONLY)
+		mode |= FMODE_WRITE;
+
+	if (!S_ISREG(lower->f_path.dentry->d_inode->i_mode) ||
+	    lower->f_path.dentry->d_sb->s_magic == FUSE_SUPER_MAGIC ||
+	    !lower->f_op || !lower->f_op->aio_read || !lower->f_op->aio_write ||
+	    (lower->f_mode & mode) != mode ||
+	    ((inarg->flags ^ lower->f_flags) & O_APPEND)) {
+		fput(lower);
+		return;
+	}
+
+	req->passthrough_filp = lower;
+}
+
+static ssize_t fuse_passthrough_rw(struct kiocb *iocb, const struct iovec *iov,
+				   unsigned long nr_segs, loff_t pos, int rw)
+{
+	struct file *file = iocb->ki_filp;
+	struct fuse_file *ff = file->private_data;
+	struct file *lower = ff->passthrough_filp;
+	struct address_space *mapping = file->f_mapping;
+	struct inode *inode = mapping->host;
+	size_t count = iov_length(iov, nr_segs);
+	const struct cred *old_cred;
+	struct kiocb kiocb;
+	ssize_t ret;
+
+	if (!count)
+		return 0;
+
+	/* Pages cached through mmap of the FUSE file come first */
+	if (mapping->nrpages) {
+		ret = filemap_write_and_wait_range(mapping, pos,
+						   pos + count - 1);
+		if (ret)
+			return ret;
+	}
+
+	init_sync_kiocb(&kiocb, lower);
+	kiocb.ki_pos = pos;
+	kiocb.ki_left = count;
+	kiocb.ki_nbytes = count;
+
+	/* the lower file is accessed as the daemon, not as the caller */
+	old_cred = override_creds(ff->fc->passthrough_creds);
+	if (rw == WRITE)
+		ret = lower->f_op->aio_write(&kiocb, iov, nr_segs, pos);
+	else
+		ret = lower->f_op->aio_read(&kiocb, iov, nr_segs, pos);
+	if (ret == -EIOCBQUEUED)
+		ret = wait_on_sync_kiocb(&kiocb);
+	revert_creds(old_cred);
+	if (ret <= 0)
+		return ret;
+
+	if (rw == WRITE) {
+		fsnotify_modify(lower);
+		fuse_write_update_size(inode, kiocb.ki_pos);
+		fuse_invalidate_attr(inode);
+		if (mapping->nrpages)
+			invalidate_mapping_pages(mapping,
+					(kiocb.ki_pos - ret) >> PAGE_CACHE_SHIFT,
+					(kiocb.ki_pos - 1) >> PAGE_CACHE_SHIFT);
+	} else {
+		fsnotify_access(lower);
+	}
+	iocb->ki_pos = kiocb.ki_pos;
+	return ret;
+}
+
+ssize_t fuse_passthrough_aio_read(struct kiocb *iocb, const struct iovec *iov,
+				  unsigned long nr_segs, loff_t pos)
+{
+	return fuse_passthrough_rw(iocb, iov, nr_segs, pos, READ);
+}
+
+ssize_t fuse_passthrough_aio_write(struct kiocb *iocb, const struct iovec *iov,
+				   unsigned long nr_segs, loff_t pos)
+{
+	return fuse_passthrough_rw(iocb, iov, nr_segs, pos, WRITE);
+}
+
+void fuse_passthrough_release(struct fuse_file *ff)
+{
+	if (ff->passthrough_filp) {
+		fput(ff->passthrough_filp);
+		ff->passthrough_filp = NULL;
+	}
+}
@@ -919,6 +919,7 @@ err_sighand:
 	unlock_task_sighand(task, &flags);
 err_task_lock:
 	task_unlock(task);
+	lowmem_adj_index_update(task);
 	put_task_struct(task);
 out:
 	return err < 0 ? err : count;
@@ -1037,6 +1038,7 @@ err_sighand:
 	unlock_task_sighand(task, &flags);
 err_task_lock:
 	task_unlock(task);
+	lowmem_adj_index_update(task);
 	put_task_struct(task);
 out:
 	return err < 0 ? err : count;
@@ -63,6 +63,79 @@ static void sync_filesystems(int wait)
 	iterate_supers(sync_one_sb, &wait);
 }
 
+/*
+ * Oldest dirtied_when of the dirty inodes of @sb, the block device under it
+ * included, or false if nothing is dirty. b_more_io and b_io hold inodes
+ * dirtied before those on b_dirty, which is kept newest first.
+ */
+static bool sb_oldest_dirty(struct super_block *sb, unsigned long *when)
+{
+	struct bdi_writeback *wb = &sb->s_bdi->wb;
+	struct inode *bd_inode = sb->s_bdev->bd_inode;
+	struct list_head *lists[] = { &wb->b_more_io, &wb->b_io, &wb->b_dirty };
+	struct inode *inode;
+	bool found = false;
+	int i;
+
+	spin_lock(&wb->list_lock);
+	for (i = 0; i < ARRAY_SIZE(lists) && !found; i++) {
+		list_for_each_entry_reverse(inode, lists[i], i_wb_list) {
+			if (inode->i_sb == sb || inode == bd_inode) {
+				*when = inode->dirtied_when;
+				found = true;
+				break;
+			}
+		}
+	}
+	spin_unlock(&wb->list_lock);
+	return found;
+}
+
+static void sync_dirty_one_sb(struct super_block *sb, void *arg)
+{
+	struct sync_dirty_control *sdc = arg;
+	unsigned long when;
+
+	if (sdc->cancelled || (sb->s_flags & MS_RDONLY) || !sb->s_bdev ||
+	    sb->s_bdi == &noop_backing_dev_info)
+		return;
+	if (!sb_oldest_dirty(sb, &when))
+		return;
+	if (time_after(when + sdc->older_than, jiffies)) {
+		sdc->nr_skipped++;
+		return;
+	}
+
+	__sync_filesystem(sb, 0);
+	if (sdc->cancel && sdc->cancel()) {
+		sdc->cancelled = true;
+		return;
+	}
+	__sync_filesystem(sb, 1);
+	sdc->nr_synced++;
+	if (sdc->cancel && sdc->cancel())
+		sdc->cancelled = true;
+}
+
+/**
+ * sync_dirty_filesystems - sync only the block filesystems with old dirt
+ * @sdc: age threshold and cancel callback, counters for the caller
+ *
+ * A lighter sys_sync() for callers such as suspend that need data which
+ * has been dirty for a while on disk, but not every last write. Writable
+ * block backed filesystems with nothing dirty for at least
+ * @sdc->older_than jiffies are left to the flusher threads. @sdc->cancel
+ * is polled between filesystems and between the write and wait passes of
+ * each, and stops the sync once it returns true.
+ */
+void sync_dirty_filesystems(struct sync_dirty_control *sdc)
+{
+	sdc->nr_synced = sdc->nr_skipped = 0;
+	sdc->cancelled = false;
+	iterate_supers(sync_dirty_one_sb, sdc);
+}
+EXPORT_SYMBOL_GPL(sync_dirty_filesystems);
+
 SYSCALL_DEFINE0(sync)
 {
 	trace_sys_sync(0);
@@ -18,6 +18,7 @@
 
 #ifdef CONFIG_HAS_EARLYSUSPEND
 #include <linux/list.h>
+#include <linux/types.h>
 #endif
 
 enum {
@@ -25,17 +26,36 @@ enum {
 	EARLY_SUSPEND_LEVEL_STOP_DRAWING = 100,
 	EARLY_SUSPEND_LEVEL_DISABLE_FB = 150,
 };
+
+/* Handler timings, in usecs, kept by the core for debugfs */
+struct early_suspend_stats {
+	unsigned int count;
+	unsigned int last_suspend;
+	unsigned int max_suspend;
+	unsigned int last_resume;
+	unsigned int max_resume;
+};
+
 struct early_suspend {
 #ifdef CONFIG_HAS_EARLYSUSPEND
 	struct list_head link;
 	int level;
 	void (*suspend)(struct early_suspend *h);
 	void (*resume)(struct early_suspend *h);
+	/* set up by the core at registration */
+	bool async;
+	struct early_suspend_stats stats;
 #endif
 };
 
 #ifdef CONFIG_HAS_EARLYSUSPEND
 void register_early_suspend(struct early_suspend *handler);
+/*
+ * For handlers that do not depend on any other handler of their level:
+ * they run concurrently with the other async handlers of the level, and
+ * the next level still only starts once all of them are done.
+ */
+void register_early_suspend_async(struct early_suspend *handler);
 void unregister_early_suspend(struct early_suspend *handler);
 #ifdef CONFIG_HTC_ONMODE_CHARGING
 void register_onchg_suspend(struct early_suspend *handler);
@@ -43,6 +63,7 @@ void unregister_onchg_suspend(struct early_suspend *handler);
 #endif
 #else
 #define register_early_suspend(handler) do { } while (0)
+#define register_early_suspend_async(handler) do { } while (0)
 #define unregister_early_suspend(handler) do { } while (0)
 #endif
 
@@ -1664,6 +1664,15 @@ static inline int thaw_bdev(struct block_device *bdev, struct super_block *sb)
 }
 #endif
 extern int sync_filesystem(struct super_block *);
+
+struct sync_dirty_control {
+	unsigned long older_than;	/* jiffies since the data got dirty */
+	bool (*cancel)(void);		/* optional, stops the sync when true */
+	unsigned int nr_synced;
+	unsigned int nr_skipped;	/* dirty, but not for long enough */
+	bool cancelled;
+};
+extern void sync_dirty_filesystems(struct sync_dirty_control *sdc);
 extern const struct file_operations def_blk_fops;
 extern const struct file_operations def_chr_fops;
 extern const struct file_operations bad_sock_fops;
@@ -118,6 +118,7 @@ struct ion_platform_heap {
 	size_t size;
 	enum ion_memory_types memory_type;
 	unsigned int has_outer_cache;
+	size_t deferred_free_max;
 	void *extra_data;
 };
 
@@ -0,0 +1,45 @@
+#ifndef __LZ4_H__
+#define __LZ4_H__
+/*
+ *  LZ4 Public Kernel Interface
+ *
+ *  LZ4 is a fast LZ77-type compressor with a fixed, byte-oriented
+ *  encoding format. It trades some compression ratio for much higher
+ *  compression and decompression speed than LZO.
+ *
+ *  The LZ4 format is described at:
+ *  http://code.google.com/p/lz4/
+ */
+
+#define LZ4_MEM_COMPRESS	(4096 * sizeof(u32))
+
+/* worst case compressed size of @isize input bytes */
+#define lz4_compressbound(isize)	((isize) + ((isize) / 255) + 16)
+
+/*
+ * lz4_compress()
+ *	src	: source address of the original data
+ *	src_len	: size of the original data
+ *	dst	: output buffer, at least lz4_compressbound(src_len) bytes
+ *	dst_len	: is the output size, which is returned after compress done
+ *	wrkmem	: address of the working memory (LZ4_MEM_COMPRESS bytes)
+ *	return	: success if return 0
+ */
+int lz4_compress(const unsigned char *src, size_t src_len,
+		unsigned char *dst, size_t *dst_len, void *wrkmem);
+
+/*
+ * lz4_decompress_unknownoutputsize()
+ *	src	: source address of the compressed data
+ *	src_len	: is the input size, the exact size of the compressed data
+ *	dst	: output buffer address of the decompressed data
+ *	dst_len	: in: size of the output buffer, out: decompressed size
+ *	return	: success if return 0
+ *
+ *	Never writes or reads outside of the given buffers, so it is safe
+ *	to use on corrupted or malicious input.
+ */
+int lz4_decompress_unknownoutputsize(const unsigned char *src, size_t src_len,
+		unsigned char *dst, size_t *dst_len);
+
+#endif
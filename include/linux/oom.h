@@ -29,6 +29,28 @@ enum oom_constraint {
 extern void compare_swap_oom_score_adj(int old_val, int new_val);
 extern int test_set_oom_score_adj(int new_val);
 
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+extern void lowmem_adj_index_add(struct task_struct *p);
+extern void lowmem_adj_index_update(struct task_struct *p);
+extern void lowmem_adj_index_del(struct task_struct *p);
+extern void lowmem_adj_index_replace(struct task_struct *old,
+				     struct task_struct *new);
+#else
+static inline void lowmem_adj_index_add(struct task_struct *p)
+{
+}
+static inline void lowmem_adj_index_update(struct task_struct *p)
+{
+}
+static inline void lowmem_adj_index_del(struct task_struct *p)
+{
+}
+static inline void lowmem_adj_index_replace(struct task_struct *old,
+					    struct task_struct *new)
+{
+}
+#endif
+
 extern unsigned int oom_badness(struct task_struct *p, struct mem_cgroup *memcg,
 			const nodemask_t *nodemask, unsigned long totalpages);
 extern int try_set_zonelist_oom(struct zonelist *zonelist, gfp_t gfp_flags);
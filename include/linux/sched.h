@@ -1051,6 +1051,12 @@ struct task_struct {
 #endif
 
 	struct list_head tasks;
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+	struct hlist_node lowmem_adj_node;
+	int lowmem_adj;
+	bool lowmem_adj_moving;
+	struct rcu_head lowmem_adj_rcu;
+#endif
 #ifdef CONFIG_SMP
 	struct plist_node pushable_tasks;
 #endif
@@ -0,0 +1,20 @@
+#ifndef __LINUX_VMPRESSURE_H
+#define __LINUX_VMPRESSURE_H
+
+#include <linux/types.h>
+
+#ifdef CONFIG_ANDROID_MEM_PRESSURE
+extern void vmpressure(gfp_t gfp, unsigned long scanned,
+		       unsigned long reclaimed);
+extern void vmpressure_prio(gfp_t gfp, int prio);
+#else
+static inline void vmpressure(gfp_t gfp, unsigned long scanned,
+			      unsigned long reclaimed)
+{
+}
+static inline void vmpressure_prio(gfp_t gfp, int prio)
+{
+}
+#endif
+
+#endif /* __LINUX_VMPRESSURE_H */
@@ -18,6 +18,7 @@
 
 #include <linux/list.h>
 #include <linux/ktime.h>
+#include <linux/rbtree.h>
 
 
 enum {
@@ -28,6 +29,7 @@ enum {
 struct wake_lock {
 #ifdef CONFIG_HAS_WAKELOCK
 	struct list_head    link;
+	struct rb_node      expire_node;
 	int                 flags;
 	const char         *name;
 	unsigned long       expires;
@@ -13,10 +13,14 @@
  *
  */
 
+#include <linux/async.h>
+#include <linux/debugfs.h>
 #include <linux/earlysuspend.h>
+#include <linux/ktime.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
 #include <linux/rtc.h>
+#include <linux/seq_file.h>
 #include <linux/wakelock.h>
 #include <linux/workqueue.h>
 #include <linux/cpu.h>
@@ -56,6 +60,17 @@ enum {
 	SUSPEND_REQUESTED_AND_SUSPENDED = SUSPEND_REQUESTED | SUSPENDED,
 };
 static int state;
+
+/*
+ * Handlers run level by level. Async handlers of a level run together on
+ * early_suspend_domain, and the level is complete once they all return.
+ * A wakeup request stops early_suspend() between two levels, and then
+ * only the handlers below suspended_level are resumed.
+ */
+static LIST_HEAD(early_suspend_domain);
+static int suspended_level;
+static s64 last_suspend_us, last_resume_us;
+
 #ifdef CONFIG_HTC_ONMODE_CHARGING
 static LIST_HEAD(onchg_suspend_handlers);
 static void onchg_suspend(struct work_struct *work);
@@ -111,11 +126,14 @@ static void __ref boost_cpu_speed(int boost)
 static void boost_cpu_speed(int boost) { return; }
 #endif
 
-void register_early_suspend(struct early_suspend *handler)
+static void __register_early_suspend(struct early_suspend *handler,
+				     bool async)
 {
 	struct list_head *pos;
 
 	mutex_lock(&early_suspend_lock);
+	handler->async = async;
+	memset(&handler->stats, 0, sizeof(handler->stats));
 	list_for_each(pos, &early_suspend_handlers) {
 		struct early_suspend *e;
 		e = list_entry(pos, struct early_suspend, link);
@@ -123,12 +141,24 @@ void register_early_suspend(struct early_suspend *handler)
 			break;
 	}
 	list_add_tail(&handler->link, pos);
-	if ((state & SUSPENDED) && handler->suspend)
+	if ((state & SUSPENDED) && handler->level < suspended_level &&
+	    handler->suspend)
 		handler->suspend(handler);
 	mutex_unlock(&early_suspend_lock);
 }
+
+void register_early_suspend(struct early_suspend *handler)
+{
+	__register_early_suspend(handler, false);
+}
 EXPORT_SYMBOL(register_early_suspend);
 
+void register_early_suspend_async(struct early_suspend *handler)
+{
+	__register_early_suspend(handler, true);
+}
+EXPORT_SYMBOL(register_early_suspend_async);
+
 void unregister_early_suspend(struct early_suspend *handler)
 {
 	mutex_lock(&early_suspend_lock);
@@ -137,10 +167,105 @@ void unregister_early_suspend(struct early_suspend *handler)
 }
 EXPORT_SYMBOL(unregister_early_suspend);
 
-static void early_suspend(struct work_struct *work)
+static void call_handler(struct early_suspend *h, bool suspend)
+{
+	struct early_suspend_stats *st = &h->stats;
+	ktime_t start = ktime_get();
+	unsigned int us;
+
+	if (suspend) {
+		if (debug_mask & DEBUG_VERBOSE)
+			pr_info("early_suspend: calling %pf\n", h->suspend);
+		h->suspend(h);
+	} else {
+		if (debug_mask & DEBUG_VERBOSE)
+			pr_info("late_resume: calling %pf\n", h->resume);
+		h->resume(h);
+	}
+
+	us = ktime_to_us(ktime_sub(ktime_get(), start));
+	if (suspend) {
+		st->count++;
+		st->last_suspend = us;
+		st->max_suspend = max(st->max_suspend, us);
+	} else {
+		st->last_resume = us;
+		st->max_resume = max(st->max_resume, us);
+	}
+}
+
+static void call_suspend_async(void *data, async_cookie_t cookie)
+{
+	call_handler(data, true);
+}
+
+static void call_resume_async(void *data, async_cookie_t cookie)
+{
+	call_handler(data, false);
+}
+
+static bool early_suspend_cancelled(void)
+{
+	unsigned long irqflags;
+	bool cancelled;
+
+	spin_lock_irqsave(&state_lock, irqflags);
+	cancelled = !(state & SUSPEND_REQUESTED);
+	spin_unlock_irqrestore(&state_lock, irqflags);
+	return cancelled;
+}
+
+/* Returns false if a wakeup request stopped it before the last level */
+static bool suspend_handlers(void)
+{
+	struct early_suspend *pos;
+	int level = INT_MIN;
+
+	list_for_each_entry(pos, &early_suspend_handlers, link) {
+		if (pos->level != level) {
+			async_synchronize_full_domain(&early_suspend_domain);
+			suspended_level = level = pos->level;
+			if (early_suspend_cancelled())
+				return false;
+		}
+		if (pos->suspend == NULL)
+			continue;
+		if (pos->async)
+			async_schedule_domain(call_suspend_async, pos,
+					      &early_suspend_domain);
+		else
+			call_handler(pos, true);
+	}
+	async_synchronize_full_domain(&early_suspend_domain);
+	suspended_level = INT_MAX;
+	return true;
+}
+
+static void resume_handlers(void)
 {
 	struct early_suspend *pos;
+	int level = INT_MAX;
+
+	list_for_each_entry_reverse(pos, &early_suspend_handlers, link) {
+		if (pos->level >= suspended_level || pos->resume == NULL)
+			continue;
+		if (pos->level != level) {
+			async_synchronize_full_domain(&early_suspend_domain);
+			level = pos->level;
+		}
+		if (pos->async)
+			async_schedule_domain(call_resume_async, pos,
+					      &early_suspend_domain);
+		else
+			call_handler(pos, false);
+	}
+	async_synchronize_full_domain(&early_suspend_domain);
+}
+
+static void early_suspend(struct work_struct *work)
+{
 	unsigned long irqflags;
+	ktime_t start;
 	int abort = 0;
 
 	pr_info("[R] early_suspend start\n");
@@ -167,13 +292,16 @@ static void early_suspend(struct work_struct *work)
 
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("early_suspend: call handlers\n");
-	list_for_each_entry(pos, &early_suspend_handlers, link) {
-		if (pos->suspend != NULL) {
-			if (debug_mask & DEBUG_VERBOSE)
-				pr_info("early_suspend: calling %pf\n", pos->suspend);
-			pos->suspend(pos);
-		}
+	start = ktime_get();
+	if (!suspend_handlers()) {
+		boost_cpu_speed(0);
+		if (debug_mask & DEBUG_SUSPEND)
+			pr_info("early_suspend: wakeup requested, stop before "
+				"level %d\n", suspended_level);
+		mutex_unlock(&early_suspend_lock);
+		goto abort;
 	}
+	last_suspend_us = ktime_to_us(ktime_sub(ktime_get(), start));
 	boost_cpu_speed(0);
 	mutex_unlock(&early_suspend_lock);
 
@@ -197,8 +325,8 @@ abort:
 
 static void late_resume(struct work_struct *work)
 {
-	struct early_suspend *pos;
 	unsigned long irqflags;
+	ktime_t start;
 	int abort = 0;
 
 	pr_info("[R] late_resume start\n");
@@ -224,14 +352,9 @@ static void late_resume(struct work_struct *work)
 
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("late_resume: call handlers\n");
-	list_for_each_entry_reverse(pos, &early_suspend_handlers, link) {
-		if (pos->resume != NULL) {
-			if (debug_mask & DEBUG_VERBOSE)
-				pr_info("late_resume: calling %pf\n", pos->resume);
-
-			pos->resume(pos);
-		}
-	}
+	start = ktime_get();
+	resume_handlers();
+	last_resume_us = ktime_to_us(ktime_sub(ktime_get(), start));
 
 	boost_cpu_speed(0);
 
@@ -415,3 +538,56 @@ suspend_state_t get_suspend_state(void)
 {
 	return requested_suspend_state;
 }
+
+#ifdef CONFIG_DEBUG_FS
+static int early_suspend_handlers_show(struct seq_file *m, void *unused)
+{
+	struct early_suspend *pos;
+	struct early_suspend_stats *st;
+
+	mutex_lock(&early_suspend_lock);
+	seq_printf(m, "last early suspend %lld us, late resume %lld us\n",
+		   last_suspend_us, last_resume_us);
+	seq_puts(m, "level  async  count  suspend_us (last max)  "
+		 "resume_us (last max)  handler\n");
+	list_for_each_entry(pos, &early_suspend_handlers, link) {
+		st = &pos->stats;
+		seq_printf(m, "%5d  %5d  %5u  %10u %10u  %9u %10u  %pf\n",
+			   pos->level, pos->async, st->count,
+			   st->last_suspend, st->max_suspend,
+			   st->last_resume, st->max_resume,
+			   pos->suspend ? (void *)pos->suspend :
+					  (void *)pos->resume);
+	}
+	mutex_unlock(&early_suspend_lock);
+	return 0;
+}
+
+static int early_suspend_handlers_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, early_suspend_handlers_show, NULL);
+}
+
+static const struct file_operations early_suspend_handlers_fops = {
+	.open		= early_suspend_handlers_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int __init early_suspend_debugfs_init(void)
+{
+	struct dentry *dir;
+
+	dir = debugfs_create_dir("earlysuspend", NULL);
+	if (!dir)
+		return -ENOMEM;
+	if (!debugfs_create_file("handlers", S_IRUGO, dir, NULL,
+				 &early_suspend_handlers_fops)) {
+		debugfs_remove(dir);
+		return -ENOMEM;
+	}
+	return 0;
+}
+late_initcall(early_suspend_debugfs_init);
+#endif
@@ -17,6 +17,7 @@
 #include <linux/platform_device.h>
 #include <linux/rtc.h>
 #include <linux/suspend.h>
+#include <linux/fs.h>
 #include <linux/syscalls.h> 
 #include <linux/wakelock.h>
 #include <linux/syscore_ops.h>
@@ -36,6 +37,22 @@ enum {
 static int debug_mask = DEBUG_EXIT_SUSPEND | DEBUG_WAKEUP;
 module_param_named(debug_mask, debug_mask, int, S_IRUGO | S_IWUSR | S_IWGRP);
 
+/*
+ * sync_mode 1 syncs only the block filesystems that have held dirty data
+ * for sync_min_age_ms, and gives up as soon as the suspend is abandoned.
+ */
+enum {
+	SUSPEND_SYNC_FULL,
+	SUSPEND_SYNC_INCREMENTAL,
+};
+static int suspend_sync_mode = SUSPEND_SYNC_FULL;
+module_param_named(sync_mode, suspend_sync_mode, int, S_IRUGO | S_IWUSR);
+static unsigned int suspend_sync_min_age_ms = 5000;
+module_param_named(sync_min_age_ms, suspend_sync_min_age_ms, uint,
+		   S_IRUGO | S_IWUSR);
+static unsigned int suspend_sync_last_us;
+module_param_named(sync_last_us, suspend_sync_last_us, uint, S_IRUGO);
+
 #define WAKE_LOCK_TYPE_MASK              (0x0f)
 #define WAKE_LOCK_INITIALIZED            (1U << 8)
 #define WAKE_LOCK_ACTIVE                 (1U << 9)
@@ -45,6 +62,15 @@ module_param_named(debug_mask, debug_mask, int, S_IRUGO | S_IWUSR | S_IWGRP);
 static DEFINE_SPINLOCK(list_lock);
 static LIST_HEAD(inactive_locks);
 static struct list_head active_wake_locks[WAKE_LOCK_TYPE_COUNT];
+/*
+ * Active locks with a timeout are also kept in expire_locks[], ordered by
+ * expiry, so the next lock to expire and the last one are found without
+ * walking the list. Active locks without a timeout are only counted: while
+ * any of them is held there is nothing to expire or time.
+ */
+static struct rb_root expire_locks[WAKE_LOCK_TYPE_COUNT];
+static struct rb_node *expire_first[WAKE_LOCK_TYPE_COUNT];
+static atomic_t active_no_timeout[WAKE_LOCK_TYPE_COUNT];
 static int current_event_num;
 static int suspend_sys_sync_count;
 static DEFINE_SPINLOCK(suspend_sys_sync_lock);
@@ -201,12 +227,52 @@ static void update_sleep_wait_stats_locked(int done)
 }
 #endif
 
+static void expire_queue_add(struct wake_lock *lock, int type)
+{
+	struct rb_node **p = &expire_locks[type].rb_node;
+	struct rb_node *parent = NULL;
+	bool first = true;
+	struct wake_lock *l;
+
+	while (*p) {
+		parent = *p;
+		l = rb_entry(parent, struct wake_lock, expire_node);
+		if ((long)(lock->expires - l->expires) < 0) {
+			p = &parent->rb_left;
+		} else {
+			p = &parent->rb_right;
+			first = false;
+		}
+	}
+	rb_link_node(&lock->expire_node, parent, p);
+	rb_insert_color(&lock->expire_node, &expire_locks[type]);
+	if (first)
+		expire_first[type] = &lock->expire_node;
+}
+
+static void expire_queue_del(struct wake_lock *lock, int type)
+{
+	if (expire_first[type] == &lock->expire_node)
+		expire_first[type] = rb_next(&lock->expire_node);
+	rb_erase(&lock->expire_node, &expire_locks[type]);
+	RB_CLEAR_NODE(&lock->expire_node);
+}
+
+/* Drops an active lock from the expiry queue or the count of its type */
+static void wake_lock_untrack(struct wake_lock *lock, int type)
+{
+	if (lock->flags & WAKE_LOCK_AUTO_EXPIRE)
+		expire_queue_del(lock, type);
+	else
+		atomic_dec(&active_no_timeout[type]);
+}
 
 static void expire_wake_lock(struct wake_lock *lock)
 {
 #ifdef CONFIG_WAKELOCK_STAT
 	wake_unlock_stat_locked(lock, 1);
 #endif
+	wake_lock_untrack(lock, lock->flags & WAKE_LOCK_TYPE_MASK);
 	lock->flags &= ~(WAKE_LOCK_ACTIVE | WAKE_LOCK_AUTO_EXPIRE);
 	list_del(&lock->link);
 	list_add(&lock->link, &inactive_locks);
@@ -263,29 +329,43 @@ void htc_print_active_wake_locks(int type)
 	spin_unlock_irqrestore(&list_lock, irqflags);
 }
 
+/*
+ * Returns -1 if a lock without timeout is held, else the jiffies until the
+ * last lock with a timeout expires, 0 if none is held. Expired locks are
+ * released on the way.
+ */
 static long has_wake_lock_locked(int type)
 {
-	struct wake_lock *lock, *n;
-	long max_timeout = 0;
+	struct wake_lock *lock;
+	unsigned long now = jiffies;
 
 	BUG_ON(type >= WAKE_LOCK_TYPE_COUNT);
-	list_for_each_entry_safe(lock, n, &active_wake_locks[type], link) {
-		if (lock->flags & WAKE_LOCK_AUTO_EXPIRE) {
-			long timeout = lock->expires - jiffies;
-			if (timeout <= 0)
-				expire_wake_lock(lock);
-			else if (timeout > max_timeout)
-				max_timeout = timeout;
-		} else
-			return -1;
+	if (atomic_read(&active_no_timeout[type]))
+		return -1;
+	while (expire_first[type]) {
+		lock = rb_entry(expire_first[type], struct wake_lock,
+				expire_node);
+		if ((long)(lock->expires - now) > 0)
+			break;
+		expire_wake_lock(lock);
 	}
-	return max_timeout;
+	if (!expire_first[type])
+		return 0;
+	lock = rb_entry(rb_last(&expire_locks[type]), struct wake_lock,
+			expire_node);
+	return lock->expires - now;
 }
 
 long has_wake_lock(int type)
 {
 	long ret;
 	unsigned long irqflags;
+
+	/* Without list_lock, unless the lock holders are to be logged */
+	if (atomic_read(&active_no_timeout[type]) &&
+	    !((debug_mask & DEBUG_WAKEUP) && type == WAKE_LOCK_SUSPEND))
+		return -1;
+
 	spin_lock_irqsave(&list_lock, irqflags);
 	ret = has_wake_lock_locked(type);
 	if (ret && (debug_mask & DEBUG_WAKEUP) && type == WAKE_LOCK_SUSPEND)
@@ -294,15 +374,41 @@ long has_wake_lock(int type)
 	return ret;
 }
 
+static bool suspend_sys_sync_abort;
+
+/* set from the timer below, so read it afresh on every call */
+static bool suspend_sys_sync_cancel(void)
+{
+	return ACCESS_ONCE(suspend_sys_sync_abort) ||
+		requested_suspend_state == PM_SUSPEND_ON;
+}
+
 static void suspend_sys_sync(struct work_struct *work)
 {
+	struct sync_dirty_control sdc = {
+		.older_than = msecs_to_jiffies(suspend_sync_min_age_ms),
+		.cancel = suspend_sys_sync_cancel,
+	};
+	ktime_t start = ktime_get();
+
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("PM: Syncing filesystems...\n");
 
-	sys_sync();
-
-	if (debug_mask & DEBUG_SUSPEND)
-		pr_info("sync done.\n");
+	if (suspend_sync_mode == SUSPEND_SYNC_INCREMENTAL)
+		sync_dirty_filesystems(&sdc);
+	else
+		sys_sync();
+	suspend_sync_last_us = ktime_to_us(ktime_sub(ktime_get(), start));
+
+	if (debug_mask & DEBUG_SUSPEND) {
+		if (suspend_sync_mode == SUSPEND_SYNC_INCREMENTAL)
+			pr_info("sync %s in %u us, %u synced, %u too recent\n",
+				sdc.cancelled ? "cancelled" : "done",
+				suspend_sync_last_us, sdc.nr_synced,
+				sdc.nr_skipped);
+		else
+			pr_info("sync done in %u us.\n", suspend_sync_last_us);
+	}
 
 	spin_lock(&suspend_sys_sync_lock);
 	suspend_sys_sync_count--;
@@ -316,12 +422,14 @@ void suspend_sys_sync_queue(void)
 
 	spin_lock(&suspend_sys_sync_lock);
 	ret = queue_work(suspend_sys_sync_work_queue, &suspend_sys_sync_work);
-	if (ret)
+	if (ret) {
 		suspend_sys_sync_count++;
+		/* an abort of an earlier attempt must not cancel this sync */
+		suspend_sys_sync_abort = false;
+	}
 	spin_unlock(&suspend_sys_sync_lock);
 }
 
-static bool suspend_sys_sync_abort;
 static void suspend_sys_sync_handler(unsigned long);
 static DEFINE_TIMER(suspend_sys_sync_timer, suspend_sys_sync_handler, 0, 0);
 #define SUSPEND_SYS_SYNC_TIMEOUT (HZ/4)
@@ -467,6 +575,7 @@ void wake_lock_init(struct wake_lock *lock, int type, const char *name)
 	lock->flags = (type & WAKE_LOCK_TYPE_MASK) | WAKE_LOCK_INITIALIZED;
 
 	INIT_LIST_HEAD(&lock->link);
+	RB_CLEAR_NODE(&lock->expire_node);
 	spin_lock_irqsave(&list_lock, irqflags);
 	list_add(&lock->link, &inactive_locks);
 	spin_unlock_irqrestore(&list_lock, irqflags);
@@ -479,6 +588,8 @@ void wake_lock_destroy(struct wake_lock *lock)
 	if (debug_mask & DEBUG_WAKE_LOCK)
 		pr_info("wake_lock_destroy name=%s\n", lock->name);
 	spin_lock_irqsave(&list_lock, irqflags);
+	if (lock->flags & WAKE_LOCK_ACTIVE)
+		wake_lock_untrack(lock, lock->flags & WAKE_LOCK_TYPE_MASK);
 	lock->flags &= ~WAKE_LOCK_INITIALIZED;
 #ifdef CONFIG_WAKELOCK_STAT
 	if (lock->stat.count) {
@@ -529,6 +640,8 @@ static void wake_lock_internal(
 #ifdef CONFIG_WAKELOCK_STAT
 		lock->stat.last_time = ktime_get();
 #endif
+	} else {
+		wake_lock_untrack(lock, type);
 	}
 	list_del(&lock->link);
 	if (has_timeout) {
@@ -539,12 +652,14 @@ static void wake_lock_internal(
 		lock->expires = jiffies + timeout;
 		lock->flags |= WAKE_LOCK_AUTO_EXPIRE;
 		list_add_tail(&lock->link, &active_wake_locks[type]);
+		expire_queue_add(lock, type);
 	} else {
 		if (debug_mask & DEBUG_WAKE_LOCK)
 			pr_info("wake_lock: %s, type %d\n", lock->name, type);
 		lock->expires = LONG_MAX;
 		lock->flags &= ~WAKE_LOCK_AUTO_EXPIRE;
 		list_add(&lock->link, &active_wake_locks[type]);
+		atomic_inc(&active_no_timeout[type]);
 	}
 	if (type == WAKE_LOCK_SUSPEND) {
 		current_event_num++;
@@ -598,6 +713,8 @@ void wake_unlock(struct wake_lock *lock)
 #endif
 	if (debug_mask & DEBUG_WAKE_LOCK)
 		pr_info("wake_unlock: %s\n", lock->name);
+	if (lock->flags & WAKE_LOCK_ACTIVE)
+		wake_lock_untrack(lock, type);
 	lock->flags &= ~(WAKE_LOCK_ACTIVE | WAKE_LOCK_AUTO_EXPIRE);
 	list_del(&lock->link);
 	list_add(&lock->link, &inactive_locks);
@@ -0,0 +1,126 @@
+/*
+ *  LZ4 - Fast LZ compression algorithm
+ *
+ *  Kernel implementation of the LZ4 block format compressor. This is
+ *  the "fast" single pass variant: a hash table of the last position
+ *  seen for every 4-byte sequence is used to find match candidates,
+ *  and the search step grows while no match is found so that
+ *  incompressible data is skipped quickly.
+ *
+ *  The LZ4 format is described at:
+ *  http://code.google.com/p/lz4/
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/lz4.h>
+#include <asm/unaligned.h>
+#include "lz4defs.h"
+
+static inline u32 lz4_hash(const unsigned char *p)
+{
+	return (get_unaligned((const u32 *)p) * 2654435761U)
+		>> (32 - LZ4_HASH_LOG);
+}
+
+static inline unsigned char *lz4_put_length(unsigned char *op, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+	return op;
+}
+
+static inline unsigned char *lz4_put_literals(unsigned char *op,
+		unsigned char *token, const unsigned char *anchor, size_t len)
+{
+	if (len >= RUN_MASK) {
+		*token = RUN_MASK << ML_BITS;
+		op = lz4_put_length(op, len - RUN_MASK);
+	} else {
+		*token = len << ML_BITS;
+	}
+	memcpy(op, anchor, len);
+	return op + len;
+}
+
+int lz4_compress(const unsigned char *src, size_t src_len,
+		unsigned char *dst, size_t *dst_len, void *wrkmem)
+{
+	/*
+	 * The table holds offsets from src. It is never cleared: a stale
+	 * entry either points beyond ip and is rejected, or points into
+	 * the current input and is verified like any other candidate.
+	 */
+	u32 *table = wrkmem;
+	const unsigned char *ip = src;
+	const unsigned char *anchor = src;
+	const unsigned char * const iend = src + src_len;
+	const unsigned char * const mflimit = iend - MFLIMIT;
+	const unsigned char * const matchlimit = iend - LASTLITERALS;
+	unsigned char *op = dst;
+	unsigned char *token;
+	size_t len;
+
+	if (src_len < MFLIMIT + 1)
+		goto last_literals;
+
+	while (ip <= mflimit) {
+		const unsigned char *ref;
+		u32 h = lz4_hash(ip);
+
+		ref = src + table[h];
+		table[h] = ip - src;
+
+		if (ref >= ip || ip - ref > MAX_DISTANCE ||
+		    get_unaligned((const u32 *)ref) !=
+		    get_unaligned((const u32 *)ip)) {
+			ip += 1 + ((ip - anchor) >> LZ4_SKIP_TRIGGER);
+			continue;
+		}
+
+		/* extend the match backwards over pending literals */
+		while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+
+		token = op++;
+		op = lz4_put_literals(op, token, anchor, ip - anchor);
+
+		put_unaligned_le16(ip - ref, op);
+		op += 2;
+
+		anchor = ip;
+		ip += MINMATCH;
+		ref += MINMATCH;
+		while (ip < matchlimit && *ip == *ref) {
+			ip++;
+			ref++;
+		}
+
+		len = ip - anchor - MINMATCH;
+		if (len >= ML_MASK) {
+			*token |= ML_MASK;
+			op = lz4_put_length(op, len - ML_MASK);
+		} else {
+			*token |= len;
+		}
+		anchor = ip;
+
+		/* prime the table with the position right before ip */
+		table[lz4_hash(ip - 2)] = ip - 2 - src;
+	}
+
+last_literals:
+	token = op++;
+	op = lz4_put_literals(op, token, anchor, iend - anchor);
+
+	*dst_len = op - dst;
+	return 0;
+}
+EXPORT_SYMBOL_GPL(lz4_compress);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("LZ4 Compressor");
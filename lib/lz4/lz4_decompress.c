@@ -0,0 +1,101 @@
+/*
+ *  LZ4 Decompressor
+ *
+ *  Kernel implementation of the LZ4 block format decompressor. All
+ *  lengths and offsets read from the input are checked against the
+ *  input and output buffer bounds, so corrupted data results in an
+ *  error rather than a buffer overrun.
+ *
+ *  The LZ4 format is described at:
+ *  http://code.google.com/p/lz4/
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/lz4.h>
+#include <asm/unaligned.h>
+#include "lz4defs.h"
+
+static inline int lz4_get_length(const unsigned char **ipp,
+		const unsigned char *iend, size_t *len)
+{
+	const unsigned char *ip = *ipp;
+	unsigned int s;
+
+	do {
+		if (unlikely(ip >= iend))
+			return -1;
+		s = *ip++;
+		*len += s;
+	} while (s == 255);
+
+	*ipp = ip;
+	return 0;
+}
+
+int lz4_decompress_unknownoutputsize(const unsigned char *src, size_t src_len,
+		unsigned char *dst, size_t *dst_len)
+{
+	const unsigned char *ip = src;
+	const unsigned char * const iend = src + src_len;
+	unsigned char *op = dst;
+	unsigned char * const oend = dst + *dst_len;
+	const unsigned char *ref;
+	unsigned int token;
+	size_t len, offset;
+
+	while (ip < iend) {
+		token = *ip++;
+
+		/* literals */
+		len = token >> ML_BITS;
+		if (len == RUN_MASK && lz4_get_length(&ip, iend, &len))
+			goto error;
+		if (unlikely(len > (size_t)(iend - ip) ||
+			     len > (size_t)(oend - op)))
+			goto error;
+		memcpy(op, ip, len);
+		op += len;
+		ip += len;
+
+		/* the last sequence has no match part */
+		if (ip == iend)
+			break;
+
+		/* match */
+		if (unlikely(iend - ip < 2))
+			goto error;
+		offset = get_unaligned_le16(ip);
+		ip += 2;
+		if (unlikely(!offset || offset > (size_t)(op - dst)))
+			goto error;
+		ref = op - offset;
+
+		len = token & ML_MASK;
+		if (len == ML_MASK && lz4_get_length(&ip, iend, &len))
+			goto error;
+		len += MINMATCH;
+		if (unlikely(len > (size_t)(oend - op)))
+			goto error;
+
+		if (offset >= len) {
+			memcpy(op, ref, len);
+			op += len;
+		} else {
+			/* overlapping copy, replicates the last bytes */
+			while (len--)
+				*op++ = *ref++;
+		}
+	}
+
+	*dst_len = op - dst;
+	return 0;
+
+error:
+	return -1;
+}
+EXPORT_SYMBOL_GPL(lz4_decompress_unknownoutputsize);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("LZ4 Decompressor");
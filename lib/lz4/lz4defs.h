@@ -0,0 +1,33 @@
+/*
+ *  lz4defs.h -- LZ4 block format definitions
+ *
+ *  The LZ4 block format is described at:
+ *  http://code.google.com/p/lz4/
+ *
+ *  A compressed block is a sequence of (token, literals, match) records.
+ *  The high nibble of the token is the literal run length and the low
+ *  nibble is the match length minus MINMATCH; a nibble of 15 means that
+ *  additional length bytes follow, each adding up to 255. The match is
+ *  a 16-bit little endian backward offset. The last record holds only
+ *  literals.
+ */
+
+#define MINMATCH	4
+
+#define ML_BITS		4
+#define ML_MASK		((1U << ML_BITS) - 1)
+#define RUN_BITS	(8 - ML_BITS)
+#define RUN_MASK	((1U << RUN_BITS) - 1)
+
+#define MAX_DISTANCE	((1 << 16) - 1)
+
+/* the last LASTLITERALS bytes of a block are always literals */
+#define LASTLITERALS	5
+/* the last match must start at least MFLIMIT bytes before block end */
+#define MFLIMIT		(8 + MINMATCH)
+
+#define LZ4_HASH_LOG	12
+#define LZ4_HASHTABLE_SIZE	(1 << LZ4_HASH_LOG)
+
+/* acceleration of the match search over incompressible data */
+#define LZ4_SKIP_TRIGGER	6
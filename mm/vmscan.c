@@ -41,6 +41,7 @@
 #include <linux/sysctl.h>
 #include <linux/oom.h>
 #include <linux/prefetch.h>
+#include <linux/vmpressure.h>
 
 #include <asm/tlbflush.h>
 #include <asm/div64.h>
@@ -1528,6 +1529,8 @@ static void shrink_zone(int priority, struct zone *zone,
 		.priority = priority,
 	};
 	struct mem_cgroup *memcg;
+	unsigned long nr_scanned = sc->nr_scanned;
+	unsigned long nr_reclaimed = sc->nr_reclaimed;
 
 	memcg = mem_cgroup_iter(root, NULL, &reclaim);
 	do {
@@ -1543,6 +1546,10 @@ static void shrink_zone(int priority, struct zone *zone,
 		}
 		memcg = mem_cgroup_iter(root, memcg, &reclaim);
 	} while (memcg);
+
+	if (global_reclaim(sc))
+		vmpressure(sc->gfp_mask, sc->nr_scanned - nr_scanned,
+			   sc->nr_reclaimed - nr_reclaimed);
 }
 
 static inline bool compaction_ready(struct zone *zone, struct scan_control *sc)
@@ -1657,6 +1664,8 @@ static unsigned long do_try_to_free_pages(struct zonelist *zonelist,
 		sc->nr_scanned = 0;
 		if (!priority)
 			disable_swap_token(sc->target_mem_cgroup);
+		if (global_reclaim(sc))
+			vmpressure_prio(sc->gfp_mask, priority);
 		aborted_reclaim = shrink_zones(priority, zonelist, sc);
 
 		if (global_reclaim(sc)) {
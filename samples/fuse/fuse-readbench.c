@@ -0,0 +1,491 @@
+/*
+ * FUSE sequential read benchmark
+ *
+ * Mirrors the regular files of a directory through a minimal read-only
+ * FUSE daemon, then reads every file once directly and once through the
+ * FUSE mount, both times with cold caches, and prints the throughput of
+ * each. No libfuse is needed; the daemon speaks the kernel protocol of
+ * <linux/fuse.h> directly.
+ *
+ * usage: fuse-readbench [-b] [-s] [-p] <directory> <mountpoint>
+ *
+ *  -b  accept FUSE_BIG_READS, so readahead is sent in requests of up
+ *      to 1 MiB instead of 128 KiB
+ *  -s  answer reads by splicing the file pages to /dev/fuse with
+ *      SPLICE_F_MOVE, so they are moved into the FUSE page cache
+ *      instead of being copied twice
+ *  -p  accept FUSE_PASSTHROUGH, so the kernel reads the files without
+ *      asking the daemon at all
+ *
+ * Must be run as root.
+ */
+#define _GNU_SOURCE
+#include <linux/fuse.h>
+
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_FILES	1024
+#define NR_THREADS	2
+#define MAX_READ	(1024 * 1024)
+#define MAX_WRITE	(128 * 1024)
+#define REQ_BUF_SIZE	(MAX_WRITE + 4096)
+#define BENCH_BUF_SIZE	(128 * 1024)
+#define TIMEOUT		3600
+
+static char *files[MAX_FILES];
+static int nr_files;
+static int lower_dirfd;
+static int fuse_fd;
+static int big_reads, use_splice, passthrough;
+
+struct thread {
+	pthread_t thread;
+	char *req;
+	char *data;
+	int pipe[2];
+	size_t pipe_size;
+};
+
+static void reply(uint64_t unique, int error, const void *arg, size_t len)
+{
+	struct fuse_out_header out = {
+		.len = sizeof(out) + len,
+		.error = error,
+		.unique = unique,
+	};
+	struct iovec iov[2] = {
+		{ .iov_base = &out, .iov_len = sizeof(out) },
+		{ .iov_base = (void *)arg, .iov_len = len },
+	};
+
+	if (writev(fuse_fd, iov, len ? 2 : 1) < 0 && errno != ENOENT)
+		perror("fuse reply");
+}
+
+static int node_stat(uint64_t nodeid, struct stat *st)
+{
+	if (nodeid == FUSE_ROOT_ID)
+		return fstat(lower_dirfd, st);
+	if (nodeid < 2 || nodeid - 2 >= (uint64_t)nr_files) {
+		errno = ENOENT;
+		return -1;
+	}
+	return fstatat(lower_dirfd, files[nodeid - 2], st, AT_SYMLINK_NOFOLLOW);
+}
+
+static void fill_attr(struct fuse_attr *attr, const struct stat *st,
+		      uint64_t nodeid)
+{
+	memset(attr, 0, sizeof(*attr));
+	attr->ino = nodeid;
+	attr->size = st->st_size;
+	attr->blocks = st->st_blocks;
+	attr->atime = st->st_atime;
+	attr->mtime = st->st_mtime;
+	attr->ctime = st->st_ctime;
+	attr->mode = st->st_mode;
+	attr->nlink = st->st_nlink;
+	attr->uid = st->st_uid;
+	attr->gid = st->st_gid;
+	attr->blksize = st->st_blksize;
+}
+
+static void do_init(struct fuse_in_header *in)
+{
+	struct fuse_init_in *arg = (void *)(in + 1);
+	struct fuse_init_out out;
+	unsigned int want = FUSE_ASYNC_READ;
+
+	if (big_reads)
+		want |= FUSE_BIG_READS;
+	if (passthrough)
+		want |= FUSE_PASSTHROUGH;
+	if ((arg->flags & want) != want)
+		fprintf(stderr, "kernel does not offer all of flags %#x\n",
+			want);
+
+	memset(&out, 0, sizeof(out));
+	out.major = FUSE_KERNEL_VERSION;
+	out.minor = FUSE_KERNEL_MINOR_VERSION;
+	out.max_readahead = big_reads ? MAX_READ : arg->max_readahead;
+	out.flags = arg->flags & want;
+	out.max_background = 16;
+	out.congestion_threshold = 12;
+	out.max_write = MAX_WRITE;
+	reply(in->unique, 0, &out, sizeof(out));
+}
+
+static void do_lookup(struct fuse_in_header *in)
+{
+	const char *name = (const char *)(in + 1);
+	struct fuse_entry_out out;
+	struct stat st;
+	int i;
+
+	if (in->nodeid != FUSE_ROOT_ID)
+		return reply(in->unique, -ENOENT, NULL, 0);
+	for (i = 0; i < nr_files; i++)
+		if (!strcmp(files[i], name))
+			break;
+	if (i == nr_files || node_stat(i + 2, &st))
+		return reply(in->unique, -ENOENT, NULL, 0);
+
+	memset(&out, 0, sizeof(out));
+	out.nodeid = i + 2;
+	out.generation = 1;
+	out.entry_valid = TIMEOUT;
+	out.attr_valid = TIMEOUT;
+	fill_attr(&out.attr, &st, out.nodeid);
+	reply(in->unique, 0, &out, sizeof(out));
+}
+
+static void do_getattr(struct fuse_in_header *in)
+{
+	struct fuse_attr_out out;
+	struct stat st;
+
+	if (node_stat(in->nodeid, &st))
+		return reply(in->unique, -errno, NULL, 0);
+
+	memset(&out, 0, sizeof(out));
+	out.attr_valid = TIMEOUT;
+	fill_attr(&out.attr, &st, in->nodeid);
+	reply(in->unique, 0, &out, sizeof(out));
+}
+
+static void do_open(struct fuse_in_header *in)
+{
+	struct fuse_open_in *arg = (void *)(in + 1);
+	struct fuse_open_out out;
+	int fd;
+
+	if ((arg->flags & O_ACCMODE) != O_RDONLY)
+		return reply(in->unique, -EROFS, NULL, 0);
+	if (in->nodeid < 2 || in->nodeid - 2 >= (uint64_t)nr_files)
+		return reply(in->unique, -ENOENT, NULL, 0);
+	fd = openat(lower_dirfd, files[in->nodeid - 2], O_RDONLY);
+	if (fd < 0)
+		return reply(in->unique, -errno, NULL, 0);
+
+	memset(&out, 0, sizeof(out));
+	out.fh = fd;
+	if (passthrough) {
+		out.open_flags |= FOPEN_PASSTHROUGH;
+		out.passthrough_fd = fd;
+	}
+	reply(in->unique, 0, &out, sizeof(out));
+}
+
+/*
+ * Queue the reply header and then the file pages in the pipe, and hand
+ * the lot to /dev/fuse. With SPLICE_F_MOVE the kernel steals the pages
+ * that are not in use elsewhere and puts them in the FUSE page cache.
+ * Returns -1 if nothing was sent and the read should be copied.
+ */
+static int splice_read(struct thread *t, struct fuse_in_header *in,
+		       struct fuse_read_in *arg)
+{
+	struct fuse_out_header out;
+	struct iovec iov = { .iov_base = &out, .iov_len = sizeof(out) };
+	loff_t off = arg->offset;
+	struct stat st;
+	size_t len, done;
+	ssize_t n;
+
+	if (fstat(arg->fh, &st))
+		return -1;
+	len = 0;
+	if ((off_t)arg->offset < st.st_size)
+		len = st.st_size - arg->offset;
+	if (len > arg->size)
+		len = arg->size;
+	/* The header takes a pipe buffer of its own */
+	if (len + 4096 > t->pipe_size)
+		return -1;
+
+	out.len = sizeof(out) + len;
+	out.error = 0;
+	out.unique = in->unique;
+	if (vmsplice(t->pipe[1], &iov, 1, 0) != sizeof(out))
+		return -1;
+
+	for (done = 0; done < len; done += n) {
+		n = splice(arg->fh, &off, t->pipe[1], NULL, len - done,
+			   SPLICE_F_MOVE);
+		if (n <= 0)
+			break;
+	}
+	if (done < len) {
+		/* The file shrank: drop what was queued and copy instead */
+		for (done += sizeof(out); done; done -= n) {
+			n = read(t->pipe[0], t->data,
+				 done < MAX_READ ? done : MAX_READ);
+			if (n <= 0)
+				break;
+		}
+		return -1;
+	}
+
+	n = splice(t->pipe[0], NULL, fuse_fd, NULL, out.len, SPLICE_F_MOVE);
+	if (n < 0 && errno != ENOENT)
+		perror("fuse splice");
+	return 0;
+}
+
+static void do_read(struct thread *t, struct fuse_in_header *in)
+{
+	struct fuse_read_in *arg = (void *)(in + 1);
+	size_t size = arg->size < MAX_READ ? arg->size : MAX_READ;
+	ssize_t n;
+
+	if (use_splice && !splice_read(t, in, arg))
+		return;
+
+	n = pread(arg->fh, t->data, size, arg->offset);
+	if (n < 0)
+		return reply(in->unique, -errno, NULL, 0);
+	reply(in->unique, 0, t->data, n);
+}
+
+static void do_release(struct fuse_in_header *in)
+{
+	struct fuse_release_in *arg = (void *)(in + 1);
+
+	close(arg->fh);
+	reply(in->unique, 0, NULL, 0);
+}
+
+static void *daemon_fn(void *arg)
+{
+	struct thread *t = arg;
+	struct fuse_in_header *in = (void *)t->req;
+	ssize_t n;
+
+	for (;;) {
+		n = read(fuse_fd, t->req, REQ_BUF_SIZE);
+		if (n < 0) {
+			if (errno == EINTR || errno == ENOENT ||
+			    errno == EAGAIN)
+				continue;
+			if (errno != ENODEV)
+				perror("fuse read");
+			return NULL;
+		}
+		if ((size_t)n < sizeof(*in))
+			continue;
+
+		switch (in->opcode) {
+		case FUSE_INIT:
+			do_init(in);
+			break;
+		case FUSE_LOOKUP:
+			do_lookup(in);
+			break;
+		case FUSE_GETATTR:
+			do_getattr(in);
+			break;
+		case FUSE_OPEN:
+			do_open(in);
+			break;
+		case FUSE_READ:
+			do_read(t, in);
+			break;
+		case FUSE_RELEASE:
+			do_release(in);
+			break;
+		case FUSE_FLUSH:
+			reply(in->unique, 0, NULL, 0);
+			break;
+		case FUSE_FORGET:
+		case FUSE_BATCH_FORGET:
+		case FUSE_INTERRUPT:
+			break;
+		default:
+			reply(in->unique, -ENOSYS, NULL, 0);
+			break;
+		}
+	}
+}
+
+static unsigned long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* Reads @name from a cold cache, returns the bytes read per second */
+static double bench(int dirfd, const char *name, char *buf,
+		    unsigned long long *bytes)
+{
+	unsigned long start;
+	ssize_t n;
+	int fd;
+
+	/* The daemon must start cold as well */
+	fd = openat(lower_dirfd, name, O_RDONLY);
+	if (fd >= 0) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+
+	fd = openat(dirfd, name, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+	*bytes = 0;
+	start = now_ns();
+	while ((n = read(fd, buf, BENCH_BUF_SIZE)) > 0)
+		*bytes += n;
+	start = now_ns() - start;
+	close(fd);
+
+	return n < 0 ? -1 : *bytes / (start / 1e9);
+}
+
+static int scan_files(const char *dir)
+{
+	struct dirent *de;
+	struct stat st;
+	DIR *d;
+
+	d = opendir(dir);
+	if (!d) {
+		perror(dir);
+		return -1;
+	}
+	while ((de = readdir(d)) && nr_files < MAX_FILES) {
+		if (fstatat(lower_dirfd, de->d_name, &st,
+			    AT_SYMLINK_NOFOLLOW) || !S_ISREG(st.st_mode))
+			continue;
+		files[nr_files++] = strdup(de->d_name);
+	}
+	closedir(d);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct thread threads[NR_THREADS];
+	unsigned long long bytes, total_bytes = 0;
+	double direct, fuse, direct_sec = 0, fuse_sec = 0;
+	char opts[128], *buf;
+	int mnt_fd, opt, i, n, ret = 0;
+
+	while ((opt = getopt(argc, argv, "bsp")) != -1) {
+		switch (opt) {
+		case 'b':
+			big_reads = 1;
+			break;
+		case 's':
+			use_splice = 1;
+			break;
+		case 'p':
+			passthrough = 1;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (argc - optind != 2)
+		goto usage;
+
+	lower_dirfd = open(argv[optind], O_RDONLY | O_DIRECTORY);
+	if (lower_dirfd < 0 || scan_files(argv[optind])) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	fuse_fd = open("/dev/fuse", O_RDWR);
+	if (fuse_fd < 0) {
+		perror("/dev/fuse");
+		return 1;
+	}
+	snprintf(opts, sizeof(opts),
+		 "fd=%d,rootmode=40000,user_id=0,group_id=0,allow_other",
+		 fuse_fd);
+	if (mount("fuse-readbench", argv[optind + 1], "fuse",
+		  MS_NOSUID | MS_NODEV, opts)) {
+		perror("mount");
+		return 1;
+	}
+
+	for (i = 0; i < NR_THREADS; i++) {
+		struct thread *t = &threads[i];
+
+		t->req = malloc(REQ_BUF_SIZE);
+		t->data = malloc(MAX_READ);
+		if (!t->req || !t->data || pipe(t->pipe)) {
+			perror("daemon setup");
+			return 1;
+		}
+		/*
+		 * Room for the header and a whole request of pages, larger
+		 * replies are copied. Beyond /proc/sys/fs/pipe-max-size this
+		 * needs CAP_SYS_RESOURCE.
+		 */
+		if (fcntl(t->pipe[1], F_SETPIPE_SZ, 2 * MAX_READ) < 0)
+			fcntl(t->pipe[1], F_SETPIPE_SZ, MAX_READ);
+		n = fcntl(t->pipe[1], F_GETPIPE_SZ);
+		t->pipe_size = n > 0 ? n : 0;
+		pthread_create(&t->thread, NULL, daemon_fn, t);
+	}
+
+	buf = malloc(BENCH_BUF_SIZE);
+	mnt_fd = open(argv[optind + 1], O_RDONLY | O_DIRECTORY);
+	if (!buf || mnt_fd < 0) {
+		perror(argv[optind + 1]);
+		ret = 1;
+		goto out;
+	}
+
+	printf("%-32s %10s %12s %12s\n", "file", "MiB", "direct MB/s",
+	       "fuse MB/s");
+	for (i = 0; i < nr_files; i++) {
+		direct = bench(lower_dirfd, files[i], buf, &bytes);
+		if (direct < 0 || !bytes)
+			continue;
+		fuse = bench(mnt_fd, files[i], buf, &bytes);
+		if (fuse < 0) {
+			perror(files[i]);
+			ret = 1;
+			continue;
+		}
+		printf("%-32s %10.1f %12.1f %12.1f\n", files[i],
+		       bytes / 1048576.0, direct / 1e6, fuse / 1e6);
+		total_bytes += bytes;
+		direct_sec += bytes / direct;
+		fuse_sec += bytes / fuse;
+	}
+	if (total_bytes)
+		printf("%-32s %10.1f %12.1f %12.1f\n", "total",
+		       total_bytes / 1048576.0, total_bytes / direct_sec / 1e6,
+		       total_bytes / fuse_sec / 1e6);
+	close(mnt_fd);
+out:
+	umount2(argv[optind + 1], MNT_DETACH);
+	for (i = 0; i < NR_THREADS; i++)
+		pthread_join(threads[i].thread, NULL);
+	return ret;
+
+usage:
+	fprintf(stderr, "usage: %s [-b] [-s] [-p] <directory> <mountpoint>\n",
+		argv[0]);
+	return 1;
+}
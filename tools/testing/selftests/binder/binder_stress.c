@@ -0,0 +1,540 @@
+/*
+ * binder transaction stress benchmark
+ *
+ * Forks one server process per client, each serving a node of its own,
+ * and a growing number of client processes that each run synchronous
+ * transactions against their own server back to back. The pairs share
+ * nothing but the driver; the benchmark process becomes the context
+ * manager only to hand the server nodes to the clients. Reports
+ * transaction throughput and 50th/99th percentile round trip latency
+ * for each client count, which makes contention inside the driver
+ * show up as soon as more than one pair is running.
+ *
+ * usage: binder_stress [max_clients] [iterations] [payload_size]
+ *
+ * Needs /dev/binder and must not run while a servicemanager owns the
+ * context manager slot.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "binder.h"
+
+#define BINDER_DEV	"/dev/binder"
+#define MAP_SZ		(1024 * 1024)
+#define STRESS_CODE	1
+#define REGISTER_CODE	2	/* server to manager: its node and index */
+#define LOOKUP_CODE	3	/* client to manager: index of its server */
+
+struct binder_conn {
+	int fd;
+	void *map;
+};
+
+/* registration and lookup reply, the object is at offset 0 */
+struct pair_msg {
+	struct flat_binder_object obj;
+	uint32_t index;
+};
+
+static size_t payload_size;
+static uint32_t nr_pairs;
+static uint32_t *pair_handle;	/* manager's handle to each server node */
+static int pair_node;		/* address names a server's node */
+
+static unsigned long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static int binder_conn_open(struct binder_conn *c)
+{
+	struct binder_version vers;
+
+	c->fd = open(BINDER_DEV, O_RDWR);
+	if (c->fd < 0)
+		return -1;
+	if (ioctl(c->fd, BINDER_VERSION, &vers) < 0 ||
+	    vers.protocol_version != BINDER_CURRENT_PROTOCOL_VERSION) {
+		fprintf(stderr, "binder protocol mismatch\n");
+		close(c->fd);
+		return -1;
+	}
+	c->map = mmap(NULL, MAP_SZ, PROT_READ, MAP_PRIVATE, c->fd, 0);
+	if (c->map == MAP_FAILED) {
+		close(c->fd);
+		return -1;
+	}
+	return 0;
+}
+
+static int binder_write_read(int fd, void *wbuf, size_t wsize,
+			     void *rbuf, size_t rsize, size_t *consumed)
+{
+	struct binder_write_read bwr;
+
+	memset(&bwr, 0, sizeof(bwr));
+	bwr.write_buffer = (unsigned long)wbuf;
+	bwr.write_size = wsize;
+	bwr.read_buffer = (unsigned long)rbuf;
+	bwr.read_size = rsize;
+	if (ioctl(fd, BINDER_WRITE_READ, &bwr) < 0)
+		return -1;
+	if (consumed)
+		*consumed = bwr.read_consumed;
+	return 0;
+}
+
+/* Appends a command and its argument to a write buffer */
+static size_t put_cmd(void *buf, size_t off, uint32_t cmd,
+		      const void *arg, size_t size)
+{
+	memcpy((char *)buf + off, &cmd, sizeof(cmd));
+	memcpy((char *)buf + off + sizeof(cmd), arg, size);
+	return off + sizeof(cmd) + size;
+}
+
+/*
+ * Answers one transaction. Stress transactions get a reply of the same
+ * size. The manager takes a strong reference to the node a server
+ * registers for its client and hands it out again when the client
+ * looks it up.
+ */
+static size_t handle_txn(char *wbuf, size_t wsize,
+			 struct binder_transaction_data *txn, void *reply)
+{
+	static const size_t msg_off;
+	const struct pair_msg *in = txn->data.ptr.buffer;
+	struct pair_msg *msg = reply;
+	uint32_t code = txn->code, index = nr_pairs;
+
+	if (code == REGISTER_CODE && txn->data_size >= sizeof(*in) &&
+	    txn->offsets_size >= sizeof(size_t) &&
+	    in->obj.type == BINDER_TYPE_HANDLE && in->index < nr_pairs) {
+		pair_handle[in->index] = in->obj.handle;
+		wsize = put_cmd(wbuf, wsize, BC_ACQUIRE,
+				&pair_handle[in->index], sizeof(uint32_t));
+	}
+	if (code == LOOKUP_CODE && txn->data_size >= sizeof(index))
+		memcpy(&index, txn->data.ptr.buffer, sizeof(index));
+	wsize = put_cmd(wbuf, wsize, BC_FREE_BUFFER, &txn->data.ptr.buffer,
+			sizeof(txn->data.ptr.buffer));
+
+	memset(txn, 0, sizeof(*txn));
+	txn->code = code;
+	if (code == STRESS_CODE) {
+		txn->data_size = payload_size;
+		txn->data.ptr.buffer = reply;
+	} else if (code == LOOKUP_CODE && index < nr_pairs &&
+		   pair_handle[index]) {
+		memset(msg, 0, sizeof(*msg));
+		msg->obj.type = BINDER_TYPE_HANDLE;
+		msg->obj.handle = pair_handle[index];
+		msg->index = index;
+		txn->data_size = sizeof(*msg);
+		txn->data.ptr.buffer = msg;
+		txn->offsets_size = sizeof(msg_off);
+		txn->data.ptr.offsets = &msg_off;
+	}
+	return put_cmd(wbuf, wsize, BC_REPLY, txn, sizeof(*txn));
+}
+
+/*
+ * Looper of a server or of the context manager. Reference count
+ * requests on the served node are acknowledged so that clients never
+ * block.
+ */
+static void *server_fn(void *arg)
+{
+	struct binder_conn *c = arg;
+	uint32_t rbuf[256];
+	char wbuf[256];
+	char *reply;
+	size_t wsize;
+	uint32_t cmd = BC_ENTER_LOOPER;
+
+	reply = calloc(1, payload_size > sizeof(struct pair_msg) ?
+		       payload_size : sizeof(struct pair_msg));
+	if (!reply ||
+	    binder_write_read(c->fd, &cmd, sizeof(cmd), NULL, 0, NULL) < 0) {
+		perror("server");
+		return NULL;
+	}
+
+	wsize = 0;
+	for (;;) {
+		size_t consumed, off = 0;
+
+		if (binder_write_read(c->fd, wbuf, wsize, rbuf,
+				      sizeof(rbuf), &consumed) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("server");
+			return NULL;
+		}
+		wsize = 0;
+
+		while (off < consumed) {
+			char *p = (char *)rbuf + off;
+			struct binder_transaction_data txn;
+			struct binder_ptr_cookie pc;
+
+			memcpy(&cmd, p, sizeof(cmd));
+			off += sizeof(cmd);
+			p += sizeof(cmd);
+
+			switch (cmd) {
+			case BR_NOOP:
+			case BR_TRANSACTION_COMPLETE:
+			case BR_SPAWN_LOOPER:
+				break;
+			case BR_INCREFS:
+			case BR_ACQUIRE:
+				memcpy(&pc, p, sizeof(pc));
+				off += sizeof(pc);
+				wsize = put_cmd(wbuf, wsize,
+						cmd == BR_INCREFS ?
+						BC_INCREFS_DONE :
+						BC_ACQUIRE_DONE,
+						&pc, sizeof(pc));
+				break;
+			case BR_RELEASE:
+			case BR_DECREFS:
+				off += sizeof(pc);
+				break;
+			case BR_TRANSACTION:
+				memcpy(&txn, p, sizeof(txn));
+				off += sizeof(txn);
+				wsize = handle_txn(wbuf, wsize, &txn, reply);
+				break;
+			default:
+				fprintf(stderr, "server: unexpected return "
+					"%08x\n", cmd);
+				return NULL;
+			}
+		}
+	}
+}
+
+/*
+ * Writes the @wsize bytes of commands already in @wbuf followed by a
+ * transaction and waits for the reply, which is returned in @txn. The
+ * caller frees the reply buffer. Reference count requests on our own
+ * node, which a server sees while registering, are acknowledged.
+ */
+static int transact(int fd, char *wbuf, size_t wsize,
+		    struct binder_transaction_data *txn)
+{
+	uint32_t rbuf[64];
+	int done = 0;
+
+	wsize = put_cmd(wbuf, wsize, BC_TRANSACTION, txn, sizeof(*txn));
+	while (!done) {
+		size_t consumed, off = 0;
+
+		if (binder_write_read(fd, wbuf, wsize, rbuf, sizeof(rbuf),
+				      &consumed) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("transact");
+			return -1;
+		}
+		wsize = 0;
+
+		while (off < consumed) {
+			struct binder_ptr_cookie pc;
+			uint32_t cmd;
+
+			memcpy(&cmd, (char *)rbuf + off, sizeof(cmd));
+			off += sizeof(cmd);
+			switch (cmd) {
+			case BR_NOOP:
+			case BR_TRANSACTION_COMPLETE:
+				break;
+			case BR_INCREFS:
+			case BR_ACQUIRE:
+				memcpy(&pc, (char *)rbuf + off, sizeof(pc));
+				off += sizeof(pc);
+				wsize = put_cmd(wbuf, wsize,
+						cmd == BR_INCREFS ?
+						BC_INCREFS_DONE :
+						BC_ACQUIRE_DONE,
+						&pc, sizeof(pc));
+				break;
+			case BR_RELEASE:
+			case BR_DECREFS:
+				off += sizeof(pc);
+				break;
+			case BR_REPLY:
+				memcpy(txn, (char *)rbuf + off, sizeof(*txn));
+				off += sizeof(*txn);
+				done = 1;
+				break;
+			case BR_DEAD_REPLY:
+			case BR_FAILED_REPLY:
+				fprintf(stderr, "transaction failed\n");
+				return -1;
+			default:
+				fprintf(stderr, "unexpected return %08x\n", cmd);
+				return -1;
+			}
+		}
+	}
+	if (wsize && binder_write_read(fd, wbuf, wsize, NULL, 0, NULL) < 0) {
+		perror("transact");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Server @index of a pair: registers a node with the context manager,
+ * reports on @ready_fd that its client may look it up, then serves it.
+ */
+static int pair_server(int index, int ready_fd)
+{
+	static const size_t msg_off;
+	struct binder_conn c;
+	struct binder_transaction_data txn;
+	struct pair_msg msg;
+	char wbuf[256];
+	size_t wsize;
+
+	if (binder_conn_open(&c) < 0) {
+		perror("server");
+		return 1;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.obj.type = BINDER_TYPE_BINDER;
+	msg.obj.binder = &pair_node;
+	msg.index = index;
+	memset(&txn, 0, sizeof(txn));
+	txn.target.handle = 0;
+	txn.code = REGISTER_CODE;
+	txn.data_size = sizeof(msg);
+	txn.data.ptr.buffer = &msg;
+	txn.offsets_size = sizeof(msg_off);
+	txn.data.ptr.offsets = &msg_off;
+	if (transact(c.fd, wbuf, 0, &txn) < 0)
+		return 1;
+	wsize = put_cmd(wbuf, 0, BC_FREE_BUFFER, &txn.data.ptr.buffer,
+			sizeof(txn.data.ptr.buffer));
+	if (binder_write_read(c.fd, wbuf, wsize, NULL, 0, NULL) < 0 ||
+	    write(ready_fd, "", 1) != 1) {
+		perror("server");
+		return 1;
+	}
+	close(ready_fd);
+
+	server_fn(&c);
+	return 1;
+}
+
+/* Runs @iters synchronous transactions to server @index, records them */
+static int client_fn(uint32_t index, int iters, unsigned long *lat_ns)
+{
+	struct binder_conn c;
+	struct binder_transaction_data txn;
+	struct pair_msg msg;
+	char wbuf[256];
+	char *data;
+	const void *reply_buf;
+	uint32_t handle;
+	size_t wsize;
+	int i;
+
+	data = calloc(1, payload_size ? payload_size : 1);
+	if (!data || binder_conn_open(&c) < 0) {
+		perror("client");
+		return 1;
+	}
+
+	memset(&txn, 0, sizeof(txn));
+	txn.target.handle = 0;
+	txn.code = LOOKUP_CODE;
+	txn.data_size = sizeof(index);
+	txn.data.ptr.buffer = &index;
+	if (transact(c.fd, wbuf, 0, &txn) < 0)
+		return 1;
+	if (txn.data_size < sizeof(msg) || txn.offsets_size < sizeof(size_t)) {
+		fprintf(stderr, "client: no server %u\n", index);
+		return 1;
+	}
+	memcpy(&msg, txn.data.ptr.buffer, sizeof(msg));
+	if (msg.obj.type != BINDER_TYPE_HANDLE) {
+		fprintf(stderr, "client: bad server object\n");
+		return 1;
+	}
+	/* keep the reference once the lookup reply is freed */
+	handle = msg.obj.handle;
+	wsize = put_cmd(wbuf, 0, BC_ACQUIRE, &handle, sizeof(handle));
+	reply_buf = txn.data.ptr.buffer;
+
+	for (i = 0; i < iters; i++) {
+		unsigned long start;
+
+		wsize = put_cmd(wbuf, wsize, BC_FREE_BUFFER,
+				&reply_buf, sizeof(reply_buf));
+		memset(&txn, 0, sizeof(txn));
+		txn.target.handle = handle;
+		txn.code = STRESS_CODE;
+		txn.data_size = payload_size;
+		txn.data.ptr.buffer = data;
+
+		start = now_ns();
+		if (transact(c.fd, wbuf, wsize, &txn) < 0)
+			return 1;
+		lat_ns[i] = now_ns() - start;
+		reply_buf = txn.data.ptr.buffer;
+		wsize = 0;
+	}
+
+	return 0;
+}
+
+static int cmp_ul(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a;
+	unsigned long y = *(const unsigned long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int run(int nr_clients, int iters)
+{
+	unsigned long *lat, start, elapsed;
+	long n = (long)nr_clients * iters;
+	pid_t *pids;
+	int i, status, ret = 0;
+
+	lat = mmap(NULL, n * sizeof(*lat), PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	pids = calloc(nr_clients, sizeof(*pids));
+	if (lat == MAP_FAILED || !pids) {
+		fprintf(stderr, "out of memory\n");
+		return -1;
+	}
+
+	start = now_ns();
+	for (i = 0; i < nr_clients; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			perror("fork");
+			return -1;
+		}
+		if (pids[i] == 0)
+			_exit(client_fn(i, iters, lat + (long)i * iters));
+	}
+	for (i = 0; i < nr_clients; i++) {
+		if (waitpid(pids[i], &status, 0) < 0 ||
+		    !WIFEXITED(status) || WEXITSTATUS(status))
+			ret = -1;
+	}
+	elapsed = now_ns() - start;
+
+	if (!ret) {
+		qsort(lat, n, sizeof(*lat), cmp_ul);
+		printf("clients=%-3d %9.1f txn/s  p50=%7.1f us  "
+		       "p99=%7.1f us\n", nr_clients, n / (elapsed / 1e9),
+		       lat[n / 2] / 1e3, lat[n * 99 / 100] / 1e3);
+	}
+
+	munmap(lat, n * sizeof(*lat));
+	free(pids);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	struct binder_conn mgr;
+	pthread_t thread;
+	pid_t *servers;
+	int max_clients, nr_clients, iters, i, ready[2], ret = 1;
+	char c;
+
+	max_clients = argc > 1 ? atoi(argv[1]) : 4;
+	iters = argc > 2 ? atoi(argv[2]) : 10000;
+	payload_size = argc > 3 ? atol(argv[3]) : 128;
+	if (max_clients < 1 || iters < 1 || payload_size > MAP_SZ / 4) {
+		fprintf(stderr,
+			"usage: %s [max_clients] [iterations] [payload_size]\n",
+			argv[0]);
+		return 1;
+	}
+
+	if (binder_conn_open(&mgr) < 0) {
+		perror(BINDER_DEV);
+		return 1;
+	}
+	if (ioctl(mgr.fd, BINDER_SET_CONTEXT_MGR, 0) < 0) {
+		perror("BINDER_SET_CONTEXT_MGR");
+		return 1;
+	}
+
+	nr_pairs = max_clients;
+	pair_handle = calloc(max_clients, sizeof(*pair_handle));
+	servers = calloc(max_clients, sizeof(*servers));
+	if (!pair_handle || !servers || pipe(ready) < 0) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	/* fork before starting threads, the servers register once it runs */
+	for (i = 0; i < max_clients; i++) {
+		servers[i] = fork();
+		if (servers[i] < 0) {
+			perror("fork");
+			goto out;
+		}
+		if (servers[i] == 0) {
+			close(ready[0]);
+			_exit(pair_server(i, ready[1]));
+		}
+	}
+	close(ready[1]);
+
+	if (pthread_create(&thread, NULL, server_fn, &mgr)) {
+		fprintf(stderr, "cannot create manager thread\n");
+		goto out;
+	}
+	for (i = 0; i < max_clients; i++) {
+		if (read(ready[0], &c, 1) != 1) {
+			fprintf(stderr, "server failed to start\n");
+			goto out;
+		}
+	}
+	close(ready[0]);
+
+	for (nr_clients = 1; ; nr_clients *= 2) {
+		if (nr_clients > max_clients)
+			nr_clients = max_clients;
+		if (run(nr_clients, iters))
+			goto out;
+		if (nr_clients == max_clients)
+			break;
+	}
+	ret = 0;
+out:
+	for (i = 0; i < max_clients && servers[i] > 0; i++) {
+		kill(servers[i], SIGKILL);
+		waitpid(servers[i], NULL, 0);
+	}
+	return ret;
+}
@@ -0,0 +1,384 @@
+/*
+ * block trace replay benchmark
+ *
+ * Replays the queued requests ("Q" actions) of a blkparse text dump
+ * against a block device, one thread per process found in the trace,
+ * each issuing its requests at their recorded times. Sync requests and
+ * all reads use O_DIRECT, async writes go through the page cache the way
+ * they did when the trace was taken. Without a trace a synthetic phone
+ * like mix is replayed: two sequential readers, a random reader, a
+ * sync writer and a buffered writer.
+ *
+ * Reports throughput and 50th/95th/99th percentile latency for sync
+ * reads, sync writes and async writes, so the same trace can be compared
+ * across schedulers by switching /sys/block/<dev>/queue/scheduler.
+ *
+ * With -t the requests are printed instead of replayed, in the
+ * "<sector> <bytes> <R|W> <sync> <delay us>" format the in-kernel
+ * test-iosched harness reads from iosched_bench/trace.
+ *
+ * usage: blk_replay [-t] <device> [trace]
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <linux/fs.h>
+
+#define SECTOR		512ULL
+#define MAX_IO		(1024 * 1024)
+#define MAX_STREAMS	64
+
+enum { SYNC_READ, SYNC_WRITE, ASYNC_WRITE, NR_CLASSES };
+
+static const char * const class_name[NR_CLASSES] = {
+	"sync read", "sync write", "async write",
+};
+
+struct io {
+	unsigned long time_ns;
+	unsigned long long sector;
+	unsigned int bytes;
+	int class;
+	unsigned long lat_ns;
+};
+
+struct stream {
+	int pid;
+	struct io *ios;
+	int nr, alloc;
+	pthread_t thread;
+};
+
+static struct stream streams[MAX_STREAMS];
+static int nr_streams;
+static int direct_fd, buffered_fd;
+static unsigned long long dev_sectors;
+static unsigned long start_ns;
+
+static unsigned long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static struct stream *get_stream(int pid)
+{
+	int i;
+
+	for (i = 0; i < nr_streams; i++)
+		if (streams[i].pid == pid)
+			return &streams[i];
+	/* fold processes beyond the limit onto existing streams */
+	if (nr_streams == MAX_STREAMS)
+		return &streams[pid % MAX_STREAMS];
+	streams[nr_streams].pid = pid;
+	return &streams[nr_streams++];
+}
+
+static int add_io(int pid, unsigned long time_ns, unsigned long long sector,
+		  unsigned int bytes, int class)
+{
+	struct stream *s = get_stream(pid);
+	struct io *io;
+
+	if (s->nr == s->alloc) {
+		s->alloc = s->alloc ? s->alloc * 2 : 256;
+		s->ios = realloc(s->ios, s->alloc * sizeof(*s->ios));
+		if (!s->ios)
+			return -1;
+	}
+	io = &s->ios[s->nr++];
+	memset(io, 0, sizeof(*io));
+	io->time_ns = time_ns;
+	/* keep requests aligned for O_DIRECT and inside the device */
+	bytes = (bytes + 4095) & ~4095U;
+	if (bytes > MAX_IO)
+		bytes = MAX_IO;
+	io->bytes = bytes;
+	io->sector = sector % (dev_sectors - bytes / SECTOR) & ~7ULL;
+	io->class = class;
+	return 0;
+}
+
+/*
+ * Parses the default blkparse output format:
+ *   8,0    3        1     0.000000000  4162  Q  WS 2048 + 8 [jbd2]
+ */
+static int load_trace(const char *path)
+{
+	char line[256], action[8], rwbs[8];
+	unsigned long long sector;
+	unsigned int nr_sectors, maj, min, cpu, seq;
+	double secs;
+	int pid, n = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%u,%u %u %u %lf %d %7s %7s %llu + %u",
+			   &maj, &min, &cpu, &seq, &secs, &pid, action, rwbs,
+			   &sector, &nr_sectors) != 10)
+			continue;
+		if (strcmp(action, "Q") || !nr_sectors)
+			continue;
+		if (strchr(rwbs, 'R')) {
+			if (add_io(pid, secs * 1e9, sector, nr_sectors * SECTOR,
+				   SYNC_READ))
+				goto nomem;
+		} else if (strchr(rwbs, 'W')) {
+			if (add_io(pid, secs * 1e9, sector, nr_sectors * SECTOR,
+				   strchr(rwbs, 'S') ? SYNC_WRITE : ASYNC_WRITE))
+				goto nomem;
+		} else {
+			continue;
+		}
+		n++;
+	}
+	fclose(f);
+	if (!n) {
+		fprintf(stderr, "%s: no queued requests found\n", path);
+		return -1;
+	}
+	return 0;
+nomem:
+	fclose(f);
+	fprintf(stderr, "out of memory\n");
+	return -1;
+}
+
+/* Five seconds of a foreground app loading while the system writes */
+static int synth_trace(void)
+{
+	unsigned long long span = dev_sectors / 4;
+	unsigned long t;
+	int i;
+
+	srand(1);
+	for (i = 0, t = 0; i < 2000; i++, t += 2500000) {
+		if (add_io(1, t, i * 256ULL, 128 * 1024, SYNC_READ) ||
+		    add_io(2, t, span + i * 64ULL, 32 * 1024, SYNC_READ) ||
+		    add_io(3, t, (unsigned long long)rand() % dev_sectors,
+			   4096, SYNC_READ))
+			return -1;
+		if (!(i % 4) &&
+		    add_io(4, t, 2 * span + (unsigned long long)rand() % span,
+			   4096, SYNC_WRITE))
+			return -1;
+		if (add_io(5, t, 3 * span + i * 128ULL, 64 * 1024,
+			   ASYNC_WRITE))
+			return -1;
+	}
+	return 0;
+}
+
+static void *stream_fn(void *arg)
+{
+	struct stream *s = arg;
+	struct timespec ts;
+	unsigned long t;
+	void *buf;
+	int i;
+	ssize_t ret;
+
+	if (posix_memalign(&buf, 4096, MAX_IO)) {
+		fprintf(stderr, "out of memory\n");
+		return (void *)1;
+	}
+	memset(buf, 0x5a, MAX_IO);
+
+	for (i = 0; i < s->nr; i++) {
+		struct io *io = &s->ios[i];
+		off_t off = io->sector * SECTOR;
+
+		t = now_ns() - start_ns;
+		if (t < io->time_ns) {
+			ts.tv_sec = (io->time_ns - t) / 1000000000UL;
+			ts.tv_nsec = (io->time_ns - t) % 1000000000UL;
+			nanosleep(&ts, NULL);
+		}
+
+		t = now_ns();
+		switch (io->class) {
+		case SYNC_READ:
+			ret = pread(direct_fd, buf, io->bytes, off);
+			break;
+		case SYNC_WRITE:
+			ret = pwrite(direct_fd, buf, io->bytes, off);
+			break;
+		default:
+			ret = pwrite(buffered_fd, buf, io->bytes, off);
+			break;
+		}
+		if (ret != (ssize_t)io->bytes) {
+			perror("replay");
+			free(buf);
+			return (void *)1;
+		}
+		io->lat_ns = now_ns() - t;
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static int cmp_time(const void *a, const void *b)
+{
+	const struct io *x = *(struct io * const *)a;
+	const struct io *y = *(struct io * const *)b;
+
+	/* keep requests issued at the same time in stream order */
+	if (x->time_ns == y->time_ns)
+		return x < y ? -1 : x > y;
+	return x->time_ns < y->time_ns ? -1 : 1;
+}
+
+/* print all streams merged in time order, for the in-kernel harness */
+static int print_trace(void)
+{
+	unsigned long prev_us = 0, us;
+	struct io **ios;
+	int total = 0, i, j, n = 0;
+
+	for (i = 0; i < nr_streams; i++)
+		total += streams[i].nr;
+	ios = malloc(total * sizeof(*ios));
+	if (!ios) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	for (i = 0; i < nr_streams; i++)
+		for (j = 0; j < streams[i].nr; j++)
+			ios[n++] = &streams[i].ios[j];
+	qsort(ios, total, sizeof(*ios), cmp_time);
+
+	for (i = 0; i < total; i++) {
+		us = ios[i]->time_ns / 1000;
+		printf("%llu %u %c %d %lu\n", ios[i]->sector, ios[i]->bytes,
+		       ios[i]->class == SYNC_READ ? 'R' : 'W',
+		       ios[i]->class != ASYNC_WRITE, us - prev_us);
+		prev_us = us;
+	}
+	free(ios);
+	return 0;
+}
+
+static int cmp_ul(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a;
+	unsigned long y = *(const unsigned long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void report(unsigned long elapsed)
+{
+	unsigned long *lat[NR_CLASSES];
+	unsigned long long bytes = 0;
+	int n[NR_CLASSES] = { 0 }, total = 0, i, j, c;
+
+	for (i = 0; i < nr_streams; i++)
+		total += streams[i].nr;
+	for (c = 0; c < NR_CLASSES; c++)
+		lat[c] = malloc(total * sizeof(unsigned long));
+
+	for (i = 0; i < nr_streams; i++) {
+		for (j = 0; j < streams[i].nr; j++) {
+			struct io *io = &streams[i].ios[j];
+
+			if (lat[io->class])
+				lat[io->class][n[io->class]++] = io->lat_ns;
+			bytes += io->bytes;
+		}
+	}
+
+	printf("%8.1f MB/s\n", bytes / (elapsed / 1e9) / (1024 * 1024));
+	for (c = 0; c < NR_CLASSES; c++) {
+		if (n[c] && lat[c]) {
+			qsort(lat[c], n[c], sizeof(unsigned long), cmp_ul);
+			printf("    %-11s %6d ios  p50=%8.1f us  p95=%8.1f us  "
+			       "p99=%8.1f us\n", class_name[c], n[c],
+			       lat[c][n[c] / 2] / 1e3,
+			       lat[c][n[c] * 95 / 100] / 1e3,
+			       lat[c][n[c] * 99 / 100] / 1e3);
+		}
+		free(lat[c]);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long long dev_bytes;
+	struct stat st;
+	void *status;
+	int i, opt, print = 0, ret = 0;
+
+	while ((opt = getopt(argc, argv, "t")) != -1) {
+		if (opt != 't')
+			goto usage;
+		print = 1;
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+	if (argc < 2)
+		goto usage;
+
+	direct_fd = open(argv[1], O_RDWR | O_DIRECT);
+	buffered_fd = open(argv[1], O_RDWR);
+	if (direct_fd < 0 || buffered_fd < 0) {
+		perror(argv[1]);
+		return 1;
+	}
+	/* image files work too, for trying out traces */
+	if (ioctl(direct_fd, BLKGETSIZE64, &dev_bytes) < 0)
+		dev_bytes = fstat(direct_fd, &st) < 0 ? 0 : st.st_size;
+	if (dev_bytes < 2 * MAX_IO) {
+		fprintf(stderr, "%s: device too small\n", argv[1]);
+		return 1;
+	}
+	dev_sectors = dev_bytes / SECTOR;
+
+	if (argc > 2 ? load_trace(argv[2]) : synth_trace())
+		return 1;
+	if (print)
+		return print_trace();
+
+	start_ns = now_ns();
+	for (i = 0; i < nr_streams; i++) {
+		if (pthread_create(&streams[i].thread, NULL, stream_fn,
+				   &streams[i])) {
+			fprintf(stderr, "cannot create stream thread\n");
+			return 1;
+		}
+	}
+	for (i = 0; i < nr_streams; i++) {
+		pthread_join(streams[i].thread, &status);
+		if (status)
+			ret = 1;
+	}
+	/* async writes are not done until they reach the device */
+	fsync(buffered_fd);
+
+	if (!ret)
+		report(now_ns() - start_ns);
+
+	return ret;
+usage:
+	fprintf(stderr, "usage: %s [-t] <device> [trace]\n", argv[0]);
+	return 1;
+}
@@ -0,0 +1,288 @@
+/*
+ * Android logger write throughput benchmark
+ *
+ * Runs a growing number of threads that each write log records to a
+ * logger device with writev(), the way liblog does, while one reader
+ * drains the log. Reports records written per second for each thread
+ * count, plus how many records the reader saw, so that contention
+ * between writers in the driver shows up as a throughput curve that
+ * stops scaling.
+ *
+ * The reader uses one read() per entry, batched reads (LOGGER_SET_BATCH_READ)
+ * or walks the ring through mmap(), depending on the reader mode.
+ *
+ * usage: log_stress [device] [max_threads] [seconds] [payload_size]
+ *                   [read|batch|mmap]
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "logger.h"
+
+#define LOG_DEV		"/dev/log/main"
+#define ENTRY_MAX	(5 * 1024)
+#define BATCH_BUF	(64 * 1024)
+
+enum { READ_ENTRY, READ_BATCH, READ_MMAP };
+
+static const char *dev;
+static int read_mode;
+static size_t payload_size;
+static volatile int stop;
+
+static unsigned long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* Writes records shaped like liblog's: priority, tag and message */
+static void *writer_fn(void *arg)
+{
+	unsigned long *count = arg;
+	unsigned char prio = 4;
+	char tag[] = "log_stress";
+	struct iovec iov[3];
+	char *msg;
+	int fd;
+
+	msg = malloc(payload_size);
+	fd = open(dev, O_WRONLY);
+	if (!msg || fd < 0) {
+		perror(dev);
+		return NULL;
+	}
+	memset(msg, 'x', payload_size - 1);
+	msg[payload_size - 1] = '\0';
+
+	iov[0].iov_base = &prio;
+	iov[0].iov_len = 1;
+	iov[1].iov_base = tag;
+	iov[1].iov_len = sizeof(tag);
+	iov[2].iov_base = msg;
+	iov[2].iov_len = payload_size;
+
+	while (!stop) {
+		if (writev(fd, iov, 3) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("writev");
+			break;
+		}
+		(*count)++;
+	}
+
+	close(fd);
+	free(msg);
+	return NULL;
+}
+
+static void ring_copy(void *dst, const char *ring, unsigned long size,
+		      unsigned long pos, size_t len)
+{
+	unsigned long off = pos & (size - 1);
+	size_t n = len < size - off ? len : size - off;
+
+	memcpy(dst, ring + off, n);
+	memcpy((char *)dst + n, ring, len - n);
+}
+
+/*
+ * Follows the committed end of the ring, copying every record out the
+ * way a logcat reading through the mapping would. Records overwritten
+ * while being copied are dropped and the reader jumps to the end.
+ */
+static void mmap_reader(int fd, unsigned long *count)
+{
+	const struct logger_mmap_header *hdr;
+	struct logger_rec *rec;
+	unsigned long pos, commit, size;
+	long buf_size;
+	const char *ring;
+	void *map;
+
+	buf_size = ioctl(fd, LOGGER_GET_LOG_BUF_SIZE);
+	rec = malloc(sizeof(*rec) + LOGGER_ENTRY_MAX_PAYLOAD);
+	if (buf_size < 0 || !rec) {
+		perror("LOGGER_GET_LOG_BUF_SIZE");
+		return;
+	}
+	map = mmap(NULL, getpagesize() + buf_size, PROT_READ, MAP_SHARED,
+		   fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return;
+	}
+	hdr = map;
+	ring = (const char *)map + hdr->hdr_size;
+	size = hdr->size;
+
+	pos = __atomic_load_n(&hdr->w_commit, __ATOMIC_ACQUIRE);
+	while (!stop) {
+		commit = __atomic_load_n(&hdr->w_commit, __ATOMIC_ACQUIRE);
+		if (commit == pos) {
+			usleep(1000);
+			continue;
+		}
+		while (pos != commit) {
+			ring_copy(rec, ring, size, pos, sizeof(*rec));
+			if (rec->pos == pos &&
+			    rec->entry.len <= LOGGER_ENTRY_MAX_PAYLOAD)
+				ring_copy(rec->entry.msg, ring, size,
+					  pos + hdr->rec_hdr_size,
+					  rec->entry.len);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (rec->pos != pos ||
+			    __atomic_load_n(&hdr->w_reserve,
+					    __ATOMIC_RELAXED) - pos > size) {
+				pos = commit;
+				break;
+			}
+			pos += hdr->rec_hdr_size + rec->entry.len;
+			(*count)++;
+		}
+	}
+
+	munmap(map, getpagesize() + buf_size);
+	free(rec);
+}
+
+static void *reader_fn(void *arg)
+{
+	unsigned long *count = arg;
+	char *buf;
+	int fd, one = 1;
+
+	buf = malloc(BATCH_BUF);
+	fd = open(dev, O_RDONLY | O_NONBLOCK);
+	if (!buf || fd < 0) {
+		perror(dev);
+		return NULL;
+	}
+	if (read_mode == READ_MMAP) {
+		mmap_reader(fd, count);
+		goto out;
+	}
+	if (read_mode == READ_BATCH &&
+	    ioctl(fd, LOGGER_SET_BATCH_READ, &one) < 0) {
+		perror("LOGGER_SET_BATCH_READ");
+		goto out;
+	}
+
+	while (!stop) {
+		ssize_t nr, off;
+
+		nr = read(fd, buf, read_mode == READ_BATCH ? BATCH_BUF :
+			  ENTRY_MAX);
+		if (nr < 0) {
+			if (errno == EAGAIN)
+				usleep(1000);
+			else if (errno != EINTR) {
+				perror("read");
+				break;
+			}
+			continue;
+		}
+		/* version 1 headers, as set up by open() */
+		for (off = 0; off < nr; (*count)++)
+			off += sizeof(struct user_logger_entry_compat) +
+				((struct user_logger_entry_compat *)
+				 (buf + off))->len;
+	}
+
+out:
+	close(fd);
+	free(buf);
+	return NULL;
+}
+
+static int run(int nr_threads, int seconds)
+{
+	pthread_t *threads, reader;
+	unsigned long *counts, total = 0, nr_read = 0, start, elapsed;
+	int i;
+
+	threads = calloc(nr_threads, sizeof(*threads));
+	/* a cache line per counter so the writers do not share one */
+	counts = calloc(nr_threads, 64);
+	if (!threads || !counts) {
+		fprintf(stderr, "out of memory\n");
+		return -1;
+	}
+
+	stop = 0;
+	if (pthread_create(&reader, NULL, reader_fn, &nr_read)) {
+		fprintf(stderr, "cannot create reader thread\n");
+		return -1;
+	}
+	start = now_ns();
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_create(&threads[i], NULL, writer_fn,
+				   counts + i * 8)) {
+			fprintf(stderr, "cannot create writer thread\n");
+			return -1;
+		}
+	}
+	sleep(seconds);
+	stop = 1;
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(threads[i], NULL);
+		total += counts[i * 8];
+	}
+	elapsed = now_ns() - start;
+	pthread_join(reader, NULL);
+
+	printf("threads=%-3d %10.1f writes/s  %9.1f writes/s/thread  "
+	       "read=%lu\n", nr_threads, total / (elapsed / 1e9),
+	       total / (elapsed / 1e9) / nr_threads, nr_read);
+
+	free(counts);
+	free(threads);
+	return total ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+	int max_threads, nr_threads, seconds;
+
+	dev = argc > 1 ? argv[1] : LOG_DEV;
+	max_threads = argc > 2 ? atoi(argv[2]) : 4;
+	seconds = argc > 3 ? atoi(argv[3]) : 5;
+	payload_size = argc > 4 ? atol(argv[4]) : 64;
+	if (argc > 5 && !strcmp(argv[5], "batch"))
+		read_mode = READ_BATCH;
+	else if (argc > 5 && !strcmp(argv[5], "mmap"))
+		read_mode = READ_MMAP;
+	else if (argc > 5 && strcmp(argv[5], "read"))
+		read_mode = -1;
+	if (max_threads < 1 || seconds < 1 || payload_size < 1 ||
+	    payload_size > ENTRY_MAX || read_mode < 0) {
+		fprintf(stderr, "usage: %s [device] [max_threads] [seconds] "
+			"[payload_size] [read|batch|mmap]\n", argv[0]);
+		return 1;
+	}
+
+	for (nr_threads = 1; ; nr_threads *= 2) {
+		if (nr_threads > max_threads)
+			nr_threads = max_threads;
+		if (run(nr_threads, seconds))
+			return 1;
+		if (nr_threads == max_threads)
+			break;
+	}
+
+	return 0;
+}
@@ -0,0 +1,154 @@
+/*
+ * lowmemorykiller stress benchmark
+ *
+ * Forks a few hundred idle processes spread over the oom_score_adj
+ * range, each holding some anonymous memory, and then allocates memory
+ * until the lowmemorykiller has killed half of them. Every fault of
+ * the allocating process may run the lowmem shrinker, so the latency
+ * of touching a page under pressure tracks the cost of selecting a
+ * victim. Reports p50/p99/max per-page fault latency and the number
+ * of kills.
+ *
+ * usage: lmk_stress [nr_procs] [proc_mb] [max_mb]
+ *
+ * Must run as root so that it can protect itself with
+ * oom_score_adj -1000. The lowmemorykiller minfree levels must be
+ * reachable within max_mb, or the test ends without kills.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define PAGE_SZ		4096
+#define MB		(1024 * 1024)
+
+static unsigned long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static int set_oom_score_adj(pid_t pid, int adj)
+{
+	char path[64];
+	FILE *f;
+	int ret;
+
+	snprintf(path, sizeof(path), "/proc/%d/oom_score_adj", pid);
+	f = fopen(path, "w");
+	if (!f)
+		return -1;
+	ret = fprintf(f, "%d\n", adj) < 0 ? -1 : 0;
+	if (fclose(f))
+		ret = -1;
+	return ret;
+}
+
+static void idle_child(long bytes)
+{
+	char *mem = malloc(bytes);
+	long i;
+
+	if (!mem)
+		_exit(1);
+	for (i = 0; i < bytes; i += PAGE_SZ)
+		mem[i] = 1;
+	for (;;)
+		pause();
+}
+
+static int cmp_ul(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a;
+	unsigned long y = *(const unsigned long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv)
+{
+	int nr_procs, proc_mb, max_mb, i, status, killed = 0;
+	unsigned long *lat;
+	long nr_pages, n;
+	pid_t *pids;
+	char *mem;
+
+	nr_procs = argc > 1 ? atoi(argv[1]) : 300;
+	proc_mb = argc > 2 ? atoi(argv[2]) : 4;
+	max_mb = argc > 3 ? atoi(argv[3]) :
+		 sysconf(_SC_PHYS_PAGES) / (MB / PAGE_SZ);
+	if (nr_procs < 2 || proc_mb < 1 || max_mb < 1) {
+		fprintf(stderr,
+			"usage: %s [nr_procs] [proc_mb] [max_mb]\n", argv[0]);
+		return 1;
+	}
+
+	if (set_oom_score_adj(getpid(), -1000)) {
+		perror("oom_score_adj");
+		return 1;
+	}
+
+	pids = calloc(nr_procs, sizeof(*pids));
+	nr_pages = (long)max_mb * (MB / PAGE_SZ);
+	lat = calloc(nr_pages, sizeof(*lat));
+	if (!pids || !lat) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	for (i = 0; i < nr_procs; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			perror("fork");
+			goto out_kill;
+		}
+		if (pids[i] == 0)
+			idle_child((long)proc_mb * MB);
+		/* spread the children over the killable range */
+		set_oom_score_adj(pids[i], 1 + i * 999 / (nr_procs - 1));
+	}
+	sleep(1);
+
+	mem = mmap(NULL, nr_pages * PAGE_SZ, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (mem == MAP_FAILED) {
+		perror("mmap");
+		goto out_kill;
+	}
+
+	for (n = 0; n < nr_pages && killed < nr_procs / 2; n++) {
+		unsigned long start = now_ns();
+
+		mem[n * PAGE_SZ] = 1;
+		lat[n] = now_ns() - start;
+		if ((n & 255) == 0)
+			while (waitpid(-1, &status, WNOHANG) > 0)
+				killed++;
+	}
+
+	if (n) {
+		qsort(lat, n, sizeof(*lat), cmp_ul);
+		printf("procs=%-4d touched=%5ld MB killed=%-4d  p50=%7.1f us  "
+		       "p99=%7.1f us  max=%9.1f us\n", nr_procs,
+		       n * PAGE_SZ / MB, killed, lat[n / 2] / 1e3,
+		       lat[n * 99 / 100] / 1e3, lat[n - 1] / 1e3);
+	}
+	munmap(mem, nr_pages * PAGE_SZ);
+
+out_kill:
+	for (i = 0; i < nr_procs && pids[i] > 0; i++)
+		kill(pids[i], SIGKILL);
+	while (wait(&status) > 0)
+		;
+	return killed ? 0 : 1;
+}
@@ -0,0 +1,209 @@
+/*
+ * wakelock lock/unlock stress test
+ *
+ * Every thread is bound to its own cpu and takes and releases its own
+ * user wake lock through /sys/power/wake_lock and /sys/power/wake_unlock.
+ * One acquire in four carries a timeout, so the expiry bookkeeping is
+ * exercised together with the plain locks. Afterwards none of the locks
+ * may still be active and, when /proc/wakelocks is available, each lock
+ * must have been released exactly as many times as the thread did.
+ *
+ * usage: wakelock_stress [nr_threads] [nr_pairs]
+ *
+ * nr_pairs lock/unlock pairs are split evenly between the threads.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WAKE_LOCK	"/sys/power/wake_lock"
+#define WAKE_UNLOCK	"/sys/power/wake_unlock"
+#define STATS		"/proc/wakelocks"
+#define TIMEOUT_NS	"100000000"
+
+struct worker {
+	pthread_t thread;
+	int cpu;
+	char name[32];
+	long nr_pairs;
+	long count_before;
+	int err;
+};
+
+static unsigned long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static int write_str(int fd, const char *s)
+{
+	size_t len = strlen(s);
+
+	return pwrite(fd, s, len, 0) == (ssize_t)len ? 0 : errno;
+}
+
+/* Release count of @name in /proc/wakelocks, -1 if it is not listed */
+static long lock_count(const char *name)
+{
+	char line[512], quoted[40];
+	long count = -1;
+	FILE *f;
+
+	f = fopen(STATS, "r");
+	if (!f)
+		return -1;
+	snprintf(quoted, sizeof(quoted), "\"%s\"\t", name);
+	while (fgets(line, sizeof(line), f)) {
+		if (!strncmp(line, quoted, strlen(quoted))) {
+			count = atol(line + strlen(quoted));
+			break;
+		}
+	}
+	fclose(f);
+	return count;
+}
+
+static void *worker_fn(void *arg)
+{
+	struct worker *w = arg;
+	char timed[64];
+	cpu_set_t set;
+	int lock_fd, unlock_fd;
+	long i;
+
+	CPU_ZERO(&set);
+	CPU_SET(w->cpu, &set);
+	sched_setaffinity(0, sizeof(set), &set);
+
+	lock_fd = open(WAKE_LOCK, O_WRONLY);
+	unlock_fd = open(WAKE_UNLOCK, O_WRONLY);
+	if (lock_fd < 0 || unlock_fd < 0) {
+		w->err = errno;
+		goto out;
+	}
+	snprintf(timed, sizeof(timed), "%s " TIMEOUT_NS, w->name);
+
+	for (i = 0; i < w->nr_pairs && !w->err; i++) {
+		w->err = write_str(lock_fd, (i & 3) ? w->name : timed);
+		if (!w->err)
+			w->err = write_str(unlock_fd, w->name);
+	}
+out:
+	if (lock_fd >= 0)
+		close(lock_fd);
+	if (unlock_fd >= 0)
+		close(unlock_fd);
+	return NULL;
+}
+
+/* Fails if any of the test locks is listed as active */
+static int check_inactive(struct worker *workers, int nr_threads)
+{
+	char *buf, *tok;
+	int fd, i, ret = 0;
+	ssize_t len;
+
+	buf = calloc(1, 65536);
+	fd = open(WAKE_LOCK, O_RDONLY);
+	if (!buf || fd < 0)
+		return -1;
+	len = read(fd, buf, 65535);
+	close(fd);
+	if (len < 0) {
+		free(buf);
+		return -1;
+	}
+
+	for (tok = strtok(buf, " \n"); tok; tok = strtok(NULL, " \n")) {
+		for (i = 0; i < nr_threads; i++) {
+			if (!strcmp(tok, workers[i].name)) {
+				fprintf(stderr, "%s still active\n", tok);
+				ret = -1;
+			}
+		}
+	}
+	free(buf);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	struct worker *workers;
+	unsigned long start, elapsed;
+	long nr_pairs, count;
+	int nr_cpus, nr_threads, i, ret = 0;
+
+	nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	nr_threads = argc > 1 ? atoi(argv[1]) : nr_cpus;
+	nr_pairs = argc > 2 ? atol(argv[2]) : 2000000;
+	if (nr_threads < 1 || nr_pairs < nr_threads) {
+		fprintf(stderr, "usage: %s [nr_threads] [nr_pairs]\n",
+			argv[0]);
+		return 1;
+	}
+
+	workers = calloc(nr_threads, sizeof(*workers));
+	if (!workers) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	for (i = 0; i < nr_threads; i++) {
+		struct worker *w = &workers[i];
+
+		w->cpu = i % nr_cpus;
+		snprintf(w->name, sizeof(w->name), "wakelock_stress_%d", i);
+		w->nr_pairs = nr_pairs / nr_threads;
+		w->count_before = lock_count(w->name);
+	}
+
+	start = now_ns();
+	for (i = 0; i < nr_threads; i++)
+		pthread_create(&workers[i].thread, NULL, worker_fn,
+			       &workers[i]);
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(workers[i].thread, NULL);
+	elapsed = now_ns() - start;
+
+	for (i = 0; i < nr_threads; i++) {
+		struct worker *w = &workers[i];
+
+		if (w->err) {
+			fprintf(stderr, "thread %d: %s\n", i,
+				strerror(w->err));
+			ret = 1;
+			continue;
+		}
+		count = lock_count(w->name);
+		if (count < 0)
+			continue;
+		if (w->count_before < 0)
+			w->count_before = 0;
+		if (count - w->count_before != w->nr_pairs) {
+			fprintf(stderr, "%s: %ld releases counted, %ld done\n",
+				w->name, count - w->count_before,
+				w->nr_pairs);
+			ret = 1;
+		}
+	}
+	if (check_inactive(workers, nr_threads))
+		ret = 1;
+
+	nr_pairs = nr_pairs / nr_threads * nr_threads;
+	printf("threads=%d pairs=%ld %.0f pairs/s %.2f us/pair\n",
+	       nr_threads, nr_pairs, nr_pairs / (elapsed / 1e9),
+	       elapsed / 1e3 / nr_pairs);
+	printf(ret ? "FAIL\n" : "PASS\n");
+
+	free(workers);
+	return ret;
+}
@@ -0,0 +1,216 @@
+/*
+ * zram write/read stress benchmark
+ *
+ * Hammers a zram block device from a growing number of threads and
+ * reports throughput and median and 99th percentile per-page latency
+ * for each thread count, and the same percentiles for each thread, so
+ * that a thread that starves behind the others stands out. Every thread works on its own
+ * slice of the device, so all contention observed is inside the zram
+ * driver.
+ *
+ * usage: zram_stress <device> [max_threads] [nr_pages]
+ *
+ * The device must be initialized (disksize set) and must not be in
+ * use, as its contents are overwritten.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PAGE_SZ		4096
+
+struct worker {
+	pthread_t thread;
+	int fd;
+	int write;
+	long first_page;
+	long nr_pages;
+	unsigned long *lat_ns;
+	unsigned long p50, p99;
+	int err;
+};
+
+static unsigned long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/*
+ * Fill a page with data that compresses roughly 2:1 under LZO, which is
+ * about what anonymous memory on Android does. A quarter of the pages
+ * are left incompressible to exercise that path as well.
+ */
+static void fill_page(unsigned char *buf, long pgno)
+{
+	unsigned int seed = pgno * 2654435761U;
+	int i;
+
+	for (i = 0; i < PAGE_SZ; i++) {
+		seed = seed * 1103515245 + 12345;
+		if ((pgno & 3) && (i & 64))
+			buf[i] = (unsigned char)(pgno + (i >> 6));
+		else
+			buf[i] = seed >> 16;
+	}
+}
+
+static void *worker_fn(void *arg)
+{
+	struct worker *w = arg;
+	unsigned char *buf;
+	long i;
+
+	if (posix_memalign((void **)&buf, PAGE_SZ, PAGE_SZ)) {
+		w->err = ENOMEM;
+		return NULL;
+	}
+
+	for (i = 0; i < w->nr_pages; i++) {
+		long pgno = w->first_page + i;
+		off_t off = (off_t)pgno * PAGE_SZ;
+		unsigned long start;
+		ssize_t ret;
+
+		if (w->write)
+			fill_page(buf, pgno);
+
+		start = now_ns();
+		if (w->write)
+			ret = pwrite(w->fd, buf, PAGE_SZ, off);
+		else
+			ret = pread(w->fd, buf, PAGE_SZ, off);
+		w->lat_ns[i] = now_ns() - start;
+
+		if (ret != PAGE_SZ) {
+			w->err = ret < 0 ? errno : EIO;
+			break;
+		}
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static int cmp_ul(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a;
+	unsigned long y = *(const unsigned long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int run(const char *dev, int nr_threads, long nr_pages, int write)
+{
+	struct worker *workers;
+	unsigned long *lat, start, elapsed;
+	long per_thread = nr_pages / nr_threads;
+	int i, ret = 0;
+
+	workers = calloc(nr_threads, sizeof(*workers));
+	lat = calloc(per_thread * nr_threads, sizeof(*lat));
+	if (!workers || !lat) {
+		fprintf(stderr, "out of memory\n");
+		return -1;
+	}
+
+	for (i = 0; i < nr_threads; i++) {
+		struct worker *w = &workers[i];
+
+		w->fd = open(dev, (write ? O_WRONLY : O_RDONLY) | O_DIRECT);
+		if (w->fd < 0) {
+			perror(dev);
+			return -1;
+		}
+		w->write = write;
+		w->first_page = i * per_thread;
+		w->nr_pages = per_thread;
+		w->lat_ns = lat + i * per_thread;
+	}
+
+	start = now_ns();
+	for (i = 0; i < nr_threads; i++)
+		pthread_create(&workers[i].thread, NULL, worker_fn,
+			       &workers[i]);
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(workers[i].thread, NULL);
+	elapsed = now_ns() - start;
+
+	for (i = 0; i < nr_threads; i++) {
+		close(workers[i].fd);
+		if (workers[i].err) {
+			fprintf(stderr, "thread %d: %s\n", i,
+				strerror(workers[i].err));
+			ret = -1;
+		}
+	}
+
+	if (!ret) {
+		double mb = (double)per_thread * nr_threads * PAGE_SZ /
+			(1024 * 1024);
+		long n = per_thread * nr_threads;
+
+		/* per thread first, the slices are sorted as a whole next */
+		for (i = 0; i < nr_threads; i++) {
+			struct worker *w = &workers[i];
+
+			qsort(w->lat_ns, per_thread, sizeof(*w->lat_ns),
+			      cmp_ul);
+			w->p50 = w->lat_ns[per_thread / 2];
+			w->p99 = w->lat_ns[per_thread * 99 / 100];
+		}
+		qsort(lat, n, sizeof(*lat), cmp_ul);
+
+		printf("%-5s threads=%-3d %9.1f MB/s  p50=%7.1f us  "
+		       "p99=%7.1f us\n", write ? "write" : "read",
+		       nr_threads, mb / (elapsed / 1e9), lat[n / 2] / 1e3,
+		       lat[n * 99 / 100] / 1e3);
+		for (i = 0; i < nr_threads; i++)
+			printf("      thread %-3d p50=%7.1f us  p99=%7.1f us\n",
+			       i, workers[i].p50 / 1e3, workers[i].p99 / 1e3);
+	}
+
+	free(lat);
+	free(workers);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	int max_threads, nr_threads;
+	long nr_pages;
+
+	if (argc < 2) {
+		fprintf(stderr,
+			"usage: %s <device> [max_threads] [nr_pages]\n",
+			argv[0]);
+		return 1;
+	}
+
+	max_threads = argc > 2 ? atoi(argv[2]) : 4;
+	nr_pages = argc > 3 ? atol(argv[3]) : 16384;
+	if (max_threads < 1 || nr_pages < max_threads) {
+		fprintf(stderr, "invalid arguments\n");
+		return 1;
+	}
+
+	for (nr_threads = 1; ; nr_threads *= 2) {
+		if (nr_threads > max_threads)
+			nr_threads = max_threads;
+		if (run(argv[1], nr_threads, nr_pages, 1) ||
+		    run(argv[1], nr_threads, nr_pages, 0))
+			return 1;
+		if (nr_threads == max_threads)
+			break;
+	}
+
+	return 0;
+}